@@ -107,10 +107,11 @@ int base64_encode(char **dst, const uint8_t *src, size_t len)
 
 
         /*
-         * If there are any leftover bits, they will already have been shifted
-         * appropriately, so we can add the next encoding char directly.
+         * If the last group was short, its leftover bits will already have
+         * been shifted appropriately, so we can add the next encoding char
+         * directly (even when those bits are all zero).
          */
-        if (leftover)
+        if (len % 3)
                 result[res_index++] = digits64[leftover];
 
         /*
@@ -130,6 +131,38 @@ int base64_encode(char **dst, const uint8_t *src, size_t len)
 }
 
 
+/*------------------------------------------------------------------------------
+ * Like base64_encode, but writes into dst, which needs room for
+ * 4 * ((len + 2) / 3) + 1 bytes.
+ *
+ * Returns the length of the text (not counting the NUL).
+ */
+size_t base64_encode_to(char *dst, const uint8_t *src, size_t len)
+{
+        char *start = dst;
+        uint32_t group;
+
+        for (; len >= 3; src += 3, len -= 3) {
+                group = src[0] << 16 | src[1] << 8 | src[2];
+                *dst++ = digits64[group >> 18];
+                *dst++ = digits64[(group >> 12) & 0x3F];
+                *dst++ = digits64[(group >> 6) & 0x3F];
+                *dst++ = digits64[group & 0x3F];
+        }
+
+        if (len) {
+                group = src[0] << 16 | (len == 2 ? src[1] << 8 : 0);
+                *dst++ = digits64[group >> 18];
+                *dst++ = digits64[(group >> 12) & 0x3F];
+                *dst++ = len == 2 ? digits64[(group >> 6) & 0x3F] : PADDING;
+                *dst++ = PADDING;
+        }
+
+        *dst = '\0';
+        return dst - start;
+}
+
+
 /*------------------------------------------------------------------------------
  * Converts a base64-encoded string into binary bytes.
  */
@@ -6,5 +6,6 @@
 
 int base64_decode(uint8_t **dst, const char *src, size_t *data_len);
 int base64_encode(char **dst, const uint8_t *src, size_t len);
+size_t base64_encode_to(char *dst, const uint8_t *src, size_t len);
 
 #endif
@@ -0,0 +1,157 @@
+/*
+ * Measures the frame codec as built: parsing masked client frames through
+ * ws_conn_read_batch, and making unmasked server frames with
+ * ws_make_text_frame.
+ *
+ * Usage: codec [num_frames] [payload_len]      (default 1000000, 32)
+ *
+ * Build it twice from the top of the tree, generic and specialized for a
+ * text-only server (see role.h), and compare the ns/frame figures:
+ *
+ *   FILES="bench/codec.c conn.c pool.c frames.c util.c limits.c \
+ *          metrics.c trace.c capture.c"
+ *   cc -O2 -o codec $FILES -lz -lpthread
+ *   cc -O2 -DWS_ROLE_SERVER -DWS_TEXT_ONLY -o codec_server $FILES \
+ *      -lz -lpthread
+ */
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../ws.h"
+
+#define CHUNK_LEN 65536
+
+#if defined(WS_ROLE_CLIENT)
+#error "The frames parsed are a client's; build generic or WS_ROLE_SERVER"
+#endif
+
+static const char role[] =
+#if defined(WS_ROLE_SERVER)
+        "server"
+#else
+        "either end"
+#endif
+#ifdef WS_TEXT_ONLY
+        ", text only"
+#endif
+        ;
+
+static uint8_t mask[] = {0x37, 0xfa, 0x21, 0x3d};
+
+static const uint8_t *source_bytes;
+static size_t source_left;
+static long num_messages = 0;
+
+static double
+now()
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static ssize_t
+read_bytes(int fd, char *ptr, size_t maxlen)
+{
+        if (source_left == 0) {
+                errno = EAGAIN;
+                return -1;
+        }
+        if (maxlen > source_left)
+                maxlen = source_left;
+        memcpy(ptr, source_bytes, maxlen);
+        source_bytes += maxlen;
+        source_left -= maxlen;
+        return maxlen;
+}
+
+static void
+handler(int fd, const WebsocketMessage *messages, size_t num_messages_in,
+                                                                void *arg)
+{
+        num_messages += num_messages_in;
+}
+
+/*
+ * A chunk of masked client frames, back to back, with whole frames only.
+ */
+static size_t
+make_client_frames(uint8_t *dst, size_t payload_len)
+{
+        size_t frame_len = 2 + (payload_len > 125 ? 2 : 0) + 4 + payload_len;
+        size_t num = CHUNK_LEN / frame_len;
+        uint8_t *ptr = dst;
+        size_t i, j;
+
+        for (i = 0; i < num; i++) {
+                *ptr++ = 0x81;
+                if (payload_len > 125) {
+                        *ptr++ = 0x80 | 126;
+                        *ptr++ = payload_len >> 8;
+                        *ptr++ = payload_len & 0xff;
+                }
+                else
+                        *ptr++ = 0x80 | payload_len;
+                memcpy(ptr, mask, 4);
+                ptr += 4;
+                for (j = 0; j < payload_len; j++)
+                        *ptr++ = ('a' + j % 26) ^ mask[j % 4];
+        }
+        return ptr - dst;
+}
+
+int
+main(int argc, char **argv)
+{
+        long num = argc > 1 ? atol(argv[1]) : 1000000;
+        size_t payload_len = argc > 2 ? atol(argv[2]) : 32;
+        WebsocketConn *conn;
+        uint8_t *chunk;
+        uint8_t *frame;
+        char *message;
+        size_t chunk_len;
+        double start;
+        long i;
+
+        if (payload_len > 65535)
+                errx(1, "payload_len must be under 64 KiB");
+        if ((chunk = malloc(CHUNK_LEN)) == NULL ||
+            (message = malloc(payload_len + 1)) == NULL)
+                err(1, "malloc");
+        memset(message, 'x', payload_len);
+        message[payload_len] = '\0';
+
+        printf("Built for: %s\n", role);
+
+        chunk_len = make_client_frames(chunk, payload_len);
+        conn = ws_conn_new(1);
+        start = now();
+        while (num_messages < num) {
+                source_bytes = chunk;
+                source_left = chunk_len;
+                if (ws_conn_read_batch(conn, read_bytes, handler, NULL,
+                                                        WS_MAX_BATCH) != 0)
+                        errx(1, "parse failed");
+        }
+        printf("parse  %8.1f ns/frame\n", (now() - start) * 1e9 / num_messages);
+        ws_conn_free(conn);
+
+        start = now();
+        for (i = 0; i < num; i++) {
+                ws_make_text_frame(message, NULL, &frame);
+                free(frame);
+        }
+        printf("build  %8.1f ns/frame\n", (now() - start) * 1e9 / num);
+
+        free(chunk);
+        free(message);
+        return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * Completes websocket handshakes as fast as it can, as after a restart when
+ * every client reconnects at once, and reports handshakes per second.
+ *
+ * Usage: handshakes [num_handshakes]      (default 1000000)
+ *
+ * Each request carries a different key. The handshakes are done one at a
+ * time with ws_complete_handshake (OpenSSL's SHA-1, and an allocated
+ * response), then with ws_complete_handshakes in batches of 1, 8 and 64,
+ * which hashes keys SHA1X_LANES at a time into caller-supplied buffers.
+ *
+ * Build from the top of the tree, e.g.:
+ *
+ *   cc -O2 -march=native -o handshakes bench/handshakes.c handshake.c \
+ *      base64.c sha1x.c metrics.c -lssl -lcrypto -lpthread
+ */
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../ws.h"
+
+#define NUM_KEYS 1024
+#define REQUEST_LEN 256
+#define RESPONSE_LEN 256
+#define MAX_BATCH 64
+
+static const char request_template[] =
+        "GET /chat HTTP/1.1\r\n"
+        "Host: server.example.com\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: %016llxAAAAAA==\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "\r\n";
+
+static char requests[NUM_KEYS][REQUEST_LEN];
+
+static double
+now()
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(const char *name, long num, double start)
+{
+        double secs = now() - start;
+
+        printf("%-24s %10.0f handshakes/s\n", name, num / secs);
+}
+
+static void
+run_single(long num)
+{
+        const char *response;
+        double start = now();
+        long i;
+
+        for (i = 0; i < num; i++) {
+                if ((response = ws_complete_handshake(
+                                        requests[i % NUM_KEYS])) == NULL)
+                        errx(1, "handshake failed");
+                free((void *)response);
+        }
+        report("single", num, start);
+}
+
+static void
+run_batched(long num, size_t batch)
+{
+        static char responses[MAX_BATCH][RESPONSE_LEN];
+        WebsocketHandshake hs[MAX_BATCH];
+        char name[32];
+        double start;
+        long done;
+        size_t i;
+
+        for (i = 0; i < batch; i++) {
+                hs[i].response = responses[i];
+                hs[i].response_cap = RESPONSE_LEN;
+                hs[i].accept_deflate = 0;
+        }
+
+        start = now();
+        for (done = 0; done < num; done += batch) {
+                for (i = 0; i < batch; i++)
+                        hs[i].request = requests[(done + i) % NUM_KEYS];
+                if (ws_complete_handshakes(hs, batch) != batch)
+                        errx(1, "handshake failed");
+        }
+
+        snprintf(name, sizeof(name), "batched (%zu)", batch);
+        report(name, done, start);
+}
+
+int
+main(int argc, char **argv)
+{
+        long num = argc > 1 ? atol(argv[1]) : 1000000;
+        int i;
+
+        for (i = 0; i < NUM_KEYS; i++)
+                snprintf(requests[i], REQUEST_LEN, request_template,
+                         (unsigned long long)i * 0x9e3779b97f4a7c15ULL);
+
+        run_single(num);
+        run_batched(num, 1);
+        run_batched(num, 8);
+        run_batched(num, MAX_BATCH);
+        return 0;
+}
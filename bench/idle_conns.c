@@ -0,0 +1,167 @@
+/*
+ * Holds a large number of idle websocket connections on loopback and reports
+ * what they cost.
+ *
+ * Usage: idle_conns [num_conns]      (default 1000000)
+ *
+ * Each connection is a TCP pair on 127.0.0.x (the client end binds to a new
+ * address every 50000 connections so ephemeral ports don't run out). Every
+ * connection reads one message through ws_conn_read and then goes idle.
+ *
+ * Library memory per idle connection is WS_CONN_IDLE_BYTES (64): the
+ * WebsocketConn itself, with no buffers attached. The kernel's socket
+ * buffers come on top of that; see the "TCP: ... mem" line printed from
+ * /proc/net/sockstat (in pages).
+ *
+ * Holding 1M connections needs both ends' fds, so raise the fd limits first:
+ *
+ *   sysctl -w fs.nr_open=2100000 fs.file-max=2100000
+ *   ulimit -n 2100000
+ *
+ * Build from the top of the tree, e.g.:
+ *
+ *   cc -O2 -o idle_conns bench/idle_conns.c conn.c pool.c frames.c util.c \
+ *      limits.c metrics.c trace.c capture.c -lpthread -lz
+ */
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "../ws.h"
+
+#define CONNS_PER_ADDR 50000
+
+static uint8_t hello_frame[] = {0x81, 0x05, 0x48, 0x65, 0x6c, 0x6c, 0x6f};
+
+static long num_messages = 0;
+
+static ssize_t
+read_bytes(int fd, char *ptr, size_t maxlen)
+{
+        return read(fd, ptr, maxlen);
+}
+
+static void
+handler(int fd, enum WebsocketFrameType type, const char *message,
+                                                        size_t len, void *arg)
+{
+        if (type == WS_FT_TEXT)
+                num_messages++;
+}
+
+static long
+rss_kb()
+{
+        char line[256];
+        long result = -1;
+        FILE *file;
+
+        if ((file = fopen("/proc/self/status", "r")) == NULL)
+                return -1;
+        while (fgets(line, sizeof(line), file))
+                if (sscanf(line, "VmRSS: %ld", &result) == 1)
+                        break;
+        fclose(file);
+        return result;
+}
+
+static void
+print_sockstat()
+{
+        char line[256];
+        FILE *file;
+
+        if ((file = fopen("/proc/net/sockstat", "r")) == NULL)
+                return;
+        while (fgets(line, sizeof(line), file))
+                if (strncmp(line, "TCP:", 4) == 0)
+                        printf("kernel:   %s", line);
+        fclose(file);
+}
+
+int
+main(int argc, char *argv[])
+{
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        WebsocketConn **conns;
+        struct rlimit rlim;
+        size_t borrowed, cached;
+        long num_conns = argc > 1 ? atol(argv[1]) : 1000000;
+        long rss_before, rss_after;
+        long i;
+        int listen_fd, client_fd, server_fd;
+        int one = 1;
+
+        rlim.rlim_cur = rlim.rlim_max = 2 * num_conns + 64;
+        if (setrlimit(RLIMIT_NOFILE, &rlim) != 0)
+                warn("Couldn't raise the fd limit to %ld; see the notes at "
+                     "the top of this file", (long)rlim.rlim_cur);
+
+        if ((conns = calloc(num_conns, sizeof(WebsocketConn *))) == NULL)
+                err(1, "calloc");
+
+        if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+                err(1, "socket");
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(listen_fd, 4096) != 0 ||
+            getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) != 0)
+                err(1, "listen");
+
+        rss_before = rss_kb();
+        for (i = 0; i < num_conns; i++) {
+                struct sockaddr_in local;
+
+                if ((client_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+                        break;
+                setsockopt(client_fd, SOL_SOCKET, SO_REUSEADDR, &one,
+                                                                 sizeof(one));
+                memset(&local, 0, sizeof(local));
+                local.sin_family = AF_INET;
+                local.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 +
+                                                       i / CONNS_PER_ADDR);
+                if (bind(client_fd, (struct sockaddr *)&local,
+                                                       sizeof(local)) != 0 ||
+                    connect(client_fd, (struct sockaddr *)&addr,
+                                                       sizeof(addr)) != 0 ||
+                    (server_fd = accept(listen_fd, NULL, NULL)) < 0) {
+                        warn("Stopped at %ld connections", i);
+                        close(client_fd);
+                        break;
+                }
+
+                fcntl(server_fd, F_SETFL, O_NONBLOCK);
+                conns[i] = ws_conn_new(server_fd);
+                if (write(client_fd, hello_frame, sizeof(hello_frame)) < 0)
+                        err(1, "write");
+                ws_conn_read(conns[i], read_bytes, handler, NULL);
+        }
+        num_conns = i;
+        rss_after = rss_kb();
+
+        ws_conn_pool_stats(&borrowed, &cached);
+        printf("conns:    %ld (%ld messages read)\n", num_conns, num_messages);
+        printf("library:  %d bytes per idle connection, %zu buffers held\n",
+               WS_CONN_IDLE_BYTES, borrowed);
+        printf("rss:      %ld KiB growth, %.1f bytes per connection\n",
+               rss_after - rss_before,
+               num_conns ? (rss_after - rss_before) * 1024.0 / num_conns : 0);
+        print_sockstat();
+
+        return 0;
+}
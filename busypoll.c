@@ -0,0 +1,509 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "constants.h"
+#include "errors.h"
+#include "metrics.h"
+#include "role.h"
+#include "trace.h"
+#include "util.h"
+#include "ws.h"
+
+/*==============================================================================
+ * Defines
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() do {} while (0)
+#endif
+
+
+/*==============================================================================
+ * Static declarations
+ */
+
+/*
+ * Each connection reads into its own buffer, allocated up front. Bytes
+ * [0, msg_len) hold the payload of the message being assembled; bytes
+ * [msg_len, num_read) are raw frame bytes still to be parsed.
+ */
+typedef struct PollConn_ {
+        int fd;
+        int in_message;         /* Fragments have started a message */
+        uint64_t msg_len;
+        uint64_t num_read;
+        uint64_t wakeup_ns;     /* When the message's first bytes arrived */
+        uint8_t *buf;
+} PollConn;
+
+struct WebsocketPoller_ {
+        int cpu;
+        int busy_poll_us;
+        int running;
+        size_t buf_len;
+        size_t max_conns;
+        size_t num_conns;
+        PollConn conns[];
+};
+
+static void deliver(PollConn *, ws_message_handler_fp, void *);
+static int drop(WebsocketPoller *, size_t);
+static int parse_frames(WebsocketPoller *, PollConn *, ws_message_handler_fp,
+                                                                      void *);
+static int send_frame(int, uint8_t, const void *, size_t);
+
+
+/*==============================================================================
+ * Public API
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Creates a busy-polling reader for up to max_conns connections.
+ *
+ * The thread that calls ws_poller_run is pinned to "cpu" (unless it's -1)
+ * and spins over non-blocking recv calls instead of sleeping in the kernel.
+ * If busy_poll_us is non-zero, SO_BUSY_POLL is set on each connection so the
+ * kernel also spins on the NIC queue for that long.
+ *
+ * Every buffer is allocated here: max_message_len bytes (plus framing) per
+ * connection. Nothing is allocated once the poller is running.
+ *
+ * NOTE: The caller must free this with ws_poller_free.
+ */
+WebsocketPoller *
+ws_poller_new(size_t max_conns, size_t max_message_len, int cpu,
+                                                             int busy_poll_us)
+{
+        WebsocketPoller *result;
+        size_t i;
+
+        result = calloc(1, sizeof(WebsocketPoller) +
+                                             max_conns * sizeof(PollConn));
+        if (result == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+
+        /* Room for one frame header past a full message, plus the NUL */
+        result->buf_len = max_message_len + WS_MAX_FRAME_HEADER_LEN + 1;
+        result->max_conns = max_conns;
+        result->cpu = cpu;
+        result->busy_poll_us = busy_poll_us;
+
+        for (i = 0; i < max_conns; i++) {
+                if ((result->conns[i].buf = malloc(result->buf_len)) == NULL)
+                        mem_alloc_failure(__FILE__, __LINE__);
+                WS_METRIC_ADD(allocs, 1);
+                WS_METRIC_ADD(alloc_bytes, result->buf_len);
+        }
+
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Frees a poller. Its connections are left open.
+ */
+void
+ws_poller_free(WebsocketPoller *poller)
+{
+        size_t i;
+
+        if (poller == NULL)
+                return;
+
+        for (i = 0; i < poller->max_conns; i++)
+                free(poller->conns[i].buf);
+        free(poller);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Adds a connection (whose handshake is done) to the poller. It's made
+ * non-blocking, with TCP_NODELAY and SO_BUSY_POLL where they apply.
+ *
+ * Returns 0 on success; -1 if the poller is full or fd couldn't be set up.
+ *
+ * NOTE: Call this before ws_poller_run or from the handler, never from
+ * another thread while the poller is running.
+ */
+int
+ws_poller_add(WebsocketPoller *poller, int fd)
+{
+        PollConn *conn;
+        int flags;
+        int one = 1;
+
+        if (poller->num_conns == poller->max_conns)
+                return -1;
+
+        if ((flags = fcntl(fd, F_GETFL)) < 0 ||
+                            fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+                return -1;
+
+        /* These fail on non-TCP sockets, which is fine */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (poller->busy_poll_us)
+                setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+                           &poller->busy_poll_us, sizeof(poller->busy_poll_us));
+
+        conn = &poller->conns[poller->num_conns++];
+        conn->fd = fd;
+        conn->in_message = 0;
+        conn->msg_len = 0;
+        conn->num_read = 0;
+        conn->wakeup_ns = 0;
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Takes a connection out of the poller (without closing it).
+ *
+ * NOTE: Call this only while the poller isn't running. Connections that
+ * close or fail are removed by the poller itself.
+ */
+void
+ws_poller_remove(WebsocketPoller *poller, int fd)
+{
+        size_t i;
+
+        for (i = 0; i < poller->num_conns; i++)
+                if (poller->conns[i].fd == fd) {
+                        drop(poller, i);
+                        return;
+                }
+}
+
+
+/*------------------------------------------------------------------------------
+ * Spins over the poller's connections, calling "handler" for each message,
+ * until ws_poller_stop is called.
+ *
+ * The message handed to the handler lives in the connection's buffer and is
+ * only good until the handler returns. Pings are answered with pongs and
+ * not passed on. A connection that sends a close frame, hits EOF or an error,
+ * or sends a message over max_message_len is removed once the handler has
+ * been told (with WS_FT_CLOSE, WS_FT_ERROR or WS_FT_TOO_BIG); the handler
+ * should close it.
+ *
+ * The time from a message's first bytes coming out of recv to its handler
+ * being called goes into the wakeup_ns histogram (see ws_metrics_snapshot).
+ *
+ * Returns 0 once stopped; -1 if the thread couldn't be pinned.
+ */
+int
+ws_poller_run(WebsocketPoller *poller, ws_message_handler_fp handler,
+                                                                    void *arg)
+{
+        cpu_set_t cpus;
+        PollConn *conn;
+        ssize_t num_read;
+        size_t i;
+
+        if (poller->cpu >= 0) {
+                CPU_ZERO(&cpus);
+                CPU_SET(poller->cpu, &cpus);
+                if (pthread_setaffinity_np(pthread_self(), sizeof(cpus),
+                                                                &cpus) != 0) {
+                        syslog(LOG_ERR, "Couldn't pin poller to CPU %d",
+                                                                 poller->cpu);
+                        return -1;
+                }
+        }
+
+        /* Make sure the metrics block exists before the hot loop */
+        ws_metrics_local();
+
+        __atomic_store_n(&poller->running, 1, __ATOMIC_RELAXED);
+        while (__atomic_load_n(&poller->running, __ATOMIC_RELAXED)) {
+                for (i = 0; i < poller->num_conns; i++) {
+                        conn = &poller->conns[i];
+                        num_read = recv(conn->fd, conn->buf + conn->num_read,
+                                        poller->buf_len - 1 - conn->num_read,
+                                        MSG_DONTWAIT);
+
+                        if (num_read < 0 && (errno == EAGAIN ||
+                                                 errno == EWOULDBLOCK ||
+                                                 errno == EINTR))
+                                continue;
+
+                        if (num_read <= 0) {
+                                handler(conn->fd, WS_FT_ERROR, NULL, 0, arg);
+                                i -= drop(poller, i);
+                                continue;
+                        }
+
+                        if (conn->num_read == conn->msg_len)
+                                conn->wakeup_ns = WS_METRIC_NOW();
+                        conn->num_read += num_read;
+                        WS_METRIC_ADD(bytes_in, num_read);
+
+                        if (parse_frames(poller, conn, handler, arg) != 0)
+                                i -= drop(poller, i);
+                }
+                cpu_relax();
+        }
+
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Makes ws_poller_run return. Safe to call from any thread or the handler.
+ */
+void
+ws_poller_stop(WebsocketPoller *poller)
+{
+        __atomic_store_n(&poller->running, 0, __ATOMIC_RELAXED);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Sends a text message on a connection with a single sendmsg and no copy of
+ * the payload. Spins if the socket buffer is full.
+ *
+ * Returns 0 on success; -1 if the connection failed.
+ */
+int
+ws_poller_send(int fd, const char *message, size_t len)
+{
+        return send_frame(fd, WS_FRAME_OP_TEXT | WS_FRAME_FIN, message, len);
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Handles every complete frame in a connection's buffer.
+ *
+ * Returns 0 if the connection is still good; -1 if it should be dropped.
+ */
+static int
+parse_frames(WebsocketPoller *poller, PollConn *conn,
+                                    ws_message_handler_fp handler, void *arg)
+{
+        uint8_t *frame;
+        uint64_t avail;
+        uint64_t header_len;
+        uint64_t payload_len;
+        const uint8_t *mask;
+        size_t num_len_bytes;
+        size_t i;
+        uint8_t opcode;
+        int is_final;
+
+        while ((avail = conn->num_read - conn->msg_len) >= 2) {
+                frame = conn->buf + conn->msg_len;
+                opcode = frame[0] & 0x0f;
+
+                payload_len = frame[1] & ~WS_FRAME_MASK;
+                num_len_bytes = 0;
+                if (payload_len == MED_MESSAGE_KEY)
+                        num_len_bytes = NUM_MED_LEN_BYTES;
+                else if (payload_len == LONG_MESSAGE_KEY)
+                        num_len_bytes = NUM_LONG_LEN_BYTES;
+
+                header_len = 2 + num_len_bytes +
+                                 (ROLE_RX_MASKED(frame[1]) ? MASK_LEN : 0);
+                if (avail < header_len)
+                        return 0;
+
+                if (!ROLE_RX_MASK_OK(frame[1])) {
+                        WS_METRIC_ADD(parse_errors, 1);
+                        handler(conn->fd, WS_FT_ERROR, NULL, 0, arg);
+                        return -1;
+                }
+
+                if (num_len_bytes) {
+                        payload_len = 0;
+                        for (i = 0; i < num_len_bytes; i++)
+                                payload_len = (payload_len << 8) | frame[2 + i];
+                }
+
+                /* The whole message has to fit in the buffer */
+                if (payload_len > poller->buf_len ||
+                    conn->msg_len + header_len + payload_len + 1 >
+                                                             poller->buf_len) {
+                        WS_METRIC_ADD(limit_rejects, 1);
+                        handler(conn->fd, WS_FT_TOO_BIG, NULL, 0, arg);
+                        return -1;
+                }
+                if (avail < header_len + payload_len)
+                        return 0;
+
+                mask = role_rx_mask(frame, header_len);
+                mask_bytes(frame + header_len, payload_len, mask, 0);
+                WS_METRIC_ADD(frames_in[opcode], 1);
+
+                /* Control frames can come between fragments */
+                if (opcode == WS_FRAME_OP_PING) {
+                        if (send_frame(conn->fd, WS_FRAME_OP_PONG |
+                                       WS_FRAME_FIN, frame + header_len,
+                                                          payload_len) != 0)
+                                return -1;
+                }
+                else if (opcode == WS_FRAME_OP_PONG) {
+                        handler(conn->fd, WS_FT_PONG,
+                                (char *)frame + header_len, payload_len, arg);
+                }
+                else if (opcode == WS_FRAME_OP_CLOSE) {
+                        WS_METRIC_CLOSE(frame + header_len, payload_len);
+                        handler(conn->fd, WS_FT_CLOSE,
+                                (char *)frame + header_len, payload_len, arg);
+                        return -1;
+                }
+                else if (ROLE_DATA_OPCODE_OK(opcode) ||
+                              (opcode == WS_FRAME_OP_CONT && conn->in_message)) {
+                        /*
+                         * Squeeze the header out, which pulls the payload
+                         * down onto what we have so far
+                         */
+                        is_final = frame[0] & WS_FRAME_FIN;
+                        memmove(frame, frame + header_len, avail - header_len);
+                        conn->msg_len += payload_len;
+                        conn->num_read -= header_len;
+                        conn->in_message = 1;
+
+                        if (is_final)
+                                deliver(conn, handler, arg);
+                        continue;
+                }
+                else {
+                        WS_METRIC_ADD(parse_errors, 1);
+                        handler(conn->fd, WS_FT_ERROR, NULL, 0, arg);
+                        return -1;
+                }
+
+                /* Skip over the control frame */
+                memmove(frame, frame + header_len + payload_len,
+                                        avail - header_len - payload_len);
+                conn->num_read -= header_len + payload_len;
+        }
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Hands an assembled message to the handler and shifts whatever follows it
+ * to the front of the buffer.
+ */
+static void
+deliver(PollConn *conn, ws_message_handler_fp handler, void *arg)
+{
+        uint8_t saved;
+        uint64_t rest;
+
+        /* NUL terminate without losing the byte that follows */
+        saved = conn->buf[conn->msg_len];
+        conn->buf[conn->msg_len] = '\0';
+
+        WS_METRIC_RECORD(wakeup_ns, WS_METRIC_NOW() - conn->wakeup_ns);
+        WS_METRIC_RECORD(message_size, conn->msg_len);
+        WS_TRACE(WS_EV_MESSAGE_DELIVERED, message_delivered, conn->fd,
+                                                   WS_FT_TEXT, conn->msg_len);
+        handler(conn->fd, WS_FT_TEXT, (char *)conn->buf, conn->msg_len, arg);
+
+        conn->buf[conn->msg_len] = saved;
+        rest = conn->num_read - conn->msg_len;
+        memmove(conn->buf, conn->buf + conn->msg_len, rest);
+        conn->num_read = rest;
+        conn->msg_len = 0;
+        conn->in_message = 0;
+
+        /* Bytes of the next message were already here */
+        if (rest)
+                conn->wakeup_ns = WS_METRIC_NOW();
+}
+
+
+/*------------------------------------------------------------------------------
+ * Removes a connection by moving the last one into its slot.
+ *
+ * Returns 1, so a caller walking the connections can step back and visit the
+ * moved one.
+ */
+static int
+drop(WebsocketPoller *poller, size_t i)
+{
+        PollConn tmp;
+
+        poller->num_conns--;
+        if (i != poller->num_conns) {
+                tmp = poller->conns[i];
+                poller->conns[i] = poller->conns[poller->num_conns];
+                poller->conns[poller->num_conns] = tmp;
+        }
+        return 1;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Sends one unmasked frame, header and payload together.
+ */
+static int
+send_frame(int fd, uint8_t byte0, const void *payload, size_t len)
+{
+        uint8_t header[WS_MAX_FRAME_HEADER_LEN];
+        struct iovec iov[2];
+        struct msghdr msg;
+        ssize_t num_sent;
+        size_t header_len;
+        size_t total;
+
+        header_len = ws_make_frame_header(byte0, len, NULL, header);
+        iov[0].iov_base = header;
+        iov[0].iov_len = header_len;
+        iov[1].iov_base = (void *)payload;
+        iov[1].iov_len = len;
+        total = header_len + len;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+
+        while (total > 0) {
+                num_sent = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+                if (num_sent < 0 && (errno == EAGAIN || errno == EINTR))
+                        continue;
+                if (num_sent < 0)
+                        return -1;
+
+                total -= num_sent;
+                while (msg.msg_iovlen && (size_t)num_sent >=
+                                                     msg.msg_iov[0].iov_len) {
+                        num_sent -= msg.msg_iov[0].iov_len;
+                        msg.msg_iov++;
+                        msg.msg_iovlen--;
+                }
+                if (msg.msg_iovlen) {
+                        msg.msg_iov[0].iov_base =
+                                (uint8_t *)msg.msg_iov[0].iov_base + num_sent;
+                        msg.msg_iov[0].iov_len -= num_sent;
+                }
+        }
+
+        WS_METRIC_ADD(frames_out[byte0 & 0x0f], 1);
+        WS_METRIC_ADD(bytes_out, header_len + len);
+        return 0;
+}
@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <sys/types.h>
+
+#include "capture.h"
+#include "metrics.h"
+#include "ws.h"
+
+/*==============================================================================
+ * Static declarations
+ */
+
+int ws_capture_enabled = 0;
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *capture_file = NULL;
+static uint64_t capture_start_ns;
+
+
+/*==============================================================================
+ * Public API
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Starts recording every byte ws_read_next_message reads, per connection and
+ * with timestamps, to "path". The file can be fed back through the reader
+ * with tools/ws_replay.
+ *
+ * Returns 0 on success; -1 if the file couldn't be created.
+ *
+ * NOTE: Captures hold whatever clients sent, so treat them as sensitive.
+ */
+int
+ws_capture_start(const char *path)
+{
+        CaptureFileHeader header;
+        FILE *file;
+
+        if ((file = fopen(path, "we")) == NULL) {
+                syslog(LOG_ERR, "Couldn't create capture file %s: %s", path,
+                                                             strerror(errno));
+                return -1;
+        }
+
+        memcpy(header.magic, WS_CAPTURE_MAGIC, 4);
+        header.version = WS_CAPTURE_VERSION;
+        if (fwrite(&header, sizeof(header), 1, file) != 1) {
+                fclose(file);
+                return -1;
+        }
+
+        ws_capture_stop();
+
+        pthread_mutex_lock(&capture_lock);
+        capture_file = file;
+        capture_start_ns = ws_now_ns();
+        __atomic_store_n(&ws_capture_enabled, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&capture_lock);
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Stops recording and closes the capture file.
+ */
+void
+ws_capture_stop()
+{
+        pthread_mutex_lock(&capture_lock);
+        __atomic_store_n(&ws_capture_enabled, 0, __ATOMIC_RELEASE);
+        if (capture_file != NULL)
+                fclose(capture_file);
+        capture_file = NULL;
+        pthread_mutex_unlock(&capture_lock);
+}
+
+
+/*==============================================================================
+ * Library functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Appends a record for bytes just read from a connection.
+ *
+ * NOTE: Records from all threads go through one lock. Capturing is meant for
+ * collecting samples, not for leaving on.
+ */
+void
+ws_capture_record(int conn, const void *bytes, size_t len)
+{
+        CaptureRecord record;
+
+        if (len == 0)
+                return;
+
+        pthread_mutex_lock(&capture_lock);
+        if (capture_file != NULL) {
+                record.ns = ws_now_ns() - capture_start_ns;
+                record.conn = conn;
+                record.len = len;
+                if (fwrite(&record, sizeof(record), 1, capture_file) != 1 ||
+                                fwrite(bytes, len, 1, capture_file) != 1) {
+                        syslog(LOG_ERR, "Capture stopped: %s",
+                                                             strerror(errno));
+                        __atomic_store_n(&ws_capture_enabled, 0,
+                                                           __ATOMIC_RELEASE);
+                        fclose(capture_file);
+                        capture_file = NULL;
+                }
+        }
+        pthread_mutex_unlock(&capture_lock);
+}
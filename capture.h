@@ -0,0 +1,41 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+#include <sys/types.h>
+
+/*
+ * Capture hook for inbound bytes. Capturing is off until ws_capture_start is
+ * called, so the hook costs one predictable branch when it isn't in use.
+ *
+ * A capture file starts with a CaptureFileHeader and is followed by records,
+ * each a CaptureRecord and then "len" bytes exactly as read_bytes returned
+ * them. All fields are in host byte order.
+ */
+
+#define WS_CAPTURE_MAGIC "WSCP"
+#define WS_CAPTURE_VERSION 1
+
+typedef struct CaptureFileHeader_ {
+        char magic[4];
+        uint32_t version;
+} CaptureFileHeader;
+
+typedef struct CaptureRecord_ {
+        uint64_t ns;            /* Since the capture started */
+        int32_t conn;
+        uint32_t len;
+} CaptureRecord;
+
+extern int ws_capture_enabled;
+
+void ws_capture_record(int conn, const void *bytes, size_t len);
+
+#define WS_CAPTURE(conn, bytes, len) \
+do {\
+        if (__builtin_expect(ws_capture_enabled, 0))\
+                ws_capture_record(conn, bytes, len);\
+} while (0)
+
+#endif
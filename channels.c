@@ -0,0 +1,1136 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+
+#include "errors.h"
+#include "metrics.h"
+#include "pool.h"
+#include "replay.h"
+#include "trace.h"
+#include "ws.h"
+
+/*==============================================================================
+ * Defines
+ */
+
+#define NUM_CHANNEL_BUCKETS 256
+#define MAX_RETIRED_SETS 64
+
+/* Subscribers are spread over this many locks (and backlog lists) by fd */
+#define NUM_FD_STRIPES 64
+
+/* A subscriber further behind than this is dropped */
+#define MAX_BACKLOG (4 * 1024 * 1024)
+
+
+/*==============================================================================
+ * Static declarations
+ */
+
+/*
+ * A subscriber set is never modified once it has been published. Joins and
+ * leaves build a new set and swap it in, so publishers can walk a set without
+ * taking any locks.
+ *
+ * Subscribers that take compressed frames come first, in
+ * fds[0, num_deflate).
+ */
+typedef struct SubscriberSet_ {
+        struct SubscriberSet_ *next_retired;
+        size_t num_fds;
+        size_t num_deflate;
+        int fds[];
+} SubscriberSet;
+
+/*
+ * Publishes to a channel take turns (publish_lock), so every subscriber gets
+ * its frames in the order of their replay sequence numbers.
+ */
+typedef struct Channel_ {
+        struct Channel_ *next;
+        SubscriberSet *subscribers;
+        ReplayRing *replay;
+        pthread_mutex_t publish_lock;
+        char name[];
+} Channel;
+
+/*
+ * The bytes a subscriber's socket wouldn't take yet, kept until
+ * ws_channels_flush writes them. Later frames go in behind them, so a frame
+ * is never torn or overtaken.
+ */
+typedef struct Backlog_ {
+        struct Backlog_ *next;
+        int fd;
+        PoolBuf *buf;           /* Unsent bytes are in [start, len) */
+} Backlog;
+
+/*
+ * Writes to an fd (and its backlog) are made holding its stripe's lock, so
+ * frames from publishers on different threads don't interleave.
+ */
+typedef struct FdStripe_ {
+        pthread_mutex_t lock;
+        Backlog *backlogs;
+} __attribute__((aligned(64))) FdStripe;
+
+/*
+ * Readers announce themselves in one of two counters, picked by the parity of
+ * the epoch when they started. A writer that swaps out a subscriber set flips
+ * the epoch twice and waits for each counter to drain; after that no reader
+ * can still hold the old set.
+ */
+struct WebsocketChannels_ {
+        Channel *buckets[NUM_CHANNEL_BUCKETS];
+
+        unsigned long epoch;
+        unsigned long readers[2] __attribute__((aligned(64)));
+
+        pthread_mutex_t write_lock __attribute__((aligned(64)));
+        SubscriberSet *retired;
+        size_t num_retired;
+
+        FdStripe stripes[NUM_FD_STRIPES];
+
+        ws_drop_fp on_drop;
+        void *on_drop_arg;
+};
+
+
+static SubscriberSet *copy_set(const SubscriberSet *, size_t);
+static Backlog **find_backlog(FdStripe *, int);
+static Channel *find_channel(WebsocketChannels *, const char *);
+static Channel *find_or_add_channel(WebsocketChannels *, const char *);
+static void free_backlog(Backlog **);
+static int has_fd(const SubscriberSet *, int);
+static size_t hash_name(const char *);
+static size_t publish(WebsocketChannels *, const char *, const char *,
+                     const uint8_t *, size_t, ws_write_bytes_fp, uint64_t *);
+static unsigned long read_lock(WebsocketChannels *);
+static void read_unlock(WebsocketChannels *, unsigned long);
+static void reclaim_retired(WebsocketChannels *);
+static int remove_fd(WebsocketChannels *, Channel *, int);
+static void retire_set(WebsocketChannels *, SubscriberSet *);
+static int send_bytes(WebsocketChannels *, int, ws_write_bytes_fp,
+                                                     const uint8_t *, size_t);
+static int subscribe(WebsocketChannels *, const char *, int, int);
+static void wait_for_readers(WebsocketChannels *);
+static SubscriberSet *with_fd(const SubscriberSet *, int, int);
+static int write_some(int, ws_write_bytes_fp, const uint8_t **, size_t *);
+
+
+/*==============================================================================
+ * Public API
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Creates an empty channel registry.
+ *
+ * NOTE: The caller must free this with ws_channels_free.
+ */
+WebsocketChannels *
+ws_channels_new()
+{
+        WebsocketChannels *result;
+        size_t i;
+
+        if ((result = calloc(1, sizeof(WebsocketChannels))) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+
+        if (pthread_mutex_init(&result->write_lock, NULL) != 0)
+                pthread_failure(__FILE__, __LINE__);
+        for (i = 0; i < NUM_FD_STRIPES; i++)
+                if (pthread_mutex_init(&result->stripes[i].lock, NULL) != 0)
+                        pthread_failure(__FILE__, __LINE__);
+
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Frees a channel registry.
+ *
+ * NOTE: No other thread may be using the registry at this point.
+ */
+void
+ws_channels_free(WebsocketChannels *channels)
+{
+        size_t i;
+        Channel *channel;
+        Channel *next;
+
+        if (channels == NULL)
+                return;
+
+        for (i = 0; i < NUM_CHANNEL_BUCKETS; i++) {
+                for (channel = channels->buckets[i]; channel; channel = next) {
+                        next = channel->next;
+                        free(channel->subscribers);
+                        replay_ring_free(channel->replay);
+                        pthread_mutex_destroy(&channel->publish_lock);
+                        free(channel);
+                }
+        }
+
+        for (i = 0; i < NUM_FD_STRIPES; i++) {
+                while (channels->stripes[i].backlogs)
+                        free_backlog(&channels->stripes[i].backlogs);
+                pthread_mutex_destroy(&channels->stripes[i].lock);
+        }
+
+        reclaim_retired(channels);
+        pthread_mutex_destroy(&channels->write_lock);
+        free(channels);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Sets a function to be told of each subscriber a publish gave up on, because
+ * writing to it failed or it fell more than MAX_BACKLOG (4 MiB) behind. By
+ * then it's been dropped from every channel (see ws_channels_drop_connection).
+ *
+ * The connection's stream may end part way through a frame, so it can't be
+ * closed cleanly with a close frame; on_drop should close the fd (or have it
+ * closed). It's called on the publishing thread, with no locks held.
+ *
+ * NOTE: Set this before publishing. Without it, the caller has to notice
+ * dropped connections some other way and close them.
+ */
+void
+ws_channels_on_drop(WebsocketChannels *channels, ws_drop_fp on_drop,
+                                                                   void *arg)
+{
+        channels->on_drop = on_drop;
+        channels->on_drop_arg = arg;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Subscribes a connection to a named channel, creating the channel if needed.
+ *
+ * Returns 0 on success; 1 if the connection was already subscribed.
+ */
+int
+ws_channel_subscribe(WebsocketChannels *channels, const char *name, int fd)
+{
+        return subscribe(channels, name, fd, 0);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Subscribes a connection that agreed to permessage-deflate (see
+ * ws_complete_handshake_deflate). Messages published with ws_channel_publish
+ * reach it compressed, whenever compressing makes them smaller.
+ *
+ * Returns 0 on success; 1 if the connection was already subscribed.
+ */
+int
+ws_channel_subscribe_deflate(WebsocketChannels *channels, const char *name,
+                                                                       int fd)
+{
+        return subscribe(channels, name, fd, 1);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Unsubscribes a connection from a named channel.
+ *
+ * Returns 0 on success; -1 if the connection wasn't subscribed.
+ */
+int
+ws_channel_unsubscribe(WebsocketChannels *channels, const char *name, int fd)
+{
+        Channel *channel;
+        int result = -1;
+
+        pthread_mutex_lock(&channels->write_lock);
+
+        if ((channel = find_channel(channels, name)) != NULL)
+                result = remove_fd(channels, channel, fd);
+
+        pthread_mutex_unlock(&channels->write_lock);
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Removes a connection from every channel it's subscribed to, and drops
+ * whatever was waiting to be written to it.
+ *
+ * This should be called when a connection closes (e.g., when
+ * ws_read_next_message returns WS_FT_CLOSE or WS_FT_ERROR).
+ */
+void
+ws_channels_drop_connection(WebsocketChannels *channels, int fd)
+{
+        FdStripe *stripe = &channels->stripes[fd % NUM_FD_STRIPES];
+        Backlog **backlog_p;
+        size_t i;
+        Channel *channel;
+
+        pthread_mutex_lock(&channels->write_lock);
+
+        for (i = 0; i < NUM_CHANNEL_BUCKETS; i++)
+                for (channel = channels->buckets[i]; channel;
+                                                       channel = channel->next)
+                        remove_fd(channels, channel, fd);
+
+        pthread_mutex_unlock(&channels->write_lock);
+
+        pthread_mutex_lock(&stripe->lock);
+        if (*(backlog_p = find_backlog(stripe, fd)) != NULL)
+                free_backlog(backlog_p);
+        pthread_mutex_unlock(&stripe->lock);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Writes out what publishes (or a replay) couldn't write to a connection
+ * without blocking. Call this when fd is writable and
+ * ws_channels_wants_write says there's something to write.
+ *
+ * Returns 0 once everything is written; 1 if some is still waiting; -1 if
+ * writing failed, in which case the connection should be dropped and closed.
+ */
+int
+ws_channels_flush(WebsocketChannels *channels, int fd,
+                                                 ws_write_bytes_fp write_bytes)
+{
+        FdStripe *stripe = &channels->stripes[fd % NUM_FD_STRIPES];
+        Backlog **backlog_p;
+        PoolBuf *buf;
+        const uint8_t *ptr;
+        size_t left;
+        int result = 0;
+
+        pthread_mutex_lock(&stripe->lock);
+
+        if (*(backlog_p = find_backlog(stripe, fd)) == NULL)
+                goto done;
+
+        buf = (*backlog_p)->buf;
+        ptr = buf->data + buf->start;
+        left = buf->len - buf->start;
+        if (write_some(fd, write_bytes, &ptr, &left) != 0) {
+                result = -1;
+                goto done;
+        }
+
+        buf->start = buf->len - left;
+        if (left)
+                result = 1;
+        else
+                free_backlog(backlog_p);
+
+done:
+        pthread_mutex_unlock(&stripe->lock);
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns 1 if there's something for ws_channels_flush to write to a
+ * connection; 0 if not.
+ */
+int
+ws_channels_wants_write(WebsocketChannels *channels, int fd)
+{
+        FdStripe *stripe = &channels->stripes[fd % NUM_FD_STRIPES];
+        int result;
+
+        pthread_mutex_lock(&stripe->lock);
+        result = *find_backlog(stripe, fd) != NULL;
+        pthread_mutex_unlock(&stripe->lock);
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Keeps the most recently published frames of a channel so that reconnecting
+ * clients can catch up with ws_channel_replay.
+ *
+ * The ring holds up to "capacity" bytes of encoded frames. If path is
+ * non-NULL, the ring is kept in a memory-mapped file at that path.
+ *
+ * Returns 0 on success; -1 if replay is already enabled or the file couldn't
+ * be set up.
+ */
+int
+ws_channel_enable_replay(WebsocketChannels *channels, const char *name,
+                                            size_t capacity, const char *path)
+{
+        Channel *channel;
+        ReplayRing *ring;
+        int result = -1;
+
+        pthread_mutex_lock(&channels->write_lock);
+
+        channel = find_or_add_channel(channels, name);
+        if (channel->replay != NULL)
+                goto done;
+
+        if ((ring = replay_ring_new(capacity, path)) == NULL)
+                goto done;
+
+        __atomic_store_n(&channel->replay, ring, __ATOMIC_SEQ_CST);
+        result = 0;
+
+done:
+        pthread_mutex_unlock(&channels->write_lock);
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns the sequence number of the last frame published to a channel with
+ * replay enabled (0 if nothing has been published yet).
+ *
+ * NOTE: Another publish may land before the caller acts on this; to know
+ * the sequence number of a given message, use ws_channel_publish_seq.
+ */
+uint64_t
+ws_channel_last_seq(WebsocketChannels *channels, const char *name)
+{
+        Channel *channel;
+        ReplayRing *ring;
+
+        if ((channel = find_channel(channels, name)) == NULL)
+                return 0;
+
+        if ((ring = __atomic_load_n(&channel->replay, __ATOMIC_SEQ_CST)) == NULL)
+                return 0;
+
+        return replay_ring_last_seq(ring);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Writes every frame published to a channel after since_seq to a connection.
+ *
+ * The frames are sent exactly as they were built at publish time; nothing is
+ * re-encoded. What the connection won't take yet is kept for
+ * ws_channels_flush, as for a publish.
+ *
+ * Returns the number of frames written (or kept); -1 if the channel has no
+ * replay ring, if frames after since_seq have already been evicted (the
+ * client needs a full resync), or if the write fails. *
+ * NOTE: Publishes can land between this and a subscribe, so a client that's
+ * catching up should use ws_channel_subscribe_since instead.
+ */
+ssize_t
+ws_channel_replay(WebsocketChannels *channels, const char *name,
+                  uint64_t since_seq, int fd, ws_write_bytes_fp write_bytes)
+{
+        Channel *channel;
+        ReplayRing *ring;
+        uint8_t *frames;
+        size_t frames_len;
+        ssize_t result;
+
+        if ((channel = find_channel(channels, name)) == NULL)
+                return -1;
+
+        if ((ring = __atomic_load_n(&channel->replay, __ATOMIC_SEQ_CST)) == NULL)
+                return -1;
+
+        /*
+         * The frames are copied out first so that a slow client doesn't hold
+         * up publishers while it drains.
+         */
+        result = replay_ring_copy_since(ring, since_seq, &frames, &frames_len);
+        if (result > 0 && send_bytes(channels, fd, write_bytes, frames,
+                                                           frames_len) != 0)
+                result = -1;
+
+        free(frames);
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Catches a reconnecting connection up and subscribes it, in one step: every
+ * frame published to the channel after since_seq is written to it (as by
+ * ws_channel_replay), then it gets every later publish (as after
+ * ws_channel_subscribe). No publish can land in between, so nothing is missed
+ * or sent twice.
+ *
+ * NOTE: Publishes to the channel wait while the frames are copied out and
+ * written. Replayed frames are plain, so this subscribes the connection as a
+ * plain one.
+ *
+ * Returns the number of frames replayed; -1 if the channel has no replay
+ * ring, if frames after since_seq have already been evicted, if the write
+ * fails or if the connection is already subscribed. It isn't subscribed
+ * after -1.
+ */
+ssize_t
+ws_channel_subscribe_since(WebsocketChannels *channels, const char *name,
+                           int fd, uint64_t since_seq,
+                           ws_write_bytes_fp write_bytes)
+{
+        Channel *channel;
+        ReplayRing *ring;
+        SubscriberSet *old_set;
+        uint8_t *frames = NULL;
+        size_t frames_len;
+        ssize_t result = -1;
+
+        pthread_mutex_lock(&channels->write_lock);
+
+        if ((channel = find_channel(channels, name)) == NULL ||
+            (ring = channel->replay) == NULL ||
+            has_fd(channel->subscribers, fd))
+                goto done;
+
+        /* The set is swapped while publishes wait, but retired after */
+        old_set = channel->subscribers;
+        pthread_mutex_lock(&channel->publish_lock);
+        result = replay_ring_copy_since(ring, since_seq, &frames, &frames_len);
+        if (result > 0 && send_bytes(channels, fd, write_bytes, frames,
+                                                           frames_len) != 0)
+                result = -1;
+        if (result >= 0)
+                __atomic_store_n(&channel->subscribers,
+                                 with_fd(old_set, fd, 0), __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&channel->publish_lock);
+
+        if (result >= 0)
+                retire_set(channels, old_set);
+
+done:
+        pthread_mutex_unlock(&channels->write_lock);
+        free(frames);
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns the number of connections subscribed to a channel.
+ */
+size_t
+ws_channel_num_subscribers(WebsocketChannels *channels, const char *name)
+{
+        Channel *channel;
+        SubscriberSet *set;
+        unsigned long epoch;
+        size_t result = 0;
+
+        epoch = read_lock(channels);
+
+        if ((channel = find_channel(channels, name)) != NULL) {
+                set = __atomic_load_n(&channel->subscribers, __ATOMIC_SEQ_CST);
+                result = set ? set->num_fds : 0;
+        }
+
+        read_unlock(channels, epoch);
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Publishes a text message to every subscriber of a channel.
+ *
+ * The frame is built once and the same bytes are written to each subscriber
+ * (and stored in the channel's replay ring, if it has one). Subscribers added
+ * with ws_channel_subscribe_deflate share one compressed frame instead. Publishers never
+ * wait on subscribes or unsubscribes.
+ *
+ * Subscriber sockets should be non-blocking, so one slow subscriber can't
+ * hold up the rest: what a socket won't take yet is kept, and written by
+ * ws_channels_flush. Any subscriber whose write fails, or which falls more
+ * than MAX_BACKLOG bytes behind, is dropped from all channels once the
+ * publish is done, and the function set with ws_channels_on_drop is told.
+ *
+ * Returns the number of subscribers the message was written to (or kept
+ * for).
+ */
+size_t
+ws_channel_publish(WebsocketChannels *channels, const char *name,
+                   const char *message, ws_write_bytes_fp write_bytes)
+{
+        uint8_t *frame = NULL;
+        size_t frame_len;
+        size_t result;
+
+        frame_len = ws_make_text_frame(message, NULL, &frame);
+        result = publish(channels, name, message, frame, frame_len,
+                                                            write_bytes, NULL);
+        free(frame);
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Like ws_channel_publish, but also sets *seq_p to the message's sequence
+ * number in the channel's replay ring (0 if it has none). Subscribers get
+ * messages in sequence order, so clients can hand this to ws_channel_replay
+ * when they reconnect.
+ */
+size_t
+ws_channel_publish_seq(WebsocketChannels *channels, const char *name,
+                       const char *message, ws_write_bytes_fp write_bytes,
+                       uint64_t *seq_p)
+{
+        uint8_t *frame = NULL;
+        size_t frame_len;
+        size_t result;
+
+        frame_len = ws_make_text_frame(message, NULL, &frame);
+        result = publish(channels, name, message, frame, frame_len,
+                                                          write_bytes, seq_p);
+        free(frame);
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Publishes an already-built frame to every subscriber of a channel.
+ * Subscribers that take compressed frames get it as it is.
+ *
+ * See ws_channel_publish.
+ */
+size_t
+ws_channel_publish_frame(WebsocketChannels *channels, const char *name,
+                         const uint8_t *frame, size_t frame_len,
+                         ws_write_bytes_fp write_bytes)
+{
+        return publish(channels, name, NULL, frame, frame_len, write_bytes,
+                                                                       NULL);
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Copies a subscriber set, leaving room for "extra" more fds.
+ */
+static SubscriberSet *
+copy_set(const SubscriberSet *set, size_t extra)
+{
+        size_t num_fds;
+        SubscriberSet *result;
+
+        num_fds = set ? set->num_fds : 0;
+        result = malloc(sizeof(SubscriberSet) + (num_fds + extra)*sizeof(int));
+        if (result == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+
+        result->next_retired = NULL;
+        result->num_fds = num_fds;
+        result->num_deflate = set ? set->num_deflate : 0;
+        if (num_fds)
+                memcpy(result->fds, set->fds, num_fds * sizeof(int));
+
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns where an fd's backlog is linked from in its stripe's list (which
+ * points at NULL if it has none).
+ *
+ * NOTE: The caller must hold the stripe's lock.
+ */
+static Backlog **
+find_backlog(FdStripe *stripe, int fd)
+{
+        Backlog **result;
+
+        for (result = &stripe->backlogs; *result; result = &(*result)->next)
+                if ((*result)->fd == fd)
+                        break;
+
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Looks up a channel by name.
+ *
+ * Channels are only ever pushed onto the head of a bucket, so this is safe to
+ * call without holding the write lock.
+ */
+static Channel *
+find_channel(WebsocketChannels *channels, const char *name)
+{
+        Channel *channel;
+
+        channel = __atomic_load_n(&channels->buckets[hash_name(name)],
+                                                             __ATOMIC_SEQ_CST);
+        for (; channel; channel = channel->next)
+                if (strcmp(channel->name, name) == 0)
+                        return channel;
+
+        return NULL;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Looks up a channel by name, adding it if it doesn't exist.
+ *
+ * NOTE: The caller must hold the write lock.
+ */
+static Channel *
+find_or_add_channel(WebsocketChannels *channels, const char *name)
+{
+        size_t bucket;
+        Channel *result;
+
+        if ((result = find_channel(channels, name)) != NULL)
+                return result;
+
+        if ((result = malloc(sizeof(Channel) + strlen(name) + 1)) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+
+        strcpy(result->name, name);
+        result->subscribers = NULL;
+        result->replay = NULL;
+        if (pthread_mutex_init(&result->publish_lock, NULL) != 0)
+                pthread_failure(__FILE__, __LINE__);
+
+        bucket = hash_name(name);
+        result->next = channels->buckets[bucket];
+        __atomic_store_n(&channels->buckets[bucket], result, __ATOMIC_SEQ_CST);
+
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Unlinks a backlog and frees it.
+ *
+ * NOTE: The caller must hold the stripe's lock.
+ */
+static void
+free_backlog(Backlog **backlog_p)
+{
+        Backlog *backlog = *backlog_p;
+
+        *backlog_p = backlog->next;
+        pool_put(backlog->buf);
+        free(backlog);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns 1 if fd is in a subscriber set; 0 if not.
+ */
+static int
+has_fd(const SubscriberSet *set, int fd)
+{
+        size_t i;
+
+        for (i = 0; set && i < set->num_fds; i++)
+                if (set->fds[i] == fd)
+                        return 1;
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Hashes a channel name into a bucket index (FNV-1a).
+ */
+static size_t
+hash_name(const char *name)
+{
+        uint32_t hash = 2166136261u;
+
+        while (*name) {
+                hash ^= (uint8_t)*name++;
+                hash *= 16777619u;
+        }
+
+        return hash % NUM_CHANNEL_BUCKETS;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Writes a frame to every subscriber of a channel (see ws_channel_publish).
+ *
+ * If "message" is given and some subscribers take compressed frames, it's
+ * compressed once for all of them. So each message is encoded at most twice,
+ * however many subscribers there are.
+ *
+ * The frame goes into the replay ring and out to subscribers under the
+ * channel's publish lock, so both see publishes in the same order. If seq_p
+ * is given, it's set to the frame's sequence number (0 without a ring).
+ */
+static size_t
+publish(WebsocketChannels *channels, const char *name, const char *message,
+        const uint8_t *frame, size_t frame_len, ws_write_bytes_fp write_bytes,
+                                                               uint64_t *seq_p)
+{
+        size_t i;
+        Channel *channel;
+        SubscriberSet *set;
+        ReplayRing *ring;
+        unsigned long epoch;
+        uint8_t *deflated = NULL;
+        size_t deflated_len = 0;
+        const uint8_t *out;
+        size_t out_len;
+        int *failed = NULL;
+        size_t num_failed = 0;
+        uint64_t seq = 0;
+        size_t result = 0;
+
+        epoch = read_lock(channels);
+
+        if ((channel = find_channel(channels, name)) == NULL) {
+                read_unlock(channels, epoch);
+                if (seq_p)
+                        *seq_p = 0;
+                return 0;
+        }
+
+        pthread_mutex_lock(&channel->publish_lock);
+        set = __atomic_load_n(&channel->subscribers, __ATOMIC_SEQ_CST);
+
+        /* Replay clients may not have agreed to deflate, so keep it plain */
+        ring = __atomic_load_n(&channel->replay, __ATOMIC_SEQ_CST);
+        if (ring)
+                seq = replay_ring_append(ring, frame, frame_len);
+
+        if (message && set && set->num_deflate) {
+                deflated_len = ws_make_deflate_frame(message, &deflated);
+                if (deflated_len >= frame_len) {
+                        free(deflated);
+                        deflated = NULL;
+                }
+        }
+
+        for (i = 0; set && i < set->num_fds; i++) {
+                out = frame;
+                out_len = frame_len;
+                if (deflated && i < set->num_deflate) {
+                        out = deflated;
+                        out_len = deflated_len;
+                }
+
+                if (send_bytes(channels, set->fds[i], write_bytes, out,
+                                                              out_len) == 0) {
+                        result++;
+                        continue;
+                }
+
+                if (failed == NULL &&
+                    (failed = malloc(set->num_fds * sizeof(int))) == NULL)
+                        mem_alloc_failure(__FILE__, __LINE__);
+                failed[num_failed++] = set->fds[i];
+        }
+
+        pthread_mutex_unlock(&channel->publish_lock);
+        read_unlock(channels, epoch);
+        free(deflated);
+        if (seq_p)
+                *seq_p = seq;
+
+        /* Clean up closed connections outside of the read section */
+        for (i = 0; i < num_failed; i++) {
+                ws_channels_drop_connection(channels, failed[i]);
+                if (channels->on_drop)
+                        channels->on_drop(failed[i], channels->on_drop_arg);
+        }
+        free(failed);
+
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Enters a read section. Returns the epoch to hand back to read_unlock.
+ */
+static unsigned long
+read_lock(WebsocketChannels *channels)
+{
+        unsigned long epoch;
+
+        epoch = __atomic_load_n(&channels->epoch, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&channels->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        return epoch;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Leaves a read section.
+ */
+static void
+read_unlock(WebsocketChannels *channels, unsigned long epoch)
+{
+        __atomic_fetch_sub(&channels->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Frees all retired subscriber sets.
+ *
+ * NOTE: The caller must make sure no reader can still be using them.
+ */
+static void
+reclaim_retired(WebsocketChannels *channels)
+{
+        SubscriberSet *set;
+        SubscriberSet *next;
+
+        for (set = channels->retired; set; set = next) {
+                next = set->next_retired;
+                free(set);
+        }
+        channels->retired = NULL;
+        channels->num_retired = 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Removes an fd from a channel's subscriber set.
+ *
+ * NOTE: The caller must hold the write lock.
+ */
+static int
+remove_fd(WebsocketChannels *channels, Channel *channel, int fd)
+{
+        size_t i;
+        SubscriberSet *old_set;
+        SubscriberSet *new_set;
+
+        old_set = channel->subscribers;
+        for (i = 0; old_set && i < old_set->num_fds; i++)
+                if (old_set->fds[i] == fd)
+                        break;
+
+        if (old_set == NULL || i == old_set->num_fds)
+                return -1;
+
+        /*
+         * Order doesn't matter, so fill the hole from the end of its group
+         * (and that from the end of the set)
+         */
+        new_set = copy_set(old_set, 0);
+        if (i < new_set->num_deflate) {
+                new_set->fds[i] = new_set->fds[--new_set->num_deflate];
+                i = new_set->num_deflate;
+        }
+        new_set->fds[i] = new_set->fds[--new_set->num_fds];
+        __atomic_store_n(&channel->subscribers, new_set, __ATOMIC_SEQ_CST);
+        retire_set(channels, old_set);
+
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Writes bytes to a subscriber without blocking, keeping whatever it won't
+ * take yet in its backlog. If it already has one, the bytes go straight to
+ * the end of it.
+ *
+ * Returns 0 if the bytes were written or kept; -1 if writing failed or the
+ * backlog would grow past MAX_BACKLOG.
+ */
+static int
+send_bytes(WebsocketChannels *channels, int fd, ws_write_bytes_fp write_bytes,
+                                                const uint8_t *ptr, size_t n)
+{
+        FdStripe *stripe = &channels->stripes[fd % NUM_FD_STRIPES];
+        Backlog **backlog_p;
+        Backlog *backlog;
+        PoolBuf *buf;
+        size_t left = n;
+        int result = 0;
+
+        pthread_mutex_lock(&stripe->lock);
+
+        backlog_p = find_backlog(stripe, fd);
+        if (*backlog_p == NULL) {
+                if (write_some(fd, write_bytes, &ptr, &left) != 0) {
+                        result = -1;
+                        goto done;
+                }
+                if (left == 0) {
+                        WS_TRACE(WS_EV_WRITE_COMPLETE, write_complete, fd, 0,
+                                                                          n);
+                        goto done;
+                }
+
+                if ((backlog = malloc(sizeof(Backlog))) == NULL)
+                        mem_alloc_failure(__FILE__, __LINE__);
+                backlog->next = NULL;
+                backlog->fd = fd;
+                backlog->buf = pool_get();
+                *backlog_p = backlog;
+        }
+
+        buf = (*backlog_p)->buf;
+        if (buf->len - buf->start + left > MAX_BACKLOG) {
+                result = -1;
+                goto done;
+        }
+
+        /* Move what's left to the front before growing */
+        if (buf->start) {
+                memmove(buf->data, buf->data + buf->start,
+                                                    buf->len - buf->start);
+                buf->len -= buf->start;
+                buf->start = 0;
+        }
+        buf = (*backlog_p)->buf = pool_grow(buf, buf->len + left);
+        memcpy(buf->data + buf->len, ptr, left);
+        buf->len += left;
+
+done:
+        pthread_mutex_unlock(&stripe->lock);
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Subscribes a connection, among the compressed subscribers if "deflate" is
+ * set.
+ */
+static int
+subscribe(WebsocketChannels *channels, const char *name, int fd, int deflate)
+{
+        Channel *channel;
+        SubscriberSet *old_set;
+        int result = 0;
+
+        pthread_mutex_lock(&channels->write_lock);
+
+        channel = find_or_add_channel(channels, name);
+        old_set = channel->subscribers;
+        if (has_fd(old_set, fd)) {
+                result = 1;
+                goto done;
+        }
+
+        __atomic_store_n(&channel->subscribers, with_fd(old_set, fd, deflate),
+                                                             __ATOMIC_SEQ_CST);
+        retire_set(channels, old_set);
+
+done:
+        pthread_mutex_unlock(&channels->write_lock);
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Queues a subscriber set that's been swapped out so it can be freed later.
+ *
+ * If no readers are active right now, nothing can be holding a retired set
+ * and we free them straight away. Otherwise, we let them pile up and only
+ * wait out the readers once there are too many of them. This keeps joins and
+ * leaves from stalling behind a long publish.
+ *
+ * NOTE: The caller must hold the write lock.
+ */
+static void
+retire_set(WebsocketChannels *channels, SubscriberSet *set)
+{
+        if (set == NULL)
+                return;
+
+        set->next_retired = channels->retired;
+        channels->retired = set;
+        channels->num_retired++;
+
+        if (__atomic_load_n(&channels->readers[0], __ATOMIC_SEQ_CST) == 0 &&
+            __atomic_load_n(&channels->readers[1], __ATOMIC_SEQ_CST) == 0) {
+                reclaim_retired(channels);
+                return;
+        }
+
+        if (channels->num_retired >= MAX_RETIRED_SETS) {
+                wait_for_readers(channels);
+                reclaim_retired(channels);
+        }
+}
+
+
+/*------------------------------------------------------------------------------
+ * Waits until every reader that might have seen a retired set has left.
+ *
+ * A reader that entered under the old epoch parity is drained by the first
+ * flip. A reader that grabbed the epoch just before the flip but registered
+ * afterwards shows up under the other parity, so we flip and drain again.
+ *
+ * NOTE: The caller must hold the write lock.
+ */
+static void
+wait_for_readers(WebsocketChannels *channels)
+{
+        int i;
+        unsigned long epoch;
+
+        for (i = 0; i < 2; i++) {
+                epoch = __atomic_fetch_add(&channels->epoch, 1,
+                                                             __ATOMIC_SEQ_CST);
+                while (__atomic_load_n(&channels->readers[epoch & 1],
+                                                        __ATOMIC_SEQ_CST) != 0)
+                        sched_yield();
+        }
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns a copy of a subscriber set with fd added, among the compressed
+ * subscribers if "deflate" is set.
+ */
+static SubscriberSet *
+with_fd(const SubscriberSet *set, int fd, int deflate)
+{
+        SubscriberSet *result;
+
+        result = copy_set(set, 1);
+        if (deflate) {
+                /* Move the first plain fd to the end to make room */
+                if (result->num_deflate < result->num_fds)
+                        result->fds[result->num_fds] =
+                                        result->fds[result->num_deflate];
+                result->fds[result->num_deflate++] = fd;
+                result->num_fds++;
+        }
+        else
+                result->fds[result->num_fds++] = fd;
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Writes until everything is out or the socket is full, advancing *ptr and
+ * *left.
+ *
+ * Returns 0 unless writing failed.
+ */
+static int
+write_some(int fd, ws_write_bytes_fp write_bytes, const uint8_t **ptr,
+                                                                 size_t *left)
+{
+        ssize_t num_written;
+
+        while (*left > 0) {
+                num_written = write_bytes(fd, *ptr, *left);
+                if (num_written < 0 && errno == EINTR)
+                        continue;
+                if (num_written < 0 && (errno == EAGAIN ||
+                                                errno == EWOULDBLOCK))
+                        return 0;
+                if (num_written <= 0)
+                        return -1;
+
+                WS_METRIC_ADD(bytes_out, num_written);
+                *ptr += num_written;
+                *left -= num_written;
+        }
+        return 0;
+}
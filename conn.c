@@ -0,0 +1,1554 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+
+#include <zlib.h>
+
+#include "capture.h"
+#include "conn.h"
+#include "constants.h"
+#include "errors.h"
+#include "limits.h"
+#include "metrics.h"
+#include "pool.h"
+#include "role.h"
+#include "trace.h"
+#include "util.h"
+#include "ws.h"
+
+/*==============================================================================
+ * Defines
+ */
+
+/* Bytes read per read_bytes call; this lives on the stack, not the conn */
+#define CONN_READ_CHUNK (16 * 1024)
+
+#define CONN_IN_PAYLOAD 0x01    /* Header done, reading the payload */
+#define CONN_IN_MESSAGE 0x02    /* A fragmented message has started */
+#define CONN_RX_HELD 0x04       /* A batched message points into rx */
+#define CONN_DEFLATE 0x08       /* permessage-deflate was agreed */
+#define CONN_MSG_DEFLATED 0x10  /* The message being assembled is compressed */
+#define CONN_PEEKING 0x20       /* Collecting a prefix for the router */
+#define CONN_DISCARDING 0x40    /* The router dropped this message */
+#define CONN_FORWARDING 0x80    /* The router is passing this message on */
+
+#define NS_PER_SEC 1000000000.0
+
+#define CONN_IMAGE_MAGIC 0x5753434eu    /* "WSCN" */
+#define CONN_IMAGE_VERSION 2
+
+
+/*==============================================================================
+ * Static declarations
+ */
+
+/*
+ * Everything a connection holds while idle. Buffers are only attached while
+ * a frame is coming in (rx) or a send couldn't finish (tx).
+ *
+ * While a frame is coming in, rx holds the message collected so far in
+ * [0, len), and the frame's payload goes right after it. A control frame's
+ * payload lands there too, between fragments, and is dropped once handled.
+ */
+struct WebsocketConn_ {
+        int fd;
+        uint8_t flags;
+        uint8_t header_len;     /* Header bytes collected */
+        uint8_t msg_opcode;     /* Opcode of the message being assembled */
+        uint8_t sched_state;    /* See conn.h */
+        uint8_t header[WS_MAX_FRAME_HEADER_LEN];
+        uint16_t unused2;
+        uint64_t frame_len;     /* Payload length of the current frame */
+        uint64_t frame_read;    /* Payload bytes of it read so far */
+        PoolBuf *rx;
+        PoolBuf *tx;
+        void *ext;              /* Extension state, made when first needed */
+};
+
+_Static_assert(sizeof(WebsocketConn) == WS_CONN_IDLE_BYTES,
+               "WebsocketConn has grown; update WS_CONN_IDLE_BYTES");
+
+typedef struct ConnBucket_ {
+        int64_t tokens;         /* Goes negative for bytes read on credit */
+        uint64_t stamp_ns;      /* Tokens were right as of this time */
+} ConnBucket;
+
+/*
+ * What only some connections need, hung off conn->ext when first needed.
+ */
+typedef struct ConnExt_ {
+        ConnBucket bytes;
+        ConnBucket messages;
+        PoolBuf *pending;       /* Read but not yet parsed, see feed */
+        const WebsocketRouter *router;
+        size_t peek_len;        /* Prefix being collected, if CONN_PEEKING */
+        uint64_t routed_len;    /* Bytes so far of a routed message */
+} ConnExt;
+
+/*
+ * Where parsed messages go: straight to a handler, or into a batch of views
+ * that's handed over when it's full or the bytes under it are about to go.
+ */
+typedef struct ConnSink_ {
+        ws_message_handler_fp handler;
+        ws_batch_handler_fp batch_handler;
+        void *arg;
+        WebsocketMessage *batch;
+        size_t max_batch;
+        size_t num_batch;
+} ConnSink;
+
+/*
+ * A connection written out by ws_conn_export. The bytes of the message so
+ * far (and of the frame part way in, unless it's routed), the unsent bytes
+ * and the unparsed bytes follow, in that order.
+ */
+typedef struct ConnImage_ {
+        uint32_t magic;
+        uint16_t version;
+        uint8_t flags;
+        uint8_t header_len;
+        uint8_t msg_opcode;
+        uint8_t has_ext;
+        uint8_t header[WS_MAX_FRAME_HEADER_LEN];
+        uint64_t frame_len;
+        uint64_t frame_read;
+        uint64_t rx_len;        /* Message bytes, not counting frame_read */
+        uint64_t tx_len;
+        uint64_t pending_len;
+        uint64_t routed_len;
+        ConnBucket bytes;
+        ConnBucket messages;
+} ConnImage;
+
+/* Counts for one ws_conn_read_budget call; parse stops at the limits */
+typedef struct ConnTally_ {
+        size_t frames;
+        size_t max_frames;
+        int64_t messages;       /* Handed to the handler or routed, so far */
+        int64_t max_messages;
+} ConnTally;
+
+static uint64_t bucket_wait_ns(const ConnBucket *, uint64_t, uint64_t);
+static void deliver(WebsocketConn *, ConnSink *, enum WebsocketFrameType,
+                                                        const char *, size_t);
+static ConnExt *ext(WebsocketConn *);
+static PoolBuf *fill_buf(const uint8_t *, size_t, size_t);
+static int feed(WebsocketConn *, uint8_t *, size_t, int,
+                     const WebsocketRateLimits *, ConnTally *, ConnSink *);
+static int finish_frame(WebsocketConn *, char *, ConnTally *, ConnSink *);
+static void finish_routed_frame(WebsocketConn *, ConnTally *);
+static int fail(WebsocketConn *, enum WebsocketFrameType, ConnSink *);
+static void flush_batch(WebsocketConn *, ConnSink *);
+static void forward(WebsocketConn *, const uint8_t *, size_t);
+static int frame_routed(const WebsocketConn *);
+static size_t header_needed(const WebsocketConn *);
+static enum WebsocketFrameType inflate_rx(WebsocketConn *);
+static ssize_t parse(WebsocketConn *, uint8_t *, size_t, ConnTally *,
+                                                                ConnSink *);
+static int paused(WebsocketConn *, const WebsocketRateLimits *);
+static void peeked(WebsocketConn *, const uint8_t *);
+static int read_some(WebsocketConn *, ws_read_bytes_fp, ConnSink *, size_t,
+                                                                     size_t);
+static void refill(ConnBucket *, uint64_t, uint64_t, uint64_t);
+static void route(WebsocketConn *, const uint8_t *, size_t);
+static int start_frame(WebsocketConn *, ConnSink *);
+static int start_peek(WebsocketConn *);
+static int write_some(WebsocketConn *, ws_write_bytes_fp, const uint8_t **,
+                                                                    size_t *);
+
+
+/*==============================================================================
+ * Public API
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Creates the state for a connection (whose handshake is done) that is driven
+ * by readiness events rather than a blocked thread.
+ *
+ * An idle connection costs WS_CONN_IDLE_BYTES bytes here; buffers are
+ * borrowed from a shared pool only while a frame is partly read or a send is
+ * partly written.
+ *
+ * NOTE: The caller must free this with ws_conn_free. fd should be
+ * non-blocking.
+ */
+WebsocketConn *
+ws_conn_new(int fd)
+{
+        WebsocketConn *result;
+
+        if ((result = calloc(1, sizeof(WebsocketConn))) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+        WS_METRIC_ADD(allocs, 1);
+        WS_METRIC_ADD(alloc_bytes, sizeof(WebsocketConn));
+
+        result->fd = fd;
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Frees a connection's state and gives back any buffers it holds. The fd is
+ * left open.
+ */
+void
+ws_conn_free(WebsocketConn *conn)
+{
+        if (conn == NULL)
+                return;
+
+        pool_put(conn->rx);
+        pool_put(conn->tx);
+        if (conn->ext != NULL) {
+                pool_put(((ConnExt *)conn->ext)->pending);
+                free(conn->ext);
+        }
+        free(conn);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns a connection's fd.
+ */
+int
+ws_conn_fd(const WebsocketConn *conn)
+{
+        return conn->fd;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Lets the peer send compressed messages, as agreed by
+ * ws_complete_handshake_deflate. They're inflated before the handler sees
+ * them.
+ *
+ * Nothing is kept between messages (the handshake ruled out context
+ * takeover), so this costs no memory while the connection is idle.
+ *
+ * NOTE: Does nothing in a WS_TEXT_ONLY build (see role.h).
+ */
+void
+ws_conn_enable_deflate(WebsocketConn *conn)
+{
+        if (ROLE_EXTENSIONS)
+                conn->flags |= CONN_DEFLATE;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Has "router" decide where each message goes before it's read in full.
+ *
+ * Once the first router->peek_len bytes of a message (or all of it, if it's
+ * shorter) are in, just those are unmasked and passed to router->route. The
+ * message is then read as usual (WS_ROUTE_DECODE); skipped over without
+ * being unmasked or copied (WS_ROUTE_DISCARD); or handed, frame by frame and
+ * still masked, to router->forward (WS_ROUTE_FORWARD), which may get each
+ * frame in several pieces. Control frames in between are handled as usual.
+ *
+ * Compressed messages are always decoded, since their bytes say nothing
+ * until inflated. Size limits apply to routed messages as to any other.
+ *
+ * NOTE: The prefix isn't NUL terminated and is only good until route
+ * returns. "router" must outlive its use here, and isn't part of what
+ * ws_conn_export writes out; pass NULL to stop routing. A message part way
+ * through being forwarded still needs a router with it: reading fails
+ * (WS_FT_ERROR) if there's none when more of it comes in.
+ */
+void
+ws_conn_set_router(WebsocketConn *conn, const WebsocketRouter *router)
+{
+        if (router != NULL || conn->ext != NULL)
+                ext(conn)->router = router;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Writes out everything a connection holds: where the parser is, the message
+ * and frame part way in, what's still to be sent and what's been read but
+ * not parsed. ws_conn_import turns this back into a connection, in this
+ * process or (say, with ws_conn_send_to) another one, which carries on from
+ * exactly here; nothing is lost or reordered as long as nobody reads from or
+ * writes to the fd in between.
+ *
+ * The connection itself is untouched; free it (without closing the fd) once
+ * the image has been handed over. Take it out of its scheduler first.
+ *
+ * The router (see ws_conn_set_router) isn't written out, but where a routed
+ * message is up to is. If one is part way through, set the router on the
+ * new connection before reading from it.
+ *
+ * NOTE: The caller must free *image_p.
+ *
+ * Returns the length of the image.
+ */
+size_t
+ws_conn_export(const WebsocketConn *conn, uint8_t **image_p)
+{
+        ConnExt *conn_ext = conn->ext;
+        ConnImage image;
+        uint8_t *result;
+        uint8_t *ptr;
+        size_t frame_bytes;
+        size_t len;
+
+        memset(&image, 0, sizeof(image));
+        image.magic = CONN_IMAGE_MAGIC;
+        image.version = CONN_IMAGE_VERSION;
+        image.flags = conn->flags & ~CONN_RX_HELD;
+        image.header_len = conn->header_len;
+        image.msg_opcode = conn->msg_opcode;
+        memcpy(image.header, conn->header, sizeof(image.header));
+        image.frame_len = conn->frame_len;
+        image.frame_read = conn->frame_read;
+        frame_bytes = ((conn->flags & CONN_IN_PAYLOAD) &&
+                                !frame_routed(conn)) ? conn->frame_read : 0;
+        image.rx_len = conn->rx ? conn->rx->len : 0;
+        image.tx_len = conn->tx ? conn->tx->len - conn->tx->start : 0;
+        if (conn_ext != NULL) {
+                image.has_ext = 1;
+                image.bytes = conn_ext->bytes;
+                image.messages = conn_ext->messages;
+                image.routed_len = conn_ext->routed_len;
+                if (conn_ext->pending != NULL)
+                        image.pending_len = conn_ext->pending->len -
+                                                  conn_ext->pending->start;
+        }
+
+        len = sizeof(image) + image.rx_len + frame_bytes + image.tx_len +
+                                                        image.pending_len;
+        if ((result = malloc(len)) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+
+        memcpy(result, &image, sizeof(image));
+        ptr = result + sizeof(image);
+        if (image.rx_len + frame_bytes) {
+                memcpy(ptr, conn->rx->data, image.rx_len + frame_bytes);
+                ptr += image.rx_len + frame_bytes;
+        }
+        if (image.tx_len) {
+                memcpy(ptr, conn->tx->data + conn->tx->start, image.tx_len);
+                ptr += image.tx_len;
+        }
+        if (image.pending_len)
+                memcpy(ptr, conn_ext->pending->data + conn_ext->pending->start,
+                                                          image.pending_len);
+
+        *image_p = result;
+        return len;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Makes a connection from an image written by ws_conn_export, on fd (which
+ * is the same socket, perhaps passed from another process).
+ *
+ * NOTE: The caller must free this with ws_conn_free.
+ *
+ * Returns NULL if the image isn't one.
+ */
+WebsocketConn *
+ws_conn_import(int fd, const uint8_t *image_bytes, size_t len)
+{
+        WebsocketConn *result;
+        ConnImage image;
+        ConnExt *conn_ext;
+        const uint8_t *ptr;
+        size_t frame_bytes;
+        int is_routed;
+
+        if (len < sizeof(image))
+                return NULL;
+        memcpy(&image, image_bytes, sizeof(image));
+
+        /* A routed frame's bytes went by as they came; none are kept */
+        is_routed = (image.flags & (CONN_DISCARDING | CONN_FORWARDING)) &&
+                                                  !(image.header[0] & 0x08);
+        frame_bytes = ((image.flags & CONN_IN_PAYLOAD) && !is_routed) ?
+                                                        image.frame_read : 0;
+        if (image.magic != CONN_IMAGE_MAGIC ||
+            image.version != CONN_IMAGE_VERSION ||
+            image.header_len > WS_MAX_FRAME_HEADER_LEN ||
+            image.frame_read > image.frame_len ||
+            (is_routed && !image.has_ext) ||
+            len != sizeof(image) + image.rx_len + frame_bytes +
+                                        image.tx_len + image.pending_len)
+                return NULL;
+
+        /* A message part way through being peeked at is read in full */
+        result = ws_conn_new(fd);
+        result->flags = image.flags & ~CONN_PEEKING;
+        result->header_len = image.header_len;
+        result->msg_opcode = image.msg_opcode;
+        memcpy(result->header, image.header, sizeof(image.header));
+        result->frame_len = image.frame_len;
+        result->frame_read = image.frame_read;
+
+        /* rx needs room for the rest of the frame, as parse would have made */
+        ptr = image_bytes + sizeof(image);
+        if (image.rx_len || ((image.flags & CONN_IN_PAYLOAD) && !is_routed)) {
+                result->rx = fill_buf(ptr, image.rx_len + frame_bytes,
+                                        image.rx_len + image.frame_len + 1);
+                result->rx->len = image.rx_len;
+                ptr += image.rx_len + frame_bytes;
+        }
+        if (image.tx_len) {
+                result->tx = fill_buf(ptr, image.tx_len, image.tx_len);
+                ptr += image.tx_len;
+        }
+        if (image.has_ext) {
+                conn_ext = ext(result);
+                conn_ext->bytes = image.bytes;
+                conn_ext->messages = image.messages;
+                conn_ext->routed_len = image.routed_len;
+                if (image.pending_len)
+                        conn_ext->pending = fill_buf(ptr, image.pending_len,
+                                                        image.pending_len);
+        }
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Reads whatever the connection has for us and calls "handler" for each
+ * complete message and control frame. Call this whenever fd is readable.
+ *
+ * Frames can arrive in any number of pieces; parsing picks up where the last
+ * call left off. A message handed to the handler is NUL terminated and only
+ * good until the handler returns.
+ *
+ * Returns 0 once read_bytes runs dry (-1 with errno EAGAIN); -1 if the
+ * connection closed, failed, sent a close frame or broke a limit, in which
+ * case the handler has been told and the connection should be freed and
+ * closed. If rate limits are set (see ws_set_rate_limits), may also return
+ * WS_CONN_PAUSED, as ws_conn_read_budget does.
+ *
+ * NOTE: Don't free the connection from inside the handler.
+ */
+int
+ws_conn_read(WebsocketConn *conn, ws_read_bytes_fp read_bytes,
+                                    ws_message_handler_fp handler, void *arg)
+{
+        return ws_conn_read_budget(conn, read_bytes, handler, arg, 0, 0);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Like ws_conn_read, but stops after handling max_frames frames or reading
+ * max_bytes bytes (0 for no cap on either), so one busy connection can't
+ * hold up the rest of an event loop. Bytes read past the last frame handled
+ * are kept for next time.
+ *
+ * Returns 0 once read_bytes runs dry; WS_CONN_MORE if the budget ran out
+ * first (call again soon, whether or not fd becomes readable);
+ * WS_CONN_PAUSED if the connection is over a rate limit (call again after
+ * ws_conn_pause_ns); -1 as for ws_conn_read.
+ *
+ * NOTE: ws_sched_run does the calling again for you.
+ */
+int
+ws_conn_read_budget(WebsocketConn *conn, ws_read_bytes_fp read_bytes,
+                    ws_message_handler_fp handler, void *arg,
+                    size_t max_frames, size_t max_bytes)
+{
+        ConnSink sink = {handler, NULL, arg, NULL, 0, 0};
+
+        return read_some(conn, read_bytes, &sink, max_frames, max_bytes);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Like ws_conn_read, but hands "handler" arrays of up to max_batch (at most
+ * WS_MAX_BATCH) messages and control frames at a time: everything complete
+ * from one read, so a handler that works faster in bulk gets the bulk.
+ *
+ * Frames that arrive whole are unmasked where they lie and not copied. The
+ * views are only good until the handler returns, and the payloads are NOT
+ * NUL terminated.
+ *
+ * A close frame ends the last batch, and an error or broken limit comes in
+ * a batch of its own (with a NULL view), as they do for ws_conn_read.
+ */
+int
+ws_conn_read_batch(WebsocketConn *conn, ws_read_bytes_fp read_bytes,
+                   ws_batch_handler_fp handler, void *arg, size_t max_batch)
+{
+        WebsocketMessage batch[WS_MAX_BATCH];
+        ConnSink sink = {NULL, handler, arg, batch, max_batch, 0};
+
+        if (max_batch == 0 || max_batch > WS_MAX_BATCH)
+                sink.max_batch = WS_MAX_BATCH;
+
+        return read_some(conn, read_bytes, &sink, 0, 0);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns how long until a connection that got WS_CONN_PAUSED may read
+ * again; 0 if it may now.
+ */
+uint64_t
+ws_conn_pause_ns(WebsocketConn *conn)
+{
+        WebsocketRateLimits rates;
+        ConnExt *conn_ext = conn->ext;
+        uint64_t result = 0;
+        uint64_t wait_ns;
+        uint64_t now;
+
+        limits_get_rates(&rates);
+        if (conn_ext == NULL || !paused(conn, &rates))
+                return 0;
+
+        now = ws_now_ns();
+        if (rates.messages_per_sec)
+                result = bucket_wait_ns(&conn_ext->messages,
+                                                rates.messages_per_sec, now);
+        if (rates.bytes_per_sec && conn_ext->pending == NULL) {
+                wait_ns = bucket_wait_ns(&conn_ext->bytes,
+                                                   rates.bytes_per_sec, now);
+                if (wait_ns > result)
+                        result = wait_ns;
+        }
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Sends a text message or a ping, pong or close frame (by "type").
+ *
+ * As much as the connection takes is written right away. The rest is kept
+ * in a borrowed buffer until ws_conn_flush can write it.
+ *
+ * Returns 0 on success; -1 if the type is bad or writing failed.
+ */
+int
+ws_conn_send(WebsocketConn *conn, ws_write_bytes_fp write_bytes,
+             enum WebsocketFrameType type, const void *payload, size_t len)
+{
+        uint8_t header[WS_MAX_FRAME_HEADER_LEN];
+        const uint8_t *header_ptr;
+        const uint8_t *payload_ptr;
+        size_t header_len;
+        size_t header_left;
+        size_t payload_left;
+        uint8_t byte0;
+
+        if (type == WS_FT_TEXT)
+                byte0 = WS_FRAME_OP_TEXT;
+        else if (type == WS_FT_PING)
+                byte0 = WS_FRAME_OP_PING;
+        else if (type == WS_FT_PONG)
+                byte0 = WS_FRAME_OP_PONG;
+        else if (type == WS_FT_CLOSE)
+                byte0 = WS_FRAME_OP_CLOSE;
+        else
+                return -1;
+
+        if (byte0 != WS_FRAME_OP_TEXT && len > SHORT_MESSAGE_LEN)
+                return -1;
+
+        byte0 |= WS_FRAME_FIN;
+        header_len = ws_make_frame_header(byte0, len, NULL, header);
+        WS_METRIC_ADD(frames_out[byte0 & 0x0f], 1);
+        WS_TRACE(WS_EV_FRAME_QUEUED, frame_queued, conn->fd, byte0 & 0x0f,
+                                                           header_len + len);
+
+        /*
+         * If nothing is waiting, write straight from the caller's memory
+         */
+        header_ptr = header;
+        header_left = header_len;
+        payload_ptr = payload;
+        payload_left = len;
+        if (conn->tx == NULL) {
+                if (write_some(conn, write_bytes, &header_ptr,
+                                                         &header_left) != 0)
+                        return -1;
+                if (header_left == 0 && write_some(conn, write_bytes,
+                                             &payload_ptr, &payload_left) != 0)
+                        return -1;
+                if (header_left == 0 && payload_left == 0)
+                        return 0;
+        }
+
+        /*
+         * Keep what's left of the frame for ws_conn_flush
+         */
+        if (conn->tx == NULL)
+                conn->tx = pool_get();
+        conn->tx = pool_grow(conn->tx, conn->tx->len + header_left +
+                                                                payload_left);
+        memcpy(conn->tx->data + conn->tx->len, header_ptr, header_left);
+        conn->tx->len += header_left;
+        if (payload_left) {
+                memcpy(conn->tx->data + conn->tx->len, payload_ptr,
+                                                                payload_left);
+                conn->tx->len += payload_left;
+        }
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Writes out what ws_conn_send couldn't. Call this when fd is writable and
+ * ws_conn_wants_write says there's something to write.
+ *
+ * Returns 0 once everything is written (and the buffer is given back); 1 if
+ * some is still waiting; -1 if writing failed.
+ */
+int
+ws_conn_flush(WebsocketConn *conn, ws_write_bytes_fp write_bytes)
+{
+        const uint8_t *ptr;
+        size_t left;
+
+        if (conn->tx == NULL)
+                return 0;
+
+        ptr = conn->tx->data + conn->tx->start;
+        left = conn->tx->len - conn->tx->start;
+        if (write_some(conn, write_bytes, &ptr, &left) != 0)
+                return -1;
+
+        conn->tx->start = conn->tx->len - left;
+        if (left)
+                return 1;
+
+        pool_put(conn->tx);
+        conn->tx = NULL;
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns 1 if ws_conn_send left something for ws_conn_flush; 0 if not.
+ */
+int
+ws_conn_wants_write(const WebsocketConn *conn)
+{
+        return conn->tx != NULL;
+}
+
+
+/*==============================================================================
+ * Library functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Gets and sets where a connection stands with its scheduler.
+ */
+int
+conn_sched_state(const WebsocketConn *conn)
+{
+        return conn->sched_state;
+}
+
+void
+conn_set_sched_state(WebsocketConn *conn, int state)
+{
+        conn->sched_state = state;
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Reads and parses until read_bytes runs dry, a budget is used up or the
+ * connection hits a rate limit (see ws_conn_read_budget).
+ */
+static int
+read_some(WebsocketConn *conn, ws_read_bytes_fp read_bytes, ConnSink *sink,
+                                        size_t max_frames, size_t max_bytes)
+{
+        uint8_t chunk[CONN_READ_CHUNK];
+        WebsocketRateLimits rates;
+        ConnTally tally;
+        PoolBuf *pending;
+        size_t num_bytes = 0;
+        size_t want;
+        ssize_t num_read;
+
+        limits_get_rates(&rates);
+        tally.frames = 0;
+        tally.max_frames = max_frames ? max_frames : SIZE_MAX;
+
+        while (1) {
+                if (tally.frames >= tally.max_frames)
+                        return WS_CONN_MORE;
+                if (paused(conn, &rates)) {
+                        WS_METRIC_ADD(rate_pauses, 1);
+                        return WS_CONN_PAUSED;
+                }
+
+                /* What was left over last time goes first */
+                pending = conn->ext ? ((ConnExt *)conn->ext)->pending : NULL;
+                if (pending != NULL) {
+                        if (feed(conn, pending->data + pending->start,
+                                 pending->len - pending->start, 1, &rates,
+                                 &tally, sink) != 0)
+                                return -1;
+                        continue;
+                }
+
+                if (max_bytes && num_bytes >= max_bytes)
+                        return WS_CONN_MORE;
+                want = sizeof(chunk);
+                if (max_bytes && want > max_bytes - num_bytes)
+                        want = max_bytes - num_bytes;
+                if (rates.bytes_per_sec &&
+                                want > (uint64_t)ext(conn)->bytes.tokens)
+                        want = ext(conn)->bytes.tokens;
+
+                num_read = read_bytes(conn->fd, (char *)chunk, want);
+                if (num_read < 0 && errno == EINTR)
+                        continue;
+                if (num_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        return 0;
+                if (num_read <= 0)
+                        return fail(conn, WS_FT_ERROR, sink);
+
+                WS_METRIC_ADD(bytes_in, num_read);
+                WS_CAPTURE(conn->fd, chunk, num_read);
+                num_bytes += num_read;
+                if (rates.bytes_per_sec)
+                        ext(conn)->bytes.tokens -= num_read;
+
+                if (feed(conn, chunk, num_read, 0, &rates, &tally, sink) != 0)
+                        return -1;
+        }
+}
+
+
+/*------------------------------------------------------------------------------
+ * Parses bytes read from the connection (or, if from_pending is set, the
+ * bytes kept from last time), stopping early if the tally's limits are hit.
+ * Whatever isn't parsed is kept in ext->pending.
+ *
+ * Returns 0 if the connection is still good; -1 if not.
+ */
+static int
+feed(WebsocketConn *conn, uint8_t *ptr, size_t len, int from_pending,
+     const WebsocketRateLimits *rates, ConnTally *tally, ConnSink *sink)
+{
+        ConnExt *conn_ext;
+        ssize_t num_parsed;
+
+        tally->messages = 0;
+        tally->max_messages = rates->messages_per_sec ?
+                                ext(conn)->messages.tokens : INT64_MAX;
+
+        if ((num_parsed = parse(conn, ptr, len, tally, sink)) < 0)
+                return -1;
+
+        if (rates->messages_per_sec)
+                ext(conn)->messages.tokens -= tally->messages;
+
+        /* Batched views may point into these bytes */
+        flush_batch(conn, sink);
+
+        if (from_pending) {
+                conn_ext = conn->ext;
+                conn_ext->pending->start += num_parsed;
+                if (conn_ext->pending->start == conn_ext->pending->len) {
+                        pool_put(conn_ext->pending);
+                        conn_ext->pending = NULL;
+                }
+        }
+        else if ((size_t)num_parsed < len) {
+                conn_ext = ext(conn);
+                conn_ext->pending = pool_grow(pool_get(), len - num_parsed);
+                memcpy(conn_ext->pending->data, ptr + num_parsed,
+                                                          len - num_parsed);
+                conn_ext->pending->len = len - num_parsed;
+        }
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Feeds bytes through the frame state machine, stopping after a frame that
+ * uses up the tally's frames or messages.
+ *
+ * Returns how many bytes were used; -1 if the connection is no good.
+ */
+static ssize_t
+parse(WebsocketConn *conn, uint8_t *ptr, size_t len, ConnTally *tally,
+                                                             ConnSink *sink)
+{
+        uint8_t *start = ptr;
+        const uint8_t *mask;
+        uint8_t *dst;
+        size_t unmasked;
+        size_t need;
+        size_t take;
+        size_t want;
+
+        /* The rest of a message being passed on can't just be dropped */
+        if ((conn->flags & CONN_FORWARDING) && len &&
+                                        ((ConnExt *)conn->ext)->router == NULL)
+                return fail(conn, WS_FT_ERROR, sink);
+
+        while (len > 0) {
+                if (tally->frames >= tally->max_frames ||
+                                        tally->messages >= tally->max_messages)
+                        break;
+
+                /*
+                 * Collect the header, which may come in pieces too
+                 */
+                if (!(conn->flags & CONN_IN_PAYLOAD)) {
+                        need = header_needed(conn);
+                        take = need - conn->header_len;
+                        if (take > len)
+                                take = len;
+                        memcpy(conn->header + conn->header_len, ptr, take);
+                        conn->header_len += take;
+                        ptr += take;
+                        len -= take;
+
+                        /* Knowing the first 2 bytes can make it longer */
+                        if (conn->header_len < header_needed(conn))
+                                continue;
+
+                        if (start_frame(conn, sink) != 0)
+                                return -1;
+                        mask = role_rx_mask(conn->header, conn->header_len);
+
+                        /*
+                         * If the start of a message the router wants to see
+                         * is all here, it's unmasked where it lies
+                         */
+                        unmasked = 0;
+                        if (start_peek(conn)) {
+                                need = ((ConnExt *)conn->ext)->peek_len;
+                                if (need > len) {
+                                        conn->flags |= CONN_PEEKING;
+                                }
+                                else {
+                                        mask_bytes(ptr, need, mask, 0);
+                                        unmasked = need;
+                                        route(conn, ptr, need);
+                                }
+                        }
+
+                        /* A routed message's frames go by as they came */
+                        if (frame_routed(conn)) {
+                                mask_bytes(ptr, unmasked, mask, 0);
+                                forward(conn, conn->header, conn->header_len);
+                                if (conn->frame_len == 0)
+                                        finish_routed_frame(conn, tally);
+                                continue;
+                        }
+
+                        /*
+                         * A batched frame that's all here and needs nothing
+                         * from earlier frames is unmasked where it lies
+                         */
+                        if (sink->batch && conn->frame_len <= len &&
+                            (conn->header[0] & WS_FRAME_FIN) &&
+                            !(conn->header[0] & WS_FRAME_RSV1) &&
+                            (conn->header[0] & 0x0f) != WS_FRAME_OP_CONT) {
+                                mask_bytes(ptr + unmasked,
+                                           conn->frame_len - unmasked, mask,
+                                                                    unmasked);
+                                ptr += conn->frame_len;
+                                len -= conn->frame_len;
+                                if (finish_frame(conn,
+                                                 (char *)ptr - conn->frame_len,
+                                                 tally, sink) != 0)
+                                        return -1;
+                                continue;
+                        }
+
+                        /* Otherwise it's all copied over and unmasked below */
+                        mask_bytes(ptr, unmasked, mask, 0);
+
+                        /* Room for the payload after the message so far */
+                        want = (conn->flags & CONN_PEEKING) ?
+                                ((ConnExt *)conn->ext)->peek_len :
+                                                        conn->frame_len;
+                        if (conn->flags & CONN_RX_HELD)
+                                flush_batch(conn, sink);
+                        if (conn->rx == NULL)
+                                conn->rx = pool_get();
+                        conn->rx = pool_grow(conn->rx, conn->rx->len + want +
+                                                                          1);
+
+                        if (conn->frame_len == 0) {
+                                if (finish_frame(conn, NULL, tally,
+                                                                 sink) != 0)
+                                        return -1;
+                                continue;
+                        }
+                }
+
+                take = conn->frame_len - conn->frame_read;
+                if (take > len)
+                        take = len;
+
+                if (frame_routed(conn)) {
+                        forward(conn, ptr, take);
+                        conn->frame_read += take;
+                        ptr += take;
+                        len -= take;
+                        if (conn->frame_read == conn->frame_len)
+                                finish_routed_frame(conn, tally);
+                        continue;
+                }
+
+                /*
+                 * Unmask the payload (or just the start, if the router's to
+                 * see it first) as it's copied over
+                 */
+                want = (conn->flags & CONN_PEEKING) ?
+                        ((ConnExt *)conn->ext)->peek_len : conn->frame_len;
+                if (take > want - conn->frame_read)
+                        take = want - conn->frame_read;
+
+                dst = conn->rx->data + conn->rx->len + conn->frame_read;
+                mask = role_rx_mask(conn->header, conn->header_len);
+                memcpy(dst, ptr, take);
+                mask_bytes(dst, take, mask, conn->frame_read);
+
+                conn->frame_read += take;
+                ptr += take;
+                len -= take;
+
+                if ((conn->flags & CONN_PEEKING) && conn->frame_read == want)
+                        peeked(conn, mask);
+
+                if (conn->frame_read < conn->frame_len)
+                        continue;
+                if (frame_routed(conn))
+                        finish_routed_frame(conn, tally);
+                else if (finish_frame(conn, NULL, tally, sink) != 0)
+                        return -1;
+        }
+        return ptr - start;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns how long the header will be, as far as we can tell from what we
+ * have of it so far.
+ */
+static size_t
+header_needed(const WebsocketConn *conn)
+{
+        size_t result = 2;
+        uint8_t len_key;
+
+        if (conn->header_len < 2)
+                return result;
+
+        len_key = conn->header[1] & ~WS_FRAME_MASK;
+        if (len_key == MED_MESSAGE_KEY)
+                result += NUM_MED_LEN_BYTES;
+        else if (len_key == LONG_MESSAGE_KEY)
+                result += NUM_LONG_LEN_BYTES;
+
+        if (ROLE_RX_MASKED(conn->header[1]))
+                result += MASK_LEN;
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Checks a complete header.
+ */
+static int
+start_frame(WebsocketConn *conn, ConnSink *sink)
+{
+        uint64_t payload_len;
+        uint64_t so_far = 0;
+        size_t num_len_bytes;
+        uint8_t opcode;
+        int is_final;
+        size_t i;
+
+        opcode = conn->header[0] & 0x0f;
+        is_final = conn->header[0] & WS_FRAME_FIN;
+
+        payload_len = conn->header[1] & ~WS_FRAME_MASK;
+        num_len_bytes = 0;
+        if (payload_len == MED_MESSAGE_KEY)
+                num_len_bytes = NUM_MED_LEN_BYTES;
+        else if (payload_len == LONG_MESSAGE_KEY)
+                num_len_bytes = NUM_LONG_LEN_BYTES;
+        if (num_len_bytes) {
+                payload_len = 0;
+                for (i = 0; i < num_len_bytes; i++)
+                        payload_len = (payload_len << 8) | conn->header[2 + i];
+        }
+
+        WS_TRACE(WS_EV_FRAME_HEADER, frame_header, conn->fd, opcode,
+                                                                 payload_len);
+
+        /* A routed message isn't kept in rx, so its length is kept aside */
+        if (conn->flags & (CONN_DISCARDING | CONN_FORWARDING))
+                so_far = ((ConnExt *)conn->ext)->routed_len;
+        else if (conn->flags & CONN_IN_MESSAGE)
+                so_far = conn->rx->len;
+
+        /*
+         * Control frames are short and whole; data frames have to follow on
+         * from what came before. Only the first frame of a message may say
+         * it's compressed, and only if that was agreed. The mask has to be as
+         * the role says (see role.h), and a 64-bit length can't have its top
+         * bit set.
+         */
+        if (!ROLE_RX_MASK_OK(conn->header[1]) ||
+            (payload_len & LONG_LEN_MSB) ||
+            (conn->header[0] & WS_FRAME_RSVS & ~WS_FRAME_RSV1) ||
+            ((conn->header[0] & WS_FRAME_RSV1) &&
+             (!ROLE_EXTENSIONS || !(conn->flags & CONN_DEFLATE) ||
+              (opcode & 0x08) || opcode == WS_FRAME_OP_CONT))) {
+                WS_METRIC_ADD(parse_errors, 1);
+                return fail(conn, WS_FT_ERROR, sink);
+        }
+        else if (opcode & 0x08) {
+                if (payload_len > SHORT_MESSAGE_LEN || !is_final ||
+                    (opcode != WS_FRAME_OP_CLOSE && opcode != WS_FRAME_OP_PING &&
+                                                opcode != WS_FRAME_OP_PONG)) {
+                        WS_METRIC_ADD(parse_errors, 1);
+                        return fail(conn, WS_FT_ERROR, sink);
+                }
+        }
+        else if (opcode == WS_FRAME_OP_CONT ?
+                        !(conn->flags & CONN_IN_MESSAGE) :
+                        (conn->flags & CONN_IN_MESSAGE) ||
+                        !ROLE_DATA_OPCODE_OK(opcode)) {
+                WS_METRIC_ADD(parse_errors, 1);
+                return fail(conn, WS_FT_ERROR, sink);
+        }
+        else if (limits_check_frame(payload_len) != 0 ||
+                 limits_check_message(so_far + payload_len) != 0) {
+                WS_METRIC_ADD(limit_rejects, 1);
+                return fail(conn, WS_FT_TOO_BIG, sink);
+        }
+
+        if (opcode != WS_FRAME_OP_CONT && !(opcode & 0x08)) {
+                conn->msg_opcode = opcode;
+                if (conn->header[0] & WS_FRAME_RSV1)
+                        conn->flags |= CONN_MSG_DEFLATED;
+        }
+
+        conn->frame_len = payload_len;
+        conn->frame_read = 0;
+        conn->flags |= CONN_IN_PAYLOAD;
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Handles a frame whose payload is all in: at "in_place" if it was left
+ * where it was read, or in rx (given NULL).
+ */
+static int
+finish_frame(WebsocketConn *conn, char *in_place, ConnTally *tally,
+                                                             ConnSink *sink)
+{
+        uint8_t opcode = conn->header[0] & 0x0f;
+        int is_final = conn->header[0] & WS_FRAME_FIN;
+        PoolBuf *rx = conn->rx;
+        enum WebsocketFrameType type;
+        size_t message_len;
+        char *payload;
+
+        WS_METRIC_ADD(frames_in[opcode], 1);
+        WS_TRACE(WS_EV_PAYLOAD_COMPLETE, payload_complete, conn->fd, opcode,
+                                                              conn->frame_len);
+
+        conn->flags &= ~CONN_IN_PAYLOAD;
+        conn->header_len = 0;
+        tally->frames++;
+
+        payload = in_place ? in_place : (char *)rx->data + rx->len;
+        if (opcode & 0x08) {
+                if (!in_place) {
+                        payload[conn->frame_len] = '\0';
+                        if (sink->batch)
+                                conn->flags |= CONN_RX_HELD;
+                }
+                if (opcode == WS_FRAME_OP_CLOSE) {
+                        WS_METRIC_CLOSE((uint8_t *)payload, conn->frame_len);
+                        deliver(conn, sink, WS_FT_CLOSE, payload,
+                                                             conn->frame_len);
+                        flush_batch(conn, sink);
+                        return -1;
+                }
+                deliver(conn, sink, opcode == WS_FRAME_OP_PING ? WS_FT_PING :
+                                WS_FT_PONG, payload, conn->frame_len);
+                tally->messages++;
+        }
+        else if (in_place) {
+                WS_METRIC_RECORD(message_size, conn->frame_len);
+                WS_TRACE(WS_EV_MESSAGE_DELIVERED, message_delivered, conn->fd,
+                                                 WS_FT_TEXT, conn->frame_len);
+                deliver(conn, sink, WS_FT_TEXT, payload, conn->frame_len);
+                tally->messages++;
+                return 0;
+        }
+        else {
+                rx->len += conn->frame_len;
+                conn->flags |= CONN_IN_MESSAGE;
+                if (!is_final) {
+                        WS_METRIC_ADD(fragments_in, 1);
+                        return 0;
+                }
+
+                if (ROLE_EXTENSIONS && (conn->flags & CONN_MSG_DEFLATED)) {
+                        conn->flags &= ~CONN_MSG_DEFLATED;
+                        if ((type = inflate_rx(conn)) != WS_FT_TEXT)
+                                return fail(conn, type, sink);
+                        rx = conn->rx;
+                }
+
+                rx->data[rx->len] = '\0';
+                WS_METRIC_RECORD(message_size, rx->len);
+                WS_TRACE(WS_EV_MESSAGE_DELIVERED, message_delivered, conn->fd,
+                                                         WS_FT_TEXT, rx->len);
+
+                /* A batched message keeps rx until the batch is handed over */
+                message_len = rx->len;
+                conn->flags &= ~CONN_IN_MESSAGE;
+                if (sink->batch)
+                        conn->flags |= CONN_RX_HELD;
+                else
+                        rx->len = 0;
+                deliver(conn, sink, WS_FT_TEXT, (char *)rx->data, message_len);
+                tally->messages++;
+        }
+
+        /* Nothing in flight or pointed at, so give the buffer back */
+        if (!(conn->flags & (CONN_IN_MESSAGE | CONN_RX_HELD))) {
+                pool_put(conn->rx);
+                conn->rx = NULL;
+        }
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Checks whether the router gets to see the start of the frame just begun,
+ * which it does if the frame starts a message that isn't compressed, and
+ * notes how much of it the router sees.
+ *
+ * Returns 1 if it does; 0 if not.
+ */
+static int
+start_peek(WebsocketConn *conn)
+{
+        ConnExt *conn_ext = conn->ext;
+        uint8_t opcode = conn->header[0] & 0x0f;
+
+        if (conn_ext == NULL || conn_ext->router == NULL ||
+            opcode == WS_FRAME_OP_CONT || (opcode & 0x08) ||
+                                        (conn->flags & CONN_MSG_DEFLATED))
+                return 0;
+
+        conn_ext->peek_len = conn_ext->router->peek_len;
+        if (conn_ext->peek_len > conn->frame_len)
+                conn_ext->peek_len = conn->frame_len;
+        return 1;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Asks the router what to do with the message whose first bytes (unmasked)
+ * are "prefix", and marks the message accordingly. Without a router, it's
+ * decoded.
+ */
+static void
+route(WebsocketConn *conn, const uint8_t *prefix, size_t len)
+{
+        ConnExt *conn_ext = conn->ext;
+        const WebsocketRouter *router = conn_ext->router;
+
+        conn->flags &= ~CONN_PEEKING;
+        conn_ext->routed_len = 0;
+        if (router == NULL)
+                return;
+
+        switch (router->route(conn->fd, (const char *)prefix, len,
+                                                             router->arg)) {
+                case WS_ROUTE_DISCARD:
+                        WS_METRIC_ADD(route_discards, 1);
+                        conn->flags |= CONN_DISCARDING;
+                        break;
+
+                case WS_ROUTE_FORWARD:
+                        WS_METRIC_ADD(route_forwards, 1);
+                        conn->flags |= CONN_FORWARDING;
+                        break;
+
+                default:
+                        break;
+        }
+}
+
+
+/*------------------------------------------------------------------------------
+ * Routes a message once the start of it has been collected in rx. If it's
+ * to be decoded, rx is made room for the rest of the frame; if not, the
+ * start is passed on (masked again) or dropped, and rx given back.
+ */
+static void
+peeked(WebsocketConn *conn, const uint8_t *mask)
+{
+        PoolBuf *rx = conn->rx;
+
+        route(conn, rx->data, conn->frame_read);
+        if (!frame_routed(conn)) {
+                conn->rx = pool_grow(rx, conn->frame_len + 1);
+                return;
+        }
+
+        mask_bytes(rx->data, conn->frame_read, mask, 0);
+        forward(conn, conn->header, conn->header_len);
+        forward(conn, rx->data, conn->frame_read);
+        pool_put(rx);
+        conn->rx = NULL;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns 1 if the frame coming in belongs to a message the router dropped
+ * or is passing on; 0 if it's read as usual.
+ */
+static int
+frame_routed(const WebsocketConn *conn)
+{
+        return (conn->flags & (CONN_DISCARDING | CONN_FORWARDING)) &&
+                                                !(conn->header[0] & 0x08);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Passes on bytes of a message the router is forwarding; does nothing if
+ * it's being dropped.
+ */
+static void
+forward(WebsocketConn *conn, const uint8_t *bytes, size_t len)
+{
+        const WebsocketRouter *router = ((ConnExt *)conn->ext)->router;
+
+        if ((conn->flags & CONN_FORWARDING) && len && router != NULL &&
+                                                    router->forward != NULL)
+                router->forward(conn->fd, bytes, len, router->arg);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Handles the end of a frame of a message the router dropped or is passing
+ * on. Nothing of it was kept, so there's nothing to hand over.
+ */
+static void
+finish_routed_frame(WebsocketConn *conn, ConnTally *tally)
+{
+        ConnExt *conn_ext = conn->ext;
+        uint8_t opcode = conn->header[0] & 0x0f;
+
+        WS_METRIC_ADD(frames_in[opcode], 1);
+        WS_TRACE(WS_EV_PAYLOAD_COMPLETE, payload_complete, conn->fd, opcode,
+                                                              conn->frame_len);
+
+        conn->flags &= ~CONN_IN_PAYLOAD;
+        conn->header_len = 0;
+        tally->frames++;
+
+        conn_ext->routed_len += conn->frame_len;
+        if (!(conn->header[0] & WS_FRAME_FIN)) {
+                WS_METRIC_ADD(fragments_in, 1);
+                conn->flags |= CONN_IN_MESSAGE;
+                return;
+        }
+
+        conn->flags &= ~(CONN_IN_MESSAGE | CONN_DISCARDING | CONN_FORWARDING);
+        tally->messages++;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Inflates the compressed message in rx into a new buffer, which replaces
+ * it.
+ *
+ * Returns WS_FT_TEXT on success; WS_FT_TOO_BIG if it inflates past the
+ * message size limit (see ws_set_limits); WS_FT_ERROR if it's corrupt.
+ */
+static enum WebsocketFrameType
+inflate_rx(WebsocketConn *conn)
+{
+        static const uint8_t tail[DEFLATE_TAIL_LEN] = {0x00, 0x00, 0xff, 0xff};
+        PoolBuf *in;
+        PoolBuf *out;
+        z_stream zs;
+        int status;
+        enum WebsocketFrameType result = WS_FT_ERROR;
+
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+                return WS_FT_ERROR;
+
+        /* Put back the end of the flushed block (RFC 7692 7.2.2) */
+        in = conn->rx = pool_grow(conn->rx, conn->rx->len + DEFLATE_TAIL_LEN);
+        memcpy(in->data + in->len, tail, DEFLATE_TAIL_LEN);
+        zs.next_in = in->data;
+        zs.avail_in = in->len + DEFLATE_TAIL_LEN;
+
+        /* Keep a byte spare for the NUL */
+        out = pool_get();
+        while (1) {
+                if (out->cap - out->len < 2)
+                        out = pool_grow(out, 2 * out->cap);
+                zs.next_out = out->data + out->len;
+                zs.avail_out = out->cap - out->len - 1;
+
+                status = inflate(&zs, Z_SYNC_FLUSH);
+                out->len = zs.next_out - out->data;
+                if (limits_check_message(out->len) != 0) {
+                        WS_METRIC_ADD(limit_rejects, 1);
+                        result = WS_FT_TOO_BIG;
+                        break;
+                }
+                if (status == Z_STREAM_END ||
+                    (zs.avail_in == 0 && zs.avail_out > 0 &&
+                            (status == Z_OK || status == Z_BUF_ERROR))) {
+                        result = WS_FT_TEXT;
+                        break;
+                }
+                if (status != Z_OK && !(status == Z_BUF_ERROR &&
+                                                        zs.avail_out == 0))
+                        break;
+        }
+        inflateEnd(&zs);
+
+        if (result == WS_FT_ERROR)
+                WS_METRIC_ADD(parse_errors, 1);
+        if (result != WS_FT_TEXT) {
+                pool_put(out);
+                return result;
+        }
+
+        pool_put(in);
+        conn->rx = out;
+        return WS_FT_TEXT;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Passes a message or control frame on, straight to the handler or into
+ * the batch.
+ */
+static void
+deliver(WebsocketConn *conn, ConnSink *sink, enum WebsocketFrameType type,
+                                                const char *data, size_t len)
+{
+        WebsocketMessage *msg;
+
+        if (sink->batch == NULL) {
+                sink->handler(conn->fd, type, data, len, sink->arg);
+                return;
+        }
+
+        msg = &sink->batch[sink->num_batch++];
+        msg->type = type;
+        msg->data = data;
+        msg->len = len;
+        if (sink->num_batch == sink->max_batch)
+                flush_batch(conn, sink);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Hands over the batch, if there is one, and lets go of rx if the batch was
+ * holding it.
+ */
+static void
+flush_batch(WebsocketConn *conn, ConnSink *sink)
+{
+        if (sink->num_batch) {
+                sink->batch_handler(conn->fd, sink->batch, sink->num_batch,
+                                                                   sink->arg);
+                sink->num_batch = 0;
+        }
+
+        if (conn->flags & CONN_RX_HELD) {
+                conn->flags &= ~CONN_RX_HELD;
+                if (!(conn->flags & CONN_IN_MESSAGE)) {
+                        pool_put(conn->rx);
+                        conn->rx = NULL;
+                }
+        }
+}
+
+
+/*------------------------------------------------------------------------------
+ * Tells the handler why the connection is done and drops what it was
+ * reading. Batched messages that came before go first.
+ */
+static int
+fail(WebsocketConn *conn, enum WebsocketFrameType type, ConnSink *sink)
+{
+        flush_batch(conn, sink);
+        deliver(conn, sink, type, NULL, 0);
+        flush_batch(conn, sink);
+
+        pool_put(conn->rx);
+        conn->rx = NULL;
+        conn->flags &= CONN_DEFLATE;
+        conn->header_len = 0;
+        return -1;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Writes until everything is out or the connection is full, advancing *ptr
+ * and *left.
+ */
+static int
+write_some(WebsocketConn *conn, ws_write_bytes_fp write_bytes,
+                                           const uint8_t **ptr, size_t *left)
+{
+        ssize_t num_written;
+
+        while (*left > 0) {
+                num_written = write_bytes(conn->fd, *ptr, *left);
+                if (num_written < 0 && errno == EINTR)
+                        continue;
+                if (num_written < 0 && (errno == EAGAIN ||
+                                                errno == EWOULDBLOCK))
+                        return 0;
+                if (num_written <= 0)
+                        return -1;
+
+                WS_METRIC_ADD(bytes_out, num_written);
+                *ptr += num_written;
+                *left -= num_written;
+        }
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns the connection's extra state, making it if need be.
+ */
+static ConnExt *
+ext(WebsocketConn *conn)
+{
+        if (conn->ext == NULL) {
+                /* A zero stamp means the buckets start full */
+                if ((conn->ext = calloc(1, sizeof(ConnExt))) == NULL)
+                        mem_alloc_failure(__FILE__, __LINE__);
+                WS_METRIC_ADD(allocs, 1);
+                WS_METRIC_ADD(alloc_bytes, sizeof(ConnExt));
+        }
+        return conn->ext;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Borrows a buffer with room for cap bytes and copies len bytes into it.
+ */
+static PoolBuf *
+fill_buf(const uint8_t *ptr, size_t len, size_t cap)
+{
+        PoolBuf *result;
+
+        result = pool_grow(pool_get(), cap);
+        memcpy(result->data, ptr, len);
+        result->len = len;
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Tops up the buckets and checks whether the connection is out of tokens.
+ * Bytes only count if there's nothing left over to parse, since those were
+ * paid for when they were read.
+ *
+ * Returns 1 if it is; 0 if it may carry on.
+ */
+static int
+paused(WebsocketConn *conn, const WebsocketRateLimits *rates)
+{
+        ConnExt *conn_ext;
+        uint64_t now;
+
+        if (!rates->bytes_per_sec && !rates->messages_per_sec)
+                return 0;
+
+        conn_ext = ext(conn);
+        now = ws_now_ns();
+        if (rates->messages_per_sec) {
+                refill(&conn_ext->messages, rates->messages_per_sec,
+                                                 rates->messages_burst, now);
+                if (conn_ext->messages.tokens <= 0)
+                        return 1;
+        }
+        if (rates->bytes_per_sec && conn_ext->pending == NULL) {
+                refill(&conn_ext->bytes, rates->bytes_per_sec,
+                                                    rates->bytes_burst, now);
+                if (conn_ext->bytes.tokens <= 0)
+                        return 1;
+        }
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Adds the tokens earned since the bucket was last topped up, up to "burst".
+ * The stamp only moves on by the time the whole tokens added were worth, so
+ * slow rates still add up.
+ */
+static void
+refill(ConnBucket *bucket, uint64_t rate, uint64_t burst, uint64_t now)
+{
+        double earned;
+
+        if (bucket->tokens >= (int64_t)burst) {
+                bucket->tokens = burst;
+                bucket->stamp_ns = now;
+                return;
+        }
+
+        earned = (double)(now - bucket->stamp_ns) * rate / NS_PER_SEC;
+        if (earned >= (double)((int64_t)burst - bucket->tokens)) {
+                bucket->tokens = burst;
+                bucket->stamp_ns = now;
+        }
+        else if (earned >= 1) {
+                bucket->tokens += (int64_t)earned;
+                bucket->stamp_ns += (uint64_t)((int64_t)earned * NS_PER_SEC /
+                                                                        rate);
+        }
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns how long until a (just topped up) bucket has a token.
+ */
+static uint64_t
+bucket_wait_ns(const ConnBucket *bucket, uint64_t rate, uint64_t now)
+{
+        double wait_ns;
+
+        if (bucket->tokens > 0)
+                return 0;
+
+        wait_ns = (1 - bucket->tokens) * NS_PER_SEC / rate -
+                                        (double)(now - bucket->stamp_ns);
+        return wait_ns < 1 ? 1 : (uint64_t)wait_ns + 1;
+}
@@ -0,0 +1,16 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include "ws.h"
+
+/*
+ * Where a connection stands with a WebsocketScheduler (see sched.c).
+ */
+#define CONN_SCHED_IDLE 0       /* Waiting for the fd to be readable */
+#define CONN_SCHED_READY 1      /* In the scheduler's run queue */
+#define CONN_SCHED_PAUSED 2     /* Waiting for its rate limit */
+
+int conn_sched_state(const WebsocketConn *conn);
+void conn_set_sched_state(WebsocketConn *conn, int state);
+
+#endif
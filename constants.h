@@ -3,6 +3,8 @@
 
 /* Byte 0 of websocket frame */
 #define WS_FRAME_FIN 0x80
+#define WS_FRAME_RSV1 0x40      /* Compressed, with permessage-deflate */
+#define WS_FRAME_RSVS 0x70
 #define WS_FRAME_OP_CONT 0x00
 #define WS_FRAME_OP_TEXT 0x01
 #define WS_FRAME_OP_BIN 0x02
@@ -22,4 +24,10 @@
 #define NUM_LONG_LEN_BYTES 8
 #define MASK_LEN 4
 
+/* Must be clear in a 64-bit length (RFC 6455 5.2) */
+#define LONG_LEN_MSB 0x8000000000000000ULL
+
+/* Every flushed deflate block ends with these; they're left off the wire */
+#define DEFLATE_TAIL_LEN 4
+
 #endif
@@ -1,14 +1,21 @@
 #define _GNU_SOURCE
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <sys/types.h>
 
+#include <zlib.h>
+
 #include "constants.h"
 #include "errors.h"
+#include "metrics.h"
+#include "role.h"
+#include "trace.h"
 #include "util.h"
+#include "ws.h"
 
 /*==============================================================================
  * Public API
@@ -19,40 +26,162 @@
  * Makes a text frame based for the specified message.
  *
  * NOTE: This function will always set the FIN bit to 1. If you want to send
- * fragments, set this to 0 once you get the frame back.
+ * fragments, set this to 0 once you get the frame back, or use an outbound
+ * queue (see outq.c), which fragments for you.
+ *
+ * NOTE: In a WS_ROLE_SERVER build, the frame is never masked (see role.h).
  */
 size_t
 ws_make_text_frame(const char *message, const uint8_t mask[4], uint8_t **frame_p)
 {
-        uint64_t i;
         uint64_t message_len;
-        size_t mask_len;
-        size_t num_len_bytes; /* Number of extended payload len bytes */
-        uint8_t byte0, byte1;     /* First two bytes of the frame */
-        uint64_t tmp;
+        size_t header_len;
         size_t frame_len;
+        uint8_t header[WS_MAX_FRAME_HEADER_LEN];
         uint8_t *result = NULL;
 
-        /* We know this is a text frame */
-        byte0 = WS_FRAME_OP_TEXT;
-        byte0 |= WS_FRAME_FIN;
+        /*
+         * Figure out the length of the frame and then allocate memory. The
+         * header is as long as it needs to be for the message length and
+         * mask.
+         */
+        mask = ROLE_TX_MASK(mask);
+        message_len = strlen(message);
+        header_len = ws_make_frame_header(WS_FRAME_OP_TEXT | WS_FRAME_FIN,
+                                                   message_len, mask, header);
+        frame_len = header_len + message_len;
+        if ((result = (uint8_t *)malloc(frame_len)) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+        WS_METRIC_ADD(allocs, 1);
+        WS_METRIC_ADD(alloc_bytes, frame_len);
+        WS_METRIC_ADD(frames_out[WS_FRAME_OP_TEXT], 1);
+        WS_TRACE(WS_EV_FRAME_QUEUED, frame_queued, -1, WS_FRAME_OP_TEXT,
+                                                                   frame_len);
+
+        /*
+         * Write data into the frame: the header, then our message, masked
+         * a word at a time.
+         */
+        memcpy(result, header, header_len);
+        memcpy(result + header_len, message, message_len);
+        mask_bytes(result + header_len, message_len, mask, 0);
+
+        /*
+         * Return results
+         */
+        *frame_p = result;
+
+        return frame_len;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Makes a compressed text frame (permessage-deflate, RFC 7692) for the
+ * specified message.
+ *
+ * The compressor starts fresh for every message, so the frame can go to any
+ * connection that agreed to deflate with server_no_context_takeover (see
+ * ws_complete_handshake_deflate), however many there are.
+ *
+ * Returns the length of the frame; 0 if the message couldn't be compressed,
+ * in which case *frame_p is set to NULL.
+ */
+size_t
+ws_make_deflate_frame(const char *message, uint8_t **frame_p)
+{
+        z_stream zs;
+        uint64_t message_len;
+        size_t payload_len;
+        size_t header_len;
+        size_t bound;
+        uint8_t header[WS_MAX_FRAME_HEADER_LEN];
+        uint8_t *result = NULL;
+        int status;
+
+        *frame_p = NULL;
+        message_len = strlen(message);
+        if (message_len > UINT_MAX)
+                return 0;
+
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+                                        8, Z_DEFAULT_STRATEGY) != Z_OK)
+                return 0;
+
+        /*
+         * Compress into the frame after room for the biggest header. The
+         * bound is for a finished stream; a sync flush adds a few bytes.
+         */
+        bound = deflateBound(&zs, message_len) + 16;
+        if ((result = malloc(WS_MAX_FRAME_HEADER_LEN + bound)) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+        WS_METRIC_ADD(allocs, 1);
+        WS_METRIC_ADD(alloc_bytes, WS_MAX_FRAME_HEADER_LEN + bound);
+
+        zs.next_in = (Bytef *)message;
+        zs.avail_in = message_len;
+        zs.next_out = result + WS_MAX_FRAME_HEADER_LEN;
+        zs.avail_out = bound;
+        status = deflate(&zs, Z_SYNC_FLUSH);
+        payload_len = bound - zs.avail_out;
+        deflateEnd(&zs);
+
+        if (status != Z_OK || zs.avail_in != 0 || zs.avail_out == 0 ||
+                                            payload_len < DEFLATE_TAIL_LEN) {
+                free(result);
+                return 0;
+        }
+
+        /* The receiver puts the flush's 00 00 ff ff back (RFC 7692 7.2.1) */
+        payload_len -= DEFLATE_TAIL_LEN;
+        header_len = ws_make_frame_header(WS_FRAME_OP_TEXT | WS_FRAME_FIN |
+                                        WS_FRAME_RSV1, payload_len, NULL, header);
+        memmove(result + header_len, result + WS_MAX_FRAME_HEADER_LEN,
+                                                                 payload_len);
+        memcpy(result, header, header_len);
+
+        WS_METRIC_ADD(frames_out[WS_FRAME_OP_TEXT], 1);
+        WS_TRACE(WS_EV_FRAME_QUEUED, frame_queued, -1, WS_FRAME_OP_TEXT,
+                                                     header_len + payload_len);
+
+        *frame_p = result;
+        return header_len + payload_len;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Writes a frame header for a payload of payload_len bytes into "header",
+ * which must have room for WS_MAX_FRAME_HEADER_LEN bytes.
+ *
+ * byte0 is the first byte of the frame (FIN bit and opcode). If a mask is
+ * specified, it's included and the mask bit is set; the caller still has to
+ * mask the payload. A WS_ROLE_SERVER build never includes one (see role.h).
+ *
+ * Returns the length of the header.
+ */
+size_t
+ws_make_frame_header(uint8_t byte0, uint64_t payload_len,
+                     const uint8_t mask[4], uint8_t *header)
+{
+        uint64_t i;
+        size_t mask_len;
+        size_t num_len_bytes; /* Number of extended payload len bytes */
+        uint8_t byte1;
+        uint64_t tmp;
 
         /* If a mask is specified, set the mask bit */
+        mask = ROLE_TX_MASK(mask);
         byte1 = mask ? WS_FRAME_MASK : 0;
 
         /*
-         * Figure out the length of the frame and then allocate memory. This
-         * involves figuring out if we need a mask, if we need extra length
-         * bytes, and how big the message is.
+         * Figure out if we need extra length bytes
          */
         mask_len = mask ? 4 : 0;
-        message_len = strlen(message);
-        if (message_len <= SHORT_MESSAGE_LEN) {
+        if (payload_len <= SHORT_MESSAGE_LEN) {
                 num_len_bytes = 0;
-                byte1 |= message_len;
+                byte1 |= payload_len;
         }
-        else if (message_len > SHORT_MESSAGE_LEN &&
-                                               message_len <= MED_MESSAGE_LEN) {
+        else if (payload_len <= MED_MESSAGE_LEN) {
                 num_len_bytes = 2;
                 byte1 |= MED_MESSAGE_KEY;
         }
@@ -60,43 +189,26 @@ ws_make_text_frame(const char *message, const uint8_t mask[4], uint8_t **frame_p
                 num_len_bytes = 8;
                 byte1 |= LONG_MESSAGE_KEY;
         }
-        frame_len = 2 + num_len_bytes + mask_len + message_len;
-        if ((result = (uint8_t *)malloc(frame_len)) == NULL)
-                mem_alloc_failure(__FILE__, __LINE__);
 
         /*
-         * Write data into the frame. First, we'll write the first 2 bytes
-         * that we've constructed. After this comes the extended payload
-         * length (if needed). After that is the mask (if needed). Finally, we
-         * write our message.
+         * First the 2 bytes we've constructed. After this comes the extended
+         * payload length (if needed). After that is the mask (if needed).
          */
-        result[0] = byte0;
-        result[1] = byte1;
+        header[0] = byte0;
+        header[1] = byte1;
 
         /* Write extended length */
-        tmp = message_len;
+        tmp = payload_len;
         for (i = num_len_bytes; i > 0; i--) {
-                result[2 + i - 1] = tmp & 0xFF;
+                header[2 + i - 1] = tmp & 0xFF;
                 tmp >>= 8;
         }
-        
-        /* Write mask */
-        if (mask)
-                for (i = 0; i < mask_len; i++)
-                        result[2 + num_len_bytes + i] = mask[i];
-
-        /* Write message */
-        for (i = 0; i < message_len; i++) {
-                result[2 + num_len_bytes + mask_len + i] =
-                                       toggle_mask(message[i], i, mask);
-        }
 
-        /*
-         * Return results
-         */
-        *frame_p = result;
+        /* Write mask */
+        for (i = 0; i < mask_len; i++)
+                header[2 + num_len_bytes + i] = mask[i];
 
-        return frame_len;
+        return 2 + num_len_bytes + mask_len;
 }
 
 
@@ -116,6 +228,10 @@ ws_make_close_frame(uint8_t **frame_p)
 
         if ((result = (uint8_t *)malloc(2)) == NULL)
                 mem_alloc_failure(__FILE__, __LINE__);
+        WS_METRIC_ADD(allocs, 1);
+        WS_METRIC_ADD(alloc_bytes, 2);
+        WS_METRIC_ADD(frames_out[byte0 & 0x0f], 1);
+        WS_TRACE(WS_EV_FRAME_QUEUED, frame_queued, -1, byte0 & 0x0f, 2);
 
         result[0] = byte0;
         result[1] = byte1;
@@ -129,6 +245,41 @@ ws_make_close_frame(uint8_t **frame_p)
 }
 
 
+/*------------------------------------------------------------------------------
+ * Makes a close frame carrying a status code (e.g., WS_CLOSE_MESSAGE_TOO_BIG).
+ */
+size_t
+ws_make_close_frame_status(uint16_t status, uint8_t **frame_p)
+{
+        uint8_t byte0, byte1;     /* First two bytes of the frame */
+        uint8_t *result = NULL;
+
+        byte0 = WS_FRAME_OP_CLOSE;
+        byte0 |= WS_FRAME_FIN;
+
+        byte1 = 2;
+
+        if ((result = (uint8_t *)malloc(4)) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+        WS_METRIC_ADD(allocs, 1);
+        WS_METRIC_ADD(alloc_bytes, 4);
+        WS_METRIC_ADD(frames_out[byte0 & 0x0f], 1);
+        WS_TRACE(WS_EV_FRAME_QUEUED, frame_queued, -1, byte0 & 0x0f, 4);
+
+        result[0] = byte0;
+        result[1] = byte1;
+        result[2] = status >> 8;
+        result[3] = status & 0xff;
+
+        /*
+         * Return result
+         */
+        *frame_p = result;
+
+        return 4;
+}
+
+
 /*------------------------------------------------------------------------------
  * Makes a ping frame.
  */
@@ -145,6 +296,10 @@ ws_make_ping_frame(uint8_t **frame_p)
 
         if ((result = (uint8_t *)malloc(2)) == NULL)
                 mem_alloc_failure(__FILE__, __LINE__);
+        WS_METRIC_ADD(allocs, 1);
+        WS_METRIC_ADD(alloc_bytes, 2);
+        WS_METRIC_ADD(frames_out[byte0 & 0x0f], 1);
+        WS_TRACE(WS_EV_FRAME_QUEUED, frame_queued, -1, byte0 & 0x0f, 2);
 
         result[0] = byte0;
         result[1] = byte1;
@@ -173,6 +328,10 @@ ws_make_pong_frame(uint8_t **frame_p)
 
         if ((result = (uint8_t *)malloc(2)) == NULL)
                 mem_alloc_failure(__FILE__, __LINE__);
+        WS_METRIC_ADD(allocs, 1);
+        WS_METRIC_ADD(alloc_bytes, 2);
+        WS_METRIC_ADD(frames_out[byte0 & 0x0f], 1);
+        WS_TRACE(WS_EV_FRAME_QUEUED, frame_queued, -1, byte0 & 0x0f, 2);
 
         result[0] = byte0;
         result[1] = byte1;
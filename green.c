@@ -0,0 +1,432 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "errors.h"
+#include "metrics.h"
+#include "ws.h"
+
+/*==============================================================================
+ * Defines
+ */
+
+#define DEFAULT_STACK_SIZE (64 * 1024)
+
+/* Free stacks kept per runtime; past this, finished stacks are unmapped */
+#define MAX_CACHED_STACKS 1024
+
+/* Events taken from epoll at once */
+#define MAX_EVENTS 256
+
+
+/*==============================================================================
+ * Static declarations
+ */
+
+typedef struct Green_ {
+        struct Green_ *next;    /* In the ready list */
+        ucontext_t ctx;
+        uint8_t *stack;         /* Guard page first, then the stack */
+        int fd;
+        uint32_t waiting;       /* epoll events it's blocked on; 0 if not */
+        int done;
+        ws_green_fp fn;
+        void *arg;
+} Green;
+
+typedef struct GreenList_ {
+        Green *head;
+        Green *tail;
+} GreenList;
+
+/*
+ * One runtime per OS thread. Green threads only ever run on the thread
+ * that's in ws_green_run, so nothing here needs a lock.
+ */
+struct WebsocketGreen_ {
+        int epfd;
+        size_t stack_size;
+        size_t page_size;
+        ucontext_t sched_ctx;   /* Where green threads yield to */
+        Green *current;
+        GreenList ready;
+        size_t num_greens;
+
+        /* Free stacks, linked through their first word */
+        void *free_stacks;
+        size_t num_cached_stacks;
+};
+
+static __thread WebsocketGreen *running_rt = NULL;
+
+static void finish(WebsocketGreen *, Green *);
+static uint8_t *get_stack(WebsocketGreen *);
+static Green *pop(GreenList *);
+static void push(GreenList *, Green *);
+static void put_stack(WebsocketGreen *, uint8_t *);
+static void trampoline();
+static int yield_for(uint32_t);
+
+
+/*==============================================================================
+ * Public API
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Creates a green-thread runtime. Each connection's handler runs as a green
+ * thread on a stack of stack_size bytes (0 for 64 KiB), written in the
+ * blocking style: passing ws_green_read and ws_green_write as read_bytes and
+ * write_bytes makes a call that would block switch to another green thread
+ * until the connection is ready.
+ *
+ * To use several OS threads, give each its own runtime (and, say, its own
+ * SO_REUSEPORT listener).
+ *
+ * NOTE: The caller must free this with ws_green_free.
+ *
+ * Returns NULL if epoll can't be set up.
+ */
+WebsocketGreen *
+ws_green_new(size_t stack_size)
+{
+        WebsocketGreen *result;
+        int epfd;
+
+        if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+                return NULL;
+
+        if ((result = calloc(1, sizeof(WebsocketGreen))) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+
+        result->epfd = epfd;
+        result->page_size = sysconf(_SC_PAGESIZE);
+        if (stack_size == 0)
+                stack_size = DEFAULT_STACK_SIZE;
+        result->stack_size = (stack_size + result->page_size - 1) &
+                                                ~(result->page_size - 1);
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Frees a runtime and its cached stacks.
+ *
+ * NOTE: This must not be called while ws_green_run is running it.
+ */
+void
+ws_green_free(WebsocketGreen *rt)
+{
+        void *stack;
+
+        if (rt == NULL)
+                return;
+
+        while ((stack = rt->free_stacks) != NULL) {
+                rt->free_stacks = *(void **)stack;
+                munmap((uint8_t *)stack - rt->page_size,
+                                           rt->page_size + rt->stack_size);
+        }
+        close(rt->epfd);
+        free(rt);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Starts a green thread that calls fn(fd, arg). The fd is made non-blocking,
+ * and the green thread owns it: it's closed when fn returns.
+ *
+ * This may be called before ws_green_run, or from one of the runtime's own
+ * green threads (an accept loop, say), but not from other OS threads.
+ *
+ * Returns 0 on success; -1 if fd can't be watched.
+ */
+int
+ws_green_spawn(WebsocketGreen *rt, int fd, ws_green_fp fn, void *arg)
+{
+        struct epoll_event ev;
+        Green *green;
+
+        if ((green = calloc(1, sizeof(Green))) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        /*
+         * Edge triggered, so the fd is only ever added once; a green thread
+         * always tries its read or write before waiting, so no edge is lost.
+         */
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = green;
+        if (epoll_ctl(rt->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+                free(green);
+                return -1;
+        }
+
+        green->fd = fd;
+        green->fn = fn;
+        green->arg = arg;
+        green->stack = get_stack(rt);
+
+        if (getcontext(&green->ctx) != 0)
+                abort();
+        green->ctx.uc_stack.ss_sp = green->stack;
+        green->ctx.uc_stack.ss_size = rt->stack_size;
+        green->ctx.uc_link = &rt->sched_ctx;
+        makecontext(&green->ctx, trampoline, 0);
+
+        push(&rt->ready, green);
+        rt->num_greens++;
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Runs green threads on the calling OS thread until they've all finished.
+ *
+ * Returns 0 once they have; -1 if epoll fails.
+ */
+int
+ws_green_run(WebsocketGreen *rt)
+{
+        struct epoll_event events[MAX_EVENTS];
+        Green *green;
+        int num_events;
+        int i;
+
+        running_rt = rt;
+        while (1) {
+                while ((green = pop(&rt->ready)) != NULL) {
+                        rt->current = green;
+                        swapcontext(&rt->sched_ctx, &green->ctx);
+                        rt->current = NULL;
+                        if (green->done)
+                                finish(rt, green);
+                }
+
+                if (rt->num_greens == 0)
+                        break;
+
+                num_events = epoll_wait(rt->epfd, events, MAX_EVENTS, -1);
+                if (num_events < 0 && errno == EINTR)
+                        continue;
+                if (num_events < 0) {
+                        running_rt = NULL;
+                        return -1;
+                }
+
+                for (i = 0; i < num_events; i++) {
+                        green = events[i].data.ptr;
+                        if (green->waiting && (events[i].events &
+                                        (green->waiting | EPOLLERR |
+                                         EPOLLHUP | EPOLLRDHUP))) {
+                                green->waiting = 0;
+                                push(&rt->ready, green);
+                        }
+                }
+        }
+
+        running_rt = NULL;
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * A read_bytes for green threads. Reading the green thread's own fd switches
+ * to other green threads until there's something to read. Anywhere else, it's
+ * a plain read.
+ */
+ssize_t
+ws_green_read(int fd, char *ptr, size_t maxlen)
+{
+        ssize_t result;
+
+        while (1) {
+                result = read(fd, ptr, maxlen);
+                if (result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                        return result;
+                if (running_rt == NULL || running_rt->current == NULL ||
+                                                running_rt->current->fd != fd)
+                        return result;
+                yield_for(EPOLLIN);
+        }
+}
+
+
+/*------------------------------------------------------------------------------
+ * A write_bytes for green threads, which waits like ws_green_read does.
+ */
+ssize_t
+ws_green_write(int fd, const void *ptr, size_t len)
+{
+        ssize_t result;
+
+        while (1) {
+                result = write(fd, ptr, len);
+                if (result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                        return result;
+                if (running_rt == NULL || running_rt->current == NULL ||
+                                                running_rt->current->fd != fd)
+                        return result;
+                yield_for(EPOLLOUT);
+        }
+}
+
+
+/*------------------------------------------------------------------------------
+ * Lets a green thread wait until its fd is readable (EPOLLIN), writable
+ * (EPOLLOUT) or either. An accept loop can call this after accept gives
+ * EAGAIN.
+ *
+ * NOTE: Wait only after an operation has come back with EAGAIN; the fd is
+ * edge triggered.
+ *
+ * Returns 0 once the fd is ready or has hung up; -1 if not called from a
+ * green thread.
+ */
+int
+ws_green_wait(uint32_t events)
+{
+        return yield_for(events);
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Where every green thread starts. Returning goes back to the scheduler
+ * (uc_link).
+ */
+static void
+trampoline()
+{
+        Green *green = running_rt->current;
+
+        green->fn(green->fd, green->arg);
+        green->done = 1;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Switches back to the scheduler until the current green thread's fd has one
+ * of the events.
+ */
+static int
+yield_for(uint32_t events)
+{
+        WebsocketGreen *rt = running_rt;
+        Green *green;
+
+        if (rt == NULL || (green = rt->current) == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        green->waiting = events;
+        swapcontext(&green->ctx, &rt->sched_ctx);
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Cleans up after a green thread whose function has returned.
+ */
+static void
+finish(WebsocketGreen *rt, Green *green)
+{
+        epoll_ctl(rt->epfd, EPOLL_CTL_DEL, green->fd, NULL);
+        close(green->fd);
+        put_stack(rt, green->stack);
+        free(green);
+        rt->num_greens--;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Takes a stack from the cache, or maps a new one with a guard page below it.
+ */
+static uint8_t *
+get_stack(WebsocketGreen *rt)
+{
+        uint8_t *result;
+
+        if ((result = rt->free_stacks) != NULL) {
+                rt->free_stacks = *(void **)result;
+                rt->num_cached_stacks--;
+                return result;
+        }
+
+        result = mmap(NULL, rt->page_size + rt->stack_size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (result == MAP_FAILED)
+                mem_alloc_failure(__FILE__, __LINE__);
+        mprotect(result, rt->page_size, PROT_NONE);
+        WS_METRIC_ADD(allocs, 1);
+        WS_METRIC_ADD(alloc_bytes, rt->page_size + rt->stack_size);
+        return result + rt->page_size;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Gives a stack back to the cache, or unmaps it if the cache is full.
+ */
+static void
+put_stack(WebsocketGreen *rt, uint8_t *stack)
+{
+        if (rt->num_cached_stacks >= MAX_CACHED_STACKS) {
+                munmap(stack - rt->page_size, rt->page_size + rt->stack_size);
+                return;
+        }
+
+        *(void **)stack = rt->free_stacks;
+        rt->free_stacks = stack;
+        rt->num_cached_stacks++;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Appends a green thread to a list.
+ */
+static void
+push(GreenList *list, Green *green)
+{
+        green->next = NULL;
+        if (list->tail)
+                list->tail->next = green;
+        else
+                list->head = green;
+        list->tail = green;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Takes the first green thread off a list.
+ */
+static Green *
+pop(GreenList *list)
+{
+        Green *result = list->head;
+
+        if (result != NULL) {
+                list->head = result->next;
+                if (list->head == NULL)
+                        list->tail = NULL;
+                result->next = NULL;
+        }
+        return result;
+}
@@ -9,6 +9,9 @@
 #include "base64.h"
 #include "constants.h"
 #include "errors.h"
+#include "metrics.h"
+#include "role.h"
+#include "sha1x.h"
 #include "ws.h"
 
 /*==============================================================================
@@ -20,6 +23,16 @@
 #define BUF_LENGTH 200
 #define SEC_WEBSOCKET_KEY "Sec-WebSocket-Key"
 #define SEC_WEBSOCKET_KEY_LEN 17
+#define SEC_WEBSOCKET_EXTENSIONS "Sec-WebSocket-Extensions:"
+
+/*
+ * What we accept a permessage-deflate offer with. Neither side keeps its
+ * compression context between messages, so one compressed frame can go to
+ * every subscriber and no connection holds a window while idle.
+ */
+#define DEFLATE_RESPONSE \
+        "Sec-WebSocket-Extensions: permessage-deflate; " \
+        "server_no_context_takeover; client_no_context_takeover\r\n"
 
 
 /*==============================================================================
@@ -28,7 +41,18 @@
 
 static char ws_magic_string[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
+/* The start of a batched response, up to the accept key */
+static const char response_head[] =
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: ";
+static const char crlf[] = "\r\n";
+
+static size_t build_response(WebsocketHandshake *, const uint8_t *);
+static const char *complete_handshake(const char *, const char *);
 static int get_ws_key(char *, size_t, const char *);
+static int offers_deflate(const char *);
 
 
 /*==============================================================================
@@ -64,6 +88,155 @@ ws_is_handshake(const char* req_str)
  * free it when done.
  */
 const char *ws_complete_handshake(const char *req_str)
+{
+        return complete_handshake(req_str, "");
+}
+
+
+/*------------------------------------------------------------------------------
+ * Like ws_complete_handshake, but accepts the permessage-deflate extension
+ * (RFC 7692) if the client offers it, setting *deflate_p to 1 if so (0 if
+ * not).
+ *
+ * Deflate is agreed with no context takeover either way, so compressed
+ * frames can be shared between connections (see
+ * ws_channel_subscribe_deflate). Offers that limit the server's window size
+ * are turned down.
+ *
+ * NOTE: A connection that agreed to deflate may send compressed messages;
+ * read it with a WebsocketConn that has had ws_conn_enable_deflate called.
+ */
+const char *
+ws_complete_handshake_deflate(const char *req_str, int *deflate_p)
+{
+        const char *result;
+
+        *deflate_p = offers_deflate(req_str);
+        result = complete_handshake(req_str,
+                                    *deflate_p ? DEFLATE_RESPONSE : "");
+        if (result == NULL)
+                *deflate_p = 0;
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Completes a batch of handshakes at once, as when thousands of clients
+ * reconnect after a restart. The accept keys are hashed SHA1X_LANES at a
+ * time with a multi-buffer SHA-1, and each response is written into the
+ * caller's buffer, so nothing is allocated.
+ *
+ * For each handshake, set "request", "response" and "response_cap" (and
+ * "accept_deflate" to take up permessage-deflate offers, as
+ * ws_complete_handshake_deflate does). On return, "response_len" is the
+ * response's length (0 if the request had no key or the buffer was too
+ * small) and "deflate" says whether deflate was agreed.
+ *
+ * Returns how many handshakes were completed.
+ */
+size_t
+ws_complete_handshakes(WebsocketHandshake *handshakes, size_t num)
+{
+        char keys[SHA1X_LANES][MAX_WEBSOCKET_KEY_LEN + sizeof(ws_magic_string)];
+        uint8_t digests[SHA1X_LANES][SHA1_DIGEST_LEN];
+        const uint8_t *msgs[SHA1X_LANES];
+        size_t lens[SHA1X_LANES];
+        WebsocketHandshake *lane_hs[SHA1X_LANES];
+        WebsocketHandshake *hs;
+        size_t num_lanes;
+        size_t result = 0;
+        size_t i = 0;
+        size_t j;
+
+        while (i < num) {
+                /* Fill the lanes with requests that have keys */
+                for (num_lanes = 0; num_lanes < SHA1X_LANES && i < num; i++) {
+                        hs = &handshakes[i];
+                        hs->response_len = 0;
+                        hs->deflate = 0;
+                        if (get_ws_key(keys[num_lanes], MAX_WEBSOCKET_KEY_LEN,
+                                                        hs->request) != 0) {
+                                WS_METRIC_ADD(handshake_failures, 1);
+                                continue;
+                        }
+                        lens[num_lanes] = strlen(keys[num_lanes]);
+                        memcpy(keys[num_lanes] + lens[num_lanes],
+                               ws_magic_string, sizeof(ws_magic_string) - 1);
+                        lens[num_lanes] += sizeof(ws_magic_string) - 1;
+                        msgs[num_lanes] = (uint8_t *)keys[num_lanes];
+                        lane_hs[num_lanes++] = hs;
+                }
+
+                sha1x(msgs, lens, num_lanes, digests);
+
+                for (j = 0; j < num_lanes; j++) {
+                        if (build_response(lane_hs[j], digests[j]) == 0) {
+                                WS_METRIC_ADD(handshake_failures, 1);
+                                continue;
+                        }
+                        WS_METRIC_ADD(handshakes, 1);
+                        result++;
+                }
+        }
+        return result;
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Writes a batched handshake's response into its buffer.
+ *
+ * Returns the response length; 0 if it doesn't fit.
+ */
+static size_t
+build_response(WebsocketHandshake *hs, const uint8_t *digest)
+{
+        char accept[4 * ((SHA1_DIGEST_LEN + 2) / 3) + 1];
+        const char *extensions = "";
+        size_t accept_len;
+        size_t extensions_len;
+        size_t len;
+        char *ptr;
+
+        if (hs->accept_deflate && offers_deflate(hs->request)) {
+                hs->deflate = 1;
+                extensions = DEFLATE_RESPONSE;
+        }
+
+        accept_len = base64_encode_to(accept, digest, SHA1_DIGEST_LEN);
+        extensions_len = strlen(extensions);
+        len = sizeof(response_head) - 1 + accept_len + 2 + extensions_len + 2;
+        if (len + 1 > hs->response_cap) {
+                hs->deflate = 0;
+                return 0;
+        }
+
+        ptr = hs->response;
+        memcpy(ptr, response_head, sizeof(response_head) - 1);
+        ptr += sizeof(response_head) - 1;
+        memcpy(ptr, accept, accept_len);
+        ptr += accept_len;
+        memcpy(ptr, crlf, 2);
+        ptr += 2;
+        memcpy(ptr, extensions, extensions_len);
+        ptr += extensions_len;
+        memcpy(ptr, crlf, sizeof(crlf));
+
+        hs->response_len = len;
+        return len;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Builds the handshake response, with "extensions" (a header line, or "")
+ * added after the accept key.
+ */
+static const char *
+complete_handshake(const char *req_str, const char *extensions)
 {
         char buf[BUF_LENGTH];
         char websocket_key[MAX_WEBSOCKET_KEY_LEN];
@@ -74,6 +247,7 @@ const char *ws_complete_handshake(const char *req_str)
                 "Upgrade: websocket\r\n"
                 "Connection: Upgrade\r\n"
                 "Sec-WebSocket-Accept: %s\r\n"
+                "%s"
                 "\r\n";
         char *result;
 
@@ -84,6 +258,8 @@ const char *ws_complete_handshake(const char *req_str)
         result = calloc(MAX_HANDSHAKE_RESPONSE_LEN, sizeof(char));
         if (result == NULL)
                 mem_alloc_failure(__FILE__, __LINE__);
+        WS_METRIC_ADD(allocs, 1);
+        WS_METRIC_ADD(alloc_bytes, MAX_HANDSHAKE_RESPONSE_LEN);
 
 	/* Compute websocket accept value */
         if (get_ws_key(websocket_key, MAX_WEBSOCKET_KEY_LEN, req_str) != 0)
@@ -99,15 +275,19 @@ const char *ws_complete_handshake(const char *req_str)
         if (base64_encode(&websocket_accept, sha_digest,
                                                   SHA_DIGEST_LENGTH) != 0)
                 goto error;
+        WS_METRIC_ADD(allocs, 1);
 
         /*
          * Construct response and return
          */
-        snprintf(result, MAX_HANDSHAKE_RESPONSE_LEN, response_template, websocket_accept);
+        snprintf(result, MAX_HANDSHAKE_RESPONSE_LEN, response_template,
+                                                websocket_accept, extensions);
         free(websocket_accept);
+        WS_METRIC_ADD(handshakes, 1);
         return result;
 
 error:
+        WS_METRIC_ADD(handshake_failures, 1);
         if (result != NULL)
                 free(result);
 
@@ -116,10 +296,6 @@ error:
         return NULL;
 }
 
-/*==============================================================================
- * Static functions
- */
-
 
 /*------------------------------------------------------------------------------
  * Returns websocket key in request string.
@@ -142,3 +318,35 @@ get_ws_key(char *dst, size_t n, const char *req_str)
 
         return 0;
 }
+
+
+/*------------------------------------------------------------------------------
+ * Checks whether the request offers permessage-deflate in a form we can
+ * accept.
+ *
+ * Returns 1 if it does; 0 if not.
+ */
+static int
+offers_deflate(const char *req_str)
+{
+        const char *line;
+        const char *offer;
+        const char *end;
+
+        if (!ROLE_EXTENSIONS)
+                return 0;
+        if ((line = strcasestr(req_str, SEC_WEBSOCKET_EXTENSIONS)) == NULL)
+                return 0;
+        if ((end = strstr(line, "\r\n")) == NULL)
+                end = line + strlen(line);
+
+        /* Take the first deflate offer; its parameters run to the next ',' */
+        offer = strcasestr(line, "permessage-deflate");
+        if (offer == NULL || offer >= end)
+                return 0;
+        if ((line = strchr(offer, ',')) != NULL && line < end)
+                end = line;
+
+        line = strcasestr(offer, "server_max_window_bits");
+        return (line == NULL || line >= end) ? 1 : 0;
+}
@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+
+#include "limits.h"
+#include "ws.h"
+
+/*==============================================================================
+ * Static declarations
+ */
+
+/* A limit of 0 means "no limit" */
+static WebsocketLimits limits = {0, 0, 0};
+static uint64_t memory_budget = 0;
+static uint64_t buffered_bytes = 0;
+static WebsocketRateLimits rate_limits = {0, 0, 0, 0};
+
+static int over(uint64_t, uint64_t *);
+
+
+/*==============================================================================
+ * Public API
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Sets the per-connection limits on frame size, message size and buffered
+ * bytes. Any field left at 0 is unlimited.
+ *
+ * When a peer announces a frame or message over these limits,
+ * ws_read_next_message returns WS_FT_TOO_BIG before allocating anything for
+ * it. The caller should then send a close frame with status
+ * WS_CLOSE_MESSAGE_TOO_BIG (see ws_make_close_frame_status) and close the
+ * connection.
+ */
+void
+ws_set_limits(const WebsocketLimits *new_limits)
+{
+        __atomic_store_n(&limits.max_frame_len, new_limits->max_frame_len,
+                                                             __ATOMIC_RELAXED);
+        __atomic_store_n(&limits.max_message_len, new_limits->max_message_len,
+                                                             __ATOMIC_RELAXED);
+        __atomic_store_n(&limits.max_buffered, new_limits->max_buffered,
+                                                             __ATOMIC_RELAXED);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Sets the most bytes all connections together may have buffered for
+ * messages being read (0 for no limit).
+ */
+void
+ws_set_memory_budget(uint64_t budget)
+{
+        __atomic_store_n(&memory_budget, budget, __ATOMIC_RELAXED);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns the bytes currently buffered for messages being read, across all
+ * connections.
+ */
+uint64_t
+ws_buffered_bytes()
+{
+        return __atomic_load_n(&buffered_bytes, __ATOMIC_RELAXED);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Sets how fast each event-driven connection may send us bytes and messages
+ * (see ws_conn_read_budget). Any rate left at 0 is unlimited.
+ *
+ * A connection that runs out of tokens is paused, not dropped: its reads
+ * stop until the bucket refills, and the kernel's buffers push back on the
+ * client. Connections already past their limit when this is called keep
+ * their current tokens.
+ *
+ * NOTE: With any rate set, each connection holds a few dozen more bytes of
+ * state (allocated on its first read).
+ */
+void
+ws_set_rate_limits(const WebsocketRateLimits *new_limits)
+{
+        __atomic_store_n(&rate_limits.bytes_per_sec,
+                         new_limits->bytes_per_sec, __ATOMIC_RELAXED);
+        __atomic_store_n(&rate_limits.bytes_burst,
+                         new_limits->bytes_burst, __ATOMIC_RELAXED);
+        __atomic_store_n(&rate_limits.messages_per_sec,
+                         new_limits->messages_per_sec, __ATOMIC_RELAXED);
+        __atomic_store_n(&rate_limits.messages_burst,
+                         new_limits->messages_burst, __ATOMIC_RELAXED);
+}
+
+
+/*==============================================================================
+ * Library functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Checks a frame's announced payload length.
+ *
+ * Returns 0 if it's OK; -1 if it's over the limit.
+ */
+int
+limits_check_frame(uint64_t frame_len)
+{
+        return over(frame_len, &limits.max_frame_len);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Checks the length a message would have once the current frame is added.
+ *
+ * Returns 0 if it's OK; -1 if it's over the limit.
+ */
+int
+limits_check_message(uint64_t message_len)
+{
+        return over(message_len, &limits.max_message_len);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Charges n more buffered bytes to a connection (whose running total is in
+ * *charged) and to the process-wide budget.
+ *
+ * Returns 0 if the bytes may be allocated; -1 if that would go over either
+ * limit, in which case nothing is charged.
+ */
+int
+limits_charge(uint64_t *charged, uint64_t n)
+{
+        uint64_t budget;
+        uint64_t total;
+
+        if (over(*charged + n, &limits.max_buffered) != 0)
+                return -1;
+
+        total = __atomic_add_fetch(&buffered_bytes, n, __ATOMIC_RELAXED);
+        budget = __atomic_load_n(&memory_budget, __ATOMIC_RELAXED);
+        if (budget && total > budget) {
+                __atomic_sub_fetch(&buffered_bytes, n, __ATOMIC_RELAXED);
+                return -1;
+        }
+
+        *charged += n;
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Gives back everything charged to a connection.
+ */
+void
+limits_release(uint64_t *charged)
+{
+        if (*charged == 0)
+                return;
+
+        __atomic_sub_fetch(&buffered_bytes, *charged, __ATOMIC_RELAXED);
+        *charged = 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Copies out the rate limits, with each unset burst filled in as one
+ * second's worth.
+ */
+void
+limits_get_rates(WebsocketRateLimits *rates)
+{
+        rates->bytes_per_sec = __atomic_load_n(&rate_limits.bytes_per_sec,
+                                                             __ATOMIC_RELAXED);
+        rates->bytes_burst = __atomic_load_n(&rate_limits.bytes_burst,
+                                                             __ATOMIC_RELAXED);
+        rates->messages_per_sec = __atomic_load_n(
+                        &rate_limits.messages_per_sec, __ATOMIC_RELAXED);
+        rates->messages_burst = __atomic_load_n(&rate_limits.messages_burst,
+                                                             __ATOMIC_RELAXED);
+
+        if (rates->bytes_burst == 0)
+                rates->bytes_burst = rates->bytes_per_sec;
+        if (rates->messages_burst == 0)
+                rates->messages_burst = rates->messages_per_sec;
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Checks a value against a limit (0 being no limit).
+ */
+static int
+over(uint64_t value, uint64_t *limit_p)
+{
+        uint64_t limit = __atomic_load_n(limit_p, __ATOMIC_RELAXED);
+
+        return (limit && value > limit) ? -1 : 0;
+}
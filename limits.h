@@ -0,0 +1,19 @@
+#ifndef LIMITS_H
+#define LIMITS_H
+
+#include <stdint.h>
+
+#include "ws.h"
+
+/*
+ * Returned by ws_update_read_state when a frame is over the size limit.
+ */
+#define WS_READ_TOO_BIG -2
+
+int limits_check_frame(uint64_t frame_len);
+int limits_check_message(uint64_t message_len);
+int limits_charge(uint64_t *charged, uint64_t n);
+void limits_release(uint64_t *charged);
+void limits_get_rates(WebsocketRateLimits *rates);
+
+#endif
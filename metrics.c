@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "errors.h"
+#include "metrics.h"
+#include "ws.h"
+
+/*==============================================================================
+ * Defines
+ */
+
+#define CACHE_LINE_LEN 64
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+
+
+/*==============================================================================
+ * Static declarations
+ */
+
+/*
+ * When a thread exits, its block is handed to the next thread that needs one
+ * rather than freed, so the counts it collected aren't lost.
+ */
+typedef struct ThreadMetrics_ {
+        WebsocketMetrics metrics;
+        struct ThreadMetrics_ *next;
+        int in_use;
+} __attribute__((aligned(CACHE_LINE_LEN))) ThreadMetrics;
+
+__thread WebsocketMetrics *ws_local_metrics = NULL;
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metrics_key;
+static ThreadMetrics *all_metrics = NULL;
+
+static size_t bucket_index(uint64_t);
+static uint64_t bucket_upper_bound(size_t);
+static void create_metrics_key();
+static void release_metrics(void *);
+
+
+/*==============================================================================
+ * Public API
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Sums the counters and histograms of every thread into "snapshot".
+ *
+ * Counts may be a few updates behind what's in flight on other threads.
+ */
+void
+ws_metrics_snapshot(WebsocketMetrics *snapshot)
+{
+        size_t i;
+        ThreadMetrics *block;
+        const uint64_t *src;
+        uint64_t *dst;
+
+        memset(snapshot, 0, sizeof(WebsocketMetrics));
+        dst = (uint64_t *)snapshot;
+
+        pthread_mutex_lock(&metrics_lock);
+        for (block = all_metrics; block; block = block->next) {
+                src = (const uint64_t *)&block->metrics;
+                for (i = 0; i < sizeof(WebsocketMetrics)/sizeof(uint64_t); i++)
+                        dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&metrics_lock);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Records how long the application took to handle a message.
+ */
+void
+ws_metrics_record_handle_ns(uint64_t ns)
+{
+        WS_METRIC_RECORD(handle_ns, ns);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns the value below which "quantile" (0.0 to 1.0) of the recorded
+ * values fall. The result is the upper bound of a bucket, so it may be up to
+ * 12.5% above the true value.
+ */
+uint64_t
+ws_histogram_value_at(const WebsocketHistogram *hist, double quantile)
+{
+        size_t i;
+        uint64_t target;
+        uint64_t seen = 0;
+
+        if (hist->count == 0)
+                return 0;
+
+        target = (uint64_t)(quantile * hist->count);
+        if (target == 0)
+                target = 1;
+
+        for (i = 0; i < WS_HIST_BUCKETS; i++) {
+                seen += hist->buckets[i];
+                if (seen >= target)
+                        return bucket_upper_bound(i);
+        }
+
+        return UINT64_MAX;
+}
+
+
+/*==============================================================================
+ * Library functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Sets up the calling thread's metrics block.
+ */
+WebsocketMetrics *
+ws_metrics_register()
+{
+        ThreadMetrics *block;
+
+        pthread_once(&metrics_once, create_metrics_key);
+
+        pthread_mutex_lock(&metrics_lock);
+        for (block = all_metrics; block; block = block->next)
+                if (!block->in_use)
+                        break;
+
+        if (block == NULL) {
+                if (posix_memalign((void **)&block, CACHE_LINE_LEN,
+                                                     sizeof(ThreadMetrics)) != 0)
+                        mem_alloc_failure(__FILE__, __LINE__);
+                memset(block, 0, sizeof(ThreadMetrics));
+                block->next = all_metrics;
+                all_metrics = block;
+        }
+        block->in_use = 1;
+        pthread_mutex_unlock(&metrics_lock);
+
+        pthread_setspecific(metrics_key, block);
+        ws_local_metrics = &block->metrics;
+        return ws_local_metrics;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Adds a value to a histogram.
+ */
+void
+ws_histogram_record(WebsocketHistogram *hist, uint64_t value)
+{
+        size_t i = bucket_index(value);
+
+        __atomic_store_n(&hist->buckets[i], hist->buckets[i] + 1,
+                                                             __ATOMIC_RELAXED);
+        __atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&hist->sum, hist->sum + value, __ATOMIC_RELAXED);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Counts a close frame by the status code at the start of its payload.
+ */
+void
+ws_metrics_record_close(const uint8_t *payload, uint64_t len)
+{
+        unsigned int code;
+
+        if (len < 2) {
+                WS_METRIC_ADD(closes_other, 1);
+                return;
+        }
+
+        code = (payload[0] << 8) | payload[1];
+        if (code >= WS_CLOSE_CODE_BASE &&
+                                code < WS_CLOSE_CODE_BASE + WS_NUM_CLOSE_CODES)
+                WS_METRIC_ADD(closes[code - WS_CLOSE_CODE_BASE], 1);
+        else
+                WS_METRIC_ADD(closes_other, 1);
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Maps a value to its histogram bucket.
+ *
+ * Values below 8 get their own bucket. Above that, each power of two is split
+ * into 8 linear sub-buckets, which bounds the error at 1/8 of the value.
+ */
+static size_t
+bucket_index(uint64_t value)
+{
+        int exponent;
+
+        if (value < HIST_SUB_BUCKETS)
+                return value;
+
+        exponent = 63 - __builtin_clzll(value);
+        return (exponent - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+               ((value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns the largest value that maps to a bucket.
+ */
+static uint64_t
+bucket_upper_bound(size_t index)
+{
+        int exponent;
+        uint64_t sub;
+
+        if (index < HIST_SUB_BUCKETS)
+                return index;
+
+        exponent = index / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+        sub = index % HIST_SUB_BUCKETS;
+        return ((HIST_SUB_BUCKETS + sub + 1) << (exponent - HIST_SUB_BITS)) - 1;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Creates the key used to find out when a thread exits.
+ */
+static void
+create_metrics_key()
+{
+        if (pthread_key_create(&metrics_key, release_metrics) != 0)
+                pthread_failure(__FILE__, __LINE__);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Marks an exiting thread's block as free for reuse.
+ */
+static void
+release_metrics(void *arg)
+{
+        ThreadMetrics *block = arg;
+
+        pthread_mutex_lock(&metrics_lock);
+        block->in_use = 0;
+        pthread_mutex_unlock(&metrics_lock);
+}
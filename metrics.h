@@ -0,0 +1,65 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "ws.h"
+
+/*
+ * Each thread bumps counters in its own cache-line-aligned block, so updates
+ * are plain stores with no sharing between cores. ws_metrics_snapshot sums
+ * the blocks when asked.
+ *
+ * Build with -DWS_NO_METRICS to compile all of this out.
+ */
+
+extern __thread WebsocketMetrics *ws_local_metrics;
+
+WebsocketMetrics *ws_metrics_register();
+void ws_histogram_record(WebsocketHistogram *hist, uint64_t value);
+void ws_metrics_record_close(const uint8_t *payload, uint64_t len);
+
+static inline WebsocketMetrics *
+ws_metrics_local()
+{
+        if (__builtin_expect(ws_local_metrics == NULL, 0))
+                return ws_metrics_register();
+        return ws_local_metrics;
+}
+
+static inline uint64_t
+ws_now_ns()
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifndef WS_NO_METRICS
+
+/* Only the owning thread writes, so a relaxed load/store pair is enough */
+#define WS_METRIC_ADD(field, n) \
+do {\
+        WebsocketMetrics *m_ = ws_metrics_local();\
+        __atomic_store_n(&m_->field, m_->field + (n), __ATOMIC_RELAXED);\
+} while (0)
+
+#define WS_METRIC_RECORD(hist, value) \
+        ws_histogram_record(&ws_metrics_local()->hist, (value))
+
+#define WS_METRIC_CLOSE(payload, len) ws_metrics_record_close((payload), (len))
+
+#define WS_METRIC_NOW() ws_now_ns()
+
+#else
+
+#define WS_METRIC_ADD(field, n) do { (void)(n); } while (0)
+#define WS_METRIC_RECORD(hist, value) do { (void)(value); } while (0)
+#define WS_METRIC_CLOSE(payload, len) do { (void)(payload); } while (0)
+#define WS_METRIC_NOW() 0
+
+#endif
+
+#endif
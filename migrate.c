@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "errors.h"
+#include "tls.h"
+#include "ws.h"
+
+/*==============================================================================
+ * Defines
+ */
+
+/* Largest connection image accepted from another process */
+#define MAX_IMAGE_LEN (1ULL << 32)
+
+
+/*==============================================================================
+ * Static declarations
+ */
+
+static int recv_all(int, uint8_t *, size_t);
+static int send_all(int, const uint8_t *, size_t);
+
+
+/*==============================================================================
+ * Public API
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Hands a connection to another process over a Unix domain socket: its fd
+ * goes across with SCM_RIGHTS, along with its ws_conn_export image. The
+ * other process picks it up with ws_conn_recv_from.
+ *
+ * On success, the connection is freed and this process's copy of the fd is
+ * closed; nothing more should be read from or written to it here. Take it out
+ * of its scheduler (and poller) first.
+ *
+ * Returns 0 on success; -1 if sending failed, in which case the connection is
+ * still ours.
+ *
+ * NOTE: sock should be blocking.
+ *
+ * NOTE: A TLS connection can't be handed over, since its session state lives
+ * in this process (see ws_tls_accept). This returns -1 with errno set to
+ * EOPNOTSUPP for one, and nothing is sent.
+ */
+int
+ws_conn_send_to(int sock, WebsocketConn *conn)
+{
+        union {
+                struct cmsghdr hdr;
+                char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct cmsghdr *cmsg;
+        struct msghdr msg;
+        struct iovec iov;
+        uint8_t *image;
+        uint64_t image_len;
+        ssize_t num_sent;
+        int fd = ws_conn_fd(conn);
+
+        if (tls_has_session(fd)) {
+                errno = EOPNOTSUPP;
+                return -1;
+        }
+
+        image_len = ws_conn_export(conn, &image);
+
+        /* The fd rides along with the length */
+        memset(&msg, 0, sizeof(msg));
+        memset(&control, 0, sizeof(control));
+        iov.iov_base = &image_len;
+        iov.iov_len = sizeof(image_len);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+        do {
+                num_sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        } while (num_sent < 0 && errno == EINTR);
+
+        if (num_sent < 0 ||
+            send_all(sock, (uint8_t *)&image_len + num_sent,
+                                        sizeof(image_len) - num_sent) != 0 ||
+            send_all(sock, image, image_len) != 0) {
+                free(image);
+                return -1;
+        }
+
+        free(image);
+        ws_conn_free(conn);
+        close(fd);
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Picks up a connection sent by ws_conn_send_to, carrying on where the other
+ * process left off.
+ *
+ * NOTE: The caller must free this with ws_conn_free. Its fd is as it was in
+ * the other process (so non-blocking, if it was there).
+ *
+ * Returns NULL if nothing (or nothing valid) could be received.
+ */
+WebsocketConn *
+ws_conn_recv_from(int sock)
+{
+        union {
+                struct cmsghdr hdr;
+                char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct cmsghdr *cmsg;
+        struct msghdr msg;
+        struct iovec iov;
+        WebsocketConn *result = NULL;
+        uint8_t *image;
+        uint64_t image_len;
+        ssize_t num_read;
+        int fd = -1;
+
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = &image_len;
+        iov.iov_len = sizeof(image_len);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        do {
+                num_read = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        } while (num_read < 0 && errno == EINTR);
+
+        if (num_read <= 0)
+                return NULL;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+                if (cmsg->cmsg_level == SOL_SOCKET &&
+                    cmsg->cmsg_type == SCM_RIGHTS &&
+                    cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+                        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+        if (fd < 0)
+                return NULL;
+
+        if (recv_all(sock, (uint8_t *)&image_len + num_read,
+                                        sizeof(image_len) - num_read) != 0 ||
+            image_len > MAX_IMAGE_LEN) {
+                close(fd);
+                return NULL;
+        }
+
+        if ((image = malloc(image_len)) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+
+        if (recv_all(sock, image, image_len) == 0)
+                result = ws_conn_import(fd, image, image_len);
+        free(image);
+
+        if (result == NULL)
+                close(fd);
+        return result;
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Sends all len bytes.
+ */
+static int
+send_all(int sock, const uint8_t *ptr, size_t len)
+{
+        ssize_t n;
+
+        while (len > 0) {
+                n = send(sock, ptr, len, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return -1;
+                ptr += n;
+                len -= n;
+        }
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Receives exactly len bytes.
+ */
+static int
+recv_all(int sock, uint8_t *ptr, size_t len)
+{
+        ssize_t n;
+
+        while (len > 0) {
+                n = recv(sock, ptr, len, 0);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return -1;
+                ptr += n;
+                len -= n;
+        }
+        return 0;
+}
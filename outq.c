@@ -0,0 +1,534 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+
+#include "constants.h"
+#include "errors.h"
+#include "metrics.h"
+#include "trace.h"
+#include "ws.h"
+
+/*==============================================================================
+ * Defines
+ */
+
+/* Buckets in a queue's table of keyed messages */
+#define NUM_KEY_BUCKETS 64
+
+
+/*==============================================================================
+ * Static declarations
+ */
+
+typedef struct OutMessage_ {
+        struct OutMessage_ *next;
+        struct OutMessage_ *key_next;   /* Keyed messages in the same bucket */
+        char *key;                      /* NULL unless pushed with a key */
+        uint8_t opcode;
+        uint64_t len;
+        uint64_t offset;        /* Payload bytes already framed */
+        uint8_t *payload;
+        uint8_t control[SHORT_MESSAGE_LEN];  /* Control payloads live here */
+} OutMessage;
+
+typedef struct OutList_ {
+        OutMessage *head;
+        OutMessage *tail;
+} OutList;
+
+/*
+ * Frames go out whole, one at a time. Between frames, the next one is picked
+ * from (in order): queued control frames, the rest of the data message being
+ * sent, high priority messages, normal messages.
+ */
+struct WebsocketOutQueue_ {
+        pthread_mutex_t lock;
+        int fd;
+        uint64_t fragment_size;
+        uint64_t num_queued;    /* Bytes not yet framed (see push_control) */
+        int closed;             /* A close frame has gone out */
+
+        OutList control;
+        OutList lists[2];       /* By WebsocketPriority */
+        OutMessage *current;    /* Data message part way through */
+        OutMessage **keyed;     /* Waiting keyed messages (made on first use) */
+
+        /* The frame being written */
+        OutMessage *frame_msg;
+        uint8_t header[WS_MAX_FRAME_HEADER_LEN];
+        size_t header_len;
+        uint64_t frame_len;     /* Payload bytes in the frame */
+        uint64_t frame_sent;    /* Header and payload bytes written */
+};
+
+static void free_list(OutList *);
+static void free_message(OutMessage *);
+static size_t hash_key(const char *);
+static OutMessage *new_message(uint8_t, uint64_t);
+static int next_frame(WebsocketOutQueue *);
+static OutMessage *pop(OutList *);
+static void push(OutList *, OutMessage *);
+static void unlink_key(WebsocketOutQueue *, OutMessage *);
+
+
+/*==============================================================================
+ * Public API
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Creates an outbound queue for a connection. Data messages are split into
+ * frames of at most fragment_size payload bytes (0 for no splitting), and
+ * control frames are sent between those fragments, so a big message to a
+ * slow client doesn't hold up pongs and closes.
+ *
+ * NOTE: The caller must free this with ws_outq_free.
+ */
+WebsocketOutQueue *
+ws_outq_new(int fd, uint64_t fragment_size)
+{
+        WebsocketOutQueue *result;
+
+        if ((result = calloc(1, sizeof(WebsocketOutQueue))) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+
+        if (pthread_mutex_init(&result->lock, NULL) != 0)
+                pthread_failure(__FILE__, __LINE__);
+
+        result->fd = fd;
+        result->fragment_size = fragment_size;
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Frees a queue and anything still in it.
+ */
+void
+ws_outq_free(WebsocketOutQueue *q)
+{
+        if (q == NULL)
+                return;
+
+        free_list(&q->control);
+        free_list(&q->lists[WS_PRIORITY_NORMAL]);
+        free_list(&q->lists[WS_PRIORITY_HIGH]);
+        if (q->frame_msg != NULL && q->frame_msg != q->current)
+                free(q->frame_msg);
+        free_message(q->current);
+
+        pthread_mutex_destroy(&q->lock);
+        free(q->keyed);
+        free(q);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Queues a text message. The queue takes "message", which must have been
+ * malloc'd, and frees it once it's been sent.
+ *
+ * High priority messages go ahead of normal ones that haven't started yet.
+ * They can't go between the fragments of a message that has (RFC 6455 only
+ * lets control frames do that), so a small fragment_size keeps their wait
+ * short.
+ *
+ * Returns 0 on success; -1 if a close frame has already gone out.
+ */
+int
+ws_outq_push_text(WebsocketOutQueue *q, char *message, size_t len,
+                                            enum WebsocketPriority priority)
+{
+        OutMessage *msg;
+        int result = -1;
+
+        msg = new_message(WS_FRAME_OP_TEXT, len);
+        msg->payload = (uint8_t *)message;
+
+        pthread_mutex_lock(&q->lock);
+        if (!q->closed) {
+                push(&q->lists[priority], msg);
+                q->num_queued += len;
+                result = 0;
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        if (result != 0) {
+                free(message);
+                free(msg);
+        }
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Queues a text message that only matters until a newer one with the same key
+ * comes along (the latest price for a symbol, say). If a message with this key
+ * is still waiting, its payload is swapped for the new one and it keeps its
+ * place (and priority); otherwise this acts like ws_outq_push_text. Either
+ * way, a client that can't keep up holds at most one message per key.
+ *
+ * A message that has started going out can't be replaced, so the new one
+ * queues behind it.
+ *
+ * The queue takes "message", which must have been malloc'd; "key" is copied.
+ *
+ * Returns 0 on success; -1 if a close frame has already gone out.
+ */
+int
+ws_outq_push_keyed(WebsocketOutQueue *q, const char *key, char *message,
+                                size_t len, enum WebsocketPriority priority)
+{
+        OutMessage *msg;
+        size_t bucket;
+
+        bucket = hash_key(key);
+
+        pthread_mutex_lock(&q->lock);
+        if (q->closed) {
+                pthread_mutex_unlock(&q->lock);
+                free(message);
+                return -1;
+        }
+
+        if (q->keyed == NULL &&
+            (q->keyed = calloc(NUM_KEY_BUCKETS, sizeof(OutMessage *))) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+
+        for (msg = q->keyed[bucket]; msg; msg = msg->key_next) {
+                if (strcmp(msg->key, key) == 0)
+                        break;
+        }
+
+        if (msg != NULL) {
+                q->num_queued -= msg->len;
+                free(msg->payload);
+                WS_METRIC_ADD(conflated, 1);
+        }
+        else {
+                msg = new_message(WS_FRAME_OP_TEXT, 0);
+                if ((msg->key = strdup(key)) == NULL)
+                        mem_alloc_failure(__FILE__, __LINE__);
+                msg->key_next = q->keyed[bucket];
+                q->keyed[bucket] = msg;
+                push(&q->lists[priority], msg);
+        }
+        msg->payload = (uint8_t *)message;
+        msg->len = len;
+        q->num_queued += len;
+        pthread_mutex_unlock(&q->lock);
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Queues a ping, pong or close frame (type WS_FT_PING, WS_FT_PONG or
+ * WS_FT_CLOSE) with up to 125 bytes of payload, which is copied. It goes out
+ * as soon as the frame being written is done.
+ *
+ * Once a close frame has gone out, nothing else will be sent.
+ *
+ * Returns 0 on success; -1 if the type or payload is bad or the queue is
+ * closed.
+ */
+int
+ws_outq_push_control(WebsocketOutQueue *q, enum WebsocketFrameType type,
+                                        const uint8_t *payload, size_t len)
+{
+        OutMessage *msg;
+        uint8_t opcode;
+        int result = -1;
+
+        if (type == WS_FT_PING)
+                opcode = WS_FRAME_OP_PING;
+        else if (type == WS_FT_PONG)
+                opcode = WS_FRAME_OP_PONG;
+        else if (type == WS_FT_CLOSE)
+                opcode = WS_FRAME_OP_CLOSE;
+        else
+                return -1;
+
+        if (len > SHORT_MESSAGE_LEN)
+                return -1;
+
+        msg = new_message(opcode, len);
+        memcpy(msg->control, payload, len);
+
+        pthread_mutex_lock(&q->lock);
+        if (!q->closed) {
+                push(&q->control, msg);
+                q->num_queued += 2 + len;
+                result = 0;
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        if (result != 0)
+                free(msg);
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Writes as much of the queue as write_bytes will take. On a non-blocking
+ * connection, write_bytes should return -1 with errno EAGAIN when it's full;
+ * call this again once the connection is writable.
+ *
+ * Returns 0 once everything queued has been written; otherwise, roughly how
+ * many bytes are still to go. Returns -1 if write_bytes failed, in which case
+ * the connection should be closed.
+ */
+int64_t
+ws_outq_flush(WebsocketOutQueue *q, ws_write_bytes_fp write_bytes)
+{
+        const uint8_t *ptr;
+        uint64_t frame_total;
+        ssize_t num_written;
+        size_t len;
+        int64_t result;
+
+        pthread_mutex_lock(&q->lock);
+        while (1) {
+                if (q->frame_msg == NULL && next_frame(q) != 0)
+                        break;
+
+                /* Header, then payload, picking up where we left off */
+                frame_total = q->header_len + q->frame_len;
+                if (q->frame_sent < q->header_len) {
+                        ptr = q->header + q->frame_sent;
+                        len = q->header_len - q->frame_sent;
+                }
+                else {
+                        ptr = (q->frame_msg->payload ? q->frame_msg->payload :
+                                                        q->frame_msg->control)
+                                + q->frame_msg->offset
+                                + (q->frame_sent - q->header_len);
+                        len = frame_total - q->frame_sent;
+                }
+
+                if (len > 0) {
+                        num_written = write_bytes(q->fd, ptr, len);
+                        if (num_written < 0 && errno == EINTR)
+                                continue;
+                        if (num_written < 0 && (errno == EAGAIN ||
+                                                     errno == EWOULDBLOCK))
+                                break;
+                        if (num_written <= 0) {
+                                pthread_mutex_unlock(&q->lock);
+                                return -1;
+                        }
+                        q->frame_sent += num_written;
+                        WS_METRIC_ADD(bytes_out, num_written);
+                }
+
+                if (q->frame_sent < frame_total)
+                        continue;
+
+                /*
+                 * The frame is out
+                 */
+                WS_TRACE(WS_EV_WRITE_COMPLETE, write_complete, q->fd,
+                                        q->header[0] & 0x0f, frame_total);
+                q->frame_msg->offset += q->frame_len;
+                if (q->frame_msg->offset == q->frame_msg->len) {
+                        if (q->frame_msg == q->current)
+                                q->current = NULL;
+                        free_message(q->frame_msg);
+                }
+                q->frame_msg = NULL;
+
+                if ((q->header[0] & 0x0f) == WS_FRAME_OP_CLOSE) {
+                        q->closed = 1;
+                        break;
+                }
+        }
+
+        result = 0;
+        if (!q->closed) {
+                result = q->num_queued;
+                if (q->frame_msg != NULL)
+                        result += q->header_len + q->frame_len - q->frame_sent;
+        }
+        pthread_mutex_unlock(&q->lock);
+        return result;
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Picks the next frame to write and builds its header.
+ *
+ * Returns 0 if there's a frame to write; -1 if there's nothing to send.
+ */
+static int
+next_frame(WebsocketOutQueue *q)
+{
+        OutMessage *msg;
+        uint8_t byte0;
+
+        if (q->closed)
+                return -1;
+
+        if ((msg = pop(&q->control)) != NULL) {
+                byte0 = msg->opcode | WS_FRAME_FIN;
+                q->frame_len = msg->len;
+                q->num_queued -= 2 + msg->len;
+        }
+        else {
+                if (q->current == NULL &&
+                        (q->current = pop(&q->lists[WS_PRIORITY_HIGH])) == NULL &&
+                        (q->current = pop(&q->lists[WS_PRIORITY_NORMAL])) == NULL)
+                        return -1;
+
+                msg = q->current;
+                if (msg->offset == 0 && msg->key != NULL)
+                        unlink_key(q, msg);
+                byte0 = msg->offset ? WS_FRAME_OP_CONT : msg->opcode;
+                q->frame_len = msg->len - msg->offset;
+                if (q->fragment_size && q->frame_len > q->fragment_size)
+                        q->frame_len = q->fragment_size;
+                if (msg->offset + q->frame_len == msg->len)
+                        byte0 |= WS_FRAME_FIN;
+                q->num_queued -= q->frame_len;
+        }
+
+        q->frame_msg = msg;
+        q->frame_sent = 0;
+        q->header_len = ws_make_frame_header(byte0, q->frame_len, NULL,
+                                                                   q->header);
+
+        WS_METRIC_ADD(frames_out[byte0 & 0x0f], 1);
+        WS_TRACE(WS_EV_FRAME_QUEUED, frame_queued, q->fd, byte0 & 0x0f,
+                                                q->header_len + q->frame_len);
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Makes an empty message.
+ */
+static OutMessage *
+new_message(uint8_t opcode, uint64_t len)
+{
+        OutMessage *result;
+
+        if ((result = malloc(sizeof(OutMessage))) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+        WS_METRIC_ADD(allocs, 1);
+        WS_METRIC_ADD(alloc_bytes, sizeof(OutMessage));
+
+        result->next = NULL;
+        result->key_next = NULL;
+        result->key = NULL;
+        result->opcode = opcode;
+        result->len = len;
+        result->offset = 0;
+        result->payload = NULL;
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Appends a message to a list.
+ */
+static void
+push(OutList *list, OutMessage *msg)
+{
+        if (list->tail)
+                list->tail->next = msg;
+        else
+                list->head = msg;
+        list->tail = msg;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Takes the first message off a list.
+ */
+static OutMessage *
+pop(OutList *list)
+{
+        OutMessage *result = list->head;
+
+        if (result != NULL) {
+                list->head = result->next;
+                if (list->head == NULL)
+                        list->tail = NULL;
+                result->next = NULL;
+        }
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Frees every message in a list.
+ */
+static void
+free_list(OutList *list)
+{
+        OutMessage *msg;
+
+        while ((msg = pop(list)) != NULL)
+                free_message(msg);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Frees a message and its payload.
+ */
+static void
+free_message(OutMessage *msg)
+{
+        if (msg == NULL)
+                return;
+
+        free(msg->payload);
+        free(msg->key);
+        free(msg);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Takes a keyed message out of the key table once it starts going out, so
+ * newer messages with that key queue behind it instead of replacing it.
+ */
+static void
+unlink_key(WebsocketOutQueue *q, OutMessage *msg)
+{
+        OutMessage **link;
+
+        for (link = &q->keyed[hash_key(msg->key)]; *link;
+                                               link = &(*link)->key_next) {
+                if (*link == msg) {
+                        *link = msg->key_next;
+                        msg->key_next = NULL;
+                        break;
+                }
+        }
+}
+
+
+/*------------------------------------------------------------------------------
+ * Hashes a message key into a bucket index (FNV-1a).
+ */
+static size_t
+hash_key(const char *key)
+{
+        uint32_t hash = 2166136261u;
+
+        while (*key) {
+                hash ^= (uint8_t)*key++;
+                hash *= 16777619u;
+        }
+
+        return hash % NUM_KEY_BUCKETS;
+}
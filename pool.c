@@ -0,0 +1,600 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "errors.h"
+#include "metrics.h"
+#include "pool.h"
+#include "ws.h"
+
+/*==============================================================================
+ * Defines
+ */
+
+/*
+ * Size classes go up 4x at a time from POOL_BUF_SIZE: 4K, 16K ... 4M. Buffers
+ * bigger than the last class get a mapping each, and aren't kept when freed.
+ */
+#define NUM_CLASSES 6
+#define CLASS_SHIFT 2
+
+/* Classes below this are carved out of slabs; the rest get a mapping each */
+#define NUM_SLAB_CLASSES 3
+
+#define SLAB_LEN (2 * 1024 * 1024)
+#define HUGE_PAGE_LEN (2 * 1024 * 1024)
+
+/* Bytes of each class a thread keeps before passing buffers to its node */
+#define THREAD_CACHE_BYTES (1024 * 1024)
+
+/* Bytes of each mapped class a node keeps; past this, they're unmapped */
+#define NODE_CACHE_BYTES (64 * 1024 * 1024)
+
+#define MAX_NODES 64
+#define CACHE_LINE_LEN 64
+
+
+/*==============================================================================
+ * Static declarations
+ */
+
+/*
+ * Free buffers whose memory is on one NUMA node, for threads running there
+ * to refill their caches from, and the slab new small buffers come out of.
+ */
+typedef struct NodePool_ {
+        pthread_mutex_t lock;
+        PoolBuf *bufs[NUM_CLASSES];
+        size_t num_bufs[NUM_CLASSES];
+        uint8_t *slab;
+        size_t slab_left;
+} __attribute__((aligned(CACHE_LINE_LEN))) NodePool;
+
+/*
+ * A thread's own free buffers, which it gets and puts without locking. Only
+ * the owning thread writes here; ws_conn_pool_stats reads the counts. As with
+ * metrics blocks, a cache is handed to the next new thread when its thread
+ * exits, so "borrowed" stays right when buffers outlive their threads.
+ */
+typedef struct ThreadCache_ {
+        PoolBuf *bufs[NUM_CLASSES];
+        size_t num_bufs[NUM_CLASSES];
+        int64_t borrowed;       /* Gets less puts, on this thread */
+        int node;               /* Where the thread last ran */
+        struct ThreadCache_ *next;
+        int in_use;
+} __attribute__((aligned(CACHE_LINE_LEN))) ThreadCache;
+
+static NodePool nodes[MAX_NODES] = {
+        [0 ... MAX_NODES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+static __thread ThreadCache *local_cache = NULL;
+
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t caches_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static ThreadCache *all_caches = NULL;
+
+static int use_hugepages = 0;
+
+static size_t class_cap(int);
+static int class_of(size_t);
+static void create_cache_key();
+static int current_node();
+static void drain(ThreadCache *, int);
+static ThreadCache *get_cache();
+static PoolBuf *get_class(int, size_t);
+static PoolBuf *map_buf(int, size_t, int);
+static uint8_t *map_memory(size_t *, int);
+static int memory_node(void *, int);
+static void put_to_node(PoolBuf *);
+static void refill(ThreadCache *, int);
+static void release_cache(void *);
+static PoolBuf *slab_buf(int, int);
+static size_t thread_cache_max(int);
+
+
+/*==============================================================================
+ * Public API
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Reports how many pool buffers are borrowed and how many are sitting free
+ * (in thread caches or waiting on their NUMA node).
+ */
+void
+ws_conn_pool_stats(size_t *borrowed, size_t *cached)
+{
+        ThreadCache *tc;
+        int64_t num_borrowed = 0;
+        size_t num_cached = 0;
+        int node;
+        int cls;
+
+        pthread_mutex_lock(&caches_lock);
+        for (tc = all_caches; tc; tc = tc->next) {
+                num_borrowed += __atomic_load_n(&tc->borrowed,
+                                                        __ATOMIC_RELAXED);
+                for (cls = 0; cls < NUM_CLASSES; cls++)
+                        num_cached += __atomic_load_n(&tc->num_bufs[cls],
+                                                        __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&caches_lock);
+
+        for (node = 0; node < MAX_NODES; node++) {
+                pthread_mutex_lock(&nodes[node].lock);
+                for (cls = 0; cls < NUM_CLASSES; cls++)
+                        num_cached += nodes[node].num_bufs[cls];
+                pthread_mutex_unlock(&nodes[node].lock);
+        }
+
+        *borrowed = num_borrowed > 0 ? num_borrowed : 0;
+        *cached = num_cached;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Turns 2 MiB huge pages on (or off) for pool memory from here on: the slabs
+ * small buffers are carved from, and buffers of 2 MiB or more. Reserved huge
+ * pages (vm.nr_hugepages) are used if there are any; otherwise the kernel is
+ * asked for transparent huge pages.
+ *
+ * Off by default, since each large buffer then takes a whole number of huge
+ * pages.
+ */
+void
+ws_set_pool_hugepages(int enable)
+{
+        __atomic_store_n(&use_hugepages, enable != 0, __ATOMIC_RELAXED);
+}
+
+
+/*==============================================================================
+ * Library functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Borrows an empty buffer with room for POOL_BUF_SIZE bytes.
+ */
+PoolBuf *
+pool_get()
+{
+        return get_class(0, POOL_BUF_SIZE);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Makes room for at least cap bytes, keeping the contents. The buffer moves
+ * up to a bigger size class, so the result may be a different buffer.
+ */
+PoolBuf *
+pool_grow(PoolBuf *buf, size_t cap)
+{
+        PoolBuf *result;
+
+        if (cap <= buf->cap)
+                return buf;
+
+        /* Past the classes, grow by at least double so maps stay rare */
+        if (cap > class_cap(NUM_CLASSES - 1) && cap < 2 * buf->cap)
+                cap = 2 * buf->cap;
+
+        result = get_class(class_of(cap), cap);
+        memcpy(result->data, buf->data, buf->len);
+        result->start = buf->start;
+        result->len = buf->len;
+        pool_put(buf);
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Gives a buffer back. It goes to this thread's cache if its memory is local,
+ * or back to its own node if not.
+ */
+void
+pool_put(PoolBuf *buf)
+{
+        ThreadCache *tc;
+        int cls;
+
+        if (buf == NULL)
+                return;
+
+        tc = get_cache();
+        __atomic_store_n(&tc->borrowed, tc->borrowed - 1, __ATOMIC_RELAXED);
+
+        if ((cls = buf->cls) == NUM_CLASSES) {
+                munmap(buf, buf->map_len);
+                return;
+        }
+
+        if (buf->node != tc->node) {
+                WS_METRIC_ADD(pool_remote_puts, 1);
+                put_to_node(buf);
+                return;
+        }
+
+        buf->next = tc->bufs[cls];
+        tc->bufs[cls] = buf;
+        __atomic_store_n(&tc->num_bufs[cls], tc->num_bufs[cls] + 1,
+                                                        __ATOMIC_RELAXED);
+        if (tc->num_bufs[cls] > thread_cache_max(cls))
+                drain(tc, cls);
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Takes a buffer of a size class (or, past the classes, a mapping of cap
+ * bytes) for the calling thread.
+ */
+static PoolBuf *
+get_class(int cls, size_t cap)
+{
+        ThreadCache *tc = get_cache();
+        PoolBuf *result;
+
+        if (cls == NUM_CLASSES) {
+                result = map_buf(cls, cap, tc->node);
+        }
+        else {
+                if (tc->bufs[cls] == NULL)
+                        refill(tc, cls);
+
+                if ((result = tc->bufs[cls]) != NULL) {
+                        tc->bufs[cls] = result->next;
+                        __atomic_store_n(&tc->num_bufs[cls],
+                                   tc->num_bufs[cls] - 1, __ATOMIC_RELAXED);
+                }
+                else if (cls < NUM_SLAB_CLASSES)
+                        result = slab_buf(cls, tc->node);
+                else
+                        result = map_buf(cls, class_cap(cls), tc->node);
+        }
+
+        if (result->node != tc->node)
+                WS_METRIC_ADD(pool_remote_gets, 1);
+        __atomic_store_n(&tc->borrowed, tc->borrowed + 1, __ATOMIC_RELAXED);
+
+        result->next = NULL;
+        result->start = 0;
+        result->len = 0;
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Refills a thread's cache of one class from its node, first checking which
+ * node the thread is on now (it may have been moved).
+ */
+static void
+refill(ThreadCache *tc, int cls)
+{
+        NodePool *np;
+        PoolBuf *buf;
+        size_t want = (thread_cache_max(cls) + 1) / 2;
+
+        tc->node = current_node();
+        np = &nodes[tc->node];
+
+        pthread_mutex_lock(&np->lock);
+        while (want-- > 0 && (buf = np->bufs[cls]) != NULL) {
+                np->bufs[cls] = buf->next;
+                np->num_bufs[cls]--;
+                buf->next = tc->bufs[cls];
+                tc->bufs[cls] = buf;
+                __atomic_store_n(&tc->num_bufs[cls], tc->num_bufs[cls] + 1,
+                                                        __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&np->lock);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Passes half of a thread's cache of one class back to the node.
+ */
+static void
+drain(ThreadCache *tc, int cls)
+{
+        PoolBuf *buf;
+        size_t keep = thread_cache_max(cls) / 2;
+
+        while (tc->num_bufs[cls] > keep) {
+                buf = tc->bufs[cls];
+                tc->bufs[cls] = buf->next;
+                __atomic_store_n(&tc->num_bufs[cls], tc->num_bufs[cls] - 1,
+                                                        __ATOMIC_RELAXED);
+                put_to_node(buf);
+        }
+}
+
+
+/*------------------------------------------------------------------------------
+ * Puts a free buffer on the node its memory is on. Mapped buffers past what
+ * the node keeps are unmapped; slab buffers are always kept.
+ */
+static void
+put_to_node(PoolBuf *buf)
+{
+        NodePool *np = &nodes[buf->node];
+        int cls = buf->cls;
+
+        pthread_mutex_lock(&np->lock);
+        if (buf->map_len && (np->num_bufs[cls] + 1) * class_cap(cls) >
+                                                        NODE_CACHE_BYTES) {
+                pthread_mutex_unlock(&np->lock);
+                munmap(buf, buf->map_len);
+                return;
+        }
+        buf->next = np->bufs[cls];
+        np->bufs[cls] = buf;
+        np->num_bufs[cls]++;
+        pthread_mutex_unlock(&np->lock);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Carves a new buffer of a small class out of the node's slab, starting a
+ * new slab if there isn't room.
+ */
+static PoolBuf *
+slab_buf(int cls, int node)
+{
+        NodePool *np = &nodes[node];
+        PoolBuf *result;
+        size_t len = (sizeof(PoolBuf) + class_cap(cls) + CACHE_LINE_LEN - 1) &
+                                                ~(size_t)(CACHE_LINE_LEN - 1);
+        size_t slab_len;
+
+        pthread_mutex_lock(&np->lock);
+        if (np->slab_left < len) {
+                slab_len = SLAB_LEN;
+                np->slab = map_memory(&slab_len, node);
+                np->slab_left = slab_len;
+        }
+        result = (PoolBuf *)np->slab;
+        np->slab += len;
+        np->slab_left -= len;
+        pthread_mutex_unlock(&np->lock);
+
+        result->cap = class_cap(cls);
+        result->cls = cls;
+        result->map_len = 0;
+        result->node = memory_node(result, node);
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Makes a buffer with a mapping of its own.
+ */
+static PoolBuf *
+map_buf(int cls, size_t cap, int node)
+{
+        PoolBuf *result;
+        size_t map_len = sizeof(PoolBuf) + cap;
+
+        result = (PoolBuf *)map_memory(&map_len, node);
+        result->cap = map_len - sizeof(PoolBuf);
+        result->cls = cls;
+        result->map_len = map_len;
+        result->node = memory_node(result, node);
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Maps at least *len_p bytes, preferably on the given node, and sets *len_p
+ * to what was mapped.
+ */
+static uint8_t *
+map_memory(size_t *len_p, int node)
+{
+        unsigned long mask = 1UL << node;
+        size_t page_len = sysconf(_SC_PAGESIZE);
+        size_t len;
+        void *result = MAP_FAILED;
+
+        if (__atomic_load_n(&use_hugepages, __ATOMIC_RELAXED) &&
+                                                     *len_p >= HUGE_PAGE_LEN) {
+                len = (*len_p + HUGE_PAGE_LEN - 1) &
+                                                ~(size_t)(HUGE_PAGE_LEN - 1);
+                result = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+                /* None reserved; transparent huge pages will have to do */
+                if (result == MAP_FAILED) {
+                        result = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                        if (result != MAP_FAILED)
+                                madvise(result, len, MADV_HUGEPAGE);
+                }
+        }
+        else {
+                len = (*len_p + page_len - 1) & ~(page_len - 1);
+                result = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        }
+
+        if (result == MAP_FAILED)
+                mem_alloc_failure(__FILE__, __LINE__);
+
+        /*
+         * Before anything touches it, so pages fault in on the node. Preferred
+         * rather than bound, so a full node falls back instead of failing.
+         * Without NUMA support this fails, and there's only one node anyway.
+         */
+        syscall(SYS_mbind, result, len, MPOL_PREFERRED, &mask,
+                                                   8 * sizeof(mask) + 1, 0);
+
+        WS_METRIC_ADD(allocs, 1);
+        WS_METRIC_ADD(alloc_bytes, len);
+        *len_p = len;
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Finds which node memory (already touched) actually ended up on.
+ *
+ * Returns "expected" if the kernel can't say.
+ */
+static int
+memory_node(void *addr, int expected)
+{
+        int node;
+
+        if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr,
+                                          MPOL_F_NODE | MPOL_F_ADDR) != 0 ||
+                                          node < 0 || node >= MAX_NODES)
+                return expected;
+        return node;
+}
+
+
+/*------------------------------------------------------------------------------
+ * The NUMA node the calling thread is running on.
+ */
+static int
+current_node()
+{
+        unsigned int cpu;
+        unsigned int node;
+
+        if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0 || node >= MAX_NODES)
+                return 0;
+        return node;
+}
+
+
+/*------------------------------------------------------------------------------
+ * The calling thread's cache, set up on first use.
+ */
+static ThreadCache *
+get_cache()
+{
+        ThreadCache *tc;
+
+        if (__builtin_expect(local_cache != NULL, 1))
+                return local_cache;
+
+        pthread_once(&caches_once, create_cache_key);
+
+        pthread_mutex_lock(&caches_lock);
+        for (tc = all_caches; tc; tc = tc->next)
+                if (!tc->in_use)
+                        break;
+
+        if (tc == NULL) {
+                if (posix_memalign((void **)&tc, CACHE_LINE_LEN,
+                                                     sizeof(ThreadCache)) != 0)
+                        mem_alloc_failure(__FILE__, __LINE__);
+                memset(tc, 0, sizeof(ThreadCache));
+                tc->next = all_caches;
+                all_caches = tc;
+        }
+        tc->in_use = 1;
+        tc->node = current_node();
+        pthread_mutex_unlock(&caches_lock);
+
+        pthread_setspecific(cache_key, tc);
+        local_cache = tc;
+        return tc;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Sets up the key whose destructor gives back an exiting thread's cache.
+ */
+static void
+create_cache_key()
+{
+        pthread_key_create(&cache_key, release_cache);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Called as a thread exits: its free buffers go back to their nodes, and its
+ * cache is left for the next new thread.
+ */
+static void
+release_cache(void *arg)
+{
+        ThreadCache *tc = arg;
+        PoolBuf *buf;
+        int cls;
+
+        for (cls = 0; cls < NUM_CLASSES; cls++) {
+                while ((buf = tc->bufs[cls]) != NULL) {
+                        tc->bufs[cls] = buf->next;
+                        put_to_node(buf);
+                }
+                __atomic_store_n(&tc->num_bufs[cls], 0, __ATOMIC_RELAXED);
+        }
+
+        pthread_mutex_lock(&caches_lock);
+        tc->in_use = 0;
+        pthread_mutex_unlock(&caches_lock);
+        local_cache = NULL;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Bytes a buffer of a size class can hold. A mapped buffer's header comes out
+ * of its class size, so the mapping is exactly a power of two (and a whole
+ * number of huge pages).
+ */
+static size_t
+class_cap(int cls)
+{
+        size_t result = (size_t)POOL_BUF_SIZE << (CLASS_SHIFT * cls);
+
+        return cls < NUM_SLAB_CLASSES ? result : result - sizeof(PoolBuf);
+}
+
+
+/*------------------------------------------------------------------------------
+ * The smallest size class with room for cap bytes.
+ *
+ * Returns NUM_CLASSES if there's none.
+ */
+static int
+class_of(size_t cap)
+{
+        int cls;
+
+        for (cls = 0; cls < NUM_CLASSES; cls++)
+                if (cap <= class_cap(cls))
+                        return cls;
+        return NUM_CLASSES;
+}
+
+
+/*------------------------------------------------------------------------------
+ * How many buffers of a class a thread keeps to itself.
+ */
+static size_t
+thread_cache_max(int cls)
+{
+        size_t result = THREAD_CACHE_BYTES / class_cap(cls);
+
+        return result > 0 ? result : 1;
+}
@@ -0,0 +1,32 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+
+#include <sys/types.h>
+
+/*
+ * Buffers the library borrows while bytes are in flight. They come in size
+ * classes from POOL_BUF_SIZE up, each thread keeps a few of each class to
+ * itself, and their memory is on the NUMA node of the thread that made them
+ * (see pool.c).
+ */
+
+#define POOL_BUF_SIZE 4096
+
+typedef struct PoolBuf_ {
+        struct PoolBuf_ *next;
+        size_t cap;
+        size_t start;           /* First byte still in use */
+        size_t len;             /* End of the bytes in use */
+        size_t map_len;         /* Bytes mapped for it; 0 if it's in a slab */
+        int node;               /* NUMA node its memory is on */
+        int cls;                /* Size class */
+        uint8_t data[];
+} PoolBuf;
+
+PoolBuf *pool_get();
+PoolBuf *pool_grow(PoolBuf *buf, size_t cap);
+void pool_put(PoolBuf *buf);
+
+#endif
@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,14 +13,22 @@
 
 #include "util.h"
 #include "ws.h"
+#include "capture.h"
 #include "constants.h"
 #include "errors.h"
+#include "limits.h"
+#include "metrics.h"
+#include "pool.h"
+#include "role.h"
+#include "spill.h"
+#include "trace.h"
 
 /*==============================================================================
  * Defines
  */
 
 #define MAXLINE 1000
+#define MAX_DIRECT_READ (1 << 20)
 
 
 /* ============================================================================ 
@@ -33,25 +42,29 @@ enum WebsocketReadState {
 };
 
 typedef struct WebsocketFrame_ {
-        uint8_t *buf;
+        uint8_t *buf;           /* The data of a pool buffer, or NULL */
         size_t buf_len;
         size_t num_read;
         size_t num_to_read;
         enum WebsocketReadState read_state;
+        int defer_payload;      /* Don't buffer medium/long payloads */
 } WebsocketFrame;
 
 
-static char *append_message(char *, char *);
 static int ws_append_bytes(WebsocketFrame *, uint8_t *, size_t);
 static int ws_extend_frame_buf(WebsocketFrame *, size_t);
-static const uint8_t *ws_extract_message(const uint8_t *);
+static PoolBuf *ws_frame_pool_buf(WebsocketFrame *);
+static uint64_t ws_header_len(const uint8_t *);
 static int ws_init_frame(WebsocketFrame *);
 static int ws_is_close_frame(const uint8_t*);
+static int ws_is_cont_frame(const uint8_t*);
 static int ws_is_final(const uint8_t*);
 static int ws_is_ping_frame(const uint8_t*);
 static int ws_is_pong_frame(const uint8_t*);
 static int ws_is_text_frame(const uint8_t*);
 static int ws_update_read_state(WebsocketFrame *);
+static void record_close(const uint8_t *);
+static uint64_t ws_payload_len(const uint8_t *);
 
 
 /*==============================================================================
@@ -64,25 +77,52 @@ static int ws_update_read_state(WebsocketFrame *);
  * When reading frames from a socket connection, we have to be careful not to
  * read only the number of bytes that are part of the frame.  To do this, we set
  * up a little state machine. We update the number of bytes to read using
- * "ws_update_read_state" and "ws_append_bytes". When "ws_update_read_state"
- * returns 0, we have a valid websocket frame.
+ * "ws_update_read_state" and "ws_append_bytes" until we know how long the
+ * payload is.
  *
- * If the websocket frame has a message in it, we can use "ws_extract_message"
- * to retrieve it.
+ * Medium and long payloads are then read straight into the message (see
+ * spill.c) and unmasked in place, so the payload is only ever held once.
+ * Short payloads come in with the header and are copied over.
  *
  * NOTE: This also handles messages split into multiple frame fragments.
  *
+ * NOTE: If ws_set_spill_threshold is in use, the message must be released
+ * with ws_free_message.
+ *
+ * NOTE: Returns WS_FT_TOO_BIG, without reading the payload, if a frame or
+ * message is over a limit set with ws_set_limits or ws_set_memory_budget.
+ * The connection can't be read from after that; the caller should send a
+ * WS_CLOSE_MESSAGE_TOO_BIG close frame and close it.
  */
 enum WebsocketFrameType
 ws_read_next_message(int connfd, ws_read_bytes_fp read_bytes, char **message)
 {
         WebsocketFrame frame;
+        MessageSink sink;
         enum WebsocketFrameType result;
-        char *frame_message = NULL;
 	char buf[MAXLINE+1];
         int num_to_read;
-        int num_read;
-        char *tmp = NULL;
+        ssize_t num_read;
+        int read_state;
+        int header_traced;
+        int has_text = 0;
+        uint8_t *dst;
+        uint8_t *chunk;
+        uint64_t chunk_len;
+        PoolBuf *spill_buf = NULL;
+        const uint8_t *mask;
+        uint64_t header_len;
+        uint64_t payload_len;
+        uint64_t num_buffered;
+        uint64_t offset;
+        uint64_t message_len = 0;
+        uint64_t start_ns;
+        uint64_t read_start_ns;
+        uint64_t read_ns = 0;
+        uint64_t mask_start_ns;
+
+        start_ns = WS_METRIC_NOW();
+        message_sink_init(&sink);
 
         /*
          * This reads frames in and combines any fragments together
@@ -90,43 +130,162 @@ ws_read_next_message(int connfd, ws_read_bytes_fp read_bytes, char **message)
         frame.buf = NULL;
         while (1) {
                 /*
-                 * Read a frame in
+                 * Read a frame header in (and the payload too if it's short)
                  */
                 ws_init_frame(&frame);
-                while (ws_update_read_state(&frame) == 1) {
+                frame.defer_payload = 1;
+                header_traced = 0;
+                while ((read_state = ws_update_read_state(&frame)) == 1) {
+                        if (frame.read_state == WSF_READ && !header_traced) {
+                                WS_TRACE(WS_EV_FRAME_HEADER, frame_header,
+                                         connfd, frame.buf[0] & 0x0f,
+                                         ws_payload_len(frame.buf));
+                                header_traced = 1;
+                        }
+
+                        /* Deferred payloads aren't buffered in the frame */
+                        if (frame.read_state == WSF_READ &&
+                                              frame.num_read == frame.buf_len)
+                                break;
+
                         num_to_read = frame.num_to_read;
                         if (num_to_read > MAXLINE)
                                 num_to_read = MAXLINE;
 
-                        if (num_to_read == 0)
-                                continue;
+                        read_start_ns = WS_METRIC_NOW();
+                        num_read = read_bytes(connfd, buf, num_to_read);
+                        read_ns += WS_METRIC_NOW() - read_start_ns;
 
-                        if ((num_read = read_bytes(connfd, buf, num_to_read)) <= 0) {
+                        if (num_read <= 0) {
                                 result = WS_FT_ERROR;
                                 goto error;
                         }
 
+                        WS_METRIC_ADD(bytes_in, num_read);
+                        WS_CAPTURE(connfd, buf, num_read);
                         ws_append_bytes(&frame, (uint8_t *)buf, num_read);
                 }
 
+                if (read_state == WS_READ_TOO_BIG) {
+                        result = WS_FT_TOO_BIG;
+                        WS_METRIC_ADD(limit_rejects, 1);
+                        goto error;
+                }
+
+                if (read_state < 0) {
+                        WS_METRIC_ADD(parse_errors, 1);
+                        result = WS_FT_ERROR;
+                        goto error;
+                }
+
+                payload_len = ws_payload_len(frame.buf);
+                header_len = ws_header_len(frame.buf);
+                num_buffered = frame.num_read - header_len;
+                mask = role_rx_mask(frame.buf, header_len);
+
                 /*
-                 * Handle frame
+                 * Only data frames can have more than a short payload
                  */
-                if (ws_is_text_frame(frame.buf)) {
-                        result = WS_FT_TEXT;
-                        tmp = (char *) ws_extract_message(frame.buf);
+                if (!ws_is_text_frame(frame.buf) &&
+                                !ws_is_cont_frame(frame.buf) &&
+                                                num_buffered < payload_len) {
+                        WS_METRIC_ADD(parse_errors, 1);
+                        result = WS_FT_ERROR;
+                        goto error;
+                }
 
-                        /* NOTE: append_message will free tmp if needed */
-                        frame_message = append_message(frame_message, tmp);
+                /*
+                 * Move the payload into the message
+                 */
+                if (ws_is_text_frame(frame.buf) || ws_is_cont_frame(frame.buf)) {
+                        has_text = 1;
+                        if (limits_check_message(message_len +
+                                                        payload_len) != 0 ||
+                            message_sink_reserve(&sink, payload_len,
+                                                                &dst) != 0) {
+                                result = WS_FT_TOO_BIG;
+                                WS_METRIC_ADD(limit_rejects, 1);
+                                goto error;
+                        }
+                        /*
+                         * A spilled message goes through a borrowed buffer,
+                         * a big chunk at a time, to keep reads and writes
+                         * to the file few
+                         */
+                        offset = 0;
+                        while (offset < payload_len) {
+                                if (dst == NULL && spill_buf == NULL)
+                                        spill_buf = pool_grow(pool_get(),
+                                                             MAX_DIRECT_READ);
+                                chunk = dst ? dst : spill_buf->data;
+                                if (offset < num_buffered) {
+                                        num_read = num_buffered;
+                                        memcpy(chunk, frame.buf + header_len,
+                                                                  num_read);
+                                }
+                                else {
+                                        chunk_len = payload_len - offset;
+                                        if (chunk_len > MAX_DIRECT_READ)
+                                                chunk_len = MAX_DIRECT_READ;
+
+                                        read_start_ns = WS_METRIC_NOW();
+                                        num_read = read_bytes(connfd,
+                                                     (char *)chunk, chunk_len);
+                                        read_ns += WS_METRIC_NOW() -
+                                                                read_start_ns;
+
+                                        if (num_read <= 0) {
+                                                result = WS_FT_ERROR;
+                                                goto error;
+                                        }
+                                        WS_METRIC_ADD(bytes_in, num_read);
+                                        WS_CAPTURE(connfd, chunk, num_read);
+                                }
+
+                                mask_start_ns = WS_METRIC_NOW();
+                                mask_bytes(chunk, num_read, mask, offset);
+                                WS_METRIC_ADD(unmask_ns,
+                                              WS_METRIC_NOW() - mask_start_ns);
+
+                                if (message_sink_commit(&sink, chunk,
+                                                               num_read) != 0) {
+                                        result = WS_FT_ERROR;
+                                        goto error;
+                                }
+
+                                offset += num_read;
+                                if (message_sink_reserve(&sink,
+                                          payload_len - offset, &dst) != 0) {
+                                        result = WS_FT_TOO_BIG;
+                                        WS_METRIC_ADD(limit_rejects, 1);
+                                        goto error;
+                                }
+                        }
+                        message_len += payload_len;
                 }
+
+                WS_TRACE(WS_EV_PAYLOAD_COMPLETE, payload_complete, connfd,
+                         frame.buf[0] & 0x0f, payload_len);
+                WS_METRIC_ADD(frames_in[frame.buf[0] & 0x0f], 1);
+                if (!ws_is_final(frame.buf))
+                        WS_METRIC_ADD(fragments_in, 1);
+
+                /*
+                 * Handle frame
+                 */
+                if (ws_is_text_frame(frame.buf) || ws_is_cont_frame(frame.buf))
+                        result = WS_FT_TEXT;
                 else if (ws_is_ping_frame(frame.buf))
                         result = WS_FT_PING;
                 else if (ws_is_pong_frame(frame.buf))
                         result = WS_FT_PONG;
-                else if (ws_is_close_frame(frame.buf))
+                else if (ws_is_close_frame(frame.buf)) {
                         result = WS_FT_CLOSE;
+                        record_close(frame.buf);
+                }
                 else {
                         result = WS_FT_ERROR;
+                        WS_METRIC_ADD(parse_errors, 1);
                         syslog(LOG_ERR, "Unknown websocket frame type");
                 }
 
@@ -134,14 +293,23 @@ ws_read_next_message(int connfd, ws_read_bytes_fp read_bytes, char **message)
                  * If this is the final fragment, we're done; otherwise,
                  * continue collecting frames.
                  */
-                if (ws_is_final(frame.buf)) {
-                        *message = frame_message;
+                if (ws_is_final(frame.buf))
                         break;
-                }
         }
 
+        *message = NULL;
+        if (has_text && (*message = message_sink_finish(&sink)) == NULL)
+                result = WS_FT_ERROR;
+
+        WS_TRACE(WS_EV_MESSAGE_DELIVERED, message_delivered, connfd, result,
+                                                                 message_len);
+        WS_METRIC_RECORD(message_size, message_len);
+        WS_METRIC_RECORD(parse_ns, WS_METRIC_NOW() - start_ns - read_ns);
+
 error:
-        free(frame.buf);
+        message_sink_discard(&sink);
+        pool_put(spill_buf);
+        pool_put(ws_frame_pool_buf(&frame));
         return result;
 }
 
@@ -150,34 +318,6 @@ error:
  */
 
 
-/*------------------------------------------------------------------------------
- * Concatenates src onto dst.
- *
- * NOTE: This could go into util.c if anyone else needed it.
- */
-static char *
-append_message(char *dst, char *src)
-{
-        size_t src_len;
-        size_t dst_len;
-
-        if (src == NULL)
-                return dst;
-
-        if (dst == NULL)
-                return src;
-
-        src_len = strlen(src);
-        dst_len = strlen(dst);
-        if ((dst=(char *)realloc(dst, dst_len + src_len + 1)) == NULL)
-                mem_alloc_failure(__FILE__, __LINE__);
-
-        strncpy(dst+dst_len, src, src_len);
-        free(src);
-
-        return dst;
-}
-
 /*------------------------------------------------------------------------------
  * Appends bytes to a frame's buf.
  *
@@ -203,113 +343,51 @@ ws_append_bytes(WebsocketFrame *frame, uint8_t *src, size_t n)
 
 
 /*------------------------------------------------------------------------------
- * Allocates more space to frame->buf.
+ * Allocates more space to frame->buf. It's a pool buffer, so headers and short
+ * payloads (which always fit in one) need no allocation once it's borrowed.
  */
 static int
 ws_extend_frame_buf(WebsocketFrame *frame, size_t more_len)
 {
-        if ((frame->buf =
-             (uint8_t *)realloc(frame->buf, frame->buf_len + more_len)) == NULL)
-                mem_alloc_failure(__FILE__, __LINE__);
+        PoolBuf *pool_buf = ws_frame_pool_buf(frame);
+
+        if (pool_buf == NULL)
+                pool_buf = pool_get();
+        pool_buf->len = frame->num_read;
+        pool_buf = pool_grow(pool_buf, frame->buf_len + more_len);
 
+        frame->buf = pool_buf->data;
         frame->buf_len += more_len;
         return 0;
 }
 
 
 /*------------------------------------------------------------------------------
- * Extracts message from a frame.
- *
- * The message may be either text or binary. If text, then the string is NUL
- * terminated.
- *
- * NOTE: Caller of this function is responsible for freeing the returned data.
+ * The pool buffer frame->buf is in, if any.
  */
-static const uint8_t *
-ws_extract_message(const uint8_t *frame)
+static PoolBuf *
+ws_frame_pool_buf(WebsocketFrame *frame)
 {
-        uint64_t i;
-        uint8_t byte0;
-        uint8_t byte1;
-        uint64_t message_len;
-        uint8_t message_start;
-        uint8_t *mask;
-        uint8_t *result;
-        uint8_t num_len_bytes;
-
-        /* Only handling TEXT or BIN frames */
-        byte0 = frame[0];
-        if (!(byte0 | WS_FRAME_OP_TEXT || byte0 | WS_FRAME_OP_BIN))
-                return NULL;
-
-        byte1 = frame[1];
-
-        /*
-         * Compute message length
-         */
-        message_len = byte1 & ~WS_FRAME_MASK;
-        if (message_len <= SHORT_MESSAGE_LEN) {
-                num_len_bytes = 0;
-        }
-        else if (message_len == MED_MESSAGE_KEY) {
-                num_len_bytes = 2;
-                message_len = 0;
-        }
-        else if (message_len == LONG_MESSAGE_KEY) {
-                num_len_bytes = 8;
-                message_len = 0;
-        }
-        else {
-                /* Should never get here */
+        if (frame->buf == NULL)
                 return NULL;
-        }
-
-        /* This only does anything for medium and long messages */
-        for (i = 0; i < num_len_bytes; i++) {
-                message_len <<= 8;
-                message_len += frame[2 + i];
-        }
-
-        /*
-         * Figure out where message and mask start.
-         */
-        mask = NULL;
-        message_start = 2 + num_len_bytes;
-        if (byte1 & WS_FRAME_MASK) {
-                mask = (uint8_t *)frame + 2 + num_len_bytes;
-                message_start = 2 + num_len_bytes + MASK_LEN;
-        }
-        
-        /*
-         * Allocate memory and fill in the message.
-         */
-        if ((result = (uint8_t *)malloc(message_len + 1)) == NULL)
-                mem_alloc_failure(__FILE__, __LINE__);
-
-        for (i = 0; i < message_len; i++)
-                result[i] = toggle_mask(frame[message_start+i], i, mask);
-
-        /* Add NUL if text frame */
-        if (byte0 | WS_FRAME_OP_TEXT)
-                result[message_len] = '\0';
-
-        return result;
+        return (PoolBuf *)(frame->buf - offsetof(PoolBuf, data));
 }
 
+
 /*------------------------------------------------------------------------------
- * Initializes a frame so it's ready for reading.
+ * Initializes a frame so it's ready for reading. A buffer left from the last
+ * frame is reused.
  *
- * NOTE: The caller must free frame->buf when done.
+ * NOTE: The caller must give frame->buf's pool buffer back when done.
  */
 static int
 ws_init_frame(WebsocketFrame *frame)
 {
-        free(frame->buf);
-        frame->buf = NULL;
         frame->buf_len = 0;
         frame->num_to_read = 2;
         frame->num_read = 0;
         frame->read_state = WSF_START;
+        frame->defer_payload = 0;
 
         ws_extend_frame_buf(frame, frame->num_to_read);
         return 0;
@@ -325,6 +403,15 @@ ws_is_close_frame(const uint8_t* frame_str)
         return (frame_str[0] & 0x0f) == WS_FRAME_OP_CLOSE;
 }
 
+/*------------------------------------------------------------------------------
+ * Checks if frame_str is a CONTINUATION frame.
+ */
+static int
+ws_is_cont_frame(const uint8_t* frame_str)
+{
+        return (frame_str[0] & 0x0f) == WS_FRAME_OP_CONT;
+}
+
 /*------------------------------------------------------------------------------
  * Checks if frame_str is a PING frame.
  */
@@ -361,12 +448,82 @@ ws_is_final(const uint8_t* frame_str)
         return (frame_str[0] & 0xf0) == WS_FRAME_FIN;
 }
 
+/*------------------------------------------------------------------------------
+ * Returns the payload length of a complete frame.
+ */
+static uint64_t
+ws_payload_len(const uint8_t *frame)
+{
+        size_t i;
+        uint64_t result;
+        int num_len_bytes;
+
+        result = frame[1] & ~WS_FRAME_MASK;
+        if (result <= SHORT_MESSAGE_LEN)
+                return result;
+
+        num_len_bytes = result == MED_MESSAGE_KEY ? NUM_MED_LEN_BYTES :
+                                                    NUM_LONG_LEN_BYTES;
+        result = 0;
+        for (i = 0; i < num_len_bytes; i++) {
+                result <<= 8;
+                result += frame[2 + i];
+        }
+        return result;
+}
+
+/*------------------------------------------------------------------------------
+ * Returns the length of a frame's header, including any mask.
+ */
+static uint64_t
+ws_header_len(const uint8_t *frame)
+{
+        uint64_t result = 2;
+
+        if ((frame[1] & ~WS_FRAME_MASK) == MED_MESSAGE_KEY)
+                result += NUM_MED_LEN_BYTES;
+        else if ((frame[1] & ~WS_FRAME_MASK) == LONG_MESSAGE_KEY)
+                result += NUM_LONG_LEN_BYTES;
+
+        if (ROLE_RX_MASKED(frame[1]))
+                result += MASK_LEN;
+
+        return result;
+}
+
+/*------------------------------------------------------------------------------
+ * Counts a close frame by its status code.
+ *
+ * Control frames are always short, so the status is right after the mask.
+ */
+static void
+record_close(const uint8_t *frame)
+{
+        size_t i;
+        uint8_t status[2];
+        uint64_t len;
+        const uint8_t *mask = NULL;
+        const uint8_t *payload = frame + 2;
+
+        len = frame[1] & ~WS_FRAME_MASK;
+        if (ROLE_RX_MASKED(frame[1])) {
+                mask = frame + 2;
+                payload += MASK_LEN;
+        }
+
+        for (i = 0; i < 2 && i < len; i++)
+                status[i] = toggle_mask(payload[i], i, mask);
+
+        WS_METRIC_CLOSE(status, len);
+}
+
 /*------------------------------------------------------------------------------
  * Implements state machine for reading websocket frames.
  *
  * Returns 1 if there's still more to read; 0 if no more to read; -1 if
  * something went wrong (which probably means we should close the websocket
- * connection).
+ * connection); WS_READ_TOO_BIG if the payload is over the frame size limit.
+ * The length is checked before any room is made for the payload.
  *
  * This function is idempotent.
  */
@@ -403,10 +560,14 @@ ws_update_read_state(WebsocketFrame *frame)
          */
         if (frame->read_state == WSF_START) {
                 byte1 = frame->buf[1];
-                mask_len = (byte1 & WS_FRAME_MASK) ? 4 : 0;
+                if (!ROLE_RX_MASK_OK(byte1))
+                        return -1;
+                mask_len = ROLE_RX_MASKED(byte1) ? MASK_LEN : 0;
                 message_len = byte1 & ~WS_FRAME_MASK;
 
                 if (message_len <= SHORT_MESSAGE_LEN) {
+                       if (limits_check_frame(message_len) != 0)
+                               return WS_READ_TOO_BIG;
                        frame->num_to_read = message_len + mask_len;
                        frame->read_state = WSF_READ;
                 }
@@ -443,9 +604,15 @@ ws_update_read_state(WebsocketFrame *frame)
                 message_len <<= 8;
                 message_len += frame->buf[2 + i];
         }
+        if (message_len & LONG_LEN_MSB)
+                return -1;
+
+        if (limits_check_frame(message_len) != 0)
+                return WS_READ_TOO_BIG;
 
         frame->num_to_read = message_len;
         frame->read_state = WSF_READ;
-        ws_extend_frame_buf(frame, frame->num_to_read);
+        if (!frame->defer_payload)
+                ws_extend_frame_buf(frame, frame->num_to_read);
         return 1;
 }
@@ -0,0 +1,385 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "constants.h"
+#include "errors.h"
+#include "metrics.h"
+#include "trace.h"
+#include "util.h"
+#include "ws.h"
+
+/*==============================================================================
+ * Defines
+ */
+
+#define RELAY_PIPE_SIZE (1 << 20)
+#define UNMASK_CHUNK (64 * 1024)
+
+
+/*==============================================================================
+ * Static declarations
+ */
+
+struct WebsocketRelay_ {
+        int pipe_fds[2];        /* Carries spliced payloads */
+        uint8_t *buf;           /* Holds masked payloads while unmasking */
+};
+
+static int open_pipe(WebsocketRelay *);
+static int read_exactly(int, uint8_t *, size_t);
+static int relay_masked(WebsocketRelay *, int, int, uint64_t,
+                                                             const uint8_t *);
+static int relay_spliced(WebsocketRelay *, int, int, uint64_t);
+static int wait_for(int, short);
+static int write_all(int, const uint8_t *, size_t, int);
+
+
+/*==============================================================================
+ * Public API
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Creates a relay, which forwards frames from one connection to another
+ * without parsing (or, mostly, copying) their payloads.
+ *
+ * Returns NULL if the relay's pipe couldn't be created.
+ *
+ * NOTE: The caller must free this with ws_relay_free. A relay may be reused
+ * for any number of connections, but only by one thread at a time.
+ */
+WebsocketRelay *
+ws_relay_new()
+{
+        WebsocketRelay *result;
+
+        if ((result = malloc(sizeof(WebsocketRelay))) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+
+        if (open_pipe(result) != 0) {
+                free(result);
+                return NULL;
+        }
+
+        result->buf = NULL;
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Frees a relay.
+ */
+void
+ws_relay_free(WebsocketRelay *relay)
+{
+        if (relay == NULL)
+                return;
+
+        close(relay->pipe_fds[0]);
+        close(relay->pipe_fds[1]);
+        free(relay->buf);
+        free(relay);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Forwards the next frame from from_fd to to_fd.
+ *
+ * Only the header is parsed. An unmasked payload (backend to client) is
+ * spliced across through the relay's pipe and never enters user space. A
+ * masked payload (client to backend) is unmasked in place, a chunk at a time,
+ * and sent on unmasked.
+ *
+ * Returns the frame's opcode (so the caller can notice close frames); -1 if
+ * from_fd closed or something went wrong. After -1, part of a frame may have
+ * been forwarded, so both connections should be closed.
+ *
+ * NOTE: This blocks until the whole frame has been forwarded, even if the
+ * connections are non-blocking.
+ */
+int
+ws_relay_frame(WebsocketRelay *relay, int from_fd, int to_fd)
+{
+        uint8_t header[WS_MAX_FRAME_HEADER_LEN];
+        size_t header_len;
+        size_t num_len_bytes;
+        uint64_t payload_len;
+        uint8_t mask[MASK_LEN];
+        int is_masked;
+        int opcode;
+        size_t i;
+
+        /*
+         * Read the header: 2 bytes, then the extended length and mask
+         */
+        if (read_exactly(from_fd, header, 2) != 0)
+                return -1;
+
+        opcode = header[0] & 0x0f;
+        is_masked = header[1] & WS_FRAME_MASK;
+        payload_len = header[1] & ~WS_FRAME_MASK;
+        if (payload_len == MED_MESSAGE_KEY)
+                num_len_bytes = NUM_MED_LEN_BYTES;
+        else if (payload_len == LONG_MESSAGE_KEY)
+                num_len_bytes = NUM_LONG_LEN_BYTES;
+        else
+                num_len_bytes = 0;
+
+        if (read_exactly(from_fd, header + 2, num_len_bytes) != 0 ||
+            (is_masked && read_exactly(from_fd, mask, MASK_LEN) != 0))
+                return -1;
+
+        if (num_len_bytes) {
+                payload_len = 0;
+                for (i = 0; i < num_len_bytes; i++) {
+                        payload_len <<= 8;
+                        payload_len += header[2 + i];
+                }
+        }
+        if (payload_len & LONG_LEN_MSB)
+                return -1;
+
+        WS_METRIC_ADD(bytes_in, 2 + num_len_bytes + (is_masked ? MASK_LEN : 0)
+                                                               + payload_len);
+        WS_METRIC_ADD(frames_in[opcode], 1);
+        WS_TRACE(WS_EV_FRAME_HEADER, frame_header, from_fd, opcode,
+                                                                 payload_len);
+
+        /*
+         * Send the header on without a mask, then the payload
+         */
+        header_len = 2 + num_len_bytes;
+        header[1] &= ~WS_FRAME_MASK;
+        if (write_all(to_fd, header, header_len, payload_len > 0) != 0)
+                return -1;
+
+        if (is_masked) {
+                if (relay_masked(relay, from_fd, to_fd, payload_len,
+                                                                 mask) != 0)
+                        return -1;
+        }
+        else if (relay_spliced(relay, from_fd, to_fd, payload_len) != 0)
+                return -1;
+
+        WS_METRIC_ADD(bytes_out, header_len + payload_len);
+        WS_METRIC_ADD(frames_out[opcode], 1);
+        WS_TRACE(WS_EV_WRITE_COMPLETE, write_complete, to_fd, opcode,
+                                                    header_len + payload_len);
+        return opcode;
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Creates the relay's pipe.
+ *
+ * Returns 0 on success; -1 if it couldn't be, in which case both fds are -1.
+ */
+static int
+open_pipe(WebsocketRelay *relay)
+{
+        if (pipe2(relay->pipe_fds, O_CLOEXEC) != 0) {
+                syslog(LOG_ERR, "Couldn't create relay pipe: %s",
+                                                             strerror(errno));
+                relay->pipe_fds[0] = -1;
+                relay->pipe_fds[1] = -1;
+                return -1;
+        }
+
+        /* A bigger pipe means fewer trips per payload; it's fine if not */
+        fcntl(relay->pipe_fds[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Moves an unmasked payload from one socket to the other through the pipe.
+ *
+ * NOTE: If this fails with bytes still in the pipe, the pipe is replaced, so
+ * they can't go out with the next frame (perhaps to another connection).
+ */
+static int
+relay_spliced(WebsocketRelay *relay, int from_fd, int to_fd, uint64_t len)
+{
+        ssize_t num_in;
+        ssize_t num_out;
+        int saved_errno;
+
+        /* Replacing it may have failed last time */
+        if (relay->pipe_fds[0] < 0 && open_pipe(relay) != 0)
+                return -1;
+
+        while (len > 0) {
+                num_in = splice(from_fd, NULL, relay->pipe_fds[1], NULL,
+                                len, SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (num_in < 0 && errno == EINTR)
+                        continue;
+                if (num_in < 0 && errno == EAGAIN) {
+                        if (wait_for(from_fd, POLLIN) != 0)
+                                return -1;
+                        continue;
+                }
+                if (num_in <= 0)
+                        return -1;
+                len -= num_in;
+
+                /* Always empty the pipe, so the next frame starts clean */
+                while (num_in > 0) {
+                        num_out = splice(relay->pipe_fds[0], NULL, to_fd, NULL,
+                                num_in, SPLICE_F_MOVE |
+                                        (len > 0 ? SPLICE_F_MORE : 0));
+                        if (num_out < 0 && errno == EINTR)
+                                continue;
+                        if (num_out < 0 && errno == EAGAIN) {
+                                if (wait_for(to_fd, POLLOUT) != 0)
+                                        goto stranded;
+                                continue;
+                        }
+                        if (num_out <= 0)
+                                goto stranded;
+                        num_in -= num_out;
+                }
+        }
+        return 0;
+
+stranded:
+        saved_errno = errno;
+        close(relay->pipe_fds[0]);
+        close(relay->pipe_fds[1]);
+        open_pipe(relay);
+        errno = saved_errno;
+        return -1;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Reads a masked payload a chunk at a time, unmasks it in place, and writes
+ * it on.
+ */
+static int
+relay_masked(WebsocketRelay *relay, int from_fd, int to_fd, uint64_t len,
+                                                        const uint8_t *mask)
+{
+        uint64_t offset = 0;
+        size_t chunk_len;
+        ssize_t num_read;
+
+        if (relay->buf == NULL &&
+                        (relay->buf = malloc(UNMASK_CHUNK)) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+
+        while (offset < len) {
+                chunk_len = len - offset;
+                if (chunk_len > UNMASK_CHUNK)
+                        chunk_len = UNMASK_CHUNK;
+
+                num_read = read(from_fd, relay->buf, chunk_len);
+                if (num_read < 0 && errno == EINTR)
+                        continue;
+                if (num_read < 0 && errno == EAGAIN) {
+                        if (wait_for(from_fd, POLLIN) != 0)
+                                return -1;
+                        continue;
+                }
+                if (num_read <= 0)
+                        return -1;
+
+                mask_bytes(relay->buf, num_read, mask, offset);
+                offset += num_read;
+                if (write_all(to_fd, relay->buf, num_read, offset < len) != 0)
+                        return -1;
+        }
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Reads exactly len bytes.
+ */
+static int
+read_exactly(int fd, uint8_t *ptr, size_t len)
+{
+        ssize_t num_read;
+
+        while (len > 0) {
+                num_read = read(fd, ptr, len);
+                if (num_read < 0 && errno == EINTR)
+                        continue;
+                if (num_read < 0 && errno == EAGAIN) {
+                        if (wait_for(fd, POLLIN) != 0)
+                                return -1;
+                        continue;
+                }
+                if (num_read <= 0)
+                        return -1;
+
+                ptr += num_read;
+                len -= num_read;
+        }
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Writes all len bytes, telling the kernel if more is coming.
+ */
+static int
+write_all(int fd, const uint8_t *ptr, size_t len, int more)
+{
+        ssize_t num_written;
+
+        while (len > 0) {
+                num_written = send(fd, ptr, len,
+                                        MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+                if (num_written < 0 && errno == ENOTSOCK)
+                        num_written = write(fd, ptr, len);
+
+                if (num_written < 0 && errno == EINTR)
+                        continue;
+                if (num_written < 0 && errno == EAGAIN) {
+                        if (wait_for(fd, POLLOUT) != 0)
+                                return -1;
+                        continue;
+                }
+                if (num_written <= 0)
+                        return -1;
+
+                ptr += num_written;
+                len -= num_written;
+        }
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Waits for a non-blocking connection to be ready.
+ */
+static int
+wait_for(int fd, short events)
+{
+        struct pollfd pfd;
+
+        pfd.fd = fd;
+        pfd.events = events;
+        while (poll(&pfd, 1, -1) < 0)
+                if (errno != EINTR)
+                        return -1;
+
+        return (pfd.revents & (POLLERR | POLLNVAL)) ? -1 : 0;
+}
@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "errors.h"
+#include "replay.h"
+
+/*==============================================================================
+ * Defines
+ */
+
+#define REPLAY_MAGIC 0x57535250u        /* "WSRP" */
+#define RECORD_HDR_LEN sizeof(RecordHeader)
+#define RECORD_ALIGN 8
+
+
+/*==============================================================================
+ * Static declarations
+ */
+
+/*
+ * The ring state lives at the start of the storage so that a file-backed ring
+ * can be picked up again after a restart.
+ */
+typedef struct RingState_ {
+        uint32_t magic;
+        uint32_t unused;
+        uint64_t capacity;
+        uint64_t head;          /* Offset of oldest record */
+        uint64_t tail;          /* Offset where the next record goes */
+        uint64_t num_records;
+        uint64_t first_seq;     /* Sequence number of oldest record */
+        uint64_t next_seq;
+} RingState;
+
+/*
+ * Each stored frame is prefixed by a record header. A header with a seq of 0
+ * marks the rest of the ring as unused and means "wrap to the start".
+ */
+typedef struct RecordHeader_ {
+        uint64_t seq;
+        uint32_t frame_len;
+        uint32_t unused;
+} RecordHeader;
+
+struct ReplayRing_ {
+        pthread_mutex_t lock;
+        RingState *state;
+        uint8_t *data;
+        size_t map_len;
+        int is_mapped;
+};
+
+
+static void evict_head(ReplayRing *);
+static void normalize_head(ReplayRing *);
+static size_t record_len(size_t);
+
+
+/*==============================================================================
+ * Public API
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Creates a ring that holds up to "capacity" bytes of frames.
+ *
+ * If path is non-NULL, the ring is kept in a memory-mapped file. If that file
+ * already holds a ring of the same capacity, its frames are kept.
+ *
+ * Returns NULL if the file can't be set up.
+ */
+ReplayRing *
+replay_ring_new(size_t capacity, const char *path)
+{
+        int fd;
+        uint8_t *storage;
+        size_t map_len;
+        ReplayRing *result;
+
+        capacity = (capacity + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+        map_len = sizeof(RingState) + capacity;
+
+        if (path == NULL) {
+                if ((storage = calloc(1, map_len)) == NULL)
+                        mem_alloc_failure(__FILE__, __LINE__);
+        }
+        else {
+                if ((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+                        return NULL;
+
+                if (ftruncate(fd, map_len) != 0) {
+                        close(fd);
+                        return NULL;
+                }
+
+                storage = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+                                                        MAP_SHARED, fd, 0);
+                close(fd);
+                if (storage == MAP_FAILED)
+                        return NULL;
+        }
+
+        if ((result = calloc(1, sizeof(ReplayRing))) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+
+        if (pthread_mutex_init(&result->lock, NULL) != 0)
+                pthread_failure(__FILE__, __LINE__);
+
+        result->state = (RingState *)storage;
+        result->data = storage + sizeof(RingState);
+        result->map_len = map_len;
+        result->is_mapped = path != NULL;
+
+        /* Start fresh unless this is a ring we wrote before */
+        if (result->state->magic != REPLAY_MAGIC ||
+            result->state->capacity != capacity) {
+                memset(result->state, 0, sizeof(RingState));
+                result->state->magic = REPLAY_MAGIC;
+                result->state->capacity = capacity;
+                result->state->first_seq = 1;
+                result->state->next_seq = 1;
+        }
+
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Frees a ring. A file-backed ring is unmapped, but the file is left alone.
+ */
+void
+replay_ring_free(ReplayRing *ring)
+{
+        if (ring == NULL)
+                return;
+
+        if (ring->is_mapped)
+                munmap(ring->state, ring->map_len);
+        else
+                free(ring->state);
+
+        pthread_mutex_destroy(&ring->lock);
+        free(ring);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Stores a copy of an encoded frame, evicting the oldest frames as needed.
+ *
+ * Returns the sequence number assigned to the frame. A frame that is bigger
+ * than the whole ring can't be stored; it still gets a sequence number, but
+ * the ring is emptied so nobody gets replayed across the gap.
+ */
+uint64_t
+replay_ring_append(ReplayRing *ring, const uint8_t *frame, size_t frame_len)
+{
+        RingState *state = ring->state;
+        RecordHeader *record;
+        size_t len;
+        uint64_t result;
+
+        pthread_mutex_lock(&ring->lock);
+
+        result = state->next_seq++;
+        len = record_len(frame_len);
+
+        if (len > state->capacity) {
+                state->head = state->tail = 0;
+                state->num_records = 0;
+                state->first_seq = state->next_seq;
+                goto done;
+        }
+
+        /*
+         * If the record doesn't fit before the end, evict whatever lives
+         * between the tail and the end, mark the wrap, and start over at 0.
+         */
+        if (state->tail + len > state->capacity) {
+                while (state->num_records && state->head >= state->tail)
+                        evict_head(ring);
+
+                if (state->capacity - state->tail >= RECORD_HDR_LEN) {
+                        record = (RecordHeader *)(ring->data + state->tail);
+                        record->seq = 0;
+                }
+                state->tail = 0;
+                normalize_head(ring);
+        }
+
+        /* Evict anything that overlaps where the record will go */
+        while (state->num_records && state->head >= state->tail &&
+                                        state->head < state->tail + len)
+                evict_head(ring);
+
+        record = (RecordHeader *)(ring->data + state->tail);
+        record->seq = result;
+        record->frame_len = frame_len;
+        memcpy(ring->data + state->tail + RECORD_HDR_LEN, frame, frame_len);
+
+        if (state->num_records++ == 0) {
+                state->head = state->tail;
+                state->first_seq = result;
+        }
+        state->tail += len;
+
+done:
+        pthread_mutex_unlock(&ring->lock);
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Copies out all frames published after since_seq, back to back, ready to be
+ * written to a socket as-is.
+ *
+ * Returns the number of frames copied, or -1 if frames after since_seq have
+ * already been evicted (the caller will need to resync some other way).
+ *
+ * NOTE: The caller must free *frames_p.
+ */
+ssize_t
+replay_ring_copy_since(ReplayRing *ring, uint64_t since_seq,
+                       uint8_t **frames_p, size_t *frames_len_p)
+{
+        RingState *state = ring->state;
+        RecordHeader *record;
+        uint64_t i;
+        uint64_t offset;
+        size_t frames_len;
+        uint8_t *frames;
+        ssize_t result = 0;
+
+        *frames_p = NULL;
+        *frames_len_p = 0;
+
+        pthread_mutex_lock(&ring->lock);
+
+        if (since_seq + 1 < state->first_seq) {
+                result = -1;
+                goto done;
+        }
+
+        if (since_seq + 1 >= state->next_seq)
+                goto done;
+
+        /*
+         * Walk from the oldest record to the first one we need, then copy
+         * until the end.
+         */
+        offset = state->head;
+        frames_len = 0;
+        frames = NULL;
+        for (i = 0; i < state->num_records; i++) {
+                if (state->capacity - offset < RECORD_HDR_LEN ||
+                    ((RecordHeader *)(ring->data + offset))->seq == 0)
+                        offset = 0;
+
+                record = (RecordHeader *)(ring->data + offset);
+                if (record->seq > since_seq) {
+                        if ((frames = realloc(frames, frames_len +
+                                                record->frame_len)) == NULL)
+                                mem_alloc_failure(__FILE__, __LINE__);
+
+                        memcpy(frames + frames_len,
+                               ring->data + offset + RECORD_HDR_LEN,
+                               record->frame_len);
+                        frames_len += record->frame_len;
+                        result++;
+                }
+                offset += record_len(record->frame_len);
+        }
+
+        *frames_p = frames;
+        *frames_len_p = frames_len;
+
+done:
+        pthread_mutex_unlock(&ring->lock);
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns the sequence number of the last frame appended (0 if none).
+ */
+uint64_t
+replay_ring_last_seq(ReplayRing *ring)
+{
+        uint64_t result;
+
+        pthread_mutex_lock(&ring->lock);
+        result = ring->state->next_seq - 1;
+        pthread_mutex_unlock(&ring->lock);
+
+        return result;
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Drops the oldest record.
+ */
+static void
+evict_head(ReplayRing *ring)
+{
+        RingState *state = ring->state;
+        RecordHeader *record;
+
+        normalize_head(ring);
+        record = (RecordHeader *)(ring->data + state->head);
+        state->head += record_len(record->frame_len);
+        state->first_seq = record->seq + 1;
+
+        if (--state->num_records == 0)
+                state->head = state->tail;
+        else
+                normalize_head(ring);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Moves head back to the start of the ring if it's sitting on a wrap.
+ */
+static void
+normalize_head(ReplayRing *ring)
+{
+        RingState *state = ring->state;
+
+        if (state->num_records == 0)
+                return;
+
+        if (state->capacity - state->head < RECORD_HDR_LEN ||
+            ((RecordHeader *)(ring->data + state->head))->seq == 0)
+                state->head = 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns the number of ring bytes a frame takes up, header included.
+ */
+static size_t
+record_len(size_t frame_len)
+{
+        return (RECORD_HDR_LEN + frame_len + RECORD_ALIGN - 1) &
+                                                          ~(RECORD_ALIGN - 1);
+}
@@ -0,0 +1,18 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+
+#include <sys/types.h>
+
+typedef struct ReplayRing_ ReplayRing;
+
+ReplayRing *replay_ring_new(size_t capacity, const char *path);
+void replay_ring_free(ReplayRing *ring);
+uint64_t replay_ring_append(ReplayRing *ring, const uint8_t *frame,
+                                                            size_t frame_len);
+ssize_t replay_ring_copy_since(ReplayRing *ring, uint64_t since_seq,
+                               uint8_t **frames_p, size_t *frames_len_p);
+uint64_t replay_ring_last_seq(ReplayRing *ring);
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef ROLE_H
+#define ROLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+/*
+ * Which end of a connection the library is built for. By default it's both,
+ * and every frame is checked at run time for a mask. Build with one of these
+ * to fix the answers at compile time, so the checks and branches fold away:
+ *
+ *   -DWS_ROLE_SERVER   Frames read must be masked (RFC 6455 5.1: anything
+ *                      else is a protocol error), and frames made never are,
+ *                      whatever mask the caller passes.
+ *   -DWS_ROLE_CLIENT   Frames read must not be masked; frames made are masked
+ *                      with the mask the caller passes.
+ *
+ * Independently, -DWS_TEXT_ONLY drops binary messages and extensions:
+ * binary frames and any RSV bit are protocol errors, and permessage-deflate
+ * is never agreed to in a handshake.
+ */
+
+#if defined(WS_ROLE_SERVER) && defined(WS_ROLE_CLIENT)
+#error "Build with WS_ROLE_SERVER or WS_ROLE_CLIENT, not both"
+#endif
+
+#if defined(WS_ROLE_SERVER)
+
+#define ROLE_RX_MASKED(byte1) 1
+#define ROLE_RX_MASK_OK(byte1) (((byte1) & WS_FRAME_MASK) != 0)
+#define ROLE_TX_MASK(mask) ((const uint8_t *)NULL)
+
+#elif defined(WS_ROLE_CLIENT)
+
+#define ROLE_RX_MASKED(byte1) 0
+#define ROLE_RX_MASK_OK(byte1) (((byte1) & WS_FRAME_MASK) == 0)
+#define ROLE_TX_MASK(mask) (mask)
+
+#else
+
+#define ROLE_RX_MASKED(byte1) (((byte1) & WS_FRAME_MASK) != 0)
+#define ROLE_RX_MASK_OK(byte1) 1
+#define ROLE_TX_MASK(mask) (mask)
+
+#endif
+
+#ifdef WS_TEXT_ONLY
+
+#define ROLE_EXTENSIONS 0
+#define ROLE_DATA_OPCODE_OK(opcode) ((opcode) == WS_FRAME_OP_TEXT)
+
+#else
+
+#define ROLE_EXTENSIONS 1
+#define ROLE_DATA_OPCODE_OK(opcode) \
+        ((opcode) == WS_FRAME_OP_TEXT || (opcode) == WS_FRAME_OP_BIN)
+
+#endif
+
+/*
+ * The mask of a frame read in, given its header (which must have room for one
+ * if the role says so); NULL if it isn't masked.
+ */
+static inline const uint8_t *
+role_rx_mask(const uint8_t *header, size_t header_len)
+{
+        return ROLE_RX_MASKED(header[1]) ? header + header_len - MASK_LEN :
+                                                                        NULL;
+}
+
+#endif
@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+
+#include "conn.h"
+#include "errors.h"
+#include "metrics.h"
+#include "ws.h"
+
+/*==============================================================================
+ * Defines
+ */
+
+#define INITIAL_CAPACITY 64
+
+
+/*==============================================================================
+ * Static declarations
+ */
+
+/*
+ * Connections with something to read wait their turn in a ring; each turn is
+ * one budgeted read. Connections over a rate limit sit in "paused" until
+ * their buckets refill.
+ */
+struct WebsocketScheduler_ {
+        size_t max_frames;
+        size_t max_bytes;
+
+        WebsocketConn **ready;
+        size_t ready_cap;
+        size_t ready_head;
+        size_t num_ready;
+
+        WebsocketConn **paused;
+        size_t paused_cap;
+        size_t num_paused;
+
+        uint64_t busy_ns;       /* Time spent giving turns, ever */
+};
+
+static void add_paused(WebsocketScheduler *, WebsocketConn *);
+static void push_ready(WebsocketScheduler *, WebsocketConn *);
+
+
+/*==============================================================================
+ * Public API
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Creates a scheduler that takes turns reading from connections, each turn
+ * handling at most max_frames frames and max_bytes bytes (0 for no cap), so
+ * a client flooding its connection only ever delays the others by one turn.
+ *
+ * NOTE: The caller must free this with ws_sched_free. It's meant for one
+ * event loop thread.
+ */
+WebsocketScheduler *
+ws_sched_new(size_t max_frames, size_t max_bytes)
+{
+        WebsocketScheduler *result;
+
+        if ((result = calloc(1, sizeof(WebsocketScheduler))) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+
+        result->max_frames = max_frames;
+        result->max_bytes = max_bytes;
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Frees a scheduler. The connections in it are left alone.
+ */
+void
+ws_sched_free(WebsocketScheduler *sched)
+{
+        size_t i;
+
+        if (sched == NULL)
+                return;
+
+        for (i = 0; i < sched->num_ready; i++)
+                conn_set_sched_state(sched->ready[(sched->ready_head + i) %
+                                        sched->ready_cap], CONN_SCHED_IDLE);
+        for (i = 0; i < sched->num_paused; i++)
+                conn_set_sched_state(sched->paused[i], CONN_SCHED_IDLE);
+
+        free(sched->ready);
+        free(sched->paused);
+        free(sched);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Queues a connection for a turn. Call this when its fd becomes readable.
+ *
+ * A connection that's already queued or paused is left where it is, so
+ * this is safe to call on every readiness event.
+ *
+ * NOTE: With level-triggered polling, a paused connection's fd stays
+ * readable; edge-triggered (EPOLLET) polling avoids waking up for it.
+ */
+void
+ws_sched_ready(WebsocketScheduler *sched, WebsocketConn *conn)
+{
+        if (conn_sched_state(conn) != CONN_SCHED_IDLE)
+                return;
+
+        push_ready(sched, conn);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Takes a connection out of the scheduler. Call this before freeing one.
+ */
+void
+ws_sched_remove(WebsocketScheduler *sched, WebsocketConn *conn)
+{
+        size_t i;
+        size_t pos;
+
+        if (conn_sched_state(conn) == CONN_SCHED_PAUSED) {
+                for (i = 0; i < sched->num_paused; i++) {
+                        if (sched->paused[i] == conn) {
+                                sched->paused[i] =
+                                        sched->paused[--sched->num_paused];
+                                break;
+                        }
+                }
+        }
+        else if (conn_sched_state(conn) == CONN_SCHED_READY) {
+                for (i = 0; i < sched->num_ready; i++) {
+                        pos = (sched->ready_head + i) % sched->ready_cap;
+                        if (sched->ready[pos] != conn)
+                                continue;
+
+                        /* Close the gap, keeping the others in order */
+                        for (; i + 1 < sched->num_ready; i++) {
+                                sched->ready[pos] = sched->ready[(pos + 1) %
+                                                             sched->ready_cap];
+                                pos = (pos + 1) % sched->ready_cap;
+                        }
+                        sched->num_ready--;
+                        break;
+                }
+        }
+        conn_set_sched_state(conn, CONN_SCHED_IDLE);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Moves a connection to another scheduler (say, another core's event loop),
+ * keeping its place: a connection with a turn coming gets one there, and a
+ * paused one stays paused. The connection's fd should be moved over to the
+ * other loop's poller too.
+ *
+ * NOTE: Both loops must be stopped (or this called from the one thread that
+ * runs them both) while this runs.
+ */
+void
+ws_sched_move(WebsocketScheduler *from, WebsocketScheduler *to,
+                                                        WebsocketConn *conn)
+{
+        int state = conn_sched_state(conn);
+
+        ws_sched_remove(from, conn);
+        if (state == CONN_SCHED_READY)
+                push_ready(to, conn);
+        else if (state == CONN_SCHED_PAUSED)
+                add_paused(to, conn);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns how many ns a scheduler has spent in ws_sched_run giving turns.
+ * Sampled now and then, the increase is a shard's load.
+ */
+uint64_t
+ws_sched_busy_ns(const WebsocketScheduler *sched)
+{
+        return sched->busy_ns;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Decides whether connections should move between shards, given each one's
+ * load over the same stretch of time (from ws_sched_busy_ns, say). If the
+ * busiest is more than max_ratio times the average, connections should move
+ * from it to the least busy.
+ *
+ * Returns 1 (with the two shards) if so; 0 if the load is even enough.
+ */
+int
+ws_rebalance_pick(const uint64_t *loads, size_t num_shards, double max_ratio,
+                                                size_t *from_p, size_t *to_p)
+{
+        double total = 0;
+        size_t busiest = 0;
+        size_t idlest = 0;
+        size_t i;
+
+        if (num_shards < 2)
+                return 0;
+
+        for (i = 0; i < num_shards; i++) {
+                total += loads[i];
+                if (loads[i] > loads[busiest])
+                        busiest = i;
+                if (loads[i] < loads[idlest])
+                        idlest = i;
+        }
+
+        if (loads[busiest] == loads[idlest] ||
+                        loads[busiest] <= max_ratio * total / num_shards)
+                return 0;
+
+        *from_p = busiest;
+        *to_p = idlest;
+        return 1;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Gives every queued connection (and every paused one whose wait is over)
+ * one turn. Connections that used their whole budget go to the back of the
+ * queue for the next run; ones over a rate limit are paused; ones that read
+ * dry wait for ws_sched_ready.
+ *
+ * A connection that closes or fails is dropped from the scheduler after its
+ * handler has been told (with WS_FT_CLOSE, WS_FT_ERROR or WS_FT_TOO_BIG);
+ * the caller should free and close it once this returns.
+ *
+ * Returns 0 if connections are still queued (run again without waiting for
+ * events); otherwise how many ns until a paused connection may read again,
+ * or -1 if none is paused. Either makes a good poll timeout.
+ */
+int64_t
+ws_sched_run(WebsocketScheduler *sched, ws_read_bytes_fp read_bytes,
+                                    ws_message_handler_fp handler, void *arg)
+{
+        WebsocketConn *conn;
+        uint64_t wait_ns;
+        int64_t result = -1;
+        uint64_t start_ns;
+        size_t num_turns;
+        size_t i;
+
+        /* Paused connections that may read again take their turn too */
+        for (i = 0; i < sched->num_paused; ) {
+                conn = sched->paused[i];
+                if (ws_conn_pause_ns(conn) == 0) {
+                        sched->paused[i] = sched->paused[--sched->num_paused];
+                        push_ready(sched, conn);
+                }
+                else
+                        i++;
+        }
+
+        /* Only those queued now; anyone requeued waits for the next run */
+        start_ns = ws_now_ns();
+        num_turns = sched->num_ready;
+        while (num_turns-- > 0) {
+                conn = sched->ready[sched->ready_head];
+                sched->ready_head = (sched->ready_head + 1) % sched->ready_cap;
+                sched->num_ready--;
+                conn_set_sched_state(conn, CONN_SCHED_IDLE);
+
+                switch (ws_conn_read_budget(conn, read_bytes, handler, arg,
+                                        sched->max_frames, sched->max_bytes)) {
+                case WS_CONN_MORE:
+                        push_ready(sched, conn);
+                        break;
+                case WS_CONN_PAUSED:
+                        add_paused(sched, conn);
+                        break;
+                default:
+                        break;
+                }
+        }
+        sched->busy_ns += ws_now_ns() - start_ns;
+
+        if (sched->num_ready)
+                return 0;
+
+        for (i = 0; i < sched->num_paused; i++) {
+                wait_ns = ws_conn_pause_ns(sched->paused[i]);
+                if (wait_ns > INT64_MAX)
+                        wait_ns = INT64_MAX;
+                if (result < 0 || (int64_t)wait_ns < result)
+                        result = wait_ns;
+        }
+        return result;
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Adds a connection to the back of the ready ring, growing it if need be.
+ */
+static void
+push_ready(WebsocketScheduler *sched, WebsocketConn *conn)
+{
+        WebsocketConn **ready;
+        size_t cap;
+        size_t i;
+
+        if (sched->num_ready == sched->ready_cap) {
+                cap = sched->ready_cap ? sched->ready_cap * 2 :
+                                                        INITIAL_CAPACITY;
+                if ((ready = malloc(cap * sizeof(WebsocketConn *))) == NULL)
+                        mem_alloc_failure(__FILE__, __LINE__);
+                for (i = 0; i < sched->num_ready; i++)
+                        ready[i] = sched->ready[(sched->ready_head + i) %
+                                                             sched->ready_cap];
+                free(sched->ready);
+                sched->ready = ready;
+                sched->ready_cap = cap;
+                sched->ready_head = 0;
+        }
+
+        sched->ready[(sched->ready_head + sched->num_ready) %
+                                                     sched->ready_cap] = conn;
+        sched->num_ready++;
+        conn_set_sched_state(conn, CONN_SCHED_READY);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Adds a connection to the paused list, growing it if need be.
+ */
+static void
+add_paused(WebsocketScheduler *sched, WebsocketConn *conn)
+{
+        if (sched->num_paused == sched->paused_cap) {
+                sched->paused_cap = sched->paused_cap ?
+                                sched->paused_cap * 2 : INITIAL_CAPACITY;
+                sched->paused = realloc(sched->paused,
+                                sched->paused_cap * sizeof(WebsocketConn *));
+                if (sched->paused == NULL)
+                        mem_alloc_failure(__FILE__, __LINE__);
+        }
+
+        sched->paused[sched->num_paused++] = conn;
+        conn_set_sched_state(conn, CONN_SCHED_PAUSED);
+}
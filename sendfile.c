@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "constants.h"
+#include "metrics.h"
+#include "tls.h"
+#include "trace.h"
+#include "ws.h"
+
+/*==============================================================================
+ * Defines
+ */
+
+/* Largest chunk handed to sendfile/splice in one call */
+#define MAX_SEND_CHUNK (1 << 30)
+
+
+/*==============================================================================
+ * Static declarations
+ */
+
+static int send_header(int, const uint8_t *, size_t, int);
+static int send_payload(int, int, off_t *, uint64_t, int);
+static int wait_writable(int);
+
+
+/*==============================================================================
+ * Public API
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Sends len bytes of file_fd, starting at offset, to a connection as a binary
+ * message without copying the payload through user space.
+ *
+ * Only the frame headers are written from here; the payload goes from the
+ * page cache to the socket with sendfile. If file_fd is a pipe, splice is used
+ * instead. When max_frame_len is non-zero, the message is fragmented into
+ * frames of at most that many payload bytes.
+ *
+ * Returns 0 on success; -1 if something went wrong, in which case part of the
+ * message may have been sent and the connection should be closed.
+ *
+ * NOTE: Frames are sent unmasked, so this is for the server side only.
+ *
+ * NOTE: file_fd's own file offset isn't used or changed (unless it's a pipe).
+ *
+ * NOTE: On a TLS connection this only works once the kernel is doing the
+ * encryption (see ws_tls_ktls_send); otherwise it fails without sending.
+ */
+int
+ws_send_file(int fd, int file_fd, off_t offset, uint64_t len,
+                                                       uint64_t max_frame_len)
+{
+        uint8_t header[WS_MAX_FRAME_HEADER_LEN];
+        size_t header_len;
+        uint64_t frame_len;
+        uint8_t byte0;
+        int is_pipe;
+
+        if (!tls_direct_write_ok(fd)) {
+                syslog(LOG_ERR, "Can't send a file over TLS without kTLS");
+                errno = EPROTONOSUPPORT;
+                return -1;
+        }
+
+        is_pipe = (lseek(file_fd, 0, SEEK_CUR) < 0 && errno == ESPIPE);
+
+        byte0 = WS_FRAME_OP_BIN;
+        do {
+                frame_len = len;
+                if (max_frame_len && frame_len > max_frame_len)
+                        frame_len = max_frame_len;
+                if (frame_len == len)
+                        byte0 |= WS_FRAME_FIN;
+
+                header_len = ws_make_frame_header(byte0, frame_len, NULL,
+                                                                       header);
+                WS_METRIC_ADD(frames_out[byte0 & 0x0f], 1);
+                WS_TRACE(WS_EV_FRAME_QUEUED, frame_queued, fd, byte0 & 0x0f,
+                                                     header_len + frame_len);
+
+                if (send_header(fd, header, header_len, frame_len > 0) != 0 ||
+                    send_payload(fd, file_fd, &offset, frame_len, is_pipe) != 0)
+                        return -1;
+
+                WS_METRIC_ADD(bytes_out, header_len + frame_len);
+                WS_TRACE(WS_EV_WRITE_COMPLETE, write_complete, fd,
+                                byte0 & 0x0f, header_len + frame_len);
+
+                len -= frame_len;
+                byte0 = WS_FRAME_OP_CONT;
+        } while (len > 0);
+
+        return 0;
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Writes a frame header. If a payload follows, the kernel is told more is
+ * coming so the header doesn't go out in a packet of its own.
+ */
+static int
+send_header(int fd, const uint8_t *header, size_t len, int more)
+{
+        ssize_t num_written;
+
+        while (len > 0) {
+                num_written = send(fd, header, len,
+                                        MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+                if (num_written < 0 && errno == ENOTSOCK)
+                        num_written = write(fd, header, len);
+
+                if (num_written < 0 && errno == EINTR)
+                        continue;
+                if (num_written < 0 && errno == EAGAIN) {
+                        if (wait_writable(fd) != 0)
+                                return -1;
+                        continue;
+                }
+                if (num_written <= 0) {
+                        syslog(LOG_ERR, "Couldn't send frame header: %s",
+                                                             strerror(errno));
+                        return -1;
+                }
+
+                header += num_written;
+                len -= num_written;
+        }
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Moves len bytes from file_fd to fd inside the kernel.
+ */
+static int
+send_payload(int fd, int file_fd, off_t *offset, uint64_t len, int is_pipe)
+{
+        ssize_t num_sent;
+        size_t chunk_len;
+
+        while (len > 0) {
+                chunk_len = len > MAX_SEND_CHUNK ? MAX_SEND_CHUNK : len;
+                if (is_pipe)
+                        num_sent = splice(file_fd, NULL, fd, NULL, chunk_len,
+                                                 SPLICE_F_MORE | SPLICE_F_MOVE);
+                else
+                        num_sent = sendfile(fd, file_fd, offset, chunk_len);
+
+                if (num_sent < 0 && errno == EINTR)
+                        continue;
+                if (num_sent < 0 && errno == EAGAIN) {
+                        if (wait_writable(fd) != 0)
+                                return -1;
+                        continue;
+                }
+                if (num_sent <= 0) {
+                        /* 0 means the file is shorter than promised */
+                        syslog(LOG_ERR, "Couldn't send file payload: %s",
+                                       num_sent ? strerror(errno) : "short file");
+                        return -1;
+                }
+
+                len -= num_sent;
+        }
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Waits for a non-blocking connection to drain. A frame can't be abandoned
+ * halfway through, so this blocks.
+ */
+static int
+wait_writable(int fd)
+{
+        struct pollfd pfd;
+
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        while (poll(&pfd, 1, -1) < 0)
+                if (errno != EINTR)
+                        return -1;
+
+        return (pfd.revents & (POLLERR | POLLHUP)) ? -1 : 0;
+}
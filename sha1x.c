@@ -0,0 +1,182 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "sha1x.h"
+
+/*==============================================================================
+ * Defines
+ */
+
+#define BLOCK_LEN 64
+
+/* Bytes a message can have and still be padded into two blocks */
+#define MAX_ONE_BLOCK 55
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+
+/*==============================================================================
+ * Static declarations
+ */
+
+/*
+ * One 32-bit word from each lane. With GCC's vector extensions the compiler
+ * picks the instructions (two SSE2 registers, or one AVX2 register when built
+ * for it), so this stays portable C.
+ */
+typedef uint32_t Lanes __attribute__((vector_size(4 * SHA1X_LANES)));
+
+static void compress(Lanes *, const uint8_t (*)[2 * BLOCK_LEN], int);
+static void load_word(Lanes *, const uint8_t (*)[2 * BLOCK_LEN], size_t);
+static void pad(uint8_t *, const uint8_t *, size_t);
+
+
+/*==============================================================================
+ * Library functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Computes the SHA-1 digests of up to SHA1X_LANES messages of at most
+ * SHA1X_MAX_LEN bytes each, all at once: each step of the hash is done for
+ * every message with one vector instruction.
+ */
+void
+sha1x(const uint8_t *const *msgs, const size_t *lens, size_t num,
+                                        uint8_t (*digests)[SHA1_DIGEST_LEN])
+{
+        uint8_t blocks[SHA1X_LANES][2 * BLOCK_LEN];
+        Lanes state[5];
+        Lanes saved[5];
+        Lanes two_blocks;
+        int any_two = 0;
+        size_t i;
+        int j;
+
+        memset(blocks, 0, sizeof(blocks));
+        for (i = 0; i < num; i++)
+                pad(blocks[i], msgs[i], lens[i]);
+
+        for (i = 0; i < SHA1X_LANES; i++) {
+                state[0][i] = 0x67452301;
+                state[1][i] = 0xefcdab89;
+                state[2][i] = 0x98badcfe;
+                state[3][i] = 0x10325476;
+                state[4][i] = 0xc3d2e1f0;
+                two_blocks[i] = (i < num && lens[i] > MAX_ONE_BLOCK) ? ~0u : 0;
+                any_two |= two_blocks[i] != 0;
+        }
+
+        compress(state, blocks, 0);
+
+        /* Short messages keep their state from the first block */
+        if (any_two) {
+                memcpy(saved, state, sizeof(state));
+                compress(state, blocks, 1);
+                for (j = 0; j < 5; j++)
+                        state[j] = (state[j] & two_blocks) |
+                                                   (saved[j] & ~two_blocks);
+        }
+
+        for (i = 0; i < num; i++) {
+                for (j = 0; j < 5; j++) {
+                        digests[i][4 * j] = state[j][i] >> 24;
+                        digests[i][4 * j + 1] = state[j][i] >> 16;
+                        digests[i][4 * j + 2] = state[j][i] >> 8;
+                        digests[i][4 * j + 3] = state[j][i];
+                }
+        }
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Pads a message (FIPS 180-4, 5.1.1) into two blocks' worth of zeroed space.
+ */
+static void
+pad(uint8_t *block, const uint8_t *msg, size_t len)
+{
+        uint64_t bits = (uint64_t)len * 8;
+        size_t end = len > MAX_ONE_BLOCK ? 2 * BLOCK_LEN : BLOCK_LEN;
+        int i;
+
+        memcpy(block, msg, len);
+        block[len] = 0x80;
+        for (i = 0; i < 8; i++)
+                block[end - 1 - i] = bits >> (8 * i);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Loads big-endian word w of every lane's padded message.
+ */
+static void
+load_word(Lanes *result, const uint8_t (*blocks)[2 * BLOCK_LEN], size_t w)
+{
+        size_t i;
+
+        for (i = 0; i < SHA1X_LANES; i++)
+                (*result)[i] = (uint32_t)blocks[i][4 * w] << 24 |
+                            (uint32_t)blocks[i][4 * w + 1] << 16 |
+                            (uint32_t)blocks[i][4 * w + 2] << 8 |
+                            (uint32_t)blocks[i][4 * w + 3];
+}
+
+
+/*------------------------------------------------------------------------------
+ * Runs the 80 rounds over block "which" (0 or 1) of every lane.
+ */
+static void
+compress(Lanes *state, const uint8_t (*blocks)[2 * BLOCK_LEN], int which)
+{
+        Lanes w[16];
+        Lanes a = state[0], b = state[1], c = state[2], d = state[3];
+        Lanes e = state[4];
+        Lanes f, k, temp;
+        int t;
+
+        for (t = 0; t < 16; t++)
+                load_word(&w[t], blocks, which * 16 + t);
+
+        for (t = 0; t < 80; t++) {
+                if (t >= 16) {
+                        temp = w[(t - 3) & 15] ^ w[(t - 8) & 15] ^
+                               w[(t - 14) & 15] ^ w[t & 15];
+                        w[t & 15] = ROTL(temp, 1);
+                }
+
+                if (t < 20) {
+                        f = (b & c) | (~b & d);
+                        k = (Lanes){} + 0x5a827999;
+                }
+                else if (t < 40) {
+                        f = b ^ c ^ d;
+                        k = (Lanes){} + 0x6ed9eba1;
+                }
+                else if (t < 60) {
+                        f = (b & c) | (b & d) | (c & d);
+                        k = (Lanes){} + 0x8f1bbcdc;
+                }
+                else {
+                        f = b ^ c ^ d;
+                        k = (Lanes){} + 0xca62c1d6;
+                }
+
+                temp = ROTL(a, 5) + f + e + k + w[t & 15];
+                e = d;
+                d = c;
+                c = ROTL(b, 30);
+                b = a;
+                a = temp;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+}
@@ -0,0 +1,19 @@
+#ifndef SHA1X_H
+#define SHA1X_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Multi-buffer SHA-1 for short messages (a websocket key and the magic
+ * string fit easily).
+ */
+
+#define SHA1X_LANES 8
+#define SHA1X_MAX_LEN 119       /* Fits in two blocks once padded */
+#define SHA1_DIGEST_LEN 20
+
+void sha1x(const uint8_t *const *msgs, const size_t *lens, size_t num,
+                                        uint8_t (*digests)[SHA1_DIGEST_LEN]);
+
+#endif
@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "errors.h"
+#include "ws.h"
+
+/*==============================================================================
+ * Defines
+ */
+
+#define RING_MIN_CAPACITY 4096
+#define RECORD_HDR_LEN sizeof(RingRecord)
+#define RECORD_ALIGN 16
+
+/* Record type meaning "the rest of the ring is unused; wrap to the start" */
+#define RECORD_PAD 0x7fffffffu
+
+#define CACHE_LINE 64
+
+
+/*==============================================================================
+ * Static declarations
+ */
+
+/*
+ * The part of the ring both processes see. The producer only writes head and
+ * the consumer only writes tail, so each sits on its own cache line. Both
+ * count bytes ever written/consumed; the offset in the ring is count & mask.
+ */
+typedef struct RingShared_ {
+        uint64_t head __attribute__((aligned(CACHE_LINE)));
+        uint32_t wake_seq;      /* Futex word, bumped to wake the consumer */
+        uint32_t sleeping;      /* The consumer is (about to be) waiting */
+        uint64_t tail __attribute__((aligned(CACHE_LINE)));
+} RingShared;
+
+/*
+ * Each message is prefixed by a record header, and followed by a NUL.
+ * Records are RECORD_ALIGN aligned, so there's always room for a header
+ * before the end of the ring.
+ */
+typedef struct RingRecord_ {
+        uint32_t len;           /* Payload bytes (the whole gap for a pad) */
+        uint32_t type;          /* enum WebsocketFrameType, or RECORD_PAD */
+        uint64_t conn_id;
+} RingRecord;
+
+/*
+ * Each process has its own copy of this (made before fork, or after by
+ * whoever maps the ring), so the cached counts are private to each end.
+ */
+struct WebsocketRing_ {
+        RingShared *shared;
+        uint8_t *data;
+        uint64_t capacity;
+        uint64_t mask;
+        size_t map_len;
+
+        uint64_t cached_tail;   /* Producer's last look at tail */
+        uint64_t cached_head;   /* Consumer's last look at head */
+        uint64_t next_tail;     /* Where the peeked record ends */
+};
+
+static int futex(uint32_t *, int, uint32_t, const struct timespec *);
+static uint64_t record_len(size_t);
+
+
+/*==============================================================================
+ * Public API
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Creates a single-producer/single-consumer ring of messages in shared memory,
+ * with room for about "capacity" bytes. It's meant to be made before fork, so
+ * the front process that terminates websockets and a worker process each get
+ * an end; use one ring for each direction.
+ *
+ * Messages are copied in once by ws_ring_push, then read in place by the
+ * other process with ws_ring_peek and ws_ring_release. No locks or syscalls
+ * are needed unless the consumer is asleep in ws_ring_wait.
+ *
+ * NOTE: The caller must free this with ws_ring_free (in each process).
+ *
+ * Returns NULL if the shared memory can't be mapped.
+ */
+WebsocketRing *
+ws_ring_new(size_t capacity)
+{
+        WebsocketRing *result;
+        uint64_t ring_capacity = RING_MIN_CAPACITY;
+        size_t header_len;
+        uint8_t *storage;
+
+        while (ring_capacity < capacity)
+                ring_capacity <<= 1;
+
+        header_len = sysconf(_SC_PAGESIZE);
+        if (header_len < sizeof(RingShared))
+                header_len = sizeof(RingShared);
+
+        storage = mmap(NULL, header_len + ring_capacity,
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                                                                    -1, 0);
+        if (storage == MAP_FAILED)
+                return NULL;
+
+        if ((result = calloc(1, sizeof(WebsocketRing))) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+
+        result->shared = (RingShared *)storage;
+        result->data = storage + header_len;
+        result->capacity = ring_capacity;
+        result->mask = ring_capacity - 1;
+        result->map_len = header_len + ring_capacity;
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Unmaps this process's end of a ring. The memory goes away once every
+ * process has let go of it.
+ */
+void
+ws_ring_free(WebsocketRing *ring)
+{
+        if (ring == NULL)
+                return;
+
+        munmap(ring->shared, ring->map_len);
+        free(ring);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Copies a message into the ring, tagged with the connection it came from
+ * (or is going to) and its type. Only one process may push to a ring.
+ *
+ * Returns 0 on success; -1 with errno EAGAIN if the ring is too full for now,
+ * or EMSGSIZE if the message could never fit (more than half the ring).
+ */
+int
+ws_ring_push(WebsocketRing *ring, uint64_t conn_id,
+             enum WebsocketFrameType type, const char *message, size_t len)
+{
+        RingShared *shared = ring->shared;
+        RingRecord *record;
+        uint64_t head;
+        uint64_t need;
+        uint64_t total;
+        uint64_t to_end;
+
+        if (len > UINT32_MAX - RECORD_ALIGN ||
+                        (need = record_len(len)) > ring->capacity / 2) {
+                errno = EMSGSIZE;
+                return -1;
+        }
+
+        head = shared->head;
+        to_end = ring->capacity - (head & ring->mask);
+        total = to_end < need ? to_end + need : need;
+
+        if (head + total - ring->cached_tail > ring->capacity) {
+                ring->cached_tail = __atomic_load_n(&shared->tail,
+                                                        __ATOMIC_ACQUIRE);
+                if (head + total - ring->cached_tail > ring->capacity) {
+                        errno = EAGAIN;
+                        return -1;
+                }
+        }
+
+        if (to_end < need) {
+                record = (RingRecord *)(ring->data + (head & ring->mask));
+                record->len = to_end;
+                record->type = RECORD_PAD;
+                head += to_end;
+        }
+
+        record = (RingRecord *)(ring->data + (head & ring->mask));
+        record->len = len;
+        record->type = type;
+        record->conn_id = conn_id;
+        memcpy(record + 1, message, len);
+        ((char *)(record + 1))[len] = '\0';
+
+        /* Publish, then wake the consumer if it's gone to sleep */
+        __atomic_store_n(&shared->head, head + need, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&shared->sleeping, __ATOMIC_SEQ_CST)) {
+                __atomic_add_fetch(&shared->wake_seq, 1, __ATOMIC_SEQ_CST);
+                futex(&shared->wake_seq, FUTEX_WAKE, 1, NULL);
+        }
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Looks at the oldest message in the ring without taking it out. The message
+ * (NUL terminated) stays where it is in shared memory until ws_ring_release
+ * is called. Only one process may read from a ring.
+ *
+ * Returns 1 if there's a message; 0 if the ring is empty.
+ */
+int
+ws_ring_peek(WebsocketRing *ring, WebsocketRingMessage *msg)
+{
+        RingShared *shared = ring->shared;
+        RingRecord *record;
+        uint64_t tail = shared->tail;
+
+        while (1) {
+                if (tail == ring->cached_head) {
+                        ring->cached_head = __atomic_load_n(&shared->head,
+                                                        __ATOMIC_ACQUIRE);
+                        if (tail == ring->cached_head)
+                                return 0;
+                }
+
+                record = (RingRecord *)(ring->data + (tail & ring->mask));
+                if (record->type != RECORD_PAD)
+                        break;
+
+                tail += record->len;
+                __atomic_store_n(&shared->tail, tail, __ATOMIC_RELEASE);
+        }
+
+        msg->conn_id = record->conn_id;
+        msg->type = record->type;
+        msg->data = (const char *)(record + 1);
+        msg->len = record->len;
+        ring->next_tail = tail + record_len(record->len);
+        return 1;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Takes the message last returned by ws_ring_peek out of the ring, giving its
+ * space back to the producer.
+ */
+void
+ws_ring_release(WebsocketRing *ring)
+{
+        __atomic_store_n(&ring->shared->tail, ring->next_tail,
+                                                        __ATOMIC_RELEASE);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Waits up to timeout_ms milliseconds (-1 for no limit) for a message to
+ * arrive. Only the consumer may wait.
+ *
+ * Returns 1 if there's a message; 0 if the time ran out first.
+ */
+int
+ws_ring_wait(WebsocketRing *ring, int timeout_ms)
+{
+        RingShared *shared = ring->shared;
+        struct timespec ts;
+        uint32_t seq;
+
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+        /*
+         * The sleeping flag goes up before the last look at head; the
+         * producer bumps wake_seq after storing head. Either we see the new
+         * message, or the futex sees wake_seq change and doesn't sleep.
+         */
+        __atomic_store_n(&shared->sleeping, 1, __ATOMIC_SEQ_CST);
+        seq = __atomic_load_n(&shared->wake_seq, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&shared->head, __ATOMIC_SEQ_CST) == shared->tail)
+                futex(&shared->wake_seq, FUTEX_WAIT, seq,
+                                                timeout_ms < 0 ? NULL : &ts);
+        __atomic_store_n(&shared->sleeping, 0, __ATOMIC_SEQ_CST);
+
+        return __atomic_load_n(&shared->head, __ATOMIC_ACQUIRE) != shared->tail;
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Space a record takes for a message of "len" bytes.
+ */
+static uint64_t
+record_len(size_t len)
+{
+        return (RECORD_HDR_LEN + len + 1 + RECORD_ALIGN - 1) &
+                                                ~(uint64_t)(RECORD_ALIGN - 1);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Shared (not process private) futex wait and wake; the ring is in memory
+ * mapped by several processes.
+ */
+static int
+futex(uint32_t *addr, int op, uint32_t val, const struct timespec *timeout)
+{
+        return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
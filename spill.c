@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "errors.h"
+#include "limits.h"
+#include "metrics.h"
+#include "spill.h"
+#include "ws.h"
+
+/*==============================================================================
+ * Static declarations
+ */
+
+typedef struct SpilledMessage_ {
+        struct SpilledMessage_ *next;
+        char *message;
+        size_t map_len;
+} SpilledMessage;
+
+static size_t spill_threshold = 0;
+static char spill_dir[PATH_MAX] = "/tmp";
+
+static pthread_mutex_t spill_lock = PTHREAD_MUTEX_INITIALIZER;
+static SpilledMessage *spilled = NULL;
+static unsigned long num_spilled = 0;
+
+static int open_spill_file();
+static int start_spill(MessageSink *);
+static int write_all(int, const uint8_t *, size_t);
+
+
+/*==============================================================================
+ * Public API
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Sets the size above which ws_read_next_message builds a message in an
+ * unlinked temp file under "dir" (NULL keeps the current directory, which
+ * starts out as /tmp) instead of on the heap. A threshold of 0, the default,
+ * keeps every message on the heap.
+ *
+ * NOTE: Once this is turned on, messages must be released with
+ * ws_free_message rather than free.
+ */
+void
+ws_set_spill_threshold(size_t threshold, const char *dir)
+{
+        pthread_mutex_lock(&spill_lock);
+        if (dir != NULL)
+                snprintf(spill_dir, sizeof(spill_dir), "%s", dir);
+        __atomic_store_n(&spill_threshold, threshold, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&spill_lock);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Releases a message returned by ws_read_next_message, whether it lives on
+ * the heap or was spilled to a file.
+ */
+void
+ws_free_message(char *message)
+{
+        SpilledMessage *entry;
+        SpilledMessage **link;
+
+        if (message == NULL)
+                return;
+
+        if (__atomic_load_n(&num_spilled, __ATOMIC_ACQUIRE) == 0) {
+                free(message);
+                return;
+        }
+
+        pthread_mutex_lock(&spill_lock);
+        for (link = &spilled; (entry = *link) != NULL; link = &entry->next)
+                if (entry->message == message)
+                        break;
+
+        if (entry != NULL) {
+                *link = entry->next;
+                __atomic_fetch_sub(&num_spilled, 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&spill_lock);
+
+        if (entry == NULL) {
+                free(message);
+                return;
+        }
+
+        munmap(entry->message, entry->map_len);
+        free(entry);
+}
+
+
+/*==============================================================================
+ * Library functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Sets up an empty sink.
+ */
+void
+message_sink_init(MessageSink *sink)
+{
+        sink->buf = NULL;
+        sink->len = 0;
+        sink->cap = 0;
+        sink->charged = 0;
+        sink->spill_fd = -1;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Makes room for n more bytes.
+ *
+ * Sets *dst_p to where to put them, or to NULL if the sink is spilled to a
+ * file, in which case the caller should hand the bytes to message_sink_commit
+ * from a buffer of its own.
+ *
+ * Returns 0 on success; -1 if growing the buffer would go over a buffering
+ * limit (see ws_set_limits and ws_set_memory_budget), or if the message's
+ * length would no longer fit in 64 bits.
+ */
+int
+message_sink_reserve(MessageSink *sink, uint64_t n, uint8_t **dst_p)
+{
+        uint64_t cap;
+        size_t threshold;
+
+        *dst_p = NULL;
+        if (n > UINT64_MAX - sink->len - 1)
+                return -1;
+        if (sink->spill_fd >= 0)
+                return 0;
+
+        threshold = __atomic_load_n(&spill_threshold, __ATOMIC_ACQUIRE);
+        if (threshold && sink->len + n > threshold && start_spill(sink) == 0)
+                return 0;
+
+        /* Leave room for the NUL */
+        if (sink->len + n + 1 > sink->cap) {
+                cap = sink->len + n + 1;
+                if (sink->cap && cap < 2 * sink->cap)
+                        cap = 2 * sink->cap;
+
+                /* Don't let doubling alone push us over a limit */
+                if (limits_charge(&sink->charged, cap - sink->cap) != 0) {
+                        cap = sink->len + n + 1;
+                        if (limits_charge(&sink->charged,
+                                                     cap - sink->cap) != 0)
+                                return -1;
+                }
+
+                if ((sink->buf = realloc(sink->buf, cap)) == NULL)
+                        mem_alloc_failure(__FILE__, __LINE__);
+                WS_METRIC_ADD(allocs, 1);
+                WS_METRIC_ADD(alloc_bytes, cap);
+                sink->cap = cap;
+        }
+
+        *dst_p = sink->buf + sink->len;
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Adds n bytes to the message. For a heap sink, src must be the pointer
+ * message_sink_reserve returned (the bytes are already in place).
+ *
+ * Returns 0 on success; -1 if writing to the spill file failed.
+ */
+int
+message_sink_commit(MessageSink *sink, const uint8_t *src, size_t n)
+{
+        if (sink->spill_fd >= 0 && write_all(sink->spill_fd, src, n) != 0)
+                return -1;
+
+        sink->len += n;
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns the collected message as a NUL terminated string.
+ *
+ * Returns NULL if a spilled message couldn't be mapped.
+ */
+char *
+message_sink_finish(MessageSink *sink)
+{
+        SpilledMessage *entry;
+        char *result;
+
+        /*
+         * The NUL always has room (see message_sink_reserve). The caller owns
+         * the message from here on, so it no longer counts as buffered.
+         */
+        if (sink->spill_fd < 0) {
+                sink->buf[sink->len] = '\0';
+                result = (char *)sink->buf;
+                sink->buf = NULL;
+                sink->cap = 0;
+                limits_release(&sink->charged);
+                return result;
+        }
+
+        /* Growing the file by one byte gives us the NUL for free */
+        result = NULL;
+        if (ftruncate(sink->spill_fd, sink->len + 1) == 0)
+                result = mmap(NULL, sink->len + 1, PROT_READ | PROT_WRITE,
+                                                 MAP_SHARED, sink->spill_fd, 0);
+        close(sink->spill_fd);
+        sink->spill_fd = -1;
+
+        if (result == NULL || result == MAP_FAILED) {
+                syslog(LOG_ERR, "Couldn't map spilled websocket message: %s",
+                                                             strerror(errno));
+                return NULL;
+        }
+
+        if ((entry = malloc(sizeof(SpilledMessage))) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+        entry->message = result;
+        entry->map_len = sink->len + 1;
+
+        pthread_mutex_lock(&spill_lock);
+        entry->next = spilled;
+        spilled = entry;
+        __atomic_fetch_add(&num_spilled, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&spill_lock);
+
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Throws away whatever has been collected.
+ */
+void
+message_sink_discard(MessageSink *sink)
+{
+        free(sink->buf);
+        sink->buf = NULL;
+        sink->cap = 0;
+        limits_release(&sink->charged);
+
+        if (sink->spill_fd >= 0)
+                close(sink->spill_fd);
+        sink->spill_fd = -1;
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Opens an anonymous temp file in the spill directory.
+ */
+static int
+open_spill_file()
+{
+        char path[PATH_MAX];
+        int fd;
+
+        pthread_mutex_lock(&spill_lock);
+        snprintf(path, sizeof(path), "%s", spill_dir);
+        pthread_mutex_unlock(&spill_lock);
+
+        if ((fd = open(path, O_TMPFILE | O_RDWR, 0600)) >= 0)
+                return fd;
+
+        /* Not every filesystem has O_TMPFILE */
+        strncat(path, "/ws-spill-XXXXXX", sizeof(path) - strlen(path) - 1);
+        if ((fd = mkstemp(path)) >= 0)
+                unlink(path);
+
+        return fd;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Moves what's been collected so far into a temp file.
+ *
+ * Returns 0 on success; -1 if there's no file to spill to, in which case the
+ * message just stays on the heap.
+ */
+static int
+start_spill(MessageSink *sink)
+{
+        int fd;
+
+        if ((fd = open_spill_file()) < 0) {
+                syslog(LOG_ERR, "Couldn't create websocket spill file: %s",
+                                                             strerror(errno));
+                return -1;
+        }
+
+        if (write_all(fd, sink->buf, sink->len) != 0) {
+                close(fd);
+                return -1;
+        }
+
+        free(sink->buf);
+        sink->buf = NULL;
+        sink->cap = 0;
+        limits_release(&sink->charged);
+        sink->spill_fd = fd;
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Writes all n bytes to fd.
+ */
+static int
+write_all(int fd, const uint8_t *ptr, size_t n)
+{
+        ssize_t num_written;
+
+        while (n > 0) {
+                if ((num_written = write(fd, ptr, n)) < 0 && errno == EINTR)
+                        continue;
+                if (num_written <= 0)
+                        return -1;
+
+                ptr += num_written;
+                n -= num_written;
+        }
+        return 0;
+}
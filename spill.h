@@ -0,0 +1,31 @@
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <stdint.h>
+
+#include <sys/types.h>
+
+/*
+ * A message sink collects the payload of a message as it's read. Small
+ * messages are built on the heap. Once a message grows past the spill
+ * threshold (see ws_set_spill_threshold), it moves to an unlinked temp file
+ * and is handed back as a memory-mapped region.
+ *
+ * Heap bytes are charged against the buffering limits (see limits.c) as the
+ * buffer grows, and given back once the message is handed over or dropped.
+ */
+typedef struct MessageSink_ {
+        uint8_t *buf;
+        uint64_t len;
+        uint64_t cap;
+        uint64_t charged;       /* Bytes charged against the limits */
+        int spill_fd;
+} MessageSink;
+
+void message_sink_init(MessageSink *sink);
+int message_sink_reserve(MessageSink *sink, uint64_t n, uint8_t **dst_p);
+int message_sink_commit(MessageSink *sink, const uint8_t *src, size_t n);
+char *message_sink_finish(MessageSink *sink);
+void message_sink_discard(MessageSink *sink);
+
+#endif
@@ -0,0 +1,260 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+#define MAX_FD 64
+#define CLOSED_FD 13
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static uint8_t hello_message_frame[] = {0x81, 0x05,
+                                        0x48, 0x65, 0x6c, 0x6c, 0x6f};
+
+static size_t bytes_written[MAX_FD];
+static int frames_ok;
+
+/*
+ * Pretends to write to fd. Writes to CLOSED_FD fail like a closed socket.
+ */
+static ssize_t write_bytes(int fd, const void *ptr, size_t len)
+{
+        if (fd == CLOSED_FD) {
+                errno = EPIPE;
+                return -1;
+        }
+
+        if (len != sizeof(hello_message_frame) ||
+            !check_frame(hello_message_frame, len, ptr))
+                frames_ok = 0;
+
+        bytes_written[fd] += len;
+        return len;
+}
+
+static ssize_t null_write_bytes(int fd, const void *ptr, size_t len)
+{
+        return len;
+}
+
+static ssize_t socket_write(int fd, const void *ptr, size_t len)
+{
+        return write(fd, ptr, len);
+}
+
+/* Notes, and closes, a subscriber the channels gave up on */
+static void note_drop(int fd, void *arg)
+{
+        *(int *)arg = fd;
+        close(fd);
+}
+
+static void *churn_subscribers(void *arg)
+{
+        int i;
+        WebsocketChannels *channels = arg;
+
+        for (i = 0; i < 2000; i++) {
+                ws_channel_subscribe(channels, "meeting", 100 + i % 50);
+                ws_channel_unsubscribe(channels, "meeting", 100 + (i+25) % 50);
+        }
+        return NULL;
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        int i;
+        WebsocketChannels *channels;
+        pthread_t churn_thread;
+        char big[100000];
+        char buf[4096];
+        uint8_t *got;
+        uint8_t *want;
+        uint8_t *frame;
+        size_t got_len;
+        size_t want_len;
+        size_t frame_len;
+        size_t filled;
+        ssize_t n;
+        int sock[2];
+        int flushed;
+        int dropped_fd;
+        char *huge;
+
+        START_SET("Subscribe and unsubscribe");
+        channels = ws_channels_new();
+
+        pass(0 == ws_channel_num_subscribers(channels, "meeting"),
+                                                  "Unknown channel is empty");
+        pass(0 == ws_channel_subscribe(channels, "meeting", 5), "Subscribe 5");
+        pass(0 == ws_channel_subscribe(channels, "meeting", 6), "Subscribe 6");
+        pass(1 == ws_channel_subscribe(channels, "meeting", 6),
+                                                   "Subscribe 6 again is noop");
+        pass(0 == ws_channel_subscribe(channels, "hub", 6), "Subscribe to hub");
+        pass(2 == ws_channel_num_subscribers(channels, "meeting"),
+                                                   "Meeting has 2 subscribers");
+
+        pass(0 == ws_channel_unsubscribe(channels, "meeting", 5),
+                                                                "Unsubscribe");
+        pass(-1 == ws_channel_unsubscribe(channels, "meeting", 5),
+                                                         "Unsubscribe again");
+        pass(1 == ws_channel_num_subscribers(channels, "meeting"),
+                                                    "Meeting has 1 subscriber");
+
+        ws_channels_drop_connection(channels, 6);
+        pass(0 == ws_channel_num_subscribers(channels, "meeting"),
+                                               "Dropped from meeting channel");
+        pass(0 == ws_channel_num_subscribers(channels, "hub"),
+                                                   "Dropped from hub channel");
+
+        ws_channels_free(channels);
+        END_SET("Subscribe and unsubscribe");
+
+
+        START_SET("Publish");
+        channels = ws_channels_new();
+        frames_ok = 1;
+        memset(bytes_written, 0, sizeof(bytes_written));
+
+        ws_channel_subscribe(channels, "meeting", 5);
+        ws_channel_subscribe(channels, "meeting", 6);
+        ws_channel_subscribe(channels, "meeting", CLOSED_FD);
+        ws_channel_subscribe(channels, "hub", 7);
+        ws_channel_subscribe(channels, "hub", CLOSED_FD);
+
+        pass(2 == ws_channel_publish(channels, "meeting", "Hello",
+                                   write_bytes), "Published to 2 subscribers");
+        pass(frames_ok, "Subscribers got hello frame");
+        pass(7 == bytes_written[5] && 7 == bytes_written[6],
+                                                   "Each got the frame once");
+        pass(0 == bytes_written[7], "Hub subscriber got nothing");
+        pass(1 == ws_channel_num_subscribers(channels, "hub"),
+                                         "Closed connection dropped from all");
+        pass(0 == ws_channel_publish(channels, "nobody", "Hello",
+                                   write_bytes), "Publish to unknown channel");
+
+        ws_channels_free(channels);
+        END_SET("Publish");
+
+
+        START_SET("Publish while subscribers churn");
+        channels = ws_channels_new();
+
+        for (i = 0; i < 25; i++)
+                ws_channel_subscribe(channels, "meeting", 100 + i);
+
+        pthread_create(&churn_thread, NULL, churn_subscribers, channels);
+        for (i = 0; i < 2000; i++)
+                ws_channel_publish(channels, "meeting", "Hello",
+                                                            null_write_bytes);
+        pthread_join(churn_thread, NULL);
+
+        pass(25 == ws_channel_num_subscribers(channels, "meeting"),
+                                            "Churn leaves 25 subscribers");
+
+        ws_channels_free(channels);
+        END_SET("Publish while subscribers churn");
+
+
+        START_SET("Publish to a full socket");
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock) != 0)
+                err(1, "Couldn't make sockets");
+        fcntl(sock[0], F_SETFL, O_NONBLOCK);
+        channels = ws_channels_new();
+        ws_channel_subscribe(channels, "meeting", sock[0]);
+
+        /* Fill the socket up first */
+        memset(buf, 'x', sizeof(buf));
+        filled = 0;
+        while ((n = write(sock[0], buf, sizeof(buf))) > 0)
+                filled += n;
+
+        memset(big, 'a', sizeof(big) - 1);
+        big[sizeof(big) - 1] = '\0';
+        pass(1 == ws_channel_publish(channels, "meeting", big, socket_write),
+                                                 "Frame kept for a full socket");
+        pass(1 == ws_channel_publish(channels, "meeting", "Hello",
+                                      socket_write), "Next frame kept behind it");
+        pass(1 == ws_channel_num_subscribers(channels, "meeting") &&
+             ws_channels_wants_write(channels, sock[0]),
+                                               "Still subscribed, with a backlog");
+
+        /* Drain the filler, then everything else as it's flushed */
+        want_len = ws_make_text_frame(big, NULL, &want);
+        frame_len = ws_make_text_frame("Hello", NULL, &frame);
+        want = realloc(want, want_len + frame_len);
+        memcpy(want + want_len, frame, frame_len);
+        want_len += frame_len;
+        free(frame);
+
+        got = malloc(filled + want_len);
+        got_len = 0;
+        flushed = 1;
+        while (got_len < filled + want_len) {
+                if (flushed == 1)
+                        flushed = ws_channels_flush(channels, sock[0],
+                                                                socket_write);
+                if ((n = read(sock[1], got + got_len, 4096)) <= 0)
+                        break;
+                got_len += n;
+        }
+        pass(0 == flushed && !ws_channels_wants_write(channels, sock[0]),
+                                                           "Backlog flushed");
+        pass(got_len >= want_len && 0 == memcmp(got + got_len - want_len,
+                                     want, want_len), "Frames arrived whole");
+        free(got);
+        free(want);
+
+        ws_channels_free(channels);
+        close(sock[0]);
+        close(sock[1]);
+        END_SET("Publish to a full socket");
+
+
+        START_SET("Subscriber too far behind");
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock) != 0)
+                err(1, "Couldn't make sockets");
+        fcntl(sock[0], F_SETFL, O_NONBLOCK);
+        channels = ws_channels_new();
+        dropped_fd = -1;
+        ws_channels_on_drop(channels, note_drop, &dropped_fd);
+        ws_channel_subscribe(channels, "meeting", sock[0]);
+
+        /* Nobody reads sock[1], so the backlog only grows */
+        huge = malloc(1024 * 1024 + 1);
+        memset(huge, 'a', 1024 * 1024);
+        huge[1024 * 1024] = '\0';
+        for (i = 0; i < 10 && dropped_fd < 0; i++)
+                ws_channel_publish(channels, "meeting", huge, socket_write);
+        pass(sock[0] == dropped_fd, "App told of the drop");
+        pass(0 == ws_channel_num_subscribers(channels, "meeting") &&
+             !ws_channels_wants_write(channels, sock[0]),
+                                       "Dropped, with its backlog");
+        pass(-1 == fcntl(sock[0], F_GETFD) && EBADF == errno,
+                                       "App closed the connection");
+        free(huge);
+
+        ws_channels_free(channels);
+        close(sock[1]);
+        END_SET("Subscriber too far behind");
+
+        return 0;
+}
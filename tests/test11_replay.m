@@ -0,0 +1,235 @@
+#include <err.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+#define BUF_LEN 1000
+#define NUM_RACED 2000
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static uint8_t one_frame[] = {0x81, 0x03, 'o', 'n', 'e'};
+static uint8_t two_frame[] = {0x81, 0x03, 't', 'w', 'o'};
+static uint8_t three_frame[] = {0x81, 0x05, 't', 'h', 'r', 'e', 'e'};
+
+static const char ring_file[] = "./replay-ring.tmp";
+
+static uint8_t written[BUF_LEN];
+static size_t num_written;
+
+/* Racing publishers: the seq each message got, and the order they arrived */
+static WebsocketChannels *raced_channels;
+static uint64_t raced_seqs[NUM_RACED];
+static int arrived[NUM_RACED];
+static int num_arrived;
+
+static ssize_t write_bytes(int fd, const void *ptr, size_t len)
+{
+        memcpy(written + num_written, ptr, len);
+        num_written += len;
+        return len;
+}
+
+/* Notes which messages frames (with short, unmasked headers) carry */
+static ssize_t note_arrival(int fd, const void *ptr, size_t len)
+{
+        const uint8_t *frame = ptr;
+        char message[16];
+        size_t n;
+
+        while (frame < (const uint8_t *)ptr + len) {
+                n = frame[1];
+                memcpy(message, frame + 2, n);
+                message[n] = '\0';
+                arrived[num_arrived++] = atoi(message);
+                frame += 2 + n;
+        }
+        return len;
+}
+
+static void *publish_half(void *arg)
+{
+        char message[16];
+        int i;
+
+        for (i = *(int *)arg; i < NUM_RACED; i += 2) {
+                snprintf(message, sizeof(message), "%d", i);
+                ws_channel_publish_seq(raced_channels, "meeting", message,
+                                                note_arrival, &raced_seqs[i]);
+        }
+        return NULL;
+}
+
+static void *publish_all(void *arg)
+{
+        char message[16];
+        int i;
+
+        for (i = 0; i < NUM_RACED; i++) {
+                snprintf(message, sizeof(message), "%d", i);
+                ws_channel_publish(raced_channels, "meeting", message,
+                                                                note_arrival);
+        }
+        return NULL;
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        int i;
+        int in_order;
+        int starts[2] = {0, 1};
+        pthread_t threads[2];
+        uint64_t seq;
+        WebsocketChannels *channels;
+
+        START_SET("Replay missed frames");
+        channels = ws_channels_new();
+
+        pass(-1 == ws_channel_replay(channels, "meeting", 0, 1, write_bytes),
+                                               "No replay without a ring");
+        pass(0 == ws_channel_enable_replay(channels, "meeting", 1024, NULL),
+                                                              "Enable replay");
+        pass(-1 == ws_channel_enable_replay(channels, "meeting", 1024, NULL),
+                                                        "Only enable once");
+        pass(0 == ws_channel_last_seq(channels, "meeting"), "Nothing yet");
+
+        ws_channel_publish(channels, "meeting", "one", write_bytes);
+        ws_channel_publish(channels, "meeting", "two", write_bytes);
+        ws_channel_publish(channels, "meeting", "three", write_bytes);
+        pass(3 == ws_channel_last_seq(channels, "meeting"), "Last seq is 3");
+
+        num_written = 0;
+        pass(2 == ws_channel_replay(channels, "meeting", 1, 1, write_bytes),
+                                                          "Replayed 2 frames");
+        pass(num_written == sizeof(two_frame) + sizeof(three_frame),
+                                                   "Replayed bytes");
+        pass(check_frame(two_frame, sizeof(two_frame), written),
+                                                          "First is two");
+        pass(check_frame(three_frame, sizeof(three_frame),
+                              written + sizeof(two_frame)), "Then three");
+
+        num_written = 0;
+        pass(0 == ws_channel_replay(channels, "meeting", 3, 1, write_bytes),
+                                                      "Nothing missed");
+        pass(0 == num_written, "Nothing written");
+
+        ws_channels_free(channels);
+        END_SET("Replay missed frames");
+
+
+        START_SET("Evict old frames");
+        channels = ws_channels_new();
+        ws_channel_enable_replay(channels, "meeting", 64, NULL);
+
+        for (i = 0; i < 20; i++)
+                ws_channel_publish(channels, "meeting", "two", write_bytes);
+        ws_channel_publish(channels, "meeting", "three", write_bytes);
+
+        pass(-1 == ws_channel_replay(channels, "meeting", 1, 1, write_bytes),
+                                                       "Seq 2 was evicted");
+
+        num_written = 0;
+        pass(2 == ws_channel_replay(channels, "meeting", 19, 1, write_bytes),
+                                                  "Recent frames still there");
+        pass(check_frame(three_frame, sizeof(three_frame),
+                              written + sizeof(two_frame)), "Ends with three");
+
+        ws_channels_free(channels);
+        END_SET("Evict old frames");
+
+
+        START_SET("File-backed ring");
+        unlink(ring_file);
+        channels = ws_channels_new();
+        pass(0 == ws_channel_enable_replay(channels, "meeting", 1024,
+                                          ring_file), "Enable file replay");
+        ws_channel_publish(channels, "meeting", "one", write_bytes);
+        ws_channels_free(channels);
+
+        channels = ws_channels_new();
+        ws_channel_enable_replay(channels, "meeting", 1024, ring_file);
+        pass(1 == ws_channel_last_seq(channels, "meeting"),
+                                                "Ring survives a restart");
+
+        num_written = 0;
+        pass(1 == ws_channel_replay(channels, "meeting", 0, 1, write_bytes),
+                                                    "Replay from the file");
+        pass(check_frame(one_frame, sizeof(one_frame), written), "Got one");
+
+        ws_channels_free(channels);
+        unlink(ring_file);
+        END_SET("File-backed ring");
+
+
+        START_SET("Sequence numbers of publishes");
+        channels = ws_channels_new();
+        ws_channel_publish_seq(channels, "meeting", "one", write_bytes, &seq);
+        pass(0 == seq, "No seq without a ring");
+
+        ws_channel_enable_replay(channels, "meeting", 1024 * 1024, NULL);
+        ws_channel_publish_seq(channels, "meeting", "one", write_bytes, &seq);
+        pass(1 == seq, "Publish gives its seq");
+
+        /* Subscribers see racing publishes in seq order */
+        raced_channels = channels;
+        ws_channel_subscribe(channels, "meeting", 7);
+        pthread_create(&threads[0], NULL, publish_half, &starts[0]);
+        pthread_create(&threads[1], NULL, publish_half, &starts[1]);
+        pthread_join(threads[0], NULL);
+        pthread_join(threads[1], NULL);
+
+        in_order = NUM_RACED == num_arrived;
+        for (i = 0; in_order && i < NUM_RACED; i++)
+                in_order = raced_seqs[arrived[i]] == (uint64_t)i + 2;
+        pass(in_order, "Frames arrive in seq order");
+
+        ws_channels_free(channels);
+        END_SET("Sequence numbers of publishes");
+
+
+        START_SET("Catch up and subscribe");
+        channels = ws_channels_new();
+        pass(-1 == ws_channel_subscribe_since(channels, "meeting", 7, 0,
+                                  note_arrival), "No catching up without a ring");
+        pass(0 == ws_channel_num_subscribers(channels, "meeting"),
+                                                      "Not subscribed then");
+
+        /* Join part way through a stream of publishes */
+        ws_channel_enable_replay(channels, "meeting", 1024 * 1024, NULL);
+        raced_channels = channels;
+        num_arrived = 0;
+        pthread_create(&threads[0], NULL, publish_all, NULL);
+        while (ws_channel_last_seq(channels, "meeting") < NUM_RACED / 2)
+                sched_yield();
+        pass(0 < ws_channel_subscribe_since(channels, "meeting", 7, 0,
+                                           note_arrival), "Caught up");
+        pthread_join(threads[0], NULL);
+
+        in_order = NUM_RACED == num_arrived;
+        for (i = 0; in_order && i < NUM_RACED; i++)
+                in_order = arrived[i] == i;
+        pass(in_order, "Every frame once, in order");
+
+        pass(-1 == ws_channel_subscribe_since(channels, "meeting", 7, 0,
+                                  note_arrival), "Only subscribe once");
+        ws_channels_free(channels);
+        END_SET("Catch up and subscribe");
+
+        return 0;
+}
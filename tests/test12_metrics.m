@@ -0,0 +1,125 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static uint8_t input_hello_frag_frame[] = {0x01, 0x03, 0x48, 0x65, 0x6c,
+                                           0x81, 0x02, 0x6c, 0x6f};
+
+/* Close frame with status 1001 (going away) */
+static uint8_t input_close_1001_frame[] = {0x88, 0x02, 0x03, 0xe9};
+
+/* Reserved opcode 0x3 */
+static uint8_t input_bad_frame[] = {0x83, 0x00};
+
+static uint8_t *source_bytes;
+
+static ssize_t read_bytes(int fd, char *ptr, size_t maxlen)
+{
+        int i;
+        for (i = 0; i < maxlen; i++)
+                *ptr++ = *source_bytes++;
+        return i;
+}
+
+static void *make_frames(void *arg)
+{
+        int i;
+        uint8_t *frame;
+
+        for (i = 0; i < 10; i++) {
+                ws_make_ping_frame(&frame);
+                free(frame);
+        }
+        return NULL;
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        int i;
+        char *message = NULL;
+        uint8_t *frame = NULL;
+        WebsocketMetrics before;
+        WebsocketMetrics after;
+        WebsocketHistogram hist;
+        pthread_t thread;
+
+        START_SET("Count frames");
+        ws_metrics_snapshot(&before);
+
+        source_bytes = input_hello_frag_frame;
+        ws_read_next_message(1, read_bytes, &message);
+        free(message);
+        message = NULL;
+
+        source_bytes = input_close_1001_frame;
+        ws_read_next_message(1, read_bytes, &message);
+
+        source_bytes = input_bad_frame;
+        ws_read_next_message(1, read_bytes, &message);
+
+        ws_metrics_snapshot(&after);
+
+        pass(sizeof(input_hello_frag_frame) + sizeof(input_close_1001_frame) +
+             sizeof(input_bad_frame) == after.bytes_in - before.bytes_in,
+                                                             "Count bytes in");
+        pass(2 == after.frames_in[0x1] - before.frames_in[0x1],
+                                                     "Two text frames");
+        pass(1 == after.fragments_in - before.fragments_in, "One fragment");
+        pass(1 == after.closes[1] - before.closes[1], "Close with 1001");
+        pass(1 == after.parse_errors - before.parse_errors,
+                                                    "Reserved opcode is error");
+        pass(after.allocs > before.allocs, "Count allocations");
+        pass(5 == ws_histogram_value_at(&after.message_size, 1.0),
+                                                   "Largest message is 5");
+        END_SET("Count frames");
+
+
+        START_SET("Aggregate threads");
+        ws_metrics_snapshot(&before);
+
+        ws_make_text_frame("Hello", NULL, &frame);
+        free(frame);
+        pthread_create(&thread, NULL, make_frames, NULL);
+        pthread_join(thread, NULL);
+
+        ws_metrics_snapshot(&after);
+        pass(1 == after.frames_out[0x1] - before.frames_out[0x1],
+                                                         "Built text frame");
+        pass(10 == after.frames_out[0x9] - before.frames_out[0x9],
+                                          "Pings from other thread counted");
+        END_SET("Aggregate threads");
+
+
+        START_SET("Histogram percentiles");
+        memset(&after, 0, sizeof(after));
+        for (i = 1; i <= 1000; i++)
+                ws_metrics_record_handle_ns(i);
+        ws_metrics_snapshot(&after);
+
+        hist = after.handle_ns;
+        pass(1000 == hist.count, "Recorded 1000 values");
+        pass(500500 == hist.sum, "Sum of values");
+        pass(ws_histogram_value_at(&hist, 0.5) >= 500 &&
+             ws_histogram_value_at(&hist, 0.5) <= 500 * 9 / 8, "Median");
+        pass(ws_histogram_value_at(&hist, 0.99) >= 990 &&
+             ws_histogram_value_at(&hist, 0.99) <= 990 * 9 / 8, "p99");
+        pass(1 == ws_histogram_value_at(&hist, 0.0), "Min");
+        END_SET("Histogram percentiles");
+
+        return 0;
+}
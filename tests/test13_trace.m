@@ -0,0 +1,130 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+#define DUMP_LEN 10000
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static uint8_t input_hello_frame[] = {0x81, 0x05, 0x48, 0x65, 0x6c, 0x6c, 0x6f};
+
+static uint8_t *source_bytes;
+
+static ssize_t read_bytes(int fd, char *ptr, size_t maxlen)
+{
+        int i;
+        for (i = 0; i < maxlen; i++)
+                *ptr++ = *source_bytes++;
+        return i;
+}
+
+/*
+ * Reads everything written to a temp file so far.
+ */
+static void read_dump(FILE *file, char *dst)
+{
+        size_t len;
+
+        fflush(file);
+        rewind(file);
+        len = fread(dst, 1, DUMP_LEN - 1, file);
+        dst[len] = '\0';
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        char *message = NULL;
+        uint8_t *frame = NULL;
+        FILE *dump_file;
+        FILE *slow_file;
+        int i;
+        static char dump[DUMP_LEN];
+
+        START_SET("Record events");
+        dump_file = tmpfile();
+
+        /* Nothing is recorded until tracing is enabled */
+        source_bytes = input_hello_frame;
+        ws_read_next_message(7, read_bytes, &message);
+        free(message);
+        ws_trace_dump(fileno(dump_file));
+        read_dump(dump_file, dump);
+        pass(strstr(dump, "conn=7") == NULL, "Off by default");
+
+        ws_trace_enable(16);
+        source_bytes = input_hello_frame;
+        ws_read_next_message(7, read_bytes, &message);
+        free(message);
+        ws_make_ping_frame(&frame);
+        free(frame);
+
+        ws_trace_dump(fileno(dump_file));
+        read_dump(dump_file, dump);
+        pass(strstr(dump, "conn=7 frame_header opcode=1 arg=5") != NULL,
+                                                         "Frame header event");
+        pass(strstr(dump, "conn=7 payload_complete") != NULL,
+                                                     "Payload complete event");
+        pass(strstr(dump, "conn=7 message_delivered") != NULL,
+                                                    "Message delivered event");
+        pass(strstr(dump, "frame_queued opcode=9") != NULL,
+                                                        "Frame queued event");
+        pass(strstr(dump, "frame_header") < strstr(dump, "message_delivered"),
+                                                              "Oldest first");
+        fclose(dump_file);
+        END_SET("Record events");
+
+
+        START_SET("Dump on slow message");
+        slow_file = tmpfile();
+        ws_trace_dump_on_latency(1, fileno(slow_file));
+
+        source_bytes = input_hello_frame;
+        ws_read_next_message(9, read_bytes, &message);
+        free(message);
+
+        read_dump(slow_file, dump);
+        pass(strstr(dump, "slow message on connection 9") != NULL,
+                                                          "Slow message dump");
+        pass(strstr(dump, "conn=9 frame_header") != NULL,
+                                                   "Dump includes the events");
+
+        ws_trace_dump_on_latency(0, -1);
+        ws_trace_disable();
+        fclose(slow_file);
+        END_SET("Dump on slow message");
+
+
+        START_SET("Full ring");
+        dump_file = tmpfile();
+        ws_trace_enable(16);
+        for (i = 0; i < 40; i++) {
+                source_bytes = input_hello_frame;
+                ws_read_next_message(7, read_bytes, &message);
+                free(message);
+        }
+        ws_trace_disable();
+
+        /* The slot the writer would fill next isn't dumped */
+        ws_trace_dump(fileno(dump_file));
+        read_dump(dump_file, dump);
+        pass(strstr(dump, ", 63 events\n") != NULL, "Oldest slot skipped");
+        fclose(dump_file);
+        END_SET("Full ring");
+
+        return 0;
+}
@@ -0,0 +1,110 @@
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static const char long66000txt[] = "./data/long-66000.txt";
+static char long66000[66000 + 1];
+
+static uint8_t mask[] = {0x37, 0xfa, 0x21, 0x3d};
+
+static uint8_t input_hello_frame[] = {0x81, 0x05, 0x48, 0x65, 0x6c, 0x6c, 0x6f};
+
+static uint8_t *source_bytes;
+static int num_reads;
+
+static ssize_t read_bytes(int fd, char *ptr, size_t maxlen)
+{
+        num_reads++;
+        memcpy(ptr, source_bytes, maxlen);
+        source_bytes += maxlen;
+        return maxlen;
+}
+
+static int is_page_aligned(const char *ptr)
+{
+        return ((uintptr_t)ptr % sysconf(_SC_PAGESIZE)) == 0;
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        char *message = NULL;
+        uint8_t *frame = NULL;
+        uint8_t *frags = NULL;
+        size_t frame_len;
+        size_t borrowed, cached;
+
+        load_data((uint8_t *)long66000, 66000, long66000txt);
+
+        START_SET("Heap path");
+        ws_set_spill_threshold(0, NULL);
+        frame_len = ws_make_text_frame(long66000, mask, &frame);
+        source_bytes = frame;
+        pass(WS_FT_TEXT == ws_read_next_message(1, read_bytes, &message),
+                                                       "Read long message");
+        pass(0 == strcmp(long66000, message), "Long message unmasked");
+        ws_free_message(message);
+        END_SET("Heap path");
+
+
+        START_SET("Spill large message");
+        ws_set_spill_threshold(4096, ".");
+
+        source_bytes = frame;
+        num_reads = 0;
+        pass(WS_FT_TEXT == ws_read_next_message(1, read_bytes, &message),
+                                                       "Read long message");
+        pass(0 == strcmp(long66000, message), "Spilled message matches");
+        pass(is_page_aligned(message), "Spilled message is mapped");
+        pass(num_reads < 10, "Spilled payload read in big chunks");
+        ws_free_message(message);
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(0 == borrowed, "Chunk buffer given back");
+
+        source_bytes = input_hello_frame;
+        ws_read_next_message(1, read_bytes, &message);
+        pass(0 == strcmp("Hello", message), "Small message");
+        ws_free_message(message);
+        END_SET("Spill large message");
+
+
+        START_SET("Spill across fragments");
+
+        /* Send the long message as two fragments: text + continuation */
+        frags = malloc(2 * frame_len);
+        memcpy(frags, frame, frame_len);
+        memcpy(frags + frame_len, frame, frame_len);
+        frags[0] &= ~0x80;
+        frags[frame_len] = 0x80;
+        ws_set_spill_threshold(100000, NULL);
+
+        source_bytes = frags;
+        pass(WS_FT_TEXT == ws_read_next_message(1, read_bytes, &message),
+                                                 "Read fragmented message");
+        pass(132000 == strlen(message), "Both fragments are there");
+        pass(0 == strncmp(long66000, message + 66000, 66000),
+                                                 "Second fragment matches");
+        pass(is_page_aligned(message), "Spilled on second fragment");
+        ws_free_message(message);
+
+        free(frags);
+        free(frame);
+        ws_set_spill_threshold(0, NULL);
+        END_SET("Spill across fragments");
+
+        return 0;
+}
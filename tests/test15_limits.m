@@ -0,0 +1,222 @@
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../ws.h"
+#include "../spill.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static const char long66000txt[] = "./data/long-66000.txt";
+static char long66000[66000 + 1];
+
+static uint8_t mask[] = {0x37, 0xfa, 0x21, 0x3d};
+
+static uint8_t input_hello_frame[] = {0x81, 0x05, 0x48, 0x65, 0x6c, 0x6c, 0x6f};
+
+/* A 64-bit length with its top bit set, which RFC 6455 5.2 forbids */
+static uint8_t input_msb_len_frame[] = {0x81, 0x7f,
+                                        0x80, 0x00, 0x00, 0x00,
+                                        0x00, 0x00, 0x00, 0x05,
+                                        0x48, 0x65, 0x6c, 0x6c, 0x6f};
+
+static uint8_t *source_bytes;
+static size_t num_source_read;
+
+static ssize_t read_bytes(int fd, char *ptr, size_t maxlen)
+{
+        memcpy(ptr, source_bytes, maxlen);
+        source_bytes += maxlen;
+        num_source_read += maxlen;
+        return maxlen;
+}
+
+/* Like read_bytes, but stops at the end of the source, as a socket would */
+static size_t source_left;
+
+static ssize_t read_some(int fd, char *ptr, size_t maxlen)
+{
+        if (source_left == 0) {
+                errno = EAGAIN;
+                return -1;
+        }
+        if (maxlen > source_left)
+                maxlen = source_left;
+        memcpy(ptr, source_bytes, maxlen);
+        source_bytes += maxlen;
+        source_left -= maxlen;
+        return maxlen;
+}
+
+static enum WebsocketFrameType last_type;
+
+static void handler(int fd, enum WebsocketFrameType type, const char *message,
+                                                        size_t len, void *arg)
+{
+        last_type = type;
+}
+
+static void no_limits()
+{
+        WebsocketLimits limits = {0, 0, 0};
+
+        ws_set_limits(&limits);
+        ws_set_memory_budget(0);
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        WebsocketLimits limits = {0, 0, 0};
+        WebsocketMetrics before, after;
+        char *message = NULL;
+        uint8_t *frame = NULL;
+        uint8_t *frags = NULL;
+        uint8_t *close_frame = NULL;
+        uint8_t *dst = NULL;
+        WebsocketConn *conn;
+        MessageSink sink;
+        size_t frame_len;
+
+        load_data((uint8_t *)long66000, 66000, long66000txt);
+        frame_len = ws_make_text_frame(long66000, mask, &frame);
+
+        START_SET("Frame limit");
+        ws_metrics_snapshot(&before);
+        limits.max_frame_len = 1000;
+        ws_set_limits(&limits);
+
+        source_bytes = frame;
+        num_source_read = 0;
+        pass(WS_FT_TOO_BIG == ws_read_next_message(1, read_bytes, &message),
+                                                     "Long frame rejected");
+        pass(num_source_read < 20, "Payload wasn't read");
+        pass(0 == ws_buffered_bytes(), "Nothing left buffered");
+
+        source_bytes = input_hello_frame;
+        pass(WS_FT_TEXT == ws_read_next_message(1, read_bytes, &message),
+                                                     "Short frame accepted");
+        pass(0 == strcmp("Hello", message), "Short message intact");
+        free(message);
+
+        limits.max_frame_len = 4;
+        ws_set_limits(&limits);
+        source_bytes = input_hello_frame;
+        pass(WS_FT_TOO_BIG == ws_read_next_message(1, read_bytes, &message),
+                                           "Short frame over limit rejected");
+
+        ws_metrics_snapshot(&after);
+        pass(2 == after.limit_rejects - before.limit_rejects,
+                                                  "Rejections are counted");
+        END_SET("Frame limit");
+
+
+        START_SET("Message limit");
+        frags = malloc(2 * frame_len);
+        memcpy(frags, frame, frame_len);
+        memcpy(frags + frame_len, frame, frame_len);
+        frags[0] &= ~0x80;
+        frags[frame_len] = 0x80;
+
+        limits.max_frame_len = 70000;
+        limits.max_message_len = 100000;
+        ws_set_limits(&limits);
+
+        source_bytes = frags;
+        num_source_read = 0;
+        pass(WS_FT_TOO_BIG == ws_read_next_message(1, read_bytes, &message),
+                                              "Fragmented message rejected");
+        pass(num_source_read < frame_len + 20,
+                                        "Second payload wasn't read");
+        pass(0 == ws_buffered_bytes(), "First fragment released");
+
+        source_bytes = frame;
+        pass(WS_FT_TEXT == ws_read_next_message(1, read_bytes, &message),
+                                                "Single frame accepted");
+        pass(0 == strcmp(long66000, message), "Long message intact");
+        pass(0 == ws_buffered_bytes(), "Message no longer counted");
+        free(message);
+        END_SET("Message limit");
+
+
+        START_SET("Buffered limits");
+        no_limits();
+        limits.max_buffered = 50000;
+        ws_set_limits(&limits);
+        source_bytes = frame;
+        pass(WS_FT_TOO_BIG == ws_read_next_message(1, read_bytes, &message),
+                                         "Per-connection limit enforced");
+
+        no_limits();
+        ws_set_memory_budget(50000);
+        source_bytes = frame;
+        pass(WS_FT_TOO_BIG == ws_read_next_message(1, read_bytes, &message),
+                                                "Global budget enforced");
+
+        ws_set_memory_budget(70000);
+        source_bytes = frame;
+        pass(WS_FT_TEXT == ws_read_next_message(1, read_bytes, &message),
+                                                  "Fits in the budget");
+        free(message);
+
+        /* Spilled messages aren't held in memory */
+        ws_set_memory_budget(1000);
+        ws_set_spill_threshold(4096, ".");
+        source_bytes = frame;
+        pass(WS_FT_TEXT == ws_read_next_message(1, read_bytes, &message),
+                                                 "Spilled message allowed");
+        pass(0 == strcmp(long66000, message), "Spilled message intact");
+        ws_free_message(message);
+        ws_set_spill_threshold(0, NULL);
+        no_limits();
+        END_SET("Buffered limits");
+
+
+        START_SET("Lengths that don't fit");
+        source_bytes = input_msb_len_frame;
+        pass(WS_FT_ERROR == ws_read_next_message(1, read_bytes, &message),
+                                          "Top bit of 64-bit length refused");
+
+        conn = ws_conn_new(1);
+        source_bytes = input_msb_len_frame;
+        source_left = sizeof(input_msb_len_frame);
+        last_type = WS_FT_TEXT;
+        ws_conn_read(conn, read_some, handler, NULL);
+        pass(WS_FT_ERROR == last_type,
+                                "Top bit of 64-bit length refused by conn");
+        ws_conn_free(conn);
+
+        message_sink_init(&sink);
+        sink.len = UINT64_MAX - 10;
+        pass(-1 == message_sink_reserve(&sink, 10, &dst),
+                                          "Message length can't wrap");
+        sink.len = 0;
+        message_sink_discard(&sink);
+        END_SET("Lengths that don't fit");
+
+
+        START_SET("Close status");
+        pass(4 == ws_make_close_frame_status(WS_CLOSE_MESSAGE_TOO_BIG,
+                                            &close_frame), "Close frame len");
+        pass(0x88 == close_frame[0] && 2 == close_frame[1],
+                                               "Close frame header");
+        pass(0x03 == close_frame[2] && 0xf1 == close_frame[3],
+                                               "Close status is 1009");
+        free(close_frame);
+        END_SET("Close status");
+
+        free(frags);
+        free(frame);
+        return 0;
+}
@@ -0,0 +1,126 @@
+#include <err.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static const char long66000txt[] = "./data/long-66000.txt";
+static char long66000[66000 + 1];
+
+static const char out_file[] = "./sendfile-out.tmp";
+
+static uint8_t sent[70000];
+
+/*
+ * Sends the file to a scratch file and reads back what was written.
+ */
+static ssize_t send_to_file(int file_fd, off_t offset, uint64_t len,
+                                                       uint64_t max_frame_len)
+{
+        ssize_t result;
+        int fd;
+
+        if ((fd = open(out_file, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+                err(1, "Couldn't open %s", out_file);
+
+        result = -1;
+        if (ws_send_file(fd, file_fd, offset, len, max_frame_len) == 0)
+                result = pread(fd, sent, sizeof(sent), 0);
+
+        close(fd);
+        unlink(out_file);
+        return result;
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        ssize_t num_sent;
+        uint8_t header[WS_MAX_FRAME_HEADER_LEN];
+        int file_fd;
+        int pipe_fds[2];
+        int sock_fds[2];
+
+        load_data((uint8_t *)long66000, 66000, long66000txt);
+        if ((file_fd = open(long66000txt, O_RDONLY)) < 0)
+                err(1, "Couldn't open %s", long66000txt);
+
+        START_SET("Frame header");
+        pass(2 == ws_make_frame_header(0x82, 5, NULL, header), "Short header");
+        pass(0x82 == header[0] && 0x05 == header[1], "Short header bytes");
+        pass(4 == ws_make_frame_header(0x82, 300, NULL, header), "Med header");
+        pass(126 == header[1] && 0x01 == header[2] && 0x2c == header[3],
+                                                          "Med header bytes");
+        pass(14 == ws_make_frame_header(0x82, 66000, (uint8_t *)"abcd",
+                                                 header), "Masked long header");
+        pass(0xff == header[1] && 0x01 == header[7] && 'a' == header[10],
+                                                         "Long header bytes");
+        END_SET("Frame header");
+
+
+        START_SET("Single frame");
+        num_sent = send_to_file(file_fd, 0, 66000, 0);
+        pass(66010 == num_sent, "Frame length");
+        pass(0x82 == sent[0] && 127 == sent[1], "Binary frame, long length");
+        pass(0 == memcmp(long66000, sent + 10, 66000), "Payload matches");
+
+        num_sent = send_to_file(file_fd, 100, 50, 0);
+        pass(52 == num_sent, "Short frame from offset");
+        pass(0 == memcmp(long66000 + 100, sent + 2, 50), "Offset honored");
+        pass(0 == lseek(file_fd, 0, SEEK_CUR), "File offset untouched");
+
+        pass(-1 == send_to_file(file_fd, 65990, 20, 0), "Short file fails");
+        END_SET("Single frame");
+
+
+        START_SET("Fragments");
+        num_sent = send_to_file(file_fd, 0, 66000, 30000);
+        pass(66000 + 3 * 4 == num_sent, "Three frames");
+        pass(0x02 == sent[0], "First is a binary fragment");
+        pass(0x00 == sent[30004], "Then a continuation");
+        pass(0x80 == sent[60008], "Last one is final");
+        pass(6000 == (sent[60010] << 8 | sent[60011]), "Last frame's length");
+        pass(0 == memcmp(long66000 + 30000, sent + 30008, 30000),
+                                                  "Middle payload matches");
+
+        num_sent = send_to_file(file_fd, 0, 0, 0);
+        pass(2 == num_sent && 0x82 == sent[0] && 0 == sent[1], "Empty file");
+        END_SET("Fragments");
+
+
+        START_SET("Pipe and socket");
+        if (pipe(pipe_fds) != 0 ||
+                        socketpair(AF_UNIX, SOCK_STREAM, 0, sock_fds) != 0)
+                err(1, "Couldn't make pipe");
+
+        write(pipe_fds[1], long66000, 1000);
+        pass(0 == ws_send_file(sock_fds[0], pipe_fds[0], 0, 1000, 0),
+                                                       "Spliced from pipe");
+        num_sent = read(sock_fds[1], sent, sizeof(sent));
+        pass(1004 == num_sent, "Spliced frame length");
+        pass(0 == memcmp(long66000, sent + 4, 1000), "Spliced payload");
+
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        close(sock_fds[0]);
+        close(sock_fds[1]);
+        END_SET("Pipe and socket");
+
+        close(file_fd);
+        return 0;
+}
@@ -0,0 +1,166 @@
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static const char long66000txt[] = "./data/long-66000.txt";
+static char long66000[66000 + 1];
+
+static uint8_t mask[] = {0x37, 0xfa, 0x21, 0x3d};
+
+static uint8_t close_frame[] = {0x88, 0x00};
+
+static uint8_t first_bytes[2];
+static int num_reads;
+
+/* Hangs up the client end once the relay is stuck writing to it */
+static void *hang_up(void *arg)
+{
+        usleep(100000);
+        close(*(int *)arg);
+        return NULL;
+}
+
+static ssize_t read_bytes(int fd, char *ptr, size_t maxlen)
+{
+        ssize_t result = read(fd, ptr, maxlen);
+
+        if (num_reads++ == 0 && result >= 2)
+                memcpy(first_bytes, ptr, 2);
+        return result;
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        WebsocketRelay *relay;
+        pthread_t thread;
+        char *message = NULL;
+        uint8_t *frame = NULL;
+        size_t frame_len;
+        uint8_t buf[8];
+        int backend[2];
+        int client[2];
+        int sndbuf = 4096;
+
+        load_data((uint8_t *)long66000, 66000, long66000txt);
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, backend) != 0 ||
+                        socketpair(AF_UNIX, SOCK_STREAM, 0, client) != 0)
+                err(1, "Couldn't make sockets");
+
+        relay = ws_relay_new();
+        pass(relay != NULL, "Relay created");
+
+        START_SET("Backend to client");
+        frame_len = ws_make_text_frame(long66000, NULL, &frame);
+        write(backend[1], frame, frame_len);
+        free(frame);
+
+        pass(1 == ws_relay_frame(relay, backend[0], client[0]),
+                                                      "Relayed text frame");
+        pass(WS_FT_TEXT == ws_read_next_message(client[1], read_bytes,
+                                              &message), "Client reads it");
+        pass(0 == strcmp(long66000, message), "Spliced payload matches");
+        free(message);
+
+        frame_len = ws_make_text_frame("Hello", NULL, &frame);
+        write(backend[1], frame, frame_len);
+        free(frame);
+        ws_relay_frame(relay, backend[0], client[0]);
+        ws_read_next_message(client[1], read_bytes, &message);
+        pass(0 == strcmp("Hello", message), "Short frame after long one");
+        free(message);
+        END_SET("Backend to client");
+
+
+        START_SET("Client to backend");
+        frame_len = ws_make_text_frame(long66000, mask, &frame);
+        write(client[1], frame, frame_len);
+        free(frame);
+
+        pass(1 == ws_relay_frame(relay, client[0], backend[0]),
+                                                     "Relayed masked frame");
+        num_reads = 0;
+        pass(WS_FT_TEXT == ws_read_next_message(backend[1], read_bytes,
+                                             &message), "Backend reads it");
+        pass(127 == first_bytes[1], "Mask bit cleared");
+        pass(0 == strcmp(long66000, message), "Unmasked payload matches");
+        free(message);
+
+        frame_len = ws_make_text_frame("Hi", mask, &frame);
+        write(client[1], frame, frame_len);
+        free(frame);
+        ws_relay_frame(relay, client[0], backend[0]);
+        pass(4 == read(backend[1], buf, sizeof(buf)) &&
+                        0 == memcmp(buf, "\x81\x02Hi", 4), "Short masked frame");
+        END_SET("Client to backend");
+
+
+        START_SET("Failed part way");
+        signal(SIGPIPE, SIG_IGN);
+        close(backend[0]);
+        close(backend[1]);
+        close(client[0]);
+        close(client[1]);
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, backend) != 0 ||
+                        socketpair(AF_UNIX, SOCK_STREAM, 0, client) != 0)
+                err(1, "Couldn't make sockets");
+
+        /* The client stops reading and goes away mid-payload */
+        setsockopt(client[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        fcntl(client[0], F_SETFL, O_NONBLOCK);
+        frame_len = ws_make_text_frame(long66000, NULL, &frame);
+        write(backend[1], frame, frame_len);
+        free(frame);
+        pthread_create(&thread, NULL, hang_up, &client[1]);
+        pass(-1 == ws_relay_frame(relay, backend[0], client[0]),
+                                                  "Relay to dead client fails");
+        pthread_join(thread, NULL);
+        close(backend[0]);
+        close(backend[1]);
+        close(client[0]);
+
+        /* The relay is used for another pair; nothing of the last may leak */
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, backend) != 0 ||
+                        socketpair(AF_UNIX, SOCK_STREAM, 0, client) != 0)
+                err(1, "Couldn't make sockets");
+        frame_len = ws_make_text_frame("Hello", NULL, &frame);
+        write(backend[1], frame, frame_len);
+        free(frame);
+        pass(1 == ws_relay_frame(relay, backend[0], client[0]),
+                                                 "Relayed to the next client");
+        pass(7 == read(client[1], buf, sizeof(buf)) &&
+                    0 == memcmp(buf, "\x81\x05Hello", 7), "Next frame is clean");
+        END_SET("Failed part way");
+
+
+        START_SET("Close");
+        write(client[1], close_frame, sizeof(close_frame));
+        pass(8 == ws_relay_frame(relay, client[0], backend[0]),
+                                                     "Close opcode returned");
+        close(client[1]);
+        pass(-1 == ws_relay_frame(relay, client[0], backend[0]),
+                                                     "EOF reported");
+        END_SET("Close");
+
+        ws_relay_free(relay);
+        return 0;
+}
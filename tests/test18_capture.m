@@ -0,0 +1,89 @@
+#include <err.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../ws.h"
+#include "../capture.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static uint8_t input_hello_frame[] = {0x81, 0x05, 0x48, 0x65, 0x6c, 0x6c, 0x6f};
+
+static const char capture_file[] = "./capture.tmp";
+
+static uint8_t *source_bytes;
+
+static ssize_t read_bytes(int fd, char *ptr, size_t maxlen)
+{
+        memcpy(ptr, source_bytes, maxlen);
+        source_bytes += maxlen;
+        return maxlen;
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        CaptureFileHeader header;
+        CaptureRecord record;
+        uint8_t captured[sizeof(input_hello_frame)];
+        size_t total = 0;
+        int num_records = 0;
+        int conns_ok = 1;
+        char *message;
+        int fd;
+
+        START_SET("Capture");
+        pass(0 == ws_capture_start(capture_file), "Capture started");
+
+        source_bytes = input_hello_frame;
+        ws_read_next_message(7, read_bytes, &message);
+        free(message);
+        source_bytes = input_hello_frame;
+        ws_read_next_message(8, read_bytes, &message);
+        free(message);
+
+        ws_capture_stop();
+
+        /* Not captured */
+        source_bytes = input_hello_frame;
+        ws_read_next_message(9, read_bytes, &message);
+        free(message);
+
+        if ((fd = open(capture_file, O_RDONLY)) < 0)
+                err(1, "Couldn't open %s", capture_file);
+        pass(sizeof(header) == read(fd, &header, sizeof(header)) &&
+             0 == memcmp(header.magic, "WSCP", 4), "File header");
+
+        while (read(fd, &record, sizeof(record)) == sizeof(record)) {
+                if (record.conn != (total < sizeof(captured) ? 7 : 8))
+                        conns_ok = 0;
+                if (total < sizeof(captured))
+                        read(fd, captured + total, record.len);
+                else
+                        lseek(fd, record.len, SEEK_CUR);
+                total += record.len;
+                num_records++;
+        }
+        close(fd);
+        unlink(capture_file);
+
+        pass(2 * sizeof(input_hello_frame) == total, "Every byte captured");
+        pass(num_records >= 2, "Reads are kept as they came");
+        pass(conns_ok, "Connections recorded");
+        pass(0 == memcmp(input_hello_frame, captured, sizeof(captured)),
+                                               "Bytes captured before unmasking");
+        END_SET("Capture");
+
+        return 0;
+}
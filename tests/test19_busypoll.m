@@ -0,0 +1,122 @@
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static const char long66000txt[] = "./data/long-66000.txt";
+static char long66000[66000 + 1];
+
+static uint8_t mask[] = {0x37, 0xfa, 0x21, 0x3d};
+
+static uint8_t input_hello_frame[] = {0x81, 0x05, 0x48, 0x65, 0x6c, 0x6c, 0x6f};
+static uint8_t input_ping_frame[] = {0x89, 0x02, 'h', 'i'};
+static uint8_t input_close_frame[] = {0x88, 0x02, 0x03, 0xe8};
+
+static WebsocketPoller *poller;
+
+static int num_messages;
+static int got_hello;
+static int got_long;
+static int got_close;
+static int got_too_big;
+
+static void handler(int fd, enum WebsocketFrameType type, const char *message,
+                                                        size_t len, void *arg)
+{
+        if (type == WS_FT_TEXT) {
+                num_messages++;
+                if (len == 5 && 0 == strcmp("Hello", message))
+                        got_hello = 1;
+                if (len == 132000 && 0 == strncmp(long66000, message, 66000) &&
+                                0 == strcmp(long66000, message + 66000))
+                        got_long = 1;
+        }
+        else if (type == WS_FT_CLOSE) {
+                got_close = (len == 2);
+                ws_poller_stop(poller);
+        }
+        else if (type == WS_FT_TOO_BIG) {
+                got_too_big = 1;
+                ws_poller_stop(poller);
+        }
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        WebsocketMetrics metrics;
+        uint8_t *frame = NULL;
+        size_t frame_len;
+        uint8_t buf[16];
+        int sock[2];
+
+        load_data((uint8_t *)long66000, 66000, long66000txt);
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock) != 0)
+                err(1, "Couldn't make sockets");
+
+        START_SET("Messages");
+        poller = ws_poller_new(4, 200000, -1, 0);
+        pass(0 == ws_poller_add(poller, sock[0]), "Connection added");
+
+        /* Hello, a ping in between two masked fragments, then close */
+        write(sock[1], input_hello_frame, sizeof(input_hello_frame));
+        frame_len = ws_make_text_frame(long66000, mask, &frame);
+        frame[0] &= ~0x80;
+        write(sock[1], frame, frame_len);
+        write(sock[1], input_ping_frame, sizeof(input_ping_frame));
+        frame[0] = 0x80;
+        write(sock[1], frame, frame_len);
+        write(sock[1], input_close_frame, sizeof(input_close_frame));
+        free(frame);
+
+        pass(0 == ws_poller_run(poller, handler, NULL), "Poller ran");
+        pass(2 == num_messages, "Two messages");
+        pass(got_hello, "Short message");
+        pass(got_long, "Fragments assembled and unmasked");
+        pass(got_close, "Close delivered");
+
+        pass(4 == read(sock[1], buf, sizeof(buf)) && 0x8a == buf[0] &&
+                        0 == memcmp(buf + 2, "hi", 2), "Ping answered");
+
+        ws_metrics_snapshot(&metrics);
+        pass(2 == metrics.wakeup_ns.count, "Wakeup latency recorded");
+        END_SET("Messages");
+
+
+        START_SET("Limits and sending");
+        pass(0 == ws_poller_send(sock[1], "Hello", 5), "Sent");
+        pass(7 == read(sock[0], buf, sizeof(buf)) &&
+                        0 == memcmp(buf, input_hello_frame, 7), "Sent frame");
+
+        ws_poller_free(poller);
+        poller = ws_poller_new(1, 1000, -1, 0);
+        ws_poller_add(poller, sock[0]);
+        pass(-1 == ws_poller_add(poller, sock[1]), "Poller is full");
+
+        frame_len = ws_make_text_frame(long66000, NULL, &frame);
+        write(sock[1], frame, 100);
+        free(frame);
+        ws_poller_run(poller, handler, NULL);
+        pass(got_too_big, "Oversized message refused");
+        ws_poller_free(poller);
+        END_SET("Limits and sending");
+
+        close(sock[0]);
+        close(sock[1]);
+        return 0;
+}
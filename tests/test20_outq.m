@@ -0,0 +1,196 @@
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static const char long66000txt[] = "./data/long-66000.txt";
+static char long66000[66000 + 1];
+
+static uint8_t written[100000];
+static size_t num_written;
+static size_t budget;           /* Bytes to take before "blocking" */
+
+static ssize_t write_bytes(int fd, const void *ptr, size_t len)
+{
+        if (budget == 0) {
+                errno = EAGAIN;
+                return -1;
+        }
+        if (len > budget)
+                len = budget;
+        memcpy(written + num_written, ptr, len);
+        num_written += len;
+        budget -= len;
+        return len;
+}
+
+/*
+ * Splits what was written into frames: byte0 and payload length of each.
+ */
+static int split_frames(uint8_t *byte0s, uint64_t *lens, int max)
+{
+        size_t pos = 0;
+        uint64_t len;
+        int n = 0;
+
+        while (pos < num_written && n < max) {
+                byte0s[n] = written[pos];
+                len = written[pos + 1] & 0x7f;
+                pos += 2;
+                if (len == 126) {
+                        len = written[pos] << 8 | written[pos + 1];
+                        pos += 2;
+                }
+                lens[n++] = len;
+                pos += len;
+        }
+        return n;
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        WebsocketOutQueue *q;
+        WebsocketMetrics before, after;
+        char buf[20];
+        uint8_t byte0s[100];
+        uint64_t lens[100];
+        int64_t left;
+        int num_frames;
+        int i;
+
+        load_data((uint8_t *)long66000, 66000, long66000txt);
+
+        START_SET("Fragments and control frames");
+        q = ws_outq_new(1, 1000);
+        pass(0 == ws_outq_push_text(q, strdup(long66000), 66000,
+                                      WS_PRIORITY_NORMAL), "Queued long");
+
+        budget = 1500;
+        left = ws_outq_flush(q, write_bytes);
+        pass(left > 64000 && left < 66000, "Blocked part way");
+
+        ws_outq_push_text(q, strdup("later"), 5, WS_PRIORITY_NORMAL);
+        ws_outq_push_text(q, strdup("urgent"), 6, WS_PRIORITY_HIGH);
+        pass(0 == ws_outq_push_control(q, WS_FT_PING, (uint8_t *)"p", 1),
+                                                             "Queued ping");
+        pass(-1 == ws_outq_push_control(q, WS_FT_TEXT, NULL, 0),
+                                                 "Data isn't a control frame");
+
+        budget = 1000000;
+        pass(0 == ws_outq_flush(q, write_bytes), "Drained");
+
+        num_frames = split_frames(byte0s, lens, 100);
+        pass(66 + 1 + 2 == num_frames, "66 fragments, a ping, 2 messages");
+        pass(0x01 == byte0s[0] && 1000 == lens[0], "First fragment");
+        pass(0x00 == byte0s[1], "Continuation finished first");
+        pass(0x89 == byte0s[2] && 1 == lens[2], "Ping between fragments");
+        pass(0x80 == byte0s[66] && 1000 == lens[66], "Last fragment");
+        pass(0x81 == byte0s[67] && 6 == lens[67], "High priority next");
+        pass(0x81 == byte0s[68] && 5 == lens[68], "Normal last");
+
+        for (i = 3; i < 66; i++)
+                if (byte0s[i] != 0x00)
+                        break;
+        pass(66 == i, "Fragments in between are continuations");
+        END_SET("Fragments and control frames");
+
+
+        START_SET("Close");
+        num_written = 0;
+        ws_outq_push_text(q, strdup(long66000), 66000, WS_PRIORITY_NORMAL);
+        budget = 2500;
+        ws_outq_flush(q, write_bytes);
+        ws_outq_push_control(q, WS_FT_CLOSE, (uint8_t *)"\x03\xe8", 2);
+
+        budget = 1000000;
+        pass(0 == ws_outq_flush(q, write_bytes), "Nothing after close");
+        num_frames = split_frames(byte0s, lens, 100);
+        pass(4 == num_frames && 0x88 == byte0s[3], "Close went out next");
+        pass(-1 == ws_outq_push_text(q, strdup("x"), 1, WS_PRIORITY_HIGH),
+                                                  "Queue is closed");
+        ws_outq_free(q);
+        END_SET("Close");
+
+
+        START_SET("No fragmenting");
+        num_written = 0;
+        q = ws_outq_new(1, 0);
+        ws_outq_push_text(q, strdup(long66000), 66000, WS_PRIORITY_NORMAL);
+        budget = 1000000;
+        pass(0 == ws_outq_flush(q, write_bytes), "Drained");
+        pass(66010 == num_written && 0x81 == written[0], "One frame");
+        pass(0 == memcmp(long66000, written + 10, 66000), "Payload intact");
+        ws_outq_free(q);
+        END_SET("No fragmenting");
+
+
+        START_SET("Conflation");
+        num_written = 0;
+        q = ws_outq_new(1, 1000);
+        ws_metrics_snapshot(&before);
+        ws_outq_push_text(q, strdup(long66000), 66000, WS_PRIORITY_NORMAL);
+        budget = 1500;
+        ws_outq_flush(q, write_bytes);
+
+        /* Stale updates pile up behind a slow send */
+        for (i = 0; i < 1000; i++) {
+                snprintf(buf, sizeof(buf), "AAA %d", i);
+                ws_outq_push_keyed(q, "AAA", strdup(buf), strlen(buf),
+                                                        WS_PRIORITY_NORMAL);
+                snprintf(buf, sizeof(buf), "BBB %d", i);
+                ws_outq_push_keyed(q, "BBB", strdup(buf), strlen(buf),
+                                                        WS_PRIORITY_NORMAL);
+        }
+        ws_outq_push_text(q, strdup("plain"), 5, WS_PRIORITY_NORMAL);
+        ws_outq_push_keyed(q, "AAA", strdup("AAA last"), 8,
+                                                        WS_PRIORITY_NORMAL);
+        left = ws_outq_flush(q, write_bytes);
+        pass(left > 64000 && left < 65000, "Queued bytes bounded by keys");
+        ws_metrics_snapshot(&after);
+        pass(1999 == after.conflated - before.conflated, "Counted");
+
+        budget = 1000000;
+        pass(0 == ws_outq_flush(q, write_bytes), "Drained");
+        num_frames = split_frames(byte0s, lens, 100);
+        pass(66 + 3 == num_frames, "One message per key");
+        pass(8 == lens[66] && 0 == memcmp(written + num_written - 7 - 9 - 8,
+                             "AAA last", 8), "Latest value, first place");
+        pass(7 == lens[67] && 0 == memcmp(written + num_written - 7 - 7,
+                                           "BBB 999", 7), "Other key");
+        pass(5 == lens[68], "Unkeyed message after");
+
+        /* Once a keyed message has started, the next one waits behind it */
+        num_written = 0;
+        ws_outq_push_keyed(q, "AAA", strdup(long66000), 66000,
+                                                        WS_PRIORITY_NORMAL);
+        budget = 1500;
+        ws_outq_flush(q, write_bytes);
+        ws_outq_push_keyed(q, "AAA", strdup("AAA next"), 8,
+                                                        WS_PRIORITY_NORMAL);
+        budget = 1000000;
+        ws_outq_flush(q, write_bytes);
+        num_frames = split_frames(byte0s, lens, 100);
+        pass(67 == num_frames && 0x80 == byte0s[65] && 8 == lens[66],
+                                       "Message in flight not replaced");
+        ws_outq_push_keyed(q, "BBB", strdup("left"), 4, WS_PRIORITY_HIGH);
+        ws_outq_free(q);
+        END_SET("Conflation");
+
+        return 0;
+}
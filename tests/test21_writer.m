@@ -0,0 +1,117 @@
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static const char long66000txt[] = "./data/long-66000.txt";
+static char long66000[66000 + 1];
+
+static uint8_t written[100000];
+static size_t num_written;
+static int num_writes;
+
+static uint8_t *source_bytes;
+
+static ssize_t write_bytes(int fd, const void *ptr, size_t len)
+{
+        memcpy(written + num_written, ptr, len);
+        num_written += len;
+        num_writes++;
+        return len;
+}
+
+static ssize_t read_bytes(int fd, char *ptr, size_t maxlen)
+{
+        memcpy(ptr, source_bytes, maxlen);
+        source_bytes += maxlen;
+        return maxlen;
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        WebsocketWriter *writer;
+        WebsocketMetrics before, after;
+        char *message;
+        size_t i;
+
+        load_data((uint8_t *)long66000, 66000, long66000txt);
+
+        START_SET("Small message");
+        writer = ws_writer_new(1, write_bytes, 4096);
+        pass(-1 == ws_writer_append(writer, "x", 1), "Nothing begun");
+        pass(0 == ws_writer_begin(writer, 0), "Begun");
+        pass(-1 == ws_writer_begin(writer, 0), "Can't begin twice");
+        ws_writer_append(writer, "Hel", 3);
+        ws_writer_append(writer, "lo", 2);
+        pass(0 == num_written, "Buffered under threshold");
+        pass(0 == ws_writer_end(writer), "Ended");
+        pass(7 == num_written && 0x81 == written[0], "One unfragmented frame");
+
+        source_bytes = written;
+        ws_read_next_message(1, read_bytes, &message);
+        pass(0 == strcmp("Hello", message), "Message reads back");
+        free(message);
+        END_SET("Small message");
+
+
+        START_SET("Streamed message");
+        num_written = 0;
+        ws_metrics_snapshot(&before);
+        ws_writer_begin(writer, 0);
+        for (i = 0; i < 66000; i += 1000)
+                ws_writer_append(writer, long66000 + i, 1000);
+        ws_writer_end(writer);
+        ws_metrics_snapshot(&after);
+
+        pass(0x01 == written[0], "Starts with a text fragment");
+        pass(0x00 == written[4004], "Then continuations");
+        pass(17 == after.frames_out[0] - before.frames_out[0] + 1,
+                                               "Sent in threshold-sized frames");
+        pass(after.allocs == before.allocs, "No allocations while streaming");
+
+        source_bytes = written;
+        pass(WS_FT_TEXT == ws_read_next_message(1, read_bytes, &message),
+                                                      "Fragments read back");
+        pass(0 == strcmp(long66000, message), "Message intact");
+        free(message);
+        END_SET("Streamed message");
+
+
+        START_SET("Large chunks");
+        num_written = 0;
+        num_writes = 0;
+        ws_writer_begin(writer, 0);
+        ws_writer_append(writer, long66000, 10);
+        ws_writer_append(writer, long66000 + 10, 65990);
+        ws_writer_end(writer);
+        pass(5 == num_writes, "Buffered bytes, the chunk, an empty final");
+
+        source_bytes = written;
+        ws_read_next_message(1, read_bytes, &message);
+        pass(0 == strcmp(long66000, message), "Message intact");
+        free(message);
+
+        num_written = 0;
+        ws_writer_begin(writer, 1);
+        ws_writer_append(writer, "\x01\x02", 2);
+        ws_writer_end(writer);
+        pass(0x82 == written[0] && 2 == written[1], "Binary message");
+        ws_writer_free(writer);
+        END_SET("Large chunks");
+
+        return 0;
+}
@@ -0,0 +1,243 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+#define MAX_IDLE 1000
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static const char long66000txt[] = "./data/long-66000.txt";
+static char long66000[66000 + 1];
+
+static uint8_t mask[] = {0x37, 0xfa, 0x21, 0x3d};
+
+static uint8_t input_hello_frame[] = {0x81, 0x05, 0x48, 0x65, 0x6c, 0x6c, 0x6f};
+static uint8_t input_ping_frame[] = {0x89, 0x02, 'h', 'i'};
+
+/* Bytes available for the current "readable" event */
+static const uint8_t *source_bytes;
+static size_t source_left;
+static size_t max_read;
+
+static int num_messages;
+static int num_pings;
+static int last_type;
+static char last_message[66000 * 2 + 1];
+
+static ssize_t read_bytes(int fd, char *ptr, size_t maxlen)
+{
+        if (source_left == 0) {
+                errno = EAGAIN;
+                return -1;
+        }
+        if (maxlen > source_left)
+                maxlen = source_left;
+        if (maxlen > max_read)
+                maxlen = max_read;
+        memcpy(ptr, source_bytes, maxlen);
+        source_bytes += maxlen;
+        source_left -= maxlen;
+        return maxlen;
+}
+
+static ssize_t socket_read(int fd, char *ptr, size_t maxlen)
+{
+        return read(fd, ptr, maxlen);
+}
+
+static ssize_t socket_write(int fd, const void *ptr, size_t len)
+{
+        return write(fd, ptr, len);
+}
+
+static void handler(int fd, enum WebsocketFrameType type, const char *message,
+                                                        size_t len, void *arg)
+{
+        last_type = type;
+        if (type == WS_FT_TEXT) {
+                num_messages++;
+                memcpy(last_message, message, len + 1);
+        }
+        else if (type == WS_FT_PING)
+                num_pings++;
+}
+
+/*
+ * Hands "len" bytes to the connection, "per_event" at a time.
+ */
+static int feed(WebsocketConn *conn, const uint8_t *bytes, size_t len,
+                                                        size_t per_event)
+{
+        size_t n;
+        int result = 0;
+
+        while (len > 0 && result == 0) {
+                n = len < per_event ? len : per_event;
+                source_bytes = bytes;
+                source_left = n;
+                result = ws_conn_read(conn, read_bytes, handler, NULL);
+                bytes += n;
+                len -= n;
+        }
+        return result;
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        WebsocketConn *conn;
+        WebsocketConn *conns[MAX_IDLE];
+        WebsocketLimits limits = {0, 0, 0};
+        struct rlimit rlim;
+        uint8_t *frame = NULL;
+        uint8_t *frags = NULL;
+        size_t frame_len;
+        size_t borrowed, cached;
+        char buf[100];
+        int sock[2];
+        int num_idle;
+        int i;
+
+        load_data((uint8_t *)long66000, 66000, long66000txt);
+        max_read = 1 << 20;
+
+        START_SET("Footprint");
+        conn = ws_conn_new(1);
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(0 == borrowed, "New connection borrows nothing");
+        pass(64 == WS_CONN_IDLE_BYTES, "64 bytes per idle connection");
+        END_SET("Footprint");
+
+
+        START_SET("Incremental parsing");
+        pass(0 == feed(conn, input_hello_frame, sizeof(input_hello_frame), 1),
+                                                       "Fed a byte at a time");
+        pass(1 == num_messages && 0 == strcmp("Hello", last_message),
+                                                         "Message delivered");
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(0 == borrowed, "Buffer given back");
+
+        /* Masked fragments with a ping in between, at odd read sizes */
+        frame_len = ws_make_text_frame(long66000, mask, &frame);
+        frags = malloc(2 * frame_len + sizeof(input_ping_frame));
+        memcpy(frags, frame, frame_len);
+        frags[0] &= ~0x80;
+        memcpy(frags + frame_len, input_ping_frame, sizeof(input_ping_frame));
+        memcpy(frags + frame_len + sizeof(input_ping_frame), frame, frame_len);
+        frags[frame_len + sizeof(input_ping_frame)] = 0x80;
+        max_read = 777;
+
+        pass(0 == feed(conn, frags, frame_len + 3, 5000),
+                                                      "Partial feed is fine");
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(1 == borrowed, "Buffer held mid-message");
+        pass(0 == feed(conn, frags + frame_len + 3,
+                       frame_len + sizeof(input_ping_frame) - 3, 3333),
+                                                              "Rest fed");
+        pass(1 == num_pings, "Ping between fragments");
+        pass(2 == num_messages && 132000 == strlen(last_message) &&
+             0 == strcmp(long66000, last_message + 66000),
+                                                "Fragments assembled");
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(0 == borrowed, "Buffer given back after message");
+        free(frags);
+        free(frame);
+        max_read = 1 << 20;
+        END_SET("Incremental parsing");
+
+
+        START_SET("Errors and limits");
+        pass(-1 == feed(conn, (uint8_t *)"\x80\x00", 2, 2),
+                                            "Continuation with no message");
+        pass(WS_FT_ERROR == last_type, "Handler told");
+
+        limits.max_message_len = 100;
+        ws_set_limits(&limits);
+        frame_len = ws_make_text_frame(long66000, NULL, &frame);
+        pass(-1 == feed(conn, frame, 10, 10), "Over the limit");
+        pass(WS_FT_TOO_BIG == last_type, "Handler told it's too big");
+        limits.max_message_len = 0;
+        ws_set_limits(&limits);
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(0 == borrowed, "Nothing held after errors");
+        ws_conn_free(conn);
+        END_SET("Errors and limits");
+
+
+        START_SET("Sending");
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock) != 0)
+                err(1, "Couldn't make sockets");
+        fcntl(sock[0], F_SETFL, O_NONBLOCK);
+        fcntl(sock[1], F_SETFL, O_NONBLOCK);
+        conn = ws_conn_new(sock[0]);
+
+        pass(0 == ws_conn_send(conn, socket_write, WS_FT_TEXT, "Hello", 5),
+                                                              "Sent short");
+        pass(!ws_conn_wants_write(conn), "Went straight out");
+        pass(7 == read(sock[1], buf, sizeof(buf)), "Frame arrived");
+
+        /* Fill the socket so the next sends have to wait */
+        for (i = 0; i < 100 && !ws_conn_wants_write(conn); i++)
+                ws_conn_send(conn, socket_write, WS_FT_TEXT, long66000, 66000);
+        pass(ws_conn_wants_write(conn), "Backed up");
+        ws_conn_send(conn, socket_write, WS_FT_PING, "p", 1);
+
+        while (ws_conn_flush(conn, socket_write) == 1) {
+                while (read(sock[1], last_message, 66000) > 0)
+                        ;
+        }
+        pass(!ws_conn_wants_write(conn), "Flushed");
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(0 == borrowed, "Send buffer given back");
+
+        ws_conn_free(conn);
+        close(sock[0]);
+        close(sock[1]);
+        free(frame);
+        END_SET("Sending");
+
+
+        START_SET("Idle connections");
+        getrlimit(RLIMIT_NOFILE, &rlim);
+        num_idle = (rlim.rlim_cur - 32) / 2;
+        if (num_idle > MAX_IDLE)
+                num_idle = MAX_IDLE;
+
+        for (i = 0; i < num_idle; i++) {
+                if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock) != 0)
+                        err(1, "Couldn't make sockets");
+                fcntl(sock[0], F_SETFL, O_NONBLOCK);
+                conns[i] = ws_conn_new(sock[0]);
+                write(sock[1], input_hello_frame, sizeof(input_hello_frame));
+                ws_conn_read(conns[i], socket_read, handler, NULL);
+                close(sock[1]);
+        }
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(0 == borrowed, "Idle connections hold no buffers");
+
+        for (i = 0; i < num_idle; i++) {
+                close(ws_conn_fd(conns[i]));
+                ws_conn_free(conns[i]);
+        }
+        END_SET("Idle connections");
+
+        return 0;
+}
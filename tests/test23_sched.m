@@ -0,0 +1,285 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+#define NUM_GOOD 10
+#define NUM_FLOOD 1000
+#define MAX_FD 1024
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static uint8_t input_hello_frame[] = {0x81, 0x05, 0x48, 0x65, 0x6c, 0x6c, 0x6f};
+
+/* Bytes available for the current "readable" event */
+static const uint8_t *source_bytes;
+static size_t source_left;
+
+static int num_messages[MAX_FD];
+static int last_type;
+
+static ssize_t read_bytes(int fd, char *ptr, size_t maxlen)
+{
+        if (source_left == 0) {
+                errno = EAGAIN;
+                return -1;
+        }
+        if (maxlen > source_left)
+                maxlen = source_left;
+        memcpy(ptr, source_bytes, maxlen);
+        source_bytes += maxlen;
+        source_left -= maxlen;
+        return maxlen;
+}
+
+static ssize_t socket_read(int fd, char *ptr, size_t maxlen)
+{
+        return read(fd, ptr, maxlen);
+}
+
+static void handler(int fd, enum WebsocketFrameType type, const char *message,
+                                                        size_t len, void *arg)
+{
+        last_type = type;
+        if (type == WS_FT_TEXT)
+                num_messages[fd]++;
+}
+
+/*
+ * Makes "n" hello frames back to back.
+ */
+static uint8_t *hellos(size_t n)
+{
+        uint8_t *result = malloc(n * sizeof(input_hello_frame));
+        size_t i;
+
+        for (i = 0; i < n; i++)
+                memcpy(result + i * sizeof(input_hello_frame),
+                       input_hello_frame, sizeof(input_hello_frame));
+        return result;
+}
+
+/*
+ * Makes a connection whose peer has already sent "n" hello frames.
+ */
+static WebsocketConn *new_sent(size_t n, int *peer_fd)
+{
+        uint8_t *frames = hellos(n);
+        int sock[2];
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock) != 0)
+                err(1, "Couldn't make sockets");
+        fcntl(sock[0], F_SETFL, O_NONBLOCK);
+        if (write(sock[1], frames, n * sizeof(input_hello_frame)) !=
+                                        n * sizeof(input_hello_frame))
+                err(1, "Couldn't write frames");
+        free(frames);
+
+        *peer_fd = sock[1];
+        return ws_conn_new(sock[0]);
+}
+
+static void free_conn(WebsocketConn *conn, int peer_fd)
+{
+        close(ws_conn_fd(conn));
+        close(peer_fd);
+        ws_conn_free(conn);
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        WebsocketRateLimits rates = {0, 0, 0, 0};
+        WebsocketScheduler *sched;
+        WebsocketConn *flood;
+        WebsocketConn *good[NUM_GOOD];
+        int good_peers[NUM_GOOD];
+        uint8_t *frames;
+        uint64_t pause_ns;
+        int64_t timeout_ns;
+        int flood_peer;
+        int flood_fd;
+        int all_good;
+        int result;
+        int i;
+
+        START_SET("Budgets");
+        frames = hellos(10);
+        source_bytes = frames;
+        source_left = 10 * sizeof(input_hello_frame);
+        flood = ws_conn_new(1);
+
+        pass(WS_CONN_MORE == ws_conn_read_budget(flood, read_bytes, handler,
+                                                         NULL, 3, 0),
+                                                  "Frame budget runs out");
+        pass(3 == num_messages[1], "Stopped after 3 frames");
+        pass(0 == source_left, "Whole chunk was read");
+        pass(WS_CONN_MORE == ws_conn_read_budget(flood, read_bytes, handler,
+                                                         NULL, 3, 0) &&
+             6 == num_messages[1], "Left over bytes come next");
+        pass(0 == ws_conn_read(flood, read_bytes, handler, NULL) &&
+             10 == num_messages[1], "No budget reads the rest");
+
+        source_bytes = frames;
+        source_left = 10 * sizeof(input_hello_frame);
+        pass(WS_CONN_MORE == ws_conn_read_budget(flood, read_bytes, handler,
+                                         NULL, 0, sizeof(input_hello_frame)),
+                                                   "Byte budget runs out");
+        pass(11 == num_messages[1] &&
+             9 * sizeof(input_hello_frame) == source_left,
+                                               "Read one frame's worth");
+        pass(0 == ws_conn_read(flood, read_bytes, handler, NULL) &&
+             20 == num_messages[1], "Read the rest");
+        ws_conn_free(flood);
+        END_SET("Budgets");
+
+
+        START_SET("Message rate");
+        memset(num_messages, 0, sizeof(num_messages));
+        rates.messages_per_sec = 100;
+        rates.messages_burst = 5;
+        ws_set_rate_limits(&rates);
+        source_bytes = frames;
+        source_left = 10 * sizeof(input_hello_frame);
+        flood = ws_conn_new(1);
+
+        pass(WS_CONN_PAUSED == ws_conn_read(flood, read_bytes, handler, NULL),
+                                                                   "Paused");
+        pass(5 == num_messages[1], "Burst of 5 delivered");
+        pause_ns = ws_conn_pause_ns(flood);
+        pass(pause_ns > 0 && pause_ns <= 10000000, "Waits one token's time");
+        pass(WS_CONN_PAUSED == ws_conn_read(flood, read_bytes, handler, NULL)
+             && 5 == num_messages[1], "Still paused");
+
+        usleep(pause_ns / 1000 + 1000);
+        pass(0 == ws_conn_pause_ns(flood), "Wait is over");
+        result = ws_conn_read(flood, read_bytes, handler, NULL);
+        pass(WS_CONN_PAUSED == result && num_messages[1] > 5 &&
+                                        num_messages[1] < 10, "Trickles on");
+
+        usleep(60000);
+        pass(0 == ws_conn_read(flood, read_bytes, handler, NULL) &&
+             10 == num_messages[1], "Caught up, still connected");
+        ws_conn_free(flood);
+        END_SET("Message rate");
+
+
+        START_SET("Byte rate");
+        memset(num_messages, 0, sizeof(num_messages));
+        rates.messages_per_sec = 0;
+        rates.messages_burst = 0;
+        rates.bytes_per_sec = 7000;
+        rates.bytes_burst = 3 * sizeof(input_hello_frame);
+        ws_set_rate_limits(&rates);
+        source_bytes = frames;
+        source_left = 10 * sizeof(input_hello_frame);
+        flood = ws_conn_new(1);
+
+        pass(WS_CONN_PAUSED == ws_conn_read(flood, read_bytes, handler, NULL),
+                                                                   "Paused");
+        pass(3 == num_messages[1] &&
+             7 * sizeof(input_hello_frame) == source_left,
+                                               "Only the burst was read");
+        pause_ns = ws_conn_pause_ns(flood);
+        pass(pause_ns > 0 && pause_ns <= 1000000, "Waits one byte's time");
+        ws_conn_free(flood);
+
+        rates.bytes_per_sec = 0;
+        rates.bytes_burst = 0;
+        ws_set_rate_limits(&rates);
+        free(frames);
+        END_SET("Byte rate");
+
+
+        START_SET("Fair turns");
+        memset(num_messages, 0, sizeof(num_messages));
+        sched = ws_sched_new(16, 0);
+        flood = new_sent(NUM_FLOOD, &flood_peer);
+        flood_fd = ws_conn_fd(flood);
+        ws_sched_ready(sched, flood);
+        for (i = 0; i < NUM_GOOD; i++) {
+                good[i] = new_sent(1, &good_peers[i]);
+                ws_sched_ready(sched, good[i]);
+        }
+        ws_sched_ready(sched, flood);
+
+        pass(0 == ws_sched_run(sched, socket_read, handler, NULL),
+                                                  "Flooder still queued");
+        pass(16 == num_messages[flood_fd], "Flooder had one turn");
+        all_good = 1;
+        for (i = 0; i < NUM_GOOD; i++)
+                all_good &= 1 == num_messages[ws_conn_fd(good[i])];
+        pass(all_good, "Everyone else was served in the same run");
+
+        while ((timeout_ns = ws_sched_run(sched, socket_read, handler,
+                                                                NULL)) == 0)
+                ;
+        pass(-1 == timeout_ns, "Nothing left to do");
+        pass(NUM_FLOOD == num_messages[flood_fd], "Flooder fully read");
+
+        /* Taking a queued connection out means it isn't read */
+        write(good_peers[0], input_hello_frame, sizeof(input_hello_frame));
+        ws_sched_ready(sched, good[0]);
+        ws_sched_remove(sched, good[0]);
+        ws_sched_run(sched, socket_read, handler, NULL);
+        pass(1 == num_messages[ws_conn_fd(good[0])], "Removed isn't read");
+
+        free_conn(flood, flood_peer);
+        for (i = 0; i < NUM_GOOD; i++)
+                free_conn(good[i], good_peers[i]);
+        END_SET("Fair turns");
+
+
+        START_SET("Paused in the scheduler");
+        memset(num_messages, 0, sizeof(num_messages));
+        rates.messages_per_sec = 1000;
+        rates.messages_burst = 10;
+        ws_set_rate_limits(&rates);
+        flood = new_sent(50, &flood_peer);
+        flood_fd = ws_conn_fd(flood);
+        good[0] = new_sent(1, &good_peers[0]);
+
+        ws_sched_ready(sched, flood);
+        timeout_ns = ws_sched_run(sched, socket_read, handler, NULL);
+        pass(timeout_ns > 0 && timeout_ns <= 1000000,
+                                              "Timeout until flooder resumes");
+        pass(10 == num_messages[flood_fd], "Flooder held to its burst");
+
+        ws_sched_ready(sched, flood);
+        ws_sched_ready(sched, good[0]);
+        ws_sched_run(sched, socket_read, handler, NULL);
+        pass(1 == num_messages[ws_conn_fd(good[0])],
+                                             "Others read while it's paused");
+
+        while ((timeout_ns = ws_sched_run(sched, socket_read, handler,
+                                                          NULL)) != -1)
+                if (timeout_ns > 0)
+                        usleep(timeout_ns / 1000 + 1);
+        pass(50 == num_messages[flood_fd], "Flooder read in the end");
+
+        free_conn(flood, flood_peer);
+        free_conn(good[0], good_peers[0]);
+        ws_sched_free(sched);
+        rates.messages_per_sec = 0;
+        rates.messages_burst = 0;
+        ws_set_rate_limits(&rates);
+        END_SET("Paused in the scheduler");
+
+        return 0;
+}
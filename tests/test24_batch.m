@@ -0,0 +1,219 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+#define MAX_CALLS 100
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static const char long66000txt[] = "./data/long-66000.txt";
+static char long66000[66000 + 1];
+
+static uint8_t mask[] = {0x37, 0xfa, 0x21, 0x3d};
+
+static uint8_t input_ping_frame[] = {0x89, 0x02, 'h', 'i'};
+static uint8_t input_close_frame[] = {0x88, 0x00};
+static uint8_t input_bad_frame[] = {0x80, 0x00};
+
+/* Bytes available for the current "readable" event */
+static const uint8_t *source_bytes;
+static size_t source_left;
+static size_t max_read;
+
+/* What each handler call was given */
+static int num_calls;
+static size_t batch_sizes[MAX_CALLS];
+static int num_hellos;
+static int num_pings;
+static int num_long;
+static int last_type;
+
+static ssize_t read_bytes(int fd, char *ptr, size_t maxlen)
+{
+        if (source_left == 0) {
+                errno = EAGAIN;
+                return -1;
+        }
+        if (maxlen > source_left)
+                maxlen = source_left;
+        if (maxlen > max_read)
+                maxlen = max_read;
+        memcpy(ptr, source_bytes, maxlen);
+        source_bytes += maxlen;
+        source_left -= maxlen;
+        return maxlen;
+}
+
+static void handler(int fd, const WebsocketMessage *messages,
+                                        size_t num_messages, void *arg)
+{
+        size_t i;
+
+        batch_sizes[num_calls++] = num_messages;
+        for (i = 0; i < num_messages; i++) {
+                last_type = messages[i].type;
+                if (messages[i].type == WS_FT_PING)
+                        num_pings += 2 == messages[i].len &&
+                                        0 == memcmp("hi", messages[i].data, 2);
+                else if (messages[i].type != WS_FT_TEXT)
+                        continue;
+                else if (5 == messages[i].len &&
+                                0 == memcmp("Hello", messages[i].data, 5))
+                        num_hellos++;
+                else if (132000 == messages[i].len &&
+                         0 == memcmp(long66000, messages[i].data, 66000) &&
+                         0 == memcmp(long66000, messages[i].data + 66000,
+                                                                     66000))
+                        num_long++;
+        }
+}
+
+static void reset()
+{
+        num_calls = 0;
+        num_hellos = 0;
+        num_pings = 0;
+        num_long = 0;
+        last_type = -2;
+}
+
+/*
+ * Appends a frame to buf at *len.
+ */
+static void add(uint8_t *buf, size_t *len, const uint8_t *frame,
+                                                        size_t frame_len)
+{
+        memcpy(buf + *len, frame, frame_len);
+        *len += frame_len;
+}
+
+static int read_all(WebsocketConn *conn, const uint8_t *bytes, size_t len,
+                                                        size_t max_batch)
+{
+        source_bytes = bytes;
+        source_left = len;
+        return ws_conn_read_batch(conn, read_bytes, handler, NULL, max_batch);
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        WebsocketConn *conn;
+        uint8_t *hello;
+        uint8_t *frame;
+        uint8_t *buf;
+        size_t hello_len;
+        size_t frame_len;
+        size_t borrowed, cached;
+        size_t len;
+        int i;
+
+        load_data((uint8_t *)long66000, 66000, long66000txt);
+        hello_len = ws_make_text_frame("Hello", mask, &hello);
+        buf = malloc(4 * 66100);
+        conn = ws_conn_new(1);
+        max_read = 1 << 20;
+
+        START_SET("Whole frames");
+        reset();
+        len = 0;
+        for (i = 0; i < 10; i++)
+                add(buf, &len, hello, hello_len);
+        pass(0 == read_all(conn, buf, len, 0), "Read dry");
+        pass(1 == num_calls && 10 == batch_sizes[0], "One batch of 10");
+        pass(10 == num_hellos, "Unmasked in place");
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(0 == borrowed, "Nothing borrowed");
+
+        reset();
+        pass(0 == read_all(conn, buf, len, 4), "Read dry");
+        pass(3 == num_calls && 4 == batch_sizes[0] && 4 == batch_sizes[1] &&
+             2 == batch_sizes[2], "Batches of at most 4");
+        END_SET("Whole frames");
+
+
+        START_SET("Split frames");
+        /* Reads of 10 bytes split every other frame */
+        reset();
+        len = 0;
+        for (i = 0; i < 10; i++)
+                add(buf, &len, hello, hello_len);
+        max_read = 10;
+        pass(0 == read_all(conn, buf, len, 0), "Read dry");
+        pass(10 == num_hellos, "All delivered");
+        max_read = 1 << 20;
+
+        /* The end of a split frame shares a batch with whole ones */
+        reset();
+        source_bytes = buf;
+        source_left = 4;
+        ws_conn_read_batch(conn, read_bytes, handler, NULL, 0);
+        pass(0 == num_calls, "Nothing yet");
+        source_left = len - 4;
+        pass(0 == ws_conn_read_batch(conn, read_bytes, handler, NULL, 0),
+                                                            "Read dry");
+        pass(1 == num_calls && 10 == batch_sizes[0], "One batch of 10");
+        pass(10 == num_hellos, "All delivered");
+
+        /* Fragments, with a ping in between, then more frames */
+        reset();
+        frame_len = ws_make_text_frame(long66000, mask, &frame);
+        len = 0;
+        add(buf, &len, frame, frame_len);
+        buf[0] &= ~0x80;
+        add(buf, &len, input_ping_frame, sizeof(input_ping_frame));
+        add(buf, &len, frame, frame_len);
+        buf[frame_len + sizeof(input_ping_frame)] = 0x80;
+        add(buf, &len, hello, hello_len);
+        max_read = 5000;
+        pass(0 == read_all(conn, buf, len, 0), "Read dry");
+        pass(1 == num_pings && 1 == num_long && 1 == num_hellos,
+                                                  "Fragments assembled");
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(0 == borrowed, "Buffer given back");
+        max_read = 1 << 20;
+        free(frame);
+        END_SET("Split frames");
+
+
+        START_SET("Endings");
+        reset();
+        len = 0;
+        add(buf, &len, hello, hello_len);
+        add(buf, &len, hello, hello_len);
+        add(buf, &len, input_close_frame, sizeof(input_close_frame));
+        pass(-1 == read_all(conn, buf, len, 0), "Closed");
+        pass(1 == num_calls && 3 == batch_sizes[0] && WS_FT_CLOSE == last_type,
+                                                   "Close ends the batch");
+        ws_conn_free(conn);
+
+        reset();
+        conn = ws_conn_new(1);
+        len = 0;
+        add(buf, &len, hello, hello_len);
+        add(buf, &len, input_bad_frame, sizeof(input_bad_frame));
+        pass(-1 == read_all(conn, buf, len, 0), "Failed");
+        pass(2 == num_calls && 1 == batch_sizes[0] && 1 == batch_sizes[1] &&
+             WS_FT_ERROR == last_type && 1 == num_hellos,
+                                           "Good message, then the error");
+        ws_conn_free(conn);
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(0 == borrowed, "Nothing held");
+        END_SET("Endings");
+
+        free(hello);
+        free(buf);
+        return 0;
+}
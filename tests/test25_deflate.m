@@ -0,0 +1,272 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <zlib.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+#define MAX_FD 64
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static const char long66000txt[] = "./data/long-66000.txt";
+static char long66000[66000 + 1];
+
+static const char request[] =
+        "GET /chat HTTP/1.1\r\n"
+        "Host: server.example.com\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "%s"
+        "\r\n";
+
+/* What each fd was last sent */
+static uint8_t first_byte[MAX_FD];
+static size_t bytes_written[MAX_FD];
+
+/* Bytes available for the current "readable" event */
+static const uint8_t *source_bytes;
+static size_t source_left;
+
+static int last_type;
+static size_t last_len;
+static int last_ok;
+
+static ssize_t write_bytes(int fd, const void *ptr, size_t len)
+{
+        first_byte[fd] = *(const uint8_t *)ptr;
+        bytes_written[fd] = len;
+        return len;
+}
+
+static ssize_t read_bytes(int fd, char *ptr, size_t maxlen)
+{
+        if (source_left == 0) {
+                errno = EAGAIN;
+                return -1;
+        }
+        if (maxlen > source_left)
+                maxlen = source_left;
+        memcpy(ptr, source_bytes, maxlen);
+        source_bytes += maxlen;
+        source_left -= maxlen;
+        return maxlen;
+}
+
+static void handler(int fd, enum WebsocketFrameType type, const char *message,
+                                                        size_t len, void *arg)
+{
+        last_type = type;
+        last_len = len;
+        last_ok = type == WS_FT_TEXT && len == 66000 &&
+                                        0 == strcmp(message, long66000);
+}
+
+static void batch_handler(int fd, const WebsocketMessage *messages,
+                                        size_t num_messages, void *arg)
+{
+        last_type = messages[0].type;
+        last_len = messages[0].len;
+        last_ok = num_messages == 1 && last_type == WS_FT_TEXT &&
+                  last_len == 66000 &&
+                  0 == memcmp(messages[0].data, long66000, 66000);
+}
+
+static const char *handshake(const char *extensions, int *deflate_p)
+{
+        static char buf[1000];
+
+        snprintf(buf, sizeof(buf), request, extensions);
+        return ws_complete_handshake_deflate(buf, deflate_p);
+}
+
+/*
+ * Inflates a frame's payload (which must have a 4 byte length) and checks it
+ * against the message.
+ */
+static int inflates_to(const uint8_t *frame, size_t frame_len,
+                                                        const char *message)
+{
+        static const uint8_t tail[] = {0x00, 0x00, 0xff, 0xff};
+        size_t payload_len = frame_len - 4;
+        uint8_t *in = malloc(payload_len + sizeof(tail));
+        char *out = malloc(strlen(message) + 1);
+        z_stream zs;
+        int result;
+
+        memcpy(in, frame + 4, payload_len);
+        memcpy(in + payload_len, tail, sizeof(tail));
+        memset(&zs, 0, sizeof(zs));
+        inflateInit2(&zs, -MAX_WBITS);
+        zs.next_in = in;
+        zs.avail_in = payload_len + sizeof(tail);
+        zs.next_out = (Bytef *)out;
+        zs.avail_out = strlen(message) + 1;
+        inflate(&zs, Z_SYNC_FLUSH);
+        result = zs.total_out == strlen(message) &&
+                                0 == memcmp(out, message, zs.total_out);
+        inflateEnd(&zs);
+        free(in);
+        free(out);
+        return result;
+}
+
+static int feed(WebsocketConn *conn, const uint8_t *bytes, size_t len)
+{
+        source_bytes = bytes;
+        source_left = len;
+        return ws_conn_read(conn, read_bytes, handler, NULL);
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        WebsocketChannels *channels;
+        WebsocketMetrics before, after;
+        WebsocketLimits limits = {0, 0, 0};
+        WebsocketConn *conn;
+        const char *response;
+        uint8_t *frame;
+        uint8_t *frags;
+        uint8_t header[WS_MAX_FRAME_HEADER_LEN];
+        size_t frame_len;
+        size_t header_len;
+        size_t frags_len;
+        size_t borrowed, cached;
+        int deflate;
+
+        load_data((uint8_t *)long66000, 66000, long66000txt);
+
+        START_SET("Negotiation");
+        response = handshake("Sec-WebSocket-Extensions: permessage-deflate; "
+                             "client_max_window_bits\r\n", &deflate);
+        pass(1 == deflate, "Deflate offered and agreed");
+        pass(NULL != strstr(response, "permessage-deflate; "
+                 "server_no_context_takeover; client_no_context_takeover"),
+                                                   "Without context takeover");
+        free((void *)response);
+
+        response = handshake("", &deflate);
+        pass(0 == deflate && NULL == strstr(response, "Extensions"),
+                                                         "Nothing offered");
+        free((void *)response);
+
+        response = handshake("Sec-WebSocket-Extensions: permessage-deflate; "
+                             "server_max_window_bits=10\r\n", &deflate);
+        pass(0 == deflate && NULL == strstr(response, "Extensions"),
+                                             "Smaller window turned down");
+        free((void *)response);
+        END_SET("Negotiation");
+
+
+        START_SET("Compressed frames");
+        frame_len = ws_make_deflate_frame(long66000, &frame);
+        pass(frame_len > 4 && frame_len < 66000, "Smaller than the message");
+        pass(0xc1 == frame[0] && 126 == frame[1], "FIN, RSV1 and text");
+        pass(inflates_to(frame, frame_len, long66000), "Inflates back");
+        END_SET("Compressed frames");
+
+
+        START_SET("Fan-out");
+        channels = ws_channels_new();
+        ws_channel_subscribe_deflate(channels, "news", 1);
+        ws_channel_subscribe(channels, "news", 2);
+        ws_channel_subscribe_deflate(channels, "news", 3);
+        ws_channel_subscribe(channels, "news", 4);
+        ws_channel_subscribe_deflate(channels, "news", 5);
+
+        ws_metrics_snapshot(&before);
+        pass(5 == ws_channel_publish(channels, "news", long66000, write_bytes),
+                                                         "Sent to everyone");
+        ws_metrics_snapshot(&after);
+        pass(2 == after.frames_out[1] - before.frames_out[1],
+                                                     "Encoded only twice");
+        pass(0xc1 == first_byte[1] && 0xc1 == first_byte[3] &&
+             0xc1 == first_byte[5] && frame_len == bytes_written[5],
+                                            "Compressed to deflate subscribers");
+        pass(0x81 == first_byte[2] && 0x81 == first_byte[4] &&
+             66010 == bytes_written[4], "Plain to the rest");
+
+        memset(first_byte, 0, sizeof(first_byte));
+        ws_channel_unsubscribe(channels, "news", 1);
+        ws_channel_unsubscribe(channels, "news", 4);
+        pass(3 == ws_channel_publish(channels, "news", long66000, write_bytes),
+                                                     "Sent after leaving");
+        pass(0 == first_byte[1] && 0 == first_byte[4] &&
+             0xc1 == first_byte[3] && 0xc1 == first_byte[5] &&
+             0x81 == first_byte[2], "Groups kept apart");
+
+        pass(3 == ws_channel_publish(channels, "news", "hi", write_bytes),
+                                                          "Sent short one");
+        pass(0x81 == first_byte[3] && 4 == bytes_written[3],
+                                       "Plain when deflate doesn't help");
+        ws_channels_free(channels);
+        END_SET("Fan-out");
+
+
+        START_SET("Compressed messages in");
+        conn = ws_conn_new(1);
+        pass(-1 == feed(conn, frame, frame_len) && WS_FT_ERROR == last_type,
+                                                    "Refused unless agreed");
+        ws_conn_free(conn);
+
+        conn = ws_conn_new(1);
+        ws_conn_enable_deflate(conn);
+        pass(0 == feed(conn, frame, frame_len) && last_ok, "Inflated");
+
+        /* The same payload split over two frames */
+        frags = malloc(frame_len + 2 * WS_MAX_FRAME_HEADER_LEN);
+        header_len = ws_make_frame_header(0x41, 100, NULL, header);
+        memcpy(frags, header, header_len);
+        memcpy(frags + header_len, frame + 4, 100);
+        frags_len = header_len + 100;
+        header_len = ws_make_frame_header(0x80, frame_len - 104, NULL, header);
+        memcpy(frags + frags_len, header, header_len);
+        memcpy(frags + frags_len + header_len, frame + 104, frame_len - 104);
+        frags_len += header_len + frame_len - 104;
+        last_ok = 0;
+        pass(0 == feed(conn, frags, frags_len) && last_ok,
+                                                 "Inflated from fragments");
+
+        source_bytes = frame;
+        source_left = frame_len;
+        last_ok = 0;
+        pass(0 == ws_conn_read_batch(conn, read_bytes, batch_handler, NULL, 0)
+             && last_ok, "Inflated in a batch");
+
+        limits.max_message_len = 1000;
+        ws_set_limits(&limits);
+        pass(-1 == feed(conn, frame, frame_len) && WS_FT_TOO_BIG == last_type,
+                                                   "Inflating is limited");
+        limits.max_message_len = 0;
+        ws_set_limits(&limits);
+        ws_conn_free(conn);
+
+        conn = ws_conn_new(1);
+        ws_conn_enable_deflate(conn);
+        frame[10] ^= 0xff;
+        frame[11] ^= 0xff;
+        pass(-1 == feed(conn, frame, frame_len) && WS_FT_ERROR == last_type,
+                                                        "Corrupt refused");
+        ws_conn_free(conn);
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(0 == borrowed, "Nothing held");
+        free(frags);
+        free(frame);
+        END_SET("Compressed messages in");
+
+        return 0;
+}
@@ -0,0 +1,167 @@
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+#define NUM_ROUND_TRIPS 20000
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static const char long66000txt[] = "./data/long-66000.txt";
+static char long66000[66000 + 1];
+
+
+/*
+ * Sends back everything it's given, with the connection id plus one, until a
+ * close arrives.
+ */
+static void worker(WebsocketRing *in, WebsocketRing *out)
+{
+        WebsocketRingMessage msg;
+
+        while (1) {
+                if (!ws_ring_peek(in, &msg)) {
+                        ws_ring_wait(in, -1);
+                        continue;
+                }
+                if (msg.type == WS_FT_CLOSE)
+                        _exit(0);
+                if (msg.data[msg.len] != '\0')
+                        _exit(1);
+
+                while (ws_ring_push(out, msg.conn_id + 1, msg.type, msg.data,
+                                                                msg.len) != 0)
+                        usleep(10);
+                ws_ring_release(in);
+        }
+}
+
+static size_t message_len(int i)
+{
+        return (i * 7919) % 3000;
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        WebsocketRing *ring;
+        WebsocketRing *requests;
+        WebsocketRing *replies;
+        WebsocketRingMessage msg;
+        pid_t pid;
+        int status;
+        int num_sent;
+        int num_replies;
+        int num_bad;
+        int i;
+
+        load_data((uint8_t *)long66000, 66000, long66000txt);
+
+        START_SET("One process");
+        ring = ws_ring_new(100);
+        pass(NULL != ring, "Made");
+        pass(0 == ws_ring_peek(ring, &msg), "Empty");
+        pass(0 == ws_ring_wait(ring, 10), "Wait timed out");
+
+        pass(0 == ws_ring_push(ring, 42, WS_FT_TEXT, "Hello", 5), "Pushed");
+        pass(1 == ws_ring_wait(ring, -1), "Wait sees it");
+        pass(1 == ws_ring_peek(ring, &msg), "Peeked");
+        pass(42 == msg.conn_id && WS_FT_TEXT == msg.type && 5 == msg.len &&
+             0 == strcmp("Hello", msg.data), "Message intact");
+        pass(1 == ws_ring_peek(ring, &msg) && 42 == msg.conn_id,
+                                                "Still there until released");
+        ws_ring_release(ring);
+        pass(0 == ws_ring_peek(ring, &msg), "Released");
+
+        errno = 0;
+        pass(-1 == ws_ring_push(ring, 1, WS_FT_TEXT, long66000, 3000) &&
+                                         EMSGSIZE == errno, "Too big to fit");
+
+        for (num_sent = 0; num_sent < 100; num_sent++)
+                if (ws_ring_push(ring, num_sent, WS_FT_PING, long66000,
+                                                                   1000) != 0)
+                        break;
+        pass(EAGAIN == errno && num_sent > 0 && num_sent < 5, "Filled up");
+
+        /* Drain and refill a few times to wrap around */
+        num_bad = 0;
+        num_replies = 0;
+        for (i = 0; i < 1000; i++) {
+                while (ws_ring_push(ring, num_sent, WS_FT_TEXT,
+                                long66000 + num_sent % 100,
+                                message_len(num_sent) % 1500) == 0)
+                        num_sent++;
+                while (ws_ring_peek(ring, &msg)) {
+                        if (msg.conn_id >= 5 && (msg.len !=
+                                message_len(msg.conn_id) % 1500 ||
+                            0 != memcmp(msg.data, long66000 +
+                                msg.conn_id % 100, msg.len)))
+                                num_bad++;
+                        num_replies++;
+                        ws_ring_release(ring);
+                }
+        }
+        pass(num_replies == num_sent && 0 == num_bad, "Wrapped intact");
+        ws_ring_free(ring);
+        END_SET("One process");
+
+
+        START_SET("Front and worker processes");
+        requests = ws_ring_new(64 * 1024);
+        replies = ws_ring_new(64 * 1024);
+        if ((pid = fork()) < 0)
+                err(1, "Couldn't fork");
+        if (pid == 0)
+                worker(requests, replies);
+
+        num_sent = 0;
+        num_replies = 0;
+        num_bad = 0;
+        while (num_replies < NUM_ROUND_TRIPS) {
+                while (num_sent < NUM_ROUND_TRIPS &&
+                       ws_ring_push(requests, num_sent, WS_FT_TEXT,
+                                    long66000 + num_sent % 1000,
+                                    message_len(num_sent)) == 0)
+                        num_sent++;
+
+                if (!ws_ring_peek(replies, &msg)) {
+                        ws_ring_wait(replies, 10);
+                        continue;
+                }
+                if (msg.conn_id != (uint64_t)num_replies + 1 ||
+                    msg.len != message_len(num_replies) ||
+                    0 != memcmp(msg.data, long66000 + num_replies % 1000,
+                                                                msg.len))
+                        num_bad++;
+                num_replies++;
+                ws_ring_release(replies);
+        }
+        pass(0 == num_bad, "Every reply came back in order");
+
+        while (ws_ring_push(requests, 0, WS_FT_CLOSE, "", 0) != 0)
+                usleep(10);
+        waitpid(pid, &status, 0);
+        pass(WIFEXITED(status) && 0 == WEXITSTATUS(status),
+                                                      "Worker saw NULs");
+        ws_ring_free(requests);
+        ws_ring_free(replies);
+        END_SET("Front and worker processes");
+
+        return 0;
+}
@@ -0,0 +1,191 @@
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+#define MAX_PAIRS 500
+#define MESSAGES_PER_CLIENT 3
+#define NUM_ACCEPTS 3
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static const char long66000txt[] = "./data/long-66000.txt";
+static char long66000[66000 + 1];
+
+static uint8_t mask[] = {0x37, 0xfa, 0x21, 0x3d};
+
+static int num_echoed;
+static int num_good;
+static int num_servers_done;
+
+/*
+ * Writes all of a frame, blocking (that is, yielding) as needed.
+ */
+static int write_all(int fd, const uint8_t *frame, size_t len)
+{
+        ssize_t n;
+
+        while (len > 0) {
+                if ((n = ws_green_write(fd, frame, len)) <= 0)
+                        return -1;
+                frame += n;
+                len -= n;
+        }
+        return 0;
+}
+
+/*
+ * An unchanged blocking-style handler: echoes messages until the client
+ * hangs up.
+ */
+static void server(int fd, void *arg)
+{
+        enum WebsocketFrameType type;
+        uint8_t *frame;
+        size_t frame_len;
+        char *message;
+
+        while ((type = ws_read_next_message(fd, ws_green_read, &message)) ==
+                                                                WS_FT_TEXT) {
+                frame_len = ws_make_text_frame(message, NULL, &frame);
+                ws_free_message(message);
+                if (write_all(fd, frame, frame_len) != 0)
+                        break;
+                free(frame);
+                num_echoed++;
+        }
+        num_servers_done++;
+}
+
+/*
+ * Sends a few long messages before reading any replies, so both ends have to
+ * block part way.
+ */
+static void client(int fd, void *arg)
+{
+        uint8_t *frame;
+        size_t frame_len;
+        char *message;
+        int i;
+
+        frame_len = ws_make_text_frame(long66000, mask, &frame);
+        for (i = 0; i < MESSAGES_PER_CLIENT; i++)
+                write_all(fd, frame, frame_len);
+        free(frame);
+
+        for (i = 0; i < MESSAGES_PER_CLIENT; i++) {
+                if (ws_read_next_message(fd, ws_green_read, &message) !=
+                                                                WS_FT_TEXT)
+                        return;
+                if (0 == strcmp(long66000, message))
+                        num_good++;
+                ws_free_message(message);
+        }
+}
+
+/*
+ * Hands NUM_ACCEPTS connections to server green threads.
+ */
+static void accept_loop(int fd, void *arg)
+{
+        WebsocketGreen *rt = arg;
+        int num_accepted = 0;
+        int connfd;
+
+        while (num_accepted < NUM_ACCEPTS) {
+                if ((connfd = accept(fd, NULL, NULL)) >= 0) {
+                        ws_green_spawn(rt, connfd, server, NULL);
+                        num_accepted++;
+                        continue;
+                }
+                if (errno != EAGAIN || ws_green_wait(EPOLLIN) != 0)
+                        return;
+        }
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        WebsocketGreen *rt;
+        struct rlimit rlim;
+        struct sockaddr_in addr;
+        socklen_t addr_len;
+        int listenfd;
+        int sock[2];
+        int num_pairs;
+        int i;
+
+        load_data((uint8_t *)long66000, 66000, long66000txt);
+
+        getrlimit(RLIMIT_NOFILE, &rlim);
+        num_pairs = (rlim.rlim_cur - 32) / 2;
+        if (num_pairs > MAX_PAIRS)
+                num_pairs = MAX_PAIRS;
+
+        START_SET("Blocking handlers on green threads");
+        rt = ws_green_new(0);
+        pass(NULL != rt, "Made");
+
+        for (i = 0; i < num_pairs; i++) {
+                if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock) != 0)
+                        err(1, "Couldn't make sockets");
+                ws_green_spawn(rt, sock[0], server, NULL);
+                ws_green_spawn(rt, sock[1], client, NULL);
+        }
+        pass(0 == ws_green_run(rt), "Ran to the end");
+        pass(num_pairs * MESSAGES_PER_CLIENT == num_echoed,
+                                                  "Every message echoed");
+        pass(num_pairs * MESSAGES_PER_CLIENT == num_good,
+                                                 "Every echo came back");
+        pass(num_pairs == num_servers_done, "Servers saw hang ups");
+        pass(-1 == ws_green_wait(EPOLLIN), "Can't wait outside");
+        END_SET("Blocking handlers on green threads");
+
+
+        START_SET("Accept loop");
+        num_echoed = 0;
+        num_good = 0;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr_len = sizeof(addr);
+        listenfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(listenfd, 16) != 0 ||
+            getsockname(listenfd, (struct sockaddr *)&addr, &addr_len) != 0)
+                err(1, "Couldn't listen");
+        ws_green_spawn(rt, listenfd, accept_loop, rt);
+
+        for (i = 0; i < NUM_ACCEPTS; i++) {
+                sock[0] = socket(AF_INET, SOCK_STREAM, 0);
+                if (connect(sock[0], (struct sockaddr *)&addr,
+                                                        sizeof(addr)) != 0)
+                        err(1, "Couldn't connect");
+                ws_green_spawn(rt, sock[0], client, NULL);
+        }
+        pass(0 == ws_green_run(rt), "Ran to the end");
+        pass(NUM_ACCEPTS * MESSAGES_PER_CLIENT == num_good,
+                                           "Accepted connections echoed");
+        ws_green_free(rt);
+        END_SET("Accept loop");
+
+        return 0;
+}
@@ -0,0 +1,211 @@
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static const char long66000txt[] = "./data/long-66000.txt";
+static char long66000[66000 + 1];
+
+static const char cert_path[] = "/tmp/test28_tls_cert.pem";
+static const char key_path[] = "/tmp/test28_tls_key.pem";
+
+static uint8_t mask[] = {0x37, 0xfa, 0x21, 0x3d};
+
+static struct sockaddr_in addr;
+static int echo_ok;
+
+/*
+ * Makes a throwaway self-signed certificate.
+ */
+static void make_cert()
+{
+        EVP_PKEY *key;
+        X509 *cert;
+        FILE *file;
+
+        key = EVP_PKEY_Q_keygen(NULL, NULL, "EC", "P-256");
+        cert = X509_new();
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+        X509_set_pubkey(cert, key);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN",
+                               MBSTRING_ASC, (uint8_t *)"localhost", -1, -1, 0);
+        X509_set_issuer_name(cert, X509_get_subject_name(cert));
+        X509_sign(cert, key, EVP_sha256());
+
+        if ((file = fopen(cert_path, "w")) == NULL)
+                err(1, "Couldn't write certificate");
+        PEM_write_X509(file, cert);
+        fclose(file);
+        if ((file = fopen(key_path, "w")) == NULL)
+                err(1, "Couldn't write key");
+        PEM_write_PrivateKey(file, key, NULL, NULL, 0, NULL, NULL);
+        fclose(file);
+
+        X509_free(cert);
+        EVP_PKEY_free(key);
+}
+
+static int read_all(SSL *ssl, uint8_t *buf, size_t len)
+{
+        int n;
+
+        while (len > 0) {
+                if ((n = SSL_read(ssl, buf, len)) <= 0)
+                        return -1;
+                buf += n;
+                len -= n;
+        }
+        return 0;
+}
+
+/*
+ * Sends a long masked message over TLS and checks the echo.
+ */
+static void *client(void *arg)
+{
+        SSL_CTX *ctx;
+        SSL *ssl;
+        uint8_t *frame;
+        uint8_t *echo;
+        size_t frame_len;
+        int fd;
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+                err(1, "Couldn't connect");
+
+        ctx = SSL_CTX_new(TLS_client_method());
+        ssl = SSL_new(ctx);
+        SSL_set_fd(ssl, fd);
+        if (SSL_connect(ssl) != 1)
+                return NULL;
+
+        frame_len = ws_make_text_frame(long66000, mask, &frame);
+        SSL_write(ssl, frame, frame_len);
+        free(frame);
+
+        echo = malloc(66010);
+        echo_ok = read_all(ssl, echo, 66010) == 0 && echo[0] == 0x81 &&
+                  0 == memcmp(echo + 10, long66000, 66000);
+        free(echo);
+
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        SSL_CTX_free(ctx);
+        close(fd);
+        return NULL;
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        WebsocketTls *tls;
+        WebsocketConn *conn;
+        pthread_t thread;
+        socklen_t addr_len;
+        uint8_t *frame;
+        size_t frame_len;
+        ssize_t n;
+        char *message;
+        char buf[10];
+        int listenfd;
+        int pair[2];
+        int fd;
+        int sent;
+
+        load_data((uint8_t *)long66000, 66000, long66000txt);
+        make_cert();
+
+        START_SET("Setup");
+        pass(NULL == ws_tls_new("/nonexistent.pem", key_path),
+                                                 "Missing certificate");
+        tls = ws_tls_new(cert_path, key_path);
+        pass(NULL != tls, "Loaded certificate");
+        pass(0 == ws_tls_ktls_send(0), "Plain fd isn't kTLS");
+        pass(-1 == ws_tls_read(0, buf, sizeof(buf)) && EBADF == errno,
+                                                 "Plain fd isn't TLS");
+        END_SET("Setup");
+
+
+        START_SET("Echo over TLS");
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr_len = sizeof(addr);
+        listenfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(listenfd, 16) != 0 ||
+            getsockname(listenfd, (struct sockaddr *)&addr, &addr_len) != 0)
+                err(1, "Couldn't listen");
+        pthread_create(&thread, NULL, client, NULL);
+
+        fd = accept(listenfd, NULL, NULL);
+        pass(0 == ws_tls_accept(tls, fd), "Handshake done");
+        pass(WS_FT_TEXT == ws_read_next_message(fd, ws_tls_read, &message),
+                                                     "Read through TLS");
+        pass(0 == strcmp(long66000, message), "Message intact");
+
+        frame_len = ws_make_text_frame(message, NULL, &frame);
+        ws_free_message(message);
+        for (sent = 0; sent < frame_len; sent += n)
+                if ((n = ws_tls_write(fd, frame + sent, frame_len - sent)) <= 0)
+                        break;
+        free(frame);
+        pthread_join(thread, NULL);
+        pass(echo_ok, "Echo came back");
+
+        /* Without kTLS, writing to the fd directly would leak plaintext */
+        if (ws_tls_ktls_send(fd))
+                pass(1, "Kernel is encrypting");
+        else
+                pass(-1 == ws_send_file(fd, 0, 0, 1, 0) &&
+                                        EPROTONOSUPPORT == errno,
+                                        "No sendfile without kTLS");
+
+        /* The session can't go with the fd to another process */
+        socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        conn = ws_conn_new(fd);
+        pass(-1 == ws_conn_send_to(pair[0], conn) && EOPNOTSUPP == errno,
+                                             "TLS connection not handed over");
+        pass(-1 == recv(pair[1], buf, sizeof(buf), MSG_DONTWAIT) &&
+                                         EAGAIN == errno, "Nothing was sent");
+        ws_conn_free(conn);
+        close(pair[0]);
+        close(pair[1]);
+
+        ws_tls_close(fd);
+        pass(0 == ws_tls_ktls_send(fd), "Session gone");
+        close(fd);
+        close(listenfd);
+        ws_tls_free(tls);
+        unlink(cert_path);
+        unlink(key_path);
+        END_SET("Echo over TLS");
+
+        return 0;
+}
@@ -0,0 +1,279 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static const char long66000txt[] = "./data/long-66000.txt";
+static char long66000[66000 + 1];
+
+static uint8_t mask[] = {0x37, 0xfa, 0x21, 0x3d};
+
+static uint8_t input_hello_frame[] = {0x81, 0x05, 0x48, 0x65, 0x6c, 0x6c, 0x6f};
+static uint8_t input_ping_frame[] = {0x89, 0x02, 'h', 'i'};
+
+/* Bytes available for the current "readable" event */
+static const uint8_t *source_bytes;
+static size_t source_left;
+
+static int num_messages;
+static int num_pings;
+static char last_message[66000 * 2 + 1];
+
+static ssize_t read_bytes(int fd, char *ptr, size_t maxlen)
+{
+        if (source_left == 0) {
+                errno = EAGAIN;
+                return -1;
+        }
+        if (maxlen > source_left)
+                maxlen = source_left;
+        memcpy(ptr, source_bytes, maxlen);
+        source_bytes += maxlen;
+        source_left -= maxlen;
+        return maxlen;
+}
+
+static ssize_t socket_read(int fd, char *ptr, size_t maxlen)
+{
+        return read(fd, ptr, maxlen);
+}
+
+static ssize_t socket_write(int fd, const void *ptr, size_t len)
+{
+        return write(fd, ptr, len);
+}
+
+static void handler(int fd, enum WebsocketFrameType type, const char *message,
+                                                        size_t len, void *arg)
+{
+        if (type == WS_FT_TEXT) {
+                num_messages++;
+                memcpy(last_message, message, len + 1);
+        }
+        else if (type == WS_FT_PING)
+                num_pings++;
+}
+
+/*
+ * Moves a connection to a new one through an image, as another shard
+ * would.
+ */
+static WebsocketConn *move(WebsocketConn *conn)
+{
+        WebsocketConn *result;
+        uint8_t *image;
+        size_t image_len;
+
+        image_len = ws_conn_export(conn, &image);
+        result = ws_conn_import(ws_conn_fd(conn), image, image_len);
+        ws_conn_free(conn);
+        free(image);
+        return result;
+}
+
+/*
+ * Two masked fragments of long66000 each.
+ */
+static size_t make_fragments(uint8_t **frags_p)
+{
+        uint8_t *frame;
+        uint8_t *frags;
+        size_t frame_len;
+
+        frame_len = ws_make_text_frame(long66000, mask, &frame);
+        frags = malloc(2 * frame_len);
+        memcpy(frags, frame, frame_len);
+        frags[0] &= ~0x80;
+        memcpy(frags + frame_len, frame, frame_len);
+        frags[frame_len] = 0x80;
+        free(frame);
+
+        *frags_p = frags;
+        return 2 * frame_len;
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        WebsocketConn *conn;
+        WebsocketScheduler *scheds[2];
+        uint8_t *frags;
+        uint8_t *image;
+        uint8_t bytes[sizeof(input_ping_frame) + sizeof(input_hello_frame)];
+        uint64_t loads[4];
+        size_t frags_len;
+        size_t image_len;
+        size_t borrowed, cached;
+        size_t from, to;
+        char buf[70000];
+        ssize_t n;
+        pid_t pid;
+        int status;
+        int sock[2];
+        int ctl[2];
+        int i;
+
+        load_data((uint8_t *)long66000, 66000, long66000txt);
+        frags_len = make_fragments(&frags);
+
+        START_SET("Moving part way through");
+        conn = ws_conn_new(1);
+        conn = move(conn);
+        pass(NULL != conn, "Idle connection moved");
+
+        /* Stop in the second fragment's payload, then again in its header */
+        source_bytes = frags;
+        source_left = 66014 + 1000;
+        ws_conn_read(conn, read_bytes, handler, NULL);
+        conn = move(conn);
+        source_left = 66014 - 1000 - 2;
+        ws_conn_read(conn, read_bytes, handler, NULL);
+        conn = move(conn);
+        source_left = 2;
+        pass(0 == ws_conn_read(conn, read_bytes, handler, NULL) &&
+             1 == num_messages && 132000 == strlen(last_message) &&
+             0 == strcmp(long66000, last_message + 66000),
+                                                 "Message finished after");
+
+        /* Bytes read but not yet parsed go along too */
+        memcpy(bytes, input_ping_frame, sizeof(input_ping_frame));
+        memcpy(bytes + sizeof(input_ping_frame), input_hello_frame,
+                                                  sizeof(input_hello_frame));
+        source_bytes = bytes;
+        source_left = sizeof(bytes);
+        pass(WS_CONN_MORE == ws_conn_read_budget(conn, read_bytes, handler,
+                                        NULL, 1, 0), "Stopped after a frame");
+        conn = move(conn);
+        pass(0 == ws_conn_read(conn, read_bytes, handler, NULL) &&
+             1 == num_pings && 2 == num_messages &&
+             0 == strcmp("Hello", last_message), "Kept bytes parsed after");
+
+        image_len = ws_conn_export(conn, &image);
+        image[0] ^= 0xff;
+        pass(NULL == ws_conn_import(1, image, image_len), "Bad image");
+        pass(NULL == ws_conn_import(1, image, 10), "Short image");
+        free(image);
+        ws_conn_free(conn);
+        END_SET("Moving part way through");
+
+
+        START_SET("Moving with unsent bytes");
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock) != 0)
+                err(1, "Couldn't make sockets");
+        fcntl(sock[0], F_SETFL, O_NONBLOCK);
+        fcntl(sock[1], F_SETFL, O_NONBLOCK);
+        conn = ws_conn_new(sock[0]);
+        for (i = 0; i < 100 && !ws_conn_wants_write(conn); i++)
+                ws_conn_send(conn, socket_write, WS_FT_TEXT, long66000, 66000);
+        ws_conn_send(conn, socket_write, WS_FT_TEXT, "last", 4);
+        conn = move(conn);
+        pass(ws_conn_wants_write(conn), "Still has bytes to send");
+
+        while (ws_conn_flush(conn, socket_write) == 1)
+                while (read(sock[1], buf, sizeof(buf)) > 0)
+                        ;
+        while ((n = read(sock[1], buf, sizeof(buf))) > 0)
+                image_len = n;
+        pass(image_len >= 6 && 0 == memcmp(buf + image_len - 6, "\x81\x04last",
+                                                  6), "Sent in order after");
+        ws_conn_free(conn);
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(0 == borrowed, "Nothing held");
+        END_SET("Moving with unsent bytes");
+
+
+        START_SET("Moving to another process");
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, ctl) != 0)
+                err(1, "Couldn't make sockets");
+        if ((pid = fork()) < 0)
+                err(1, "Couldn't fork");
+        if (pid == 0) {
+                close(ctl[0]);
+                close(sock[1]);
+                close(sock[0]);
+                num_messages = 0;
+                if ((conn = ws_conn_recv_from(ctl[1])) == NULL)
+                        _exit(1);
+                write(ctl[1], "k", 1);
+                while (num_messages == 0)
+                        if (ws_conn_read(conn, socket_read, handler,
+                                                             NULL) < 0)
+                                _exit(2);
+                _exit(0 == strcmp(long66000, last_message + 66000) ? 0 : 3);
+        }
+        close(ctl[1]);
+
+        conn = ws_conn_new(sock[0]);
+        write(sock[1], frags, 66014 + 1000);
+        ws_conn_read(conn, socket_read, handler, NULL);
+        pass(0 == ws_conn_send_to(ctl[0], conn), "Sent over");
+        pass(-1 == fcntl(sock[0], F_GETFD), "Our copy closed");
+        pass(1 == read(ctl[0], buf, 1), "Picked up");
+
+        /* The rest arrives on the same socket, now read over there */
+        fcntl(sock[1], F_SETFL, 0);
+        write(sock[1], frags + 66014 + 1000, frags_len - 66014 - 1000);
+        waitpid(pid, &status, 0);
+        pass(WIFEXITED(status) && 0 == WEXITSTATUS(status),
+                                           "Finished the message there");
+        close(sock[1]);
+        close(ctl[0]);
+        END_SET("Moving to another process");
+
+
+        START_SET("Rebalancing");
+        scheds[0] = ws_sched_new(1, 0);
+        scheds[1] = ws_sched_new(1, 0);
+        conn = ws_conn_new(1);
+        source_bytes = bytes;
+        source_left = sizeof(bytes);
+        num_pings = 0;
+        num_messages = 0;
+        ws_sched_ready(scheds[0], conn);
+        ws_sched_run(scheds[0], read_bytes, handler, NULL);
+        pass(1 == num_pings && 0 == num_messages, "One turn taken");
+        pass(ws_sched_busy_ns(scheds[0]) > 0, "Busy time counted");
+
+        ws_sched_move(scheds[0], scheds[1], conn);
+        pass(-1 == ws_sched_run(scheds[0], read_bytes, handler, NULL),
+                                                        "Gone from the old");
+        ws_sched_run(scheds[1], read_bytes, handler, NULL);
+        pass(1 == num_messages, "Next turn on the new");
+        ws_sched_remove(scheds[1], conn);
+        ws_conn_free(conn);
+        ws_sched_free(scheds[0]);
+        ws_sched_free(scheds[1]);
+
+        loads[0] = 100;
+        loads[1] = 110;
+        loads[2] = 90;
+        loads[3] = 100;
+        pass(0 == ws_rebalance_pick(loads, 4, 1.25, &from, &to), "Even");
+        loads[1] = 400;
+        pass(1 == ws_rebalance_pick(loads, 4, 1.25, &from, &to) &&
+             1 == from && 2 == to, "Busiest to idlest");
+        pass(0 == ws_rebalance_pick(loads, 1, 1.25, &from, &to),
+                                                           "Only one shard");
+        END_SET("Rebalancing");
+
+        free(frags);
+        return 0;
+}
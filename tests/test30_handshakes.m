@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+#define NUM_REQUESTS 1000
+#define RESPONSE_CAP 300
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static const char request_template[] =
+        "GET /chat HTTP/1.1\r\n"
+        "Host: server.example.com\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: %s\r\n"
+        "%s"
+        "Sec-WebSocket-Version: 13\r\n"
+        "\r\n";
+
+static const char deflate_offer[] =
+        "Sec-WebSocket-Extensions: permessage-deflate\r\n";
+
+static char requests[NUM_REQUESTS][400];
+static char responses[NUM_REQUESTS][RESPONSE_CAP];
+
+
+/*
+ * Makes a request with a key of 1 to 39 characters (so both one and two
+ * block hashes), some with a deflate offer and some with no key at all.
+ */
+static void make_request(char *dst, int i)
+{
+        static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdef0123+/";
+        char key[40];
+        int len = 1 + (i * 7) % 39;
+        int j;
+
+        for (j = 0; j < len; j++)
+                key[j] = chars[(i + j * 13) % (sizeof(chars) - 1)];
+        key[len] = '\0';
+
+        sprintf(dst, request_template, key, i % 3 == 0 ? deflate_offer : "");
+        if (i % 50 == 49)
+                strcpy(dst, "GET / HTTP/1.1\r\n\r\n");
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        WebsocketHandshake hs[NUM_REQUESTS];
+        const char *expected;
+        size_t num_done;
+        int num_failed = 0;
+        int num_bad = 0;
+        int deflate;
+        int i;
+
+        START_SET("RFC 6455 example");
+        sprintf(requests[0], request_template, "dGhlIHNhbXBsZSBub25jZQ==", "");
+        hs[0].request = requests[0];
+        hs[0].response = responses[0];
+        hs[0].response_cap = RESPONSE_CAP;
+        hs[0].accept_deflate = 0;
+        pass(1 == ws_complete_handshakes(hs, 1), "Completed");
+        pass(NULL != strstr(responses[0],
+               "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"),
+                                                          "Accept value");
+        pass(strlen(responses[0]) == hs[0].response_len, "Length");
+
+        hs[0].response_cap = 50;
+        pass(0 == ws_complete_handshakes(hs, 1) && 0 == hs[0].response_len,
+                                                     "Buffer too small");
+        END_SET("RFC 6455 example");
+
+
+        START_SET("Same as one at a time");
+        for (i = 0; i < NUM_REQUESTS; i++) {
+                make_request(requests[i], i);
+                hs[i].request = requests[i];
+                hs[i].response = responses[i];
+                hs[i].response_cap = RESPONSE_CAP;
+                hs[i].accept_deflate = i % 2;
+        }
+        num_done = ws_complete_handshakes(hs, NUM_REQUESTS);
+
+        for (i = 0; i < NUM_REQUESTS; i++) {
+                if (i % 2)
+                        expected = ws_complete_handshake_deflate(requests[i],
+                                                                  &deflate);
+                else {
+                        expected = ws_complete_handshake(requests[i]);
+                        deflate = 0;
+                }
+
+                if (i % 50 == 49) {
+                        if (0 != hs[i].response_len)
+                                num_bad++;
+                        num_failed++;
+                }
+                else if (expected == NULL ||
+                         0 != strcmp(expected, responses[i]) ||
+                         deflate != hs[i].deflate)
+                        num_bad++;
+                free((void *)expected);
+        }
+        pass(NUM_REQUESTS - num_failed == num_done, "Keyless ones failed");
+        pass(0 == num_bad, "Every response matches");
+        END_SET("Same as one at a time");
+
+        return 0;
+}
@@ -0,0 +1,173 @@
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+#define BIG_LEN (5 * 1024 * 1024)
+#define HUGE_LEN (3 * 1024 * 1024)
+#define NUM_CYCLES 200
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static uint8_t mask[] = {0x37, 0xfa, 0x21, 0x3d};
+
+static const uint8_t *source_bytes;
+static size_t source_left;
+
+static int num_messages;
+static size_t last_len;
+static int last_ok;
+static char *expected;
+
+static ssize_t read_bytes(int fd, char *ptr, size_t maxlen)
+{
+        if (source_left == 0) {
+                errno = EAGAIN;
+                return -1;
+        }
+        if (maxlen > source_left)
+                maxlen = source_left;
+        memcpy(ptr, source_bytes, maxlen);
+        source_bytes += maxlen;
+        source_left -= maxlen;
+        return maxlen;
+}
+
+static void handler(int fd, enum WebsocketFrameType type, const char *message,
+                                                        size_t len, void *arg)
+{
+        if (type != WS_FT_TEXT)
+                return;
+        num_messages++;
+        last_len = len;
+        last_ok = 0 == memcmp(message, expected, len);
+}
+
+/*
+ * Hands "len" bytes to the connection, "per_event" at a time.
+ */
+static int feed(WebsocketConn *conn, const uint8_t *bytes, size_t len,
+                                                        size_t per_event)
+{
+        size_t n;
+        int result = 0;
+
+        while (len > 0 && result == 0) {
+                n = len < per_event ? len : per_event;
+                source_bytes = bytes;
+                source_left = n;
+                result = ws_conn_read(conn, read_bytes, handler, NULL);
+                bytes += n;
+                len -= n;
+        }
+        return result;
+}
+
+/*
+ * Makes a masked frame carrying the first "len" bytes of the expected text.
+ */
+static size_t make_frame(size_t len, uint8_t **frame)
+{
+        char saved = expected[len];
+        size_t result;
+
+        expected[len] = '\0';
+        result = ws_make_text_frame(expected, mask, (const uint8_t **)frame);
+        expected[len] = saved;
+        return result;
+}
+
+static void *free_conn(void *arg)
+{
+        ws_conn_free(arg);
+        return NULL;
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        WebsocketConn *conn;
+        WebsocketMetrics metrics;
+        pthread_t thread;
+        uint8_t *frame;
+        size_t frame_len;
+        size_t borrowed, cached, cached_before;
+        int i;
+
+        if ((expected = malloc(BIG_LEN + 1)) == NULL)
+                err(1, "malloc");
+        for (i = 0; i < BIG_LEN; i++)
+                expected[i] = 'a' + i % 26;
+        expected[BIG_LEN] = '\0';
+
+        START_SET("Size classes");
+        conn = ws_conn_new(1);
+        frame_len = make_frame(BIG_LEN, &frame);
+        pass(0 == feed(conn, frame, frame_len, 100000), "Fed a big message");
+        pass(1 == num_messages && BIG_LEN == last_len && last_ok,
+                                             "Grown through every class");
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(0 == borrowed, "Everything given back");
+        free(frame);
+
+        frame_len = make_frame(66000, &frame);
+        pass(0 == feed(conn, frame, frame_len, 1000), "Fed a medium one");
+        ws_conn_pool_stats(&borrowed, &cached_before);
+        for (i = 0; i < NUM_CYCLES; i++)
+                feed(conn, frame, frame_len, 1000);
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(2 + NUM_CYCLES == num_messages && 66000 == last_len && last_ok,
+                                                           "All delivered");
+        pass(0 == borrowed && cached == cached_before,
+                                              "Buffers reused, not piled up");
+        free(frame);
+        END_SET("Size classes");
+
+
+        START_SET("Huge pages");
+        ws_set_pool_hugepages(1);
+        frame_len = make_frame(HUGE_LEN, &frame);
+        pass(0 == feed(conn, frame, frame_len, 1 << 20), "Fed");
+        pass(HUGE_LEN == last_len && last_ok, "Delivered");
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(0 == borrowed, "Given back");
+        ws_set_pool_hugepages(0);
+        free(frame);
+        END_SET("Huge pages");
+
+
+        START_SET("Across threads");
+        frame_len = make_frame(66000, &frame);
+        pass(0 == feed(conn, frame, frame_len / 2, 1000), "Half a message");
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(1 == borrowed, "Buffer held");
+        pthread_create(&thread, NULL, free_conn, conn);
+        pthread_join(thread, NULL);
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(0 == borrowed, "Given back by another thread");
+        free(frame);
+
+        /* With one node, nothing can be remote */
+        ws_metrics_snapshot(&metrics);
+        if (access("/sys/devices/system/node/node1", F_OK) != 0)
+                pass(0 == metrics.pool_remote_gets &&
+                     0 == metrics.pool_remote_puts, "Nothing remote");
+        END_SET("Across threads");
+
+        free(expected);
+        return 0;
+}
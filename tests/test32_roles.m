@@ -0,0 +1,165 @@
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+/* NOTE: Built with -DWS_ROLE_SERVER -DWS_TEXT_ONLY (see GNUmakefile.preamble) */
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static uint8_t mask[] = {0x37, 0xfa, 0x21, 0x3d};
+
+static uint8_t unmasked_hello_frame[] = {0x81, 0x05, 0x48, 0x65, 0x6c, 0x6c,
+                                         0x6f};
+
+static const char deflate_request[] =
+        "GET /chat HTTP/1.1\r\n"
+        "Host: server.example.com\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Extensions: permessage-deflate\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "\r\n";
+
+static const uint8_t *source_bytes;
+static size_t source_left;
+
+static int num_messages;
+static int last_type;
+static char last_message[100];
+
+static ssize_t read_bytes(int fd, char *ptr, size_t maxlen)
+{
+        if (source_left == 0) {
+                errno = EAGAIN;
+                return -1;
+        }
+        if (maxlen > source_left)
+                maxlen = source_left;
+        memcpy(ptr, source_bytes, maxlen);
+        source_bytes += maxlen;
+        source_left -= maxlen;
+        return maxlen;
+}
+
+static void handler(int fd, enum WebsocketFrameType type, const char *message,
+                                                        size_t len, void *arg)
+{
+        last_type = type;
+        if (type == WS_FT_TEXT) {
+                num_messages++;
+                memcpy(last_message, message, len + 1);
+        }
+}
+
+/*
+ * Makes a short masked frame the way a client would; the library won't in a
+ * server build.
+ */
+static size_t client_frame(uint8_t byte0, const char *payload, uint8_t *dst)
+{
+        size_t len = strlen(payload);
+        size_t i;
+
+        dst[0] = byte0;
+        dst[1] = 0x80 | len;
+        memcpy(dst + 2, mask, 4);
+        for (i = 0; i < len; i++)
+                dst[6 + i] = payload[i] ^ mask[i % 4];
+        return 6 + len;
+}
+
+/*
+ * Feeds one frame to a new connection, returning what ws_conn_read did.
+ */
+static int feed_one(const uint8_t *frame, size_t len, int deflate)
+{
+        WebsocketConn *conn = ws_conn_new(1);
+        int result;
+
+        if (deflate)
+                ws_conn_enable_deflate(conn);
+        source_bytes = frame;
+        source_left = len;
+        result = ws_conn_read(conn, read_bytes, handler, NULL);
+        ws_conn_free(conn);
+        return result;
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        uint8_t buf[100];
+        uint8_t *frame;
+        char *message;
+        const char *response;
+        size_t len;
+        int deflate;
+
+        START_SET("Frames made");
+        len = ws_make_text_frame("Hello", mask, &frame);
+        pass(sizeof(unmasked_hello_frame) == len &&
+             0 == memcmp(unmasked_hello_frame, frame, len),
+                                               "Never masked by a server");
+        free(frame);
+        END_SET("Frames made");
+
+
+        START_SET("Frames read");
+        len = client_frame(0x81, "Hello", buf);
+        feed_one(buf, len, 0);
+        pass(1 == num_messages && 0 == strcmp("Hello", last_message),
+                                                   "Masked frame delivered");
+
+        feed_one(unmasked_hello_frame, sizeof(unmasked_hello_frame), 0);
+        pass(1 == num_messages && WS_FT_ERROR == last_type,
+                                                "Unmasked frame refused");
+
+        len = client_frame(0x82, "Hello", buf);
+        feed_one(buf, len, 0);
+        pass(1 == num_messages && WS_FT_ERROR == last_type,
+                                                  "Binary frame refused");
+
+        len = client_frame(0xc1, "Hello", buf);
+        feed_one(buf, len, 1);
+        pass(1 == num_messages && WS_FT_ERROR == last_type,
+                                "Compressed frame refused, deflate or not");
+
+        len = client_frame(0x81, "Hello", buf);
+        source_bytes = buf;
+        source_left = len;
+        pass(WS_FT_TEXT == ws_read_next_message(0, read_bytes, &message) &&
+             0 == strcmp("Hello", message), "Read a masked message");
+        free(message);
+
+        source_bytes = unmasked_hello_frame;
+        source_left = sizeof(unmasked_hello_frame);
+        message = NULL;
+        pass(WS_FT_ERROR == ws_read_next_message(0, read_bytes, &message),
+                                             "Refused an unmasked message");
+        free(message);
+        END_SET("Frames read");
+
+
+        START_SET("No extensions");
+        response = ws_complete_handshake_deflate(deflate_request, &deflate);
+        pass(NULL != response && 0 == deflate &&
+             NULL == strstr(response, "Sec-WebSocket-Extensions"),
+                                                      "Deflate not agreed");
+        free((void *)response);
+        END_SET("No extensions");
+
+        return 0;
+}
@@ -0,0 +1,363 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../ws.h"
+#include "test_util.h"
+#import "Testing.h"
+
+
+#define PEEK_LEN 5
+
+
+/* ============================================================================
+ * Test data
+ */
+
+static const char long66000txt[] = "./data/long-66000.txt";
+static char long66000[66000 + 1];
+
+static uint8_t mask[] = {0x37, 0xfa, 0x21, 0x3d};
+
+static uint8_t input_ping_frame[] = {0x89, 0x02, 'h', 'i'};
+
+/* The stream read, and the bytes that should be forwarded from it */
+static uint8_t *stream;
+static size_t stream_len;
+static uint8_t *expected;
+static size_t expected_len;
+
+/* Bytes available for the current "readable" event */
+static const uint8_t *source_bytes;
+static size_t source_left;
+static size_t max_read;
+
+/* What was seen */
+static int num_routed;
+static int num_short_prefixes;
+static int num_texts;
+static int num_pings;
+static int num_keeps;
+static int num_his;
+static int num_empties;
+static int num_longs;
+static int num_errors;
+static uint8_t *forwarded;
+static size_t forwarded_len;
+
+static ssize_t read_bytes(int fd, char *ptr, size_t maxlen)
+{
+        if (source_left == 0) {
+                errno = EAGAIN;
+                return -1;
+        }
+        if (maxlen > source_left)
+                maxlen = source_left;
+        if (maxlen > max_read)
+                maxlen = max_read;
+        memcpy(ptr, source_bytes, maxlen);
+        source_bytes += maxlen;
+        source_left -= maxlen;
+        return maxlen;
+}
+
+static enum WebsocketRoute route(int fd, const char *prefix, size_t len,
+                                                                void *arg)
+{
+        num_routed++;
+        if (len < PEEK_LEN) {
+                num_short_prefixes++;
+                return WS_ROUTE_DECODE;
+        }
+        if (0 == memcmp(prefix, "drop:", PEEK_LEN))
+                return WS_ROUTE_DISCARD;
+        if (0 == memcmp(prefix, "fwd::", PEEK_LEN))
+                return WS_ROUTE_FORWARD;
+        return WS_ROUTE_DECODE;
+}
+
+static void forward(int fd, const uint8_t *bytes, size_t len, void *arg)
+{
+        memcpy(forwarded + forwarded_len, bytes, len);
+        forwarded_len += len;
+}
+
+static void saw(enum WebsocketFrameType type, const char *message, size_t len)
+{
+        if (type == WS_FT_ERROR) {
+                num_errors++;
+                return;
+        }
+        if (type == WS_FT_PING) {
+                num_pings++;
+                return;
+        }
+        if (type != WS_FT_TEXT)
+                return;
+
+        num_texts++;
+        if (len == 11 && 0 == memcmp(message, "keep: hello", 11))
+                num_keeps++;
+        else if (len == 2 && 0 == memcmp(message, "hi", 2))
+                num_his++;
+        else if (len == 0)
+                num_empties++;
+        else if (len == 66000 && 0 == memcmp(message, long66000, 66000))
+                num_longs++;
+}
+
+static void handler(int fd, enum WebsocketFrameType type, const char *message,
+                                                        size_t len, void *arg)
+{
+        saw(type, message, len);
+}
+
+static void batch_handler(int fd, const WebsocketMessage *messages,
+                                        size_t num_messages, void *arg)
+{
+        size_t i;
+
+        for (i = 0; i < num_messages; i++)
+                saw(messages[i].type, messages[i].data, messages[i].len);
+}
+
+/*
+ * Appends a masked text frame to the stream (and to what should be
+ * forwarded, if it should be), with byte0 as given.
+ */
+static void add_frame(uint8_t byte0, const char *text, int is_forwarded)
+{
+        uint8_t *frame;
+        size_t len;
+
+        len = ws_make_text_frame(text, mask, &frame);
+        frame[0] = byte0;
+        memcpy(stream + stream_len, frame, len);
+        stream_len += len;
+        if (is_forwarded) {
+                memcpy(expected + expected_len, frame, len);
+                expected_len += len;
+        }
+        free(frame);
+}
+
+static void make_stream()
+{
+        char *drop_long;
+
+        drop_long = malloc(66005 + 1);
+        memcpy(drop_long, "drop:", 5);
+        memcpy(drop_long + 5, long66000, 66000 + 1);
+
+        stream = malloc(200000);
+        expected = malloc(200000);
+        forwarded = malloc(200000);
+
+        add_frame(0x81, "drop: not wanted", 0);
+        add_frame(0x01, "fwd:: part one,", 1);
+        memcpy(stream + stream_len, input_ping_frame, sizeof(input_ping_frame));
+        stream_len += sizeof(input_ping_frame);
+        add_frame(0x00, " part two,", 1);
+        add_frame(0x80, " part three", 1);
+        add_frame(0x81, "keep: hello", 0);
+        add_frame(0x81, drop_long, 0);
+        add_frame(0x81, "fwd:: short", 1);
+        add_frame(0x81, long66000, 0);
+        add_frame(0x81, "hi", 0);
+        add_frame(0x81, "", 0);
+        free(drop_long);
+}
+
+static void reset()
+{
+        num_routed = 0;
+        num_short_prefixes = 0;
+        num_texts = 0;
+        num_pings = 0;
+        num_keeps = 0;
+        num_his = 0;
+        num_empties = 0;
+        num_longs = 0;
+        num_errors = 0;
+        forwarded_len = 0;
+}
+
+/*
+ * Reads the whole stream, at most "per_read" bytes at a time, as messages
+ * or batches.
+ */
+static int read_stream(WebsocketConn *conn, size_t per_read, int batched)
+{
+        int result = 0;
+
+        reset();
+        source_bytes = stream;
+        source_left = stream_len;
+        max_read = per_read;
+        while (source_left > 0 && result == 0) {
+                if (batched)
+                        result = ws_conn_read_batch(conn, read_bytes,
+                                                    batch_handler, NULL, 0);
+                else
+                        result = ws_conn_read(conn, read_bytes, handler, NULL);
+        }
+        return result;
+}
+
+/*
+ * Makes a new connection from an old one, as another process would, and
+ * gives it the router back.
+ */
+static WebsocketConn *move(WebsocketConn *conn, const WebsocketRouter *router)
+{
+        WebsocketConn *result;
+        uint8_t *image;
+        size_t image_len;
+
+        image_len = ws_conn_export(conn, &image);
+        result = ws_conn_import(ws_conn_fd(conn), image, image_len);
+        ws_conn_free(conn);
+        free(image);
+        if (result != NULL)
+                ws_conn_set_router(result, router);
+        return result;
+}
+
+/*
+ * Reads the whole stream "per_read" bytes at a time, moving the connection
+ * after every read.
+ */
+static int read_stream_moving(WebsocketConn **conn_p, size_t per_read,
+                                             const WebsocketRouter *router)
+{
+        int result = 0;
+
+        reset();
+        source_bytes = stream;
+        source_left = stream_len;
+        max_read = per_read;
+        while (source_left > 0 && result == 0 && *conn_p != NULL) {
+                result = ws_conn_read(*conn_p, read_bytes, handler, NULL);
+                *conn_p = move(*conn_p, router);
+        }
+        return *conn_p != NULL ? result : -1;
+}
+
+/* Everything in the stream was routed as it should have been */
+static int all_routed()
+{
+        return 8 == num_routed && 2 == num_short_prefixes &&
+               4 == num_texts && 1 == num_pings && 1 == num_keeps &&
+               1 == num_his && 1 == num_empties && 1 == num_longs &&
+               forwarded_len == expected_len &&
+               0 == memcmp(forwarded, expected, expected_len);
+}
+
+
+/* ============================================================================
+ * Main
+ */
+int main()
+{
+        WebsocketRouter router = {PEEK_LEN, route, forward, NULL};
+        WebsocketMetrics before, after;
+        WebsocketLimits limits;
+        WebsocketConn *conn;
+        size_t borrowed, cached;
+
+        load_data((uint8_t *)long66000, 66000, long66000txt);
+        make_stream();
+
+        START_SET("Routing messages");
+        conn = ws_conn_new(1);
+        ws_conn_set_router(conn, &router);
+
+        ws_metrics_snapshot(&before);
+        pass(0 == read_stream(conn, SIZE_MAX, 0) && all_routed(),
+                                           "Routed, read all at once");
+        ws_metrics_snapshot(&after);
+        pass(2 == after.route_discards - before.route_discards &&
+             2 == after.route_forwards - before.route_forwards,
+                                                   "Routing is counted");
+
+        pass(0 == read_stream(conn, 1, 0) && all_routed(),
+                                           "Routed, read a byte at a time");
+        pass(0 == read_stream(conn, 7, 0) && all_routed(),
+                                           "Routed, read in small pieces");
+        pass(0 == read_stream(conn, SIZE_MAX, 1) && all_routed(),
+                                           "Routed in batches");
+        pass(0 == read_stream(conn, 3, 1) && all_routed(),
+                                 "Routed in batches, read in small pieces");
+
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(0 == borrowed, "Nothing held between messages");
+
+        ws_conn_set_router(conn, NULL);
+        pass(0 == read_stream(conn, SIZE_MAX, 0) && 0 == num_routed &&
+             8 == num_texts && 0 == forwarded_len,
+                                     "Everything decoded without a router");
+        ws_conn_free(conn);
+        END_SET("Routing messages");
+
+
+        START_SET("Moving while routing");
+        conn = ws_conn_new(1);
+        ws_conn_set_router(conn, &router);
+        pass(0 == read_stream_moving(&conn, 7, &router) && all_routed(),
+                                        "Moved between every few bytes");
+        pass(0 == read_stream_moving(&conn, 1000, &router) && all_routed(),
+                                   "Moved in the middle of routed frames");
+        ws_conn_free(conn);
+
+        /* Stop part way into the forwarded "fwd:: short" */
+        conn = ws_conn_new(1);
+        ws_conn_set_router(conn, &router);
+        reset();
+        source_bytes = stream;
+        max_read = 1;
+        do {
+                source_left = 1;
+        } while (0 == ws_conn_read(conn, read_bytes, handler, NULL) &&
+                                        forwarded_len < expected_len - 3);
+        conn = move(conn, NULL);
+        source_left = stream + stream_len - source_bytes;
+        pass(-1 == ws_conn_read(conn, read_bytes, handler, NULL) &&
+             1 == num_errors && forwarded_len == expected_len - 3,
+                              "Forwarding without the router refused");
+        ws_conn_free(conn);
+
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(0 == borrowed, "Nothing held");
+        END_SET("Moving while routing");
+
+
+        START_SET("Routing within limits");
+        memset(&limits, 0, sizeof(limits));
+        limits.max_message_len = 1000;
+        ws_set_limits(&limits);
+
+        conn = ws_conn_new(1);
+        ws_conn_set_router(conn, &router);
+        reset();
+        source_bytes = stream;
+        source_left = stream_len;
+        max_read = 1;
+        while (source_left > 0 &&
+                        0 == ws_conn_read(conn, read_bytes, handler, NULL))
+                ;
+        pass(1 == num_keeps && 0 == num_longs && source_left > 0,
+                                "Dropped message over the limit refused");
+        ws_conn_free(conn);
+
+        memset(&limits, 0, sizeof(limits));
+        ws_set_limits(&limits);
+        ws_conn_pool_stats(&borrowed, &cached);
+        pass(0 == borrowed, "Nothing held");
+        END_SET("Routing within limits");
+
+        free(stream);
+        free(expected);
+        free(forwarded);
+        return 0;
+}
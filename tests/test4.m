@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
 
 #include "../ws.h"
 #include "../read_message.c"
@@ -44,6 +45,30 @@ uint8_t masked_hello_frame[] = {0x81, 0x85,
                                 0x37, 0xfa, 0x21, 0x3d,
                                 0x7f, 0x9f, 0x4d, 0x51, 0x58};
 
+static const uint8_t *source_bytes;
+static size_t source_left;
+
+static ssize_t read_bytes(int fd, char *ptr, size_t maxlen)
+{
+        if (maxlen > source_left) {
+                errno = ECONNRESET;
+                return -1;
+        }
+        memcpy(ptr, source_bytes, maxlen);
+        source_bytes += maxlen;
+        source_left -= maxlen;
+        return maxlen;
+}
+
+/* Reads the message in "frame" */
+static enum WebsocketFrameType read_frame(const uint8_t *frame, size_t len,
+                                                        char **message)
+{
+        source_bytes = frame;
+        source_left = len;
+        return ws_read_next_message(1, read_bytes, message);
+}
+
 
 /* ============================================================================
  * Expected results
@@ -58,31 +83,37 @@ static char hello_message[] = "Hello";
 
 int main()
 {
-        const char *message_body = NULL;
+        char *message_body = NULL;
 
         /*
          * Read small message
          */
-        START_SET("Extract small message");
-        message_body = ws_extract_message(hello_message_frame);
-        pass(0 == strcmp(message_body, hello_message), "Hello message");
-        free(message_body);
-
-        message_body = ws_extract_message(empty_message_frame);
-        pass(0 == strcmp(message_body, empty_message), "Empty message");
-        free(message_body);
-        END_SET("Extract small message");
+        START_SET("Read small message");
+        pass(WS_FT_TEXT == read_frame(hello_message_frame,
+                                      sizeof(hello_message_frame),
+                                      &message_body) &&
+             0 == strcmp(message_body, hello_message), "Hello message");
+        ws_free_message(message_body);
+
+        pass(WS_FT_TEXT == read_frame(empty_message_frame,
+                                      sizeof(empty_message_frame),
+                                      &message_body) &&
+             0 == strcmp(message_body, empty_message), "Empty message");
+        ws_free_message(message_body);
+        END_SET("Read small message");
 
         /*
          * Read small, masked message
          */
-        START_SET("Extract small, masked message");
+        START_SET("Read small, masked message");
 
-        message_body = ws_extract_message(masked_hello_frame);
-        pass(0 == strcmp(message_body, hello_message), "Masked message");
-        free(message_body);
+        pass(WS_FT_TEXT == read_frame(masked_hello_frame,
+                                      sizeof(masked_hello_frame),
+                                      &message_body) &&
+             0 == strcmp(message_body, hello_message), "Masked message");
+        ws_free_message(message_body);
 
-        END_SET("Extract small, masked message");
+        END_SET("Read small, masked message");
 
         return 0;
 }
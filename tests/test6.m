@@ -22,38 +22,55 @@ static char med126[126 + 1];
 static const char long66000txt[] = "./data/long-66000.txt";
 static char long66000[66000 + 1];
 
+static const uint8_t *source_bytes;
+static size_t source_left;
+
+static ssize_t read_bytes(int fd, char *ptr, size_t maxlen)
+{
+        if (maxlen > source_left) {
+                errno = ECONNRESET;
+                return -1;
+        }
+        memcpy(ptr, source_bytes, maxlen);
+        source_bytes += maxlen;
+        source_left -= maxlen;
+        return maxlen;
+}
+
 /* ============================================================================
  * Main
  */
 
 int main()
 {
-        const char *message_body = NULL;
-        const uint8_t *frame = NULL;
+        char *message_body = NULL;
+        uint8_t *frame = NULL;
 
-        START_SET("Extract medium message");
+        START_SET("Read medium message");
         load_data(med126, 126, med126txt);
-        ws_make_text_frame(med126, NULL, &frame);
-        
-        message_body = ws_extract_message(frame);
-        pass(0 == strcmp(med126, message_body), "Extract medium");
+        source_left = ws_make_text_frame(med126, NULL, &frame);
+        source_bytes = frame;
+
+        pass(WS_FT_TEXT == ws_read_next_message(1, read_bytes, &message_body) &&
+             0 == strcmp(med126, message_body), "Read medium");
 
         free(frame);
-        free(message_body);
-        END_SET("Extract medium message");
+        ws_free_message(message_body);
+        END_SET("Read medium message");
 
 
 
-        START_SET("Extract long message");
+        START_SET("Read long message");
         load_data(long66000, 66000, long66000txt);
-        ws_make_text_frame(long66000, NULL, &frame);
-        
-        message_body = ws_extract_message(frame);
-        pass(0 == strcmp(long66000, message_body), "Extract long");
+        source_left = ws_make_text_frame(long66000, NULL, &frame);
+        source_bytes = frame;
+
+        pass(WS_FT_TEXT == ws_read_next_message(1, read_bytes, &message_body) &&
+             0 == strcmp(long66000, message_body), "Read long");
 
         free(frame);
-        free(message_body);
+        ws_free_message(message_body);
 
-        END_SET("Extract long message");
+        END_SET("Read long message");
         return 0;
 }
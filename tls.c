@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "errors.h"
+#include "tls.h"
+#include "ws.h"
+
+/*==============================================================================
+ * Defines
+ */
+
+/* Sessions are found by fd in a two level table, so lookups need no lock */
+#define CHUNK_BITS 10
+#define CHUNK_LEN (1 << CHUNK_BITS)
+#define NUM_CHUNKS 1024
+
+
+/*==============================================================================
+ * Static declarations
+ */
+
+struct WebsocketTls_ {
+        SSL_CTX *ctx;
+};
+
+/*
+ * A chunk, once made, is never freed, so a reader that loaded its pointer
+ * can always use it. Each slot only changes between ws_tls_accept and
+ * ws_tls_close on the thread that owns the connection.
+ */
+typedef struct SessionChunk_ {
+        SSL *sessions[CHUNK_LEN];
+} SessionChunk;
+
+static pthread_mutex_t chunks_lock = PTHREAD_MUTEX_INITIALIZER;
+static SessionChunk *chunks[NUM_CHUNKS];
+
+static int io_result(SSL *, int);
+static SSL *lookup(int);
+static void set_session(int, SSL *);
+
+
+/*==============================================================================
+ * Public API
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Sets up TLS for wss:// connections, using a PEM certificate chain and
+ * private key. Kernel TLS is asked for, so once a handshake is done, the
+ * kernel encrypts records itself where it can, and the fd can be written to
+ * directly (see ws_tls_ktls_send).
+ *
+ * NOTE: The caller must free this with ws_tls_free.
+ *
+ * Returns NULL if the certificate or key can't be loaded.
+ */
+WebsocketTls *
+ws_tls_new(const char *cert_path, const char *key_path)
+{
+        WebsocketTls *result;
+        SSL_CTX *ctx;
+
+        if ((ctx = SSL_CTX_new(TLS_server_method())) == NULL)
+                return NULL;
+
+        SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+        SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                              SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+        /* Ciphers the kernel can do */
+        SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20");
+        SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:"
+                            "TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256");
+
+        if (SSL_CTX_use_certificate_chain_file(ctx, cert_path) != 1 ||
+            SSL_CTX_use_PrivateKey_file(ctx, key_path, SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(ctx) != 1) {
+                syslog(LOG_ERR, "Couldn't load TLS certificate or key: %s",
+                                ERR_error_string(ERR_get_error(), NULL));
+                SSL_CTX_free(ctx);
+                return NULL;
+        }
+
+        if ((result = calloc(1, sizeof(WebsocketTls))) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+        result->ctx = ctx;
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Frees TLS settings. Connections already accepted keep working.
+ */
+void
+ws_tls_free(WebsocketTls *tls)
+{
+        if (tls == NULL)
+                return;
+
+        SSL_CTX_free(tls->ctx);
+        free(tls);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Does the TLS handshake on a newly accepted connection, before the websocket
+ * handshake is read. On a non-blocking fd, call this again when the fd is
+ * ready until it stops returning 1.
+ *
+ * Afterwards, ws_tls_read and ws_tls_write work as read_bytes and write_bytes
+ * for the connection. Call ws_tls_close before closing the fd.
+ *
+ * Returns 0 once the handshake is done; 1 if it needs the fd to be ready
+ * again (errno is EAGAIN); -1 if it failed, in which case the session has
+ * been cleaned up.
+ */
+int
+ws_tls_accept(WebsocketTls *tls, int fd)
+{
+        SSL *ssl;
+        int ret;
+
+        if (fd < 0 || fd >= NUM_CHUNKS * CHUNK_LEN) {
+                errno = EBADF;
+                return -1;
+        }
+
+        if ((ssl = lookup(fd)) == NULL) {
+                if ((ssl = SSL_new(tls->ctx)) == NULL)
+                        mem_alloc_failure(__FILE__, __LINE__);
+                SSL_set_fd(ssl, fd);
+                set_session(fd, ssl);
+        }
+
+        if ((ret = SSL_accept(ssl)) == 1)
+                return 0;
+
+        switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+                errno = EAGAIN;
+                return 1;
+
+        default:
+                syslog(LOG_INFO, "TLS handshake failed: %s",
+                                ERR_error_string(ERR_get_error(), NULL));
+                ERR_clear_error();
+                set_session(fd, NULL);
+                SSL_free(ssl);
+                return -1;
+        }
+}
+
+
+/*------------------------------------------------------------------------------
+ * Says whether the kernel is encrypting what's written to this connection
+ * (kernel TLS). If it is, anything that writes to the fd directly, like
+ * ws_send_file, works unchanged over TLS.
+ *
+ * Returns 1 if so; 0 if records are encrypted by OpenSSL (or fd isn't TLS).
+ */
+int
+ws_tls_ktls_send(int fd)
+{
+        SSL *ssl = lookup(fd);
+
+        return ssl != NULL && BIO_get_ktls_send(SSL_get_wbio(ssl));
+}
+
+
+/*------------------------------------------------------------------------------
+ * A read_bytes for TLS connections. With kernel TLS receive, OpenSSL takes
+ * the decrypted bytes straight from the socket.
+ */
+ssize_t
+ws_tls_read(int fd, char *ptr, size_t maxlen)
+{
+        SSL *ssl;
+
+        if ((ssl = lookup(fd)) == NULL) {
+                errno = EBADF;
+                return -1;
+        }
+        if (maxlen > INT_MAX)
+                maxlen = INT_MAX;
+        return io_result(ssl, SSL_read(ssl, ptr, maxlen));
+}
+
+
+/*------------------------------------------------------------------------------
+ * A write_bytes for TLS connections. Like write, this may write less than
+ * len bytes.
+ */
+ssize_t
+ws_tls_write(int fd, const void *ptr, size_t len)
+{
+        SSL *ssl;
+
+        if ((ssl = lookup(fd)) == NULL) {
+                errno = EBADF;
+                return -1;
+        }
+        if (len == 0)
+                return 0;
+        if (len > INT_MAX)
+                len = INT_MAX;
+        return io_result(ssl, SSL_write(ssl, ptr, len));
+}
+
+
+/*------------------------------------------------------------------------------
+ * Sends a TLS close_notify (without waiting for the client's) and frees the
+ * session. The fd itself is left open.
+ */
+void
+ws_tls_close(int fd)
+{
+        SSL *ssl;
+
+        if ((ssl = lookup(fd)) == NULL)
+                return;
+
+        SSL_shutdown(ssl);
+        ERR_clear_error();
+        set_session(fd, NULL);
+        SSL_free(ssl);
+}
+
+
+/*==============================================================================
+ * Library functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Says whether bytes written straight to fd end up protected as they should:
+ * either it's a plain connection, or the kernel is doing TLS for it.
+ */
+int
+tls_direct_write_ok(int fd)
+{
+        SSL *ssl = lookup(fd);
+
+        return ssl == NULL || BIO_get_ktls_send(SSL_get_wbio(ssl));
+}
+
+
+/*------------------------------------------------------------------------------
+ * Says whether fd has a TLS session in this process.
+ */
+int
+tls_has_session(int fd)
+{
+        return lookup(fd) != NULL;
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Turns an SSL_read/SSL_write result into what read/write would return.
+ */
+static int
+io_result(SSL *ssl, int ret)
+{
+        if (ret > 0)
+                return ret;
+
+        switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_ZERO_RETURN:
+                return 0;
+
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+                errno = EAGAIN;
+                return -1;
+
+        case SSL_ERROR_SYSCALL:
+                if (errno == 0)
+                        return 0;
+                ERR_clear_error();
+                return -1;
+
+        default:
+                ERR_clear_error();
+                errno = EPROTO;
+                return -1;
+        }
+}
+
+
+/*------------------------------------------------------------------------------
+ * Finds the TLS session for an fd, if it has one.
+ */
+static SSL *
+lookup(int fd)
+{
+        SessionChunk *chunk;
+
+        if (fd < 0 || fd >= NUM_CHUNKS * CHUNK_LEN)
+                return NULL;
+
+        chunk = __atomic_load_n(&chunks[fd >> CHUNK_BITS], __ATOMIC_ACQUIRE);
+        if (chunk == NULL)
+                return NULL;
+        return __atomic_load_n(&chunk->sessions[fd & (CHUNK_LEN - 1)],
+                                                        __ATOMIC_ACQUIRE);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Records (or, with NULL, forgets) an fd's TLS session. The fd must be in
+ * range (see ws_tls_accept).
+ */
+static void
+set_session(int fd, SSL *ssl)
+{
+        SessionChunk *chunk;
+
+        pthread_mutex_lock(&chunks_lock);
+        if ((chunk = chunks[fd >> CHUNK_BITS]) == NULL) {
+                if ((chunk = calloc(1, sizeof(SessionChunk))) == NULL)
+                        mem_alloc_failure(__FILE__, __LINE__);
+                __atomic_store_n(&chunks[fd >> CHUNK_BITS], chunk,
+                                                        __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&chunks_lock);
+
+        __atomic_store_n(&chunk->sessions[fd & (CHUNK_LEN - 1)], ssl,
+                                                        __ATOMIC_RELEASE);
+}
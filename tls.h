@@ -0,0 +1,7 @@
+#ifndef TLS_H
+#define TLS_H
+
+int tls_direct_write_ok(int fd);
+int tls_has_session(int fd);
+
+#endif
@@ -0,0 +1,276 @@
+/*
+ * Replays a traffic capture (see ws_capture_start) through the reader and
+ * reports throughput and allocations.
+ *
+ * Usage: ws_replay [-t] [-n iterations] capture-file
+ *
+ *   -t    Keep the original timing between reads (per connection)
+ *   -n    Replay the whole capture this many times (default 1)
+ *
+ * Each connection's bytes are handed to ws_read_next_message in the same
+ * pieces read_bytes originally returned, so fragmentation and short reads
+ * are reproduced exactly. Connections are replayed one after another.
+ *
+ * Build from the top of the tree, e.g.:
+ *
+ *   cc -O2 -o ws_replay tools/ws_replay.c capture.c read_message.c util.c \
+ *      metrics.c trace.c spill.c limits.c pool.c -lpthread
+ */
+#define _GNU_SOURCE
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "../capture.h"
+#include "../metrics.h"
+#include "../ws.h"
+
+/*==============================================================================
+ * Static declarations
+ */
+
+/* Records aren't aligned in the file, so they're copied out as pieces */
+typedef struct Piece_ {
+        uint64_t ns;
+        size_t len;
+        const uint8_t *bytes;
+} Piece;
+
+typedef struct Stream_ {
+        int32_t conn;
+        size_t num_records;
+        size_t cap;
+        Piece *records;
+
+        size_t next;            /* Record being handed out */
+        size_t used;            /* Bytes of it already handed out */
+        uint64_t start_ns;      /* When replay of this stream began */
+} Stream;
+
+static Stream *streams = NULL;
+static size_t num_streams = 0;
+static int timed = 0;
+
+static void load_capture(const char *);
+static ssize_t replay_read(int, char *, size_t);
+static Stream *stream_for(int32_t);
+static void wait_until(uint64_t);
+
+
+/*==============================================================================
+ * Main
+ */
+
+int
+main(int argc, char *argv[])
+{
+        WebsocketMetrics before, after;
+        uint64_t num_messages = 0;
+        uint64_t num_errors = 0;
+        uint64_t start_ns, elapsed_ns;
+        uint64_t bytes;
+        long iterations = 1;
+        long i;
+        size_t s;
+        char *message;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "tn:")) != -1) {
+                if (opt == 't')
+                        timed = 1;
+                else if (opt == 'n')
+                        iterations = atol(optarg);
+                else
+                        break;
+        }
+        if (optind != argc - 1 || iterations < 1)
+                errx(2, "Usage: ws_replay [-t] [-n iterations] capture-file");
+
+        load_capture(argv[optind]);
+
+        ws_metrics_snapshot(&before);
+        start_ns = ws_now_ns();
+        for (i = 0; i < iterations; i++) {
+                for (s = 0; s < num_streams; s++) {
+                        streams[s].next = 0;
+                        streams[s].used = 0;
+                        streams[s].start_ns = ws_now_ns();
+
+                        /* A capture can stop mid-message; that's the end */
+                        while (streams[s].next < streams[s].num_records) {
+                                message = NULL;
+                                if (ws_read_next_message(s, replay_read,
+                                                     &message) == WS_FT_ERROR)
+                                        num_errors++;
+                                else
+                                        num_messages++;
+                                ws_free_message(message);
+                        }
+                }
+        }
+        elapsed_ns = ws_now_ns() - start_ns;
+        ws_metrics_snapshot(&after);
+
+        bytes = after.bytes_in - before.bytes_in;
+        printf("connections: %zu\n", num_streams);
+        printf("messages:    %llu (%llu errors)\n",
+               (unsigned long long)num_messages,
+               (unsigned long long)num_errors);
+        printf("bytes:       %llu\n", (unsigned long long)bytes);
+        printf("elapsed:     %.3f ms\n", elapsed_ns / 1e6);
+        printf("throughput:  %.1f MB/s, %.0f messages/s\n",
+               bytes / 1e6 / (elapsed_ns / 1e9),
+               num_messages / (elapsed_ns / 1e9));
+        printf("allocs:      %llu (%.2f per message, %llu bytes)\n",
+               (unsigned long long)(after.allocs - before.allocs),
+               num_messages ? (double)(after.allocs - before.allocs) /
+                                                          num_messages : 0.0,
+               (unsigned long long)(after.alloc_bytes - before.alloc_bytes));
+        printf("parse p50/p99: %llu/%llu ns\n",
+               (unsigned long long)ws_histogram_value_at(&after.parse_ns, 0.5),
+               (unsigned long long)ws_histogram_value_at(&after.parse_ns,
+                                                                       0.99));
+        return 0;
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Maps a capture file and indexes its records by connection.
+ */
+static void
+load_capture(const char *path)
+{
+        CaptureFileHeader header;
+        CaptureRecord record;
+        const uint8_t *data;
+        const uint8_t *end;
+        struct stat st;
+        Stream *stream;
+        int fd;
+
+        if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+                err(1, "Couldn't open %s", path);
+        if ((size_t)st.st_size < sizeof(CaptureFileHeader))
+                errx(1, "%s is too short to be a capture", path);
+
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+                err(1, "Couldn't map %s", path);
+        close(fd);
+
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, WS_CAPTURE_MAGIC, 4) != 0 ||
+                                        header.version != WS_CAPTURE_VERSION)
+                errx(1, "%s isn't a version %d capture", path,
+                                                          WS_CAPTURE_VERSION);
+
+        end = data + st.st_size;
+        data += sizeof(CaptureFileHeader);
+        while (data + sizeof(CaptureRecord) <= end) {
+                memcpy(&record, data, sizeof(record));
+                data += sizeof(CaptureRecord);
+                if (data + record.len > end)
+                        break;
+
+                stream = stream_for(record.conn);
+                if (stream->num_records == stream->cap) {
+                        stream->cap = stream->cap ? 2 * stream->cap : 64;
+                        stream->records = realloc(stream->records,
+                                                   stream->cap * sizeof(Piece));
+                        if (stream->records == NULL)
+                                err(1, "realloc");
+                }
+                stream->records[stream->num_records].ns = record.ns;
+                stream->records[stream->num_records].len = record.len;
+                stream->records[stream->num_records].bytes = data;
+                stream->num_records++;
+
+                data += record.len;
+        }
+}
+
+
+/*------------------------------------------------------------------------------
+ * Finds (or adds) the stream for a connection.
+ */
+static Stream *
+stream_for(int32_t conn)
+{
+        size_t i;
+
+        for (i = 0; i < num_streams; i++)
+                if (streams[i].conn == conn)
+                        return &streams[i];
+
+        if ((streams = realloc(streams, (num_streams + 1) *
+                                                    sizeof(Stream))) == NULL)
+                err(1, "realloc");
+        memset(&streams[num_streams], 0, sizeof(Stream));
+        streams[num_streams].conn = conn;
+        return &streams[num_streams++];
+}
+
+
+/*------------------------------------------------------------------------------
+ * Hands out a stream's bytes, never crossing a record boundary in one call.
+ */
+static ssize_t
+replay_read(int fd, char *ptr, size_t maxlen)
+{
+        Stream *stream = &streams[fd];
+        const Piece *record;
+        size_t len;
+
+        if (stream->next >= stream->num_records)
+                return 0;
+
+        record = &stream->records[stream->next];
+        if (timed && stream->used == 0)
+                wait_until(stream->start_ns + record->ns -
+                                                 stream->records[0].ns);
+
+        len = record->len - stream->used;
+        if (len > maxlen)
+                len = maxlen;
+        memcpy(ptr, record->bytes + stream->used, len);
+
+        stream->used += len;
+        if (stream->used == record->len) {
+                stream->next++;
+                stream->used = 0;
+        }
+        return len;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Sleeps until a point in time (see ws_now_ns).
+ */
+static void
+wait_until(uint64_t ns)
+{
+        struct timespec ts;
+        uint64_t now = ws_now_ns();
+
+        if (ns <= now)
+                return;
+
+        ts.tv_sec = (ns - now) / 1000000000;
+        ts.tv_nsec = (ns - now) % 1000000000;
+        nanosleep(&ts, NULL);
+}
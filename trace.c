@@ -0,0 +1,384 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "errors.h"
+#include "metrics.h"
+#include "trace.h"
+#include "ws.h"
+
+/*==============================================================================
+ * Defines
+ */
+
+#define MIN_TRACE_EVENTS 64
+#define AUTO_DUMP_INTERVAL_NS 1000000000ull
+
+
+/*==============================================================================
+ * Static declarations
+ */
+
+typedef struct TraceEntry_ {
+        uint64_t ticks;
+        uint64_t arg;
+        int32_t conn;
+        uint8_t event;
+        uint8_t opcode;
+        uint16_t unused;
+} TraceEntry;
+
+/*
+ * Only the owning thread writes to a ring. It stores the entry first and then
+ * publishes it by bumping "head", so a dump running on another thread can
+ * tell which entries it may have raced with.
+ */
+typedef struct TraceRing_ {
+        struct TraceRing_ *next;
+        pid_t tid;
+        int in_use;
+        uint64_t head;
+        uint64_t message_start;
+        size_t mask;
+        TraceEntry entries[];
+} TraceRing;
+
+int ws_trace_enabled = 0;
+
+static __thread TraceRing *local_ring = NULL;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static TraceRing *all_rings = NULL;
+static size_t ring_len = 0;
+
+static uint64_t base_ticks;
+static uint64_t base_ns;
+
+static uint64_t threshold_ticks = 0;
+static int threshold_fd = -1;
+static uint64_t last_auto_dump_ns = 0;
+
+static const char *event_names[] = {
+        "frame_header",
+        "payload_complete",
+        "message_delivered",
+        "frame_queued",
+        "write_complete"
+};
+
+static void create_trace_key();
+static void dump_ring(int, TraceRing *, uint64_t, uint64_t);
+static TraceRing *register_ring();
+static void release_ring(void *);
+static uint64_t ticks_now();
+
+
+/*==============================================================================
+ * Public API
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Starts recording events. Each thread keeps its most recent "num_events"
+ * events (rounded up to a power of two).
+ *
+ * NOTE: Call this before starting threads that read or write frames; the ring
+ * size can't change once recording has started.
+ */
+void
+ws_trace_enable(size_t num_events)
+{
+        size_t len = MIN_TRACE_EVENTS;
+
+        pthread_mutex_lock(&trace_lock);
+        if (ring_len == 0) {
+                while (len < num_events)
+                        len <<= 1;
+                ring_len = len;
+                base_ticks = ticks_now();
+                base_ns = ws_now_ns();
+        }
+        pthread_mutex_unlock(&trace_lock);
+
+        __atomic_store_n(&ws_trace_enabled, 1, __ATOMIC_RELEASE);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Stops recording events. Recorded events are kept for dumping.
+ */
+void
+ws_trace_disable()
+{
+        __atomic_store_n(&ws_trace_enabled, 0, __ATOMIC_RELEASE);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Dumps the events recorded by a thread whenever a message takes longer than
+ * threshold_ns from its first frame header to its delivery. Dumps go to fd
+ * and happen at most once a second.
+ *
+ * A threshold of 0 turns this off.
+ */
+void
+ws_trace_dump_on_latency(uint64_t threshold_ns, int fd)
+{
+        uint64_t ticks = threshold_ns;
+#if defined(__x86_64__) || defined(__i386__)
+        struct timespec delay = {0, 1000000};
+        uint64_t start_ticks;
+        uint64_t start_ns;
+
+        /* Measure the TSC rate over a millisecond */
+        start_ticks = ticks_now();
+        start_ns = ws_now_ns();
+        nanosleep(&delay, NULL);
+        ticks = (double)threshold_ns * (ticks_now() - start_ticks) /
+                                                    (ws_now_ns() - start_ns);
+#endif
+
+        pthread_mutex_lock(&trace_lock);
+        threshold_fd = fd;
+        __atomic_store_n(&threshold_ticks, ticks, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&trace_lock);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Writes the recorded events of every thread to fd, oldest first.
+ *
+ * Times are shown in nanoseconds relative to the dump.
+ */
+void
+ws_trace_dump(int fd)
+{
+        TraceRing *ring;
+        uint64_t now_ticks;
+        uint64_t now_ns;
+
+        now_ticks = ticks_now();
+        now_ns = ws_now_ns();
+
+        pthread_mutex_lock(&trace_lock);
+        for (ring = all_rings; ring; ring = ring->next)
+                dump_ring(fd, ring, now_ticks, now_ns);
+        pthread_mutex_unlock(&trace_lock);
+}
+
+
+/*==============================================================================
+ * Library functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Records an event in the calling thread's ring.
+ */
+void
+ws_trace_record(enum WebsocketTraceEvent event, int conn, int opcode,
+                                                                  uint64_t arg)
+{
+        TraceRing *ring;
+        TraceEntry *entry;
+        uint64_t ticks;
+        uint64_t threshold;
+        uint64_t now_ns;
+        uint64_t last_ns;
+
+        if ((ring = local_ring) == NULL && (ring = register_ring()) == NULL)
+                return;
+
+        ticks = ticks_now();
+        entry = &ring->entries[ring->head & ring->mask];
+        entry->ticks = ticks;
+        entry->arg = arg;
+        entry->conn = conn;
+        entry->event = event;
+        entry->opcode = opcode;
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+
+        if (event == WS_EV_FRAME_HEADER && ring->message_start == 0)
+                ring->message_start = ticks;
+
+        if (event != WS_EV_MESSAGE_DELIVERED)
+                return;
+
+        threshold = __atomic_load_n(&threshold_ticks, __ATOMIC_ACQUIRE);
+        if (threshold && ring->message_start &&
+                                     ticks - ring->message_start > threshold) {
+                now_ns = ws_now_ns();
+                last_ns = __atomic_load_n(&last_auto_dump_ns, __ATOMIC_RELAXED);
+                if (now_ns - last_ns > AUTO_DUMP_INTERVAL_NS &&
+                    __atomic_compare_exchange_n(&last_auto_dump_ns, &last_ns,
+                                   now_ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                {
+                        dprintf(threshold_fd, "websockets: slow message on "
+                                "connection %d (%llu ticks)\n", conn,
+                                (unsigned long long)(ticks - ring->message_start));
+                        dump_ring(threshold_fd, ring, ticks_now(), now_ns);
+                }
+        }
+        ring->message_start = 0;
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Creates the key used to find out when a thread exits.
+ */
+static void
+create_trace_key()
+{
+        if (pthread_key_create(&trace_key, release_ring) != 0)
+                pthread_failure(__FILE__, __LINE__);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Writes out one ring.
+ *
+ * The owner may keep writing while we read, so we note "head" before and
+ * after copying and skip any entry that could have been overwritten, or be
+ * part way through being written.
+ */
+static void
+dump_ring(int fd, TraceRing *ring, uint64_t now_ticks, uint64_t now_ns)
+{
+        size_t i;
+        size_t num;
+        uint64_t start;
+        uint64_t end;
+        uint64_t skip;
+        double ns_per_tick = 1.0;
+        TraceEntry *entries;
+        TraceEntry *entry;
+
+        end = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        num = end < ring->mask + 1 ? end : ring->mask + 1;
+        start = end - num;
+
+        if ((entries = malloc(num * sizeof(TraceEntry) + 1)) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+        for (i = 0; i < num; i++)
+                entries[i] = ring->entries[(start + i) & ring->mask];
+
+        /*
+         * Anything the writer lapped while we copied is unreliable. In a
+         * full ring, so is the oldest entry: it's the slot the writer fills
+         * next, before it moves head on.
+         */
+        skip = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - end;
+        if (num == ring->mask + 1)
+                skip++;
+        if (skip > num)
+                skip = num;
+
+#if defined(__x86_64__) || defined(__i386__)
+        if (now_ticks > base_ticks)
+                ns_per_tick = (double)(now_ns - base_ns) /
+                                                    (now_ticks - base_ticks);
+#endif
+
+        dprintf(fd, "websockets: thread %d, %zu events\n", (int)ring->tid,
+                                                                 num - skip);
+        for (i = skip; i < num; i++) {
+                entry = &entries[i];
+                dprintf(fd, "  %12.0fns conn=%d %s opcode=%u arg=%llu\n",
+                        -(double)(now_ticks - entry->ticks) * ns_per_tick,
+                        entry->conn,
+                        entry->event < sizeof(event_names)/sizeof(char *) ?
+                                     event_names[entry->event] : "unknown",
+                        entry->opcode, (unsigned long long)entry->arg);
+        }
+
+        free(entries);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Sets up the calling thread's ring, reusing one left by an exited thread if
+ * possible.
+ */
+static TraceRing *
+register_ring()
+{
+        TraceRing *ring;
+
+        pthread_once(&trace_once, create_trace_key);
+
+        pthread_mutex_lock(&trace_lock);
+        if (ring_len == 0) {
+                pthread_mutex_unlock(&trace_lock);
+                return NULL;
+        }
+
+        for (ring = all_rings; ring; ring = ring->next)
+                if (!ring->in_use)
+                        break;
+
+        if (ring == NULL) {
+                ring = calloc(1, sizeof(TraceRing) +
+                                                   ring_len * sizeof(TraceEntry));
+                if (ring == NULL)
+                        mem_alloc_failure(__FILE__, __LINE__);
+                ring->mask = ring_len - 1;
+                ring->next = all_rings;
+                all_rings = ring;
+        }
+        ring->in_use = 1;
+        ring->tid = gettid();
+        ring->message_start = 0;
+        pthread_mutex_unlock(&trace_lock);
+
+        pthread_setspecific(trace_key, ring);
+        local_ring = ring;
+        return ring;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Marks an exiting thread's ring as free for reuse. Its events stay around
+ * until the ring gets reused.
+ */
+static void
+release_ring(void *arg)
+{
+        TraceRing *ring = arg;
+
+        pthread_mutex_lock(&trace_lock);
+        ring->in_use = 0;
+        pthread_mutex_unlock(&trace_lock);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Returns the current time stamp: the TSC where there is one, otherwise
+ * monotonic nanoseconds.
+ */
+static uint64_t
+ticks_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return ws_now_ns();
+#endif
+}
@@ -0,0 +1,43 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "ws.h"
+
+/*
+ * Flight recorder hooks. Recording is off until ws_trace_enable is called, so
+ * each hook costs one predictable branch when it isn't in use.
+ *
+ * If <sys/sdt.h> is available, every hook is also a USDT probe in the
+ * "websockets" provider (e.g., usdt:./app:websockets:frame_header) that can
+ * be attached to with perf or bpftrace at any time.
+ */
+
+extern int ws_trace_enabled;
+
+void ws_trace_record(enum WebsocketTraceEvent event, int conn,
+                                                    int opcode, uint64_t arg);
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>) && !defined(WS_NO_SDT)
+#include <sys/sdt.h>
+#define WS_HAVE_SDT
+#endif
+#endif
+
+#ifdef WS_HAVE_SDT
+#define WS_TRACE_PROBE(name, conn, opcode, arg) \
+        DTRACE_PROBE3(websockets, name, conn, opcode, arg)
+#else
+#define WS_TRACE_PROBE(name, conn, opcode, arg) do {} while (0)
+#endif
+
+#define WS_TRACE(event, name, conn, opcode, arg) \
+do {\
+        WS_TRACE_PROBE(name, conn, opcode, arg);\
+        if (__builtin_expect(ws_trace_enabled, 0))\
+                ws_trace_record(event, conn, opcode, arg);\
+} while (0)
+
+#endif
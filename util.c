@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "util.h"
 
 uint8_t toggle_mask(uint8_t c, size_t index, const uint8_t mask[4])
@@ -9,3 +11,33 @@ uint8_t toggle_mask(uint8_t c, size_t index, const uint8_t mask[4])
         return result;
 }
 
+
+/*
+ * Applies a mask in place to bytes that start "offset" bytes into a payload.
+ *
+ * The bulk of the bytes are done 8 at a time with the mask repeated (and
+ * rotated to line up with offset) across a 64 bit word.
+ */
+void mask_bytes(uint8_t *buf, size_t len, const uint8_t mask[4], size_t offset)
+{
+        size_t i;
+        uint8_t rotated[8];
+        uint64_t mask64;
+        uint64_t word;
+
+        if (!mask)
+                return;
+
+        for (i = 0; i < 8; i++)
+                rotated[i] = mask[(offset + i) % 4];
+        memcpy(&mask64, rotated, 8);
+
+        for (i = 0; i + 8 <= len; i += 8) {
+                memcpy(&word, buf + i, 8);
+                word ^= mask64;
+                memcpy(buf + i, &word, 8);
+        }
+
+        for (; i < len; i++)
+                buf[i] ^= mask[(offset + i) % 4];
+}
@@ -6,5 +6,7 @@
 #include <sys/types.h>
 
 uint8_t toggle_mask(uint8_t c, size_t index, const uint8_t mask[4]);
+void mask_bytes(uint8_t *buf, size_t len, const uint8_t mask[4],
+                                                               size_t offset);
 
 #endif
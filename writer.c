@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+
+#include "constants.h"
+#include "errors.h"
+#include "metrics.h"
+#include "trace.h"
+#include "ws.h"
+
+/*==============================================================================
+ * Static declarations
+ */
+
+struct WebsocketWriter_ {
+        int fd;
+        ws_write_bytes_fp write_bytes;
+        uint8_t opcode;         /* Of the message being written */
+        int in_message;
+        int num_frames;         /* Frames sent for the message so far */
+        size_t buf_len;
+        size_t threshold;
+        uint8_t *buf;
+};
+
+static int send_frame(WebsocketWriter *, int, const uint8_t *, size_t);
+static int write_all(WebsocketWriter *, const uint8_t *, size_t);
+
+
+/*==============================================================================
+ * Public API
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Creates a writer that streams messages to a connection a piece at a time.
+ *
+ * Appended bytes are collected until there are more than "threshold" of
+ * them, then sent as a fragment. Memory use is bounded by the threshold no
+ * matter how big the message gets. A message that ends before reaching the
+ * threshold goes out as one unfragmented frame.
+ *
+ * NOTE: The caller must free this with ws_writer_free. write_bytes should
+ * block until it can write something (errors end the message).
+ */
+WebsocketWriter *
+ws_writer_new(int fd, ws_write_bytes_fp write_bytes, size_t threshold)
+{
+        WebsocketWriter *result;
+
+        if ((result = calloc(1, sizeof(WebsocketWriter))) == NULL)
+                mem_alloc_failure(__FILE__, __LINE__);
+
+        if (threshold) {
+                if ((result->buf = malloc(threshold)) == NULL)
+                        mem_alloc_failure(__FILE__, __LINE__);
+                WS_METRIC_ADD(allocs, 1);
+                WS_METRIC_ADD(alloc_bytes, threshold);
+        }
+
+        result->fd = fd;
+        result->write_bytes = write_bytes;
+        result->threshold = threshold;
+        return result;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Frees a writer. A message that wasn't ended is left unfinished.
+ */
+void
+ws_writer_free(WebsocketWriter *writer)
+{
+        if (writer == NULL)
+                return;
+
+        free(writer->buf);
+        free(writer);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Starts a text (or, if "binary" is set, binary) message.
+ *
+ * Returns 0 on success; -1 if a message is already being written.
+ */
+int
+ws_writer_begin(WebsocketWriter *writer, int binary)
+{
+        if (writer->in_message)
+                return -1;
+
+        writer->opcode = binary ? WS_FRAME_OP_BIN : WS_FRAME_OP_TEXT;
+        writer->in_message = 1;
+        writer->num_frames = 0;
+        writer->buf_len = 0;
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Adds bytes to the message. They're sent once more than the threshold has
+ * built up; a chunk bigger than the threshold is sent straight from "data"
+ * without being copied.
+ *
+ * Returns 0 on success; -1 if there's no message or writing failed, in which
+ * case the message is abandoned and the connection should be closed.
+ */
+int
+ws_writer_append(WebsocketWriter *writer, const void *data, size_t len)
+{
+        if (!writer->in_message)
+                return -1;
+        if (len == 0)
+                return 0;
+
+        if (writer->buf_len + len <= writer->threshold) {
+                memcpy(writer->buf + writer->buf_len, data, len);
+                writer->buf_len += len;
+                return 0;
+        }
+
+        /* Send what's buffered, then this chunk, as two fragments */
+        if (writer->buf_len &&
+            send_frame(writer, 0, writer->buf, writer->buf_len) != 0)
+                return -1;
+        writer->buf_len = 0;
+
+        if (len <= writer->threshold) {
+                memcpy(writer->buf, data, len);
+                writer->buf_len = len;
+                return 0;
+        }
+
+        return send_frame(writer, 0, data, len);
+}
+
+
+/*------------------------------------------------------------------------------
+ * Finishes the message with a final frame holding whatever is still buffered.
+ *
+ * Returns 0 on success; -1 if there's no message or writing failed.
+ */
+int
+ws_writer_end(WebsocketWriter *writer)
+{
+        if (!writer->in_message)
+                return -1;
+
+        if (send_frame(writer, 1, writer->buf, writer->buf_len) != 0)
+                return -1;
+
+        writer->in_message = 0;
+        writer->buf_len = 0;
+        return 0;
+}
+
+
+/*==============================================================================
+ * Static functions
+ */
+
+
+/*------------------------------------------------------------------------------
+ * Sends one frame of the message: the first is a text/binary frame and the
+ * rest are continuations.
+ */
+static int
+send_frame(WebsocketWriter *writer, int is_final, const uint8_t *payload,
+                                                                   size_t len)
+{
+        uint8_t header[WS_MAX_FRAME_HEADER_LEN];
+        size_t header_len;
+        uint8_t byte0;
+
+        byte0 = writer->num_frames ? WS_FRAME_OP_CONT : writer->opcode;
+        if (is_final)
+                byte0 |= WS_FRAME_FIN;
+
+        header_len = ws_make_frame_header(byte0, len, NULL, header);
+        WS_METRIC_ADD(frames_out[byte0 & 0x0f], 1);
+        WS_TRACE(WS_EV_FRAME_QUEUED, frame_queued, writer->fd, byte0 & 0x0f,
+                                                           header_len + len);
+
+        if (write_all(writer, header, header_len) != 0 ||
+                                        write_all(writer, payload, len) != 0) {
+                writer->in_message = 0;
+                return -1;
+        }
+
+        WS_TRACE(WS_EV_WRITE_COMPLETE, write_complete, writer->fd,
+                                                byte0 & 0x0f, header_len + len);
+        writer->num_frames++;
+        return 0;
+}
+
+
+/*------------------------------------------------------------------------------
+ * Writes all len bytes.
+ */
+static int
+write_all(WebsocketWriter *writer, const uint8_t *ptr, size_t len)
+{
+        ssize_t num_written;
+
+        while (len > 0) {
+                num_written = writer->write_bytes(writer->fd, ptr, len);
+                if (num_written < 0 && errno == EINTR)
+                        continue;
+                if (num_written <= 0)
+                        return -1;
+
+                WS_METRIC_ADD(bytes_out, num_written);
+                ptr += num_written;
+                len -= num_written;
+        }
+        return 0;
+}
@@ -11,15 +11,189 @@
  */
 
 typedef ssize_t (*ws_read_bytes_fp)(int fd, char *ptr, size_t maxlen);
+typedef ssize_t (*ws_write_bytes_fp)(int fd, const void *ptr, size_t len);
+
+typedef struct WebsocketChannels_ WebsocketChannels;
+typedef struct WebsocketRelay_ WebsocketRelay;
+typedef struct WebsocketPoller_ WebsocketPoller;
+typedef struct WebsocketOutQueue_ WebsocketOutQueue;
+typedef struct WebsocketWriter_ WebsocketWriter;
+typedef struct WebsocketConn_ WebsocketConn;
+typedef struct WebsocketScheduler_ WebsocketScheduler;
+typedef struct WebsocketRing_ WebsocketRing;
+typedef struct WebsocketGreen_ WebsocketGreen;
+typedef struct WebsocketTls_ WebsocketTls;
+
+/* Library memory held by an idle WebsocketConn (see ws_conn_new) */
+#define WS_CONN_IDLE_BYTES 64
+
+/* ws_conn_read_budget results, besides 0 (read dry) and -1 (done) */
+#define WS_CONN_MORE 1          /* Used its budget; there may be more to read */
+#define WS_CONN_PAUSED 2        /* Over a rate limit; see ws_conn_pause_ns */
+
+/* 2 bytes, 8 extended length bytes and a 4 byte mask */
+#define WS_MAX_FRAME_HEADER_LEN 14
+
+/*
+ * Log-linear histogram: each power of two is split into 8 buckets.
+ */
+#define WS_HIST_BUCKETS 496
+
+typedef struct WebsocketHistogram_ {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t buckets[WS_HIST_BUCKETS];
+} WebsocketHistogram;
+
+enum WebsocketTraceEvent {
+        WS_EV_FRAME_HEADER,
+        WS_EV_PAYLOAD_COMPLETE,
+        WS_EV_MESSAGE_DELIVERED,
+        WS_EV_FRAME_QUEUED,
+        WS_EV_WRITE_COMPLETE
+};
+
+/* Close status codes 1000-1015 are counted individually */
+#define WS_CLOSE_CODE_BASE 1000
+#define WS_NUM_CLOSE_CODES 16
+
+/* Sent when a peer's frame or message is over a limit (see ws_set_limits) */
+#define WS_CLOSE_MESSAGE_TOO_BIG 1009
+
+/*
+ * Per-connection limits. A limit of 0 means no limit.
+ */
+typedef struct WebsocketLimits_ {
+        uint64_t max_frame_len;         /* Payload bytes in one frame */
+        uint64_t max_message_len;       /* Payload bytes over all fragments */
+        uint64_t max_buffered;          /* Heap bytes held for one message */
+} WebsocketLimits;
+
+/*
+ * Inbound rate limits per connection, kept as token buckets. A rate of 0
+ * means no limit; a burst of 0 means one second's worth.
+ */
+typedef struct WebsocketRateLimits_ {
+        uint64_t bytes_per_sec;
+        uint64_t bytes_burst;
+        uint64_t messages_per_sec;      /* Messages and control frames */
+        uint64_t messages_burst;
+} WebsocketRateLimits;
+
+/*
+ * NOTE: Every field must be a uint64_t (snapshots are summed word by word).
+ */
+typedef struct WebsocketMetrics_ {
+        uint64_t bytes_in;              /* Bytes read from connections */
+        uint64_t bytes_out;             /* Bytes the library wrote out */
+        uint64_t frames_in[16];         /* Frames read, by opcode */
+        uint64_t frames_out[16];        /* Frames built, by opcode */
+        uint64_t fragments_in;          /* Non-final frames read */
+        uint64_t handshakes;
+        uint64_t handshake_failures;
+        uint64_t allocs;
+        uint64_t alloc_bytes;
+        uint64_t parse_errors;
+        uint64_t limit_rejects;         /* Frames refused by a size limit */
+        uint64_t rate_pauses;           /* Reads held back by a rate limit */
+        uint64_t conflated;             /* Queued messages replaced by newer */
+        uint64_t pool_remote_gets;      /* Buffers lent across NUMA nodes */
+        uint64_t pool_remote_puts;      /* Given back across NUMA nodes */
+        uint64_t route_discards;        /* Messages a router dropped */
+        uint64_t route_forwards;        /* Messages a router passed on */
+        uint64_t closes[WS_NUM_CLOSE_CODES];
+        uint64_t closes_other;          /* No status, or outside 1000-1015 */
+        uint64_t read_ns;               /* Time spent in read_bytes calls */
+        uint64_t unmask_ns;             /* Time spent unmasking payloads */
+
+        WebsocketHistogram message_size;
+        WebsocketHistogram parse_ns;    /* Reading a message, minus read_ns */
+        WebsocketHistogram handle_ns;   /* See ws_metrics_record_handle_ns */
+        WebsocketHistogram wakeup_ns;   /* recv to handler, see ws_poller_run */
+} WebsocketMetrics;
 
 enum WebsocketFrameType {
         WS_FT_ERROR = -1,
         WS_FT_TEXT,
         WS_FT_CLOSE,
         WS_FT_PING,
-        WS_FT_PONG
+        WS_FT_PONG,
+        WS_FT_TOO_BIG
 };
 
+enum WebsocketPriority {
+        WS_PRIORITY_NORMAL,
+        WS_PRIORITY_HIGH
+};
+
+typedef void (*ws_message_handler_fp)(int fd, enum WebsocketFrameType type,
+                                  const char *message, size_t len, void *arg);
+
+/* Most messages ws_conn_read_batch hands over at once */
+#define WS_MAX_BATCH 256
+
+/*
+ * A view of a message (or control frame) handed over in a batch.
+ */
+typedef struct WebsocketMessage_ {
+        enum WebsocketFrameType type;
+        const char *data;               /* Not NUL terminated */
+        size_t len;
+} WebsocketMessage;
+
+typedef void (*ws_batch_handler_fp)(int fd, const WebsocketMessage *messages,
+                                            size_t num_messages, void *arg);
+
+typedef void (*ws_green_fp)(int fd, void *arg);
+
+/* Told of a subscriber that channels gave up on (see ws_channels_on_drop) */
+typedef void (*ws_drop_fp)(int fd, void *arg);
+
+/* What a router does with a message, having seen the start of it */
+enum WebsocketRoute {
+        WS_ROUTE_DECODE,                /* Read it in full, as usual */
+        WS_ROUTE_DISCARD,               /* Skip the rest, unread */
+        WS_ROUTE_FORWARD                /* Pass its frames on, still masked */
+};
+
+typedef enum WebsocketRoute (*ws_route_fp)(int fd, const char *prefix,
+                                           size_t prefix_len, void *arg);
+typedef void (*ws_forward_fp)(int fd, const uint8_t *bytes, size_t len,
+                                                                void *arg);
+
+/*
+ * Decides where messages go from their first peek_len bytes, before the
+ * rest is unmasked or copied (see ws_conn_set_router).
+ */
+typedef struct WebsocketRouter_ {
+        size_t peek_len;
+        ws_route_fp route;
+        ws_forward_fp forward;          /* Gets frames as they came in */
+        void *arg;
+} WebsocketRouter;
+
+/*
+ * One handshake for ws_complete_handshakes.
+ */
+typedef struct WebsocketHandshake_ {
+        const char *request;            /* In */
+        char *response;                 /* In: where the response goes */
+        size_t response_cap;            /* In */
+        int accept_deflate;             /* In: take up a deflate offer */
+        size_t response_len;            /* Out: 0 if it failed */
+        int deflate;                    /* Out: deflate was agreed */
+} WebsocketHandshake;
+
+/*
+ * A message read in place from a shared-memory ring.
+ */
+typedef struct WebsocketRingMessage_ {
+        uint64_t conn_id;
+        enum WebsocketFrameType type;
+        const char *data;               /* NUL terminated */
+        size_t len;
+} WebsocketRingMessage;
+
 
 /* ============================================================================ 
  * Public API
@@ -31,6 +205,8 @@ enum WebsocketFrameType {
  */
 int ws_is_handshake(const char* req_str);
 const char *ws_complete_handshake(const char *req_str);
+const char *ws_complete_handshake_deflate(const char *req_str, int *deflate_p);
+size_t ws_complete_handshakes(WebsocketHandshake *handshakes, size_t num);
 
 /* 
  * Writing websocket frames
@@ -38,9 +214,27 @@ const char *ws_complete_handshake(const char *req_str);
  */
 size_t ws_make_text_frame(const char *message, const uint8_t mask[4],
                                                          uint8_t **frame_p);
+size_t ws_make_deflate_frame(const char *message, uint8_t **frame_p);
 size_t ws_make_close_frame(uint8_t **frame_p);
+size_t ws_make_close_frame_status(uint16_t status, uint8_t **frame_p);
 size_t ws_make_ping_frame(uint8_t **frame_p);
 size_t ws_make_pong_frame(uint8_t **frame_p);
+size_t ws_make_frame_header(uint8_t byte0, uint64_t payload_len,
+                            const uint8_t mask[4], uint8_t *header);
+int ws_send_file(int fd, int file_fd, off_t offset, uint64_t len,
+                                                      uint64_t max_frame_len);
+
+
+/* 
+ * Streaming messages out
+ * ----------------------
+ */
+WebsocketWriter *ws_writer_new(int fd, ws_write_bytes_fp write_bytes,
+                                                             size_t threshold);
+void ws_writer_free(WebsocketWriter *writer);
+int ws_writer_begin(WebsocketWriter *writer, int binary);
+int ws_writer_append(WebsocketWriter *writer, const void *data, size_t len);
+int ws_writer_end(WebsocketWriter *writer);
 
 
 /* 
@@ -49,6 +243,210 @@ size_t ws_make_pong_frame(uint8_t **frame_p);
  */
 enum WebsocketFrameType ws_read_next_message(int fd,
                                     ws_read_bytes_fp read_bytes, char **message);
+void ws_set_spill_threshold(size_t threshold, const char *dir);
+void ws_free_message(char *message);
+
+
+/* 
+ * Limits
+ * ------
+ */
+void ws_set_limits(const WebsocketLimits *limits);
+void ws_set_memory_budget(uint64_t budget);
+uint64_t ws_buffered_bytes();
+void ws_set_rate_limits(const WebsocketRateLimits *rate_limits);
+
+
+/* 
+ * Outbound queues
+ * ---------------
+ */
+WebsocketOutQueue *ws_outq_new(int fd, uint64_t fragment_size);
+void ws_outq_free(WebsocketOutQueue *q);
+int ws_outq_push_text(WebsocketOutQueue *q, char *message, size_t len,
+                                            enum WebsocketPriority priority);
+int ws_outq_push_keyed(WebsocketOutQueue *q, const char *key, char *message,
+                                size_t len, enum WebsocketPriority priority);
+int ws_outq_push_control(WebsocketOutQueue *q, enum WebsocketFrameType type,
+                                        const uint8_t *payload, size_t len);
+int64_t ws_outq_flush(WebsocketOutQueue *q, ws_write_bytes_fp write_bytes);
+
+
+/* 
+ * Relaying frames
+ * ---------------
+ */
+WebsocketRelay *ws_relay_new();
+void ws_relay_free(WebsocketRelay *relay);
+int ws_relay_frame(WebsocketRelay *relay, int from_fd, int to_fd);
+
+
+/* 
+ * Event-driven connections
+ * ------------------------
+ */
+WebsocketConn *ws_conn_new(int fd);
+void ws_conn_free(WebsocketConn *conn);
+int ws_conn_fd(const WebsocketConn *conn);
+void ws_conn_enable_deflate(WebsocketConn *conn);
+void ws_conn_set_router(WebsocketConn *conn, const WebsocketRouter *router);
+int ws_conn_read(WebsocketConn *conn, ws_read_bytes_fp read_bytes,
+                                    ws_message_handler_fp handler, void *arg);
+int ws_conn_read_budget(WebsocketConn *conn, ws_read_bytes_fp read_bytes,
+                        ws_message_handler_fp handler, void *arg,
+                        size_t max_frames, size_t max_bytes);
+int ws_conn_read_batch(WebsocketConn *conn, ws_read_bytes_fp read_bytes,
+                       ws_batch_handler_fp handler, void *arg,
+                       size_t max_batch);
+uint64_t ws_conn_pause_ns(WebsocketConn *conn);
+int ws_conn_send(WebsocketConn *conn, ws_write_bytes_fp write_bytes,
+             enum WebsocketFrameType type, const void *payload, size_t len);
+int ws_conn_flush(WebsocketConn *conn, ws_write_bytes_fp write_bytes);
+int ws_conn_wants_write(const WebsocketConn *conn);
+void ws_conn_pool_stats(size_t *borrowed, size_t *cached);
+void ws_set_pool_hugepages(int enable);
+size_t ws_conn_export(const WebsocketConn *conn, uint8_t **image_p);
+WebsocketConn *ws_conn_import(int fd, const uint8_t *image, size_t len);
+/* TLS connections can't be handed over: -1, with errno EOPNOTSUPP */
+int ws_conn_send_to(int sock, WebsocketConn *conn);
+WebsocketConn *ws_conn_recv_from(int sock);
+
+
+/* 
+ * Scheduling connections fairly
+ * -----------------------------
+ */
+WebsocketScheduler *ws_sched_new(size_t max_frames, size_t max_bytes);
+void ws_sched_free(WebsocketScheduler *sched);
+void ws_sched_ready(WebsocketScheduler *sched, WebsocketConn *conn);
+void ws_sched_remove(WebsocketScheduler *sched, WebsocketConn *conn);
+int64_t ws_sched_run(WebsocketScheduler *sched, ws_read_bytes_fp read_bytes,
+                                    ws_message_handler_fp handler, void *arg);
+void ws_sched_move(WebsocketScheduler *from, WebsocketScheduler *to,
+                                                        WebsocketConn *conn);
+uint64_t ws_sched_busy_ns(const WebsocketScheduler *sched);
+int ws_rebalance_pick(const uint64_t *loads, size_t num_shards,
+                        double max_ratio, size_t *from_p, size_t *to_p);
+
+
+/* 
+ * Busy polling
+ * ------------
+ */
+WebsocketPoller *ws_poller_new(size_t max_conns, size_t max_message_len,
+                                                    int cpu, int busy_poll_us);
+void ws_poller_free(WebsocketPoller *poller);
+int ws_poller_add(WebsocketPoller *poller, int fd);
+void ws_poller_remove(WebsocketPoller *poller, int fd);
+int ws_poller_run(WebsocketPoller *poller, ws_message_handler_fp handler,
+                                                                    void *arg);
+void ws_poller_stop(WebsocketPoller *poller);
+int ws_poller_send(int fd, const char *message, size_t len);
+
+
+/* 
+ * Channels
+ * --------
+ */
+WebsocketChannels *ws_channels_new();
+void ws_channels_free(WebsocketChannels *channels);
+void ws_channels_on_drop(WebsocketChannels *channels, ws_drop_fp on_drop,
+                                                                  void *arg);
+int ws_channel_subscribe(WebsocketChannels *channels, const char *name, int fd);
+int ws_channel_subscribe_deflate(WebsocketChannels *channels, const char *name,
+                                                                      int fd);
+int ws_channel_unsubscribe(WebsocketChannels *channels, const char *name,
+                                                                       int fd);
+void ws_channels_drop_connection(WebsocketChannels *channels, int fd);
+int ws_channels_flush(WebsocketChannels *channels, int fd,
+                                                ws_write_bytes_fp write_bytes);
+int ws_channels_wants_write(WebsocketChannels *channels, int fd);
+int ws_channel_enable_replay(WebsocketChannels *channels, const char *name,
+                                            size_t capacity, const char *path);
+uint64_t ws_channel_last_seq(WebsocketChannels *channels, const char *name);
+ssize_t ws_channel_replay(WebsocketChannels *channels, const char *name,
+                  uint64_t since_seq, int fd, ws_write_bytes_fp write_bytes);
+ssize_t ws_channel_subscribe_since(WebsocketChannels *channels,
+                                   const char *name, int fd,
+                                   uint64_t since_seq,
+                                   ws_write_bytes_fp write_bytes);
+size_t ws_channel_num_subscribers(WebsocketChannels *channels,
+                                                             const char *name);
+size_t ws_channel_publish(WebsocketChannels *channels, const char *name,
+                          const char *message, ws_write_bytes_fp write_bytes);
+size_t ws_channel_publish_seq(WebsocketChannels *channels, const char *name,
+                              const char *message,
+                              ws_write_bytes_fp write_bytes, uint64_t *seq_p);
+size_t ws_channel_publish_frame(WebsocketChannels *channels, const char *name,
+                                const uint8_t *frame, size_t frame_len,
+                                ws_write_bytes_fp write_bytes);
+
+
+/* 
+ * Shared-memory rings
+ * -------------------
+ */
+WebsocketRing *ws_ring_new(size_t capacity);
+void ws_ring_free(WebsocketRing *ring);
+int ws_ring_push(WebsocketRing *ring, uint64_t conn_id,
+             enum WebsocketFrameType type, const char *message, size_t len);
+int ws_ring_peek(WebsocketRing *ring, WebsocketRingMessage *msg);
+void ws_ring_release(WebsocketRing *ring);
+int ws_ring_wait(WebsocketRing *ring, int timeout_ms);
+
+
+/* 
+ * TLS (wss://)
+ * ------------
+ */
+WebsocketTls *ws_tls_new(const char *cert_path, const char *key_path);
+void ws_tls_free(WebsocketTls *tls);
+int ws_tls_accept(WebsocketTls *tls, int fd);
+int ws_tls_ktls_send(int fd);
+ssize_t ws_tls_read(int fd, char *ptr, size_t maxlen);
+ssize_t ws_tls_write(int fd, const void *ptr, size_t len);
+void ws_tls_close(int fd);
+
+
+/* 
+ * Green threads
+ * -------------
+ */
+WebsocketGreen *ws_green_new(size_t stack_size);
+void ws_green_free(WebsocketGreen *rt);
+int ws_green_spawn(WebsocketGreen *rt, int fd, ws_green_fp fn, void *arg);
+int ws_green_run(WebsocketGreen *rt);
+ssize_t ws_green_read(int fd, char *ptr, size_t maxlen);
+ssize_t ws_green_write(int fd, const void *ptr, size_t len);
+int ws_green_wait(uint32_t events);
+
+
+/* 
+ * Metrics
+ * -------
+ */
+void ws_metrics_snapshot(WebsocketMetrics *snapshot);
+void ws_metrics_record_handle_ns(uint64_t ns);
+uint64_t ws_histogram_value_at(const WebsocketHistogram *hist,
+                                                              double quantile);
+
+
+/* 
+ * Flight recorder
+ * ---------------
+ */
+void ws_trace_enable(size_t num_events);
+void ws_trace_disable();
+void ws_trace_dump(int fd);
+void ws_trace_dump_on_latency(uint64_t threshold_ns, int fd);
+
+
+/* 
+ * Traffic capture
+ * ---------------
+ */
+int ws_capture_start(const char *path);
+void ws_capture_stop();
 
 
 